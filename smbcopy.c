@@ -0,0 +1,2729 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+
+#include <ofc/config.h>
+#include <ofc/framework.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/file.h>
+#include <ofc/waitset.h>
+#include <ofc/queue.h>
+#include <ofc/timer.h>
+#include <ofc/thread.h>
+#include <ofc/time.h>
+
+#include "smbcopy.h"
+#include "smbtrace.h"
+#include "smbrate.h"
+#include "smbmem.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Buffering definitions.  We test using overlapped asynchronous I/O.
+ * These are the most a copy uses.  The memory budget may give it fewer,
+ * or smaller, buffers.
+ */
+#define BUFFER_SIZE OFC_MAX_IO
+#define NUM_FILE_BUFFERS 10
+/*
+ * Largest source a boosted copy counts as small
+ */
+#define BOOST_SIZE (4 * 1024 * 1024)
+/*
+ * File system controls used by sparse copies
+ */
+#if !defined(FSCTL_SET_SPARSE)
+#define FSCTL_SET_SPARSE 0x000900c4
+#endif
+#if !defined(FSCTL_QUERY_ALLOCATED_RANGES)
+#define FSCTL_QUERY_ALLOCATED_RANGES 0x000940cf
+#endif
+/*
+ * Number of allocated ranges fetched per query
+ */
+#define NUM_QUERY_RANGES 128
+/*
+ * Source failover.  Attempts to reopen the source after it is lost, the
+ * delay between attempts in milliseconds (which grows with each attempt
+ * and is waited out on the failover timer) and the most failovers made
+ * in one copy.
+ */
+#define FAILOVER_ATTEMPTS 5
+#define FAILOVER_BACKOFF 1000
+#define FAILOVER_MAX 8
+/*
+ * Reads abandoned to a hedge and still outstanding
+ */
+#define STALE_READ 0x01           /* The read from the source */
+#define STALE_HEDGE 0x02          /* The read from the replica */
+/*
+ * Read striping.  The most sources chunks are read from, the source
+ * itself and its replicas, and the weight, as a shift, of each new
+ * sample in a source's average read rate.
+ */
+#define NUM_STRIPES 5
+#define STRIPE_EWMA_SHIFT 3
+/*
+ * Buffer states.
+ */
+typedef enum {
+  BUFFER_STATE_IDLE,        /* There is no I/O active */
+  BUFFER_STATE_READ,        /* Data is being read into the buffer */
+  BUFFER_STATE_WRITE,       /* Data is being written from the buffer */
+  BUFFER_STATE_DEFER_READ,  /* A read is waiting on the rate limiter */
+  BUFFER_STATE_DEFER_WRITE, /* A write is waiting on the rate limiter */
+  BUFFER_STATE_DRAIN,       /* Waiting for an abandoned read to finish */
+  BUFFER_STATE_SPARE        /* Has no memory, given back to the budget */
+} BUFFER_STATE;
+/*
+ * What an event in the wait set is for.  The app of every handle a copy
+ * adds to the wait set points to one of these, so that events of any
+ * number of copies can share a wait set.
+ */
+typedef struct file_buffer OFC_FILE_BUFFER;
+
+struct engine_event {
+  struct smbcopy *copy_state;   /* Copy the event belongs to */
+  OFC_FILE_BUFFER *buffer;      /* Buffer, or OFC_NULL for a timer */
+};
+/*
+ * The buffer context
+ */
+struct file_buffer {
+  OFC_HANDLE readOverlapped;  /* The handle to the buffer when reading */
+  OFC_HANDLE stripeOverlapped[NUM_STRIPES]; /* Read handle on each stripe */
+  OFC_INT stripe;             /* Stripe the chunk is read from */
+  OFC_UINT64 started;         /* When the pending read was issued, in us */
+  OFC_HANDLE writeOverlapped; /* The handle to the buffer when writing */
+  OFC_CHAR *data;             /* Pointer to the buffer */
+  BUFFER_STATE state;         /* Buffer state */
+  OFC_OFFT offset;            /* Offset in file of the chunk */
+  OFC_DWORD chunk;            /* Length of the chunk */
+  OFC_DWORD filled;           /* Bytes of the chunk read so far */
+  OFC_DWORD flushed;          /* Bytes of the chunk written so far */
+  OFC_DWORD length;           /* Length of a deferred I/O */
+  struct engine_event event;  /* App of the buffer's I/O in the wait set */
+  OFC_HANDLE hedgeOverlapped; /* The handle to the buffer when hedging */
+  OFC_CHAR *hedge_data;       /* Buffer for the hedge read */
+  OFC_MSTIME issued;          /* When the chunk's read was issued */
+  OFC_BOOL racing;            /* A hedge read is racing the read */
+  OFC_INT stale;              /* Abandoned reads still outstanding */
+};
+/**
+ * Async I/O Result
+ */
+typedef enum {
+  ASYNC_RESULT_DONE,            /* I/O is successful */
+  ASYNC_RESULT_ERROR,           /* I/O was in error */
+  ASYNC_RESULT_EOF,             /* I/O hit EOF */
+  ASYNC_RESULT_PENDING          /* I/O is still pending */
+} ASYNC_RESULT;
+
+/*
+ * A source that chunks are read from.  Stripe 0 is the source itself and
+ * the rest are replicas of it.
+ */
+struct stripe {
+  OFC_HANDLE file;              /* Handle of a replica */
+  OFC_INT reading;              /* Reads outstanding */
+  OFC_UINT64 rate;              /* Average read rate in bytes/s */
+  OFC_UINT64 bytes;             /* Bytes read */
+  OFC_BOOL lost;                /* Failed, not read from any more */
+};
+
+/**
+ * Copy State
+ *
+ * Main state for the copy
+ */
+struct smbcopy {
+  OFC_HANDLE read_file;         /* Handle of Read File */
+  OFC_HANDLE write_file;        /* Handle of Write File */
+  OFC_HANDLE wait_set;          /* Caller's wait set */
+  OFC_HANDLE buffer_list;       /* List of Buffers */
+  OFC_OFFT offset;              /* Running Offset for next read */
+  OFC_INT pending;              /* Number of pending I/Os */
+  OFC_BOOL eof;                 /* EOF state of copy */
+  OFC_BOOL sparse;              /* Skip holes and zero chunks */
+  OFC_OFFT size;                /* Source size or -1 if unknown */
+  OFC_OFFT extent;              /* End of the data read so far */
+  struct alloc_range *ranges;   /* Allocated ranges of the source */
+  OFC_INT num_ranges;           /* Number of allocated ranges */
+  OFC_INT range;                /* Range the reads have reached */
+  OFC_UINT64 skipped;           /* Bytes not written */
+  OFC_HANDLE deferred;          /* Buffers waiting on the rate limiter */
+  OFC_HANDLE rate_timer;        /* Fires when deferred I/O may go */
+  OFC_BOOL timer_armed;         /* Rate timer is in the wait set */
+  OFC_TCHAR *rfilename;         /* Source path, for reopening */
+  OFC_BOOL remote_source;       /* Source is on the network */
+  OFC_BOOL striping;            /* Spread reads across the replicas */
+  struct stripe stripes[NUM_STRIPES]; /* Sources chunks are read from */
+  OFC_INT num_stripes;          /* Number of stripes */
+  OFC_BOOL failover;            /* Source lost, reads held back */
+  OFC_MSTIME failed_at;         /* When the source was lost */
+  OFC_INT failovers;            /* Number of failovers made */
+  OFC_INT reopens;              /* Reopen attempts in this failover */
+  OFC_HANDLE failover_timer;    /* Fires when the source may be reopened */
+  OFC_BOOL failover_armed;      /* Failover timer is in the wait set */
+  OFC_HANDLE replica_file;      /* Another copy of the source */
+  OFC_MSTIME hedge_ms;          /* Read time after which reads are hedged */
+  OFC_HANDLE hedge_timer;       /* Fires when a read may need hedging */
+  OFC_BOOL hedge_armed;         /* Hedge timer is in the wait set */
+  OFC_INT extra;                /* Hedge and abandoned reads outstanding */
+  struct engine_event timer_event; /* App of the timers */
+  SMBCOPY_STATUS status;        /* Where the copy stands */
+  OFC_DWORD error;              /* Last error of the copy */
+  OFC_BOOL cancelled;           /* Cancelled by the caller */
+  OFC_UINT64 written;           /* Bytes written */
+  SMBCOPY_PROGRESS *progress;   /* Caller's progress routine */
+  OFC_VOID *context;            /* Caller's context */
+  struct smbcopy_stats stats;   /* Overhead of this copy */
+  struct smbmem_share share;    /* Share of the memory budget */
+  OFC_BOOL boosted;             /* Small file, run a priority higher */
+};
+
+/*
+ * An allocated range of a sparse file as returned by
+ * FSCTL_QUERY_ALLOCATED_RANGES
+ */
+struct alloc_range {
+  OFC_LARGE_INTEGER offset;
+  OFC_LARGE_INTEGER length;
+};
+
+/*
+ * Zero chunk detection.  The buffer is scanned a block at a time with
+ * GCC vector extensions, which compile to the widest vector unit the
+ * target was built for, and we stop at the first non zero block.
+ */
+typedef OFC_UINT64 zero_vec __attribute__((vector_size(32), aligned(1)));
+#define ZERO_BLOCK (8 * sizeof(zero_vec))
+
+static OFC_BOOL buffer_is_zero(const OFC_CHAR *data, OFC_DWORD len)
+{
+  const zero_vec *vec;
+  zero_vec acc;
+  OFC_DWORD i;
+
+  /*
+   * Most chunks of most files have data at one end or the other
+   */
+  if (len == 0 || data[0] != 0 || data[len - 1] != 0)
+    return (len == 0);
+
+  for (i = 0; i + ZERO_BLOCK <= len; i += ZERO_BLOCK)
+    {
+      vec = (const zero_vec *) (data + i);
+      acc = vec[0] | vec[1] | vec[2] | vec[3] |
+        vec[4] | vec[5] | vec[6] | vec[7];
+      if ((acc[0] | acc[1] | acc[2] | acc[3]) != 0)
+        return (OFC_FALSE);
+    }
+  for (; i < len; i++)
+    if (data[i] != 0)
+      return (OFC_FALSE);
+  return (OFC_TRUE);
+}
+
+static OFC_UINT64 engine_now(OFC_VOID)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((OFC_UINT64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Perform an I/O Read
+ *
+ * This routine initiates a read on an async buffer and adds it to the
+ * waitset if the I/O is pending
+ *
+ * \param wait_set
+ * The wait set that this I/O and it's overlapped handles will be part of
+ *
+ * \param read_file
+ * Handle of read file
+ *
+ * \param buffer
+ * Pointer to buffer to read into
+ *
+ * \param dwLen
+ * Length of buffer to read
+ *
+ * \param dwLastError
+ * Error code if result is error
+ *
+ * \returns
+ * ASYNC_RESULT of I/O
+ */
+static ASYNC_RESULT AsyncRead(OFC_HANDLE wait_set,
+                              OFC_HANDLE read_file,
+                              OFC_FILE_BUFFER *buffer,
+                              OFC_DWORD dwLen,
+                              OFC_DWORD *dwLastError)
+{
+  ASYNC_RESULT result;
+  OFC_BOOL status;
+
+  /*
+   * initialize the read buffer using the read file, the read overlapped
+   * handle and the current read offset
+   */
+  OfcSetOverlappedOffset(read_file, buffer->readOverlapped,
+                         buffer->offset + buffer->filled);
+  buffer->state = BUFFER_STATE_READ;
+  /*
+   * Issue the non blocking read.  The read continues from whatever part
+   * of the chunk has already been read.
+   */
+  smbtrace(OFC_LOG_DEBUG, "read %p offset %lld length %u", buffer,
+           (long long) (buffer->offset + buffer->filled), dwLen);
+  status = OfcReadFile(read_file, buffer->data + buffer->filled, dwLen,
+                       OFC_NULL, buffer->readOverlapped);
+
+  if (status == OFC_TRUE)
+    {
+      result = ASYNC_RESULT_DONE;
+    }
+  else
+    {
+      /*
+       * Check if it's pending (expected)
+       */
+      *dwLastError = OfcGetLastError();
+      if (*dwLastError == OFC_ERROR_IO_PENDING)
+        {
+          /*
+           * Add it to the waitset
+           */
+          ofc_waitset_add(wait_set, (OFC_HANDLE) &buffer->event,
+                          buffer->readOverlapped);
+          result = ASYNC_RESULT_PENDING;
+	  *dwLastError = OFC_ERROR_SUCCESS;
+        }
+      else
+        {
+          if (*dwLastError == OFC_ERROR_HANDLE_EOF) 
+            {
+              result = ASYNC_RESULT_EOF;
+            }
+          else
+            {
+              smbtrace(OFC_LOG_WARN, "read offset %lld failed: %s",
+                       (long long) buffer->offset,
+                       ofc_get_error_string(*dwLastError));
+              result = ASYNC_RESULT_ERROR;
+            }
+          /*
+           * Either eof or error, buffer is complete
+           */
+          buffer->state = BUFFER_STATE_IDLE;
+          ofc_waitset_remove(wait_set, buffer->readOverlapped);
+        }
+    }
+  return (result);
+}
+
+/*
+ * Return the state of an async read
+ *
+ * \param wait_set
+ * Wait set that the I/O should be part of
+ *
+ * \param read_file
+ * Handle to the read file
+ *
+ * \param buffer
+ * Pointer to the buffer
+ *
+ * \param dwLen
+ * Number of bytes to read / number of bytes read
+ *
+ * \param dwLastError
+ * Error code if status is ASYNC_RESULT_ERROR
+ *
+ * \returns
+ * status of the read
+ */
+static ASYNC_RESULT AsyncReadResult(OFC_HANDLE wait_set,
+                                    OFC_HANDLE read_file,
+                                    OFC_FILE_BUFFER *buffer,
+                                    OFC_DWORD *dwLen,
+                                    OFC_DWORD *dwLastError)
+{
+  ASYNC_RESULT result;
+  OFC_BOOL status;
+  /*
+   * Get the overlapped result
+   */
+  status = OfcGetOverlappedResult(read_file, buffer->readOverlapped,
+                                  dwLen, OFC_FALSE);
+  /*
+   * If the I/O is complete, status will be true and length will be non zero
+   */
+  if (status == OFC_TRUE)
+    {
+      if (*dwLen == 0)
+        {
+          result = ASYNC_RESULT_EOF;
+        }
+      else
+        {
+          result = ASYNC_RESULT_DONE;
+        }
+    }
+  else
+    {
+      /*
+       * I/O may still be pending
+       */
+      *dwLastError = OfcGetLastError();
+      if (*dwLastError == OFC_ERROR_IO_PENDING)
+        result = ASYNC_RESULT_PENDING;
+      else
+        {
+          /*
+           * I/O may also be EOF
+           */
+          if (*dwLastError != OFC_ERROR_HANDLE_EOF)
+            {
+              smbtrace(OFC_LOG_WARN, "read offset %lld failed: %s",
+                       (long long) buffer->offset,
+                       ofc_get_error_string(*dwLastError));
+              result = ASYNC_RESULT_ERROR;
+            }
+          else
+            result = ASYNC_RESULT_EOF;
+        }
+    }
+  if (result == ASYNC_RESULT_DONE)
+    smbtrace(OFC_LOG_DEBUG, "read %p offset %lld done %u", buffer,
+             (long long) buffer->offset, *dwLen);
+
+  if (result != ASYNC_RESULT_PENDING)
+    {
+      /*
+       * Finish up the buffer if the I/O is no longer pending
+       */
+      buffer->state = BUFFER_STATE_IDLE;
+      ofc_waitset_remove(wait_set, buffer->readOverlapped);
+    }
+
+  return (result);
+}
+
+/*
+ * Perform an I/O Write
+ *
+ * This routine initiates a write on an async buffer and adds it to the
+ * waitset if the I/O is pending
+ *
+ * \param wait_set
+ * The wait set that this I/O and it's overlapped handles will be part of
+ *
+ * \param write_file
+ * Handle of write file
+ *
+ * \param buffer
+ * Pointer to buffer to read into
+ *
+ * \param dwLen
+ * Length of buffer to read
+ *
+ * \param dwLastError
+ * Error code if result is error
+ *
+ * \returns
+ * Async Result
+ */
+static ASYNC_RESULT AsyncWrite(OFC_HANDLE wait_set, OFC_HANDLE write_file,
+                               OFC_FILE_BUFFER *buffer, OFC_DWORD dwLen,
+                               OFC_DWORD *dwLastError)
+{
+  OFC_BOOL status;
+  ASYNC_RESULT result;
+
+  OfcSetOverlappedOffset(write_file, buffer->writeOverlapped,
+                         buffer->offset + buffer->flushed);
+
+  buffer->state = BUFFER_STATE_WRITE;
+
+  smbtrace(OFC_LOG_DEBUG, "write %p offset %lld length %u", buffer,
+           (long long) (buffer->offset + buffer->flushed), dwLen);
+  status = OfcWriteFile(write_file, buffer->data + buffer->flushed, dwLen,
+                        OFC_NULL, buffer->writeOverlapped);
+
+  result = ASYNC_RESULT_DONE;
+  if (status != OFC_TRUE)
+    {
+      *dwLastError = OfcGetLastError();
+      if (*dwLastError == OFC_ERROR_IO_PENDING)
+        {
+	  *dwLastError = OFC_ERROR_SUCCESS;
+          result = ASYNC_RESULT_PENDING;
+          ofc_waitset_add(wait_set,
+                          (OFC_HANDLE) &buffer->event,
+                          buffer->writeOverlapped);
+        }
+      else
+        {
+          smbtrace(OFC_LOG_WARN, "write offset %lld failed: %s",
+                   (long long) buffer->offset,
+                   ofc_get_error_string(*dwLastError));
+          result = ASYNC_RESULT_ERROR;
+          buffer->state = BUFFER_STATE_IDLE;
+        }
+    }
+  return (result);
+}
+
+static ASYNC_RESULT AsyncWriteResult(OFC_HANDLE wait_set,
+                                     OFC_HANDLE write_file,
+                                     OFC_FILE_BUFFER *buffer,
+                                     OFC_DWORD *dwLen,
+                                     OFC_DWORD *dwLastError)
+{
+  ASYNC_RESULT result;
+  OFC_BOOL status;
+
+  status = OfcGetOverlappedResult(write_file, buffer->writeOverlapped,
+                                  dwLen, OFC_FALSE);
+  if (status == OFC_TRUE)
+    result = ASYNC_RESULT_DONE;
+  else
+    {
+      *dwLastError = OfcGetLastError();
+      if (*dwLastError == OFC_ERROR_IO_PENDING)
+        result = ASYNC_RESULT_PENDING;
+      else
+        {
+          smbtrace(OFC_LOG_WARN, "write offset %lld failed: %s",
+                   (long long) buffer->offset,
+                   ofc_get_error_string(*dwLastError));
+          result = ASYNC_RESULT_ERROR;
+        }
+    }
+  if (result == ASYNC_RESULT_DONE)
+    smbtrace(OFC_LOG_DEBUG, "write %p offset %lld done %u", buffer,
+             (long long) buffer->offset, *dwLen);
+
+  if (result != ASYNC_RESULT_PENDING)
+    {
+      buffer->state = BUFFER_STATE_IDLE;
+      ofc_waitset_remove(wait_set, buffer->writeOverlapped);
+    }
+
+  return (result);
+}
+
+/*
+ * Source failover
+ *
+ * A read that fails because the connection to the source was lost is
+ * held back rather than failing the copy, as long as the source is a
+ * network path.  Once no reads are left outstanding on the old handle,
+ * the source is reopened by name.  Reopening resolves any DFS referral
+ * again, and the target that went away won't answer, so the copy carries
+ * on from another replica.  Only the reads that were held back are
+ * reissued.  Chunks already read are not read again.
+ *
+ * The destination doesn't fail over.  A replica reached through another
+ * referral can't be assumed to hold what was already written.
+ */
+static OFC_BOOL is_remote(OFC_CTCHAR *filename)
+{
+  return ((filename[0] == TSTR('/') || filename[0] == TSTR('\\')) &&
+          (filename[1] == TSTR('/') || filename[1] == TSTR('\\')));
+}
+
+static OFC_BOOL is_retryable(OFC_DWORD dwLastError)
+{
+  return (dwLastError == OFC_ERROR_NETNAME_DELETED ||
+          dwLastError == OFC_ERROR_UNEXP_NET_ERR ||
+          dwLastError == OFC_ERROR_BAD_NETPATH ||
+          dwLastError == OFC_ERROR_BAD_NET_NAME);
+}
+
+/*
+ * Hold back a failed read for reissue after failover.  Returns OFC_FALSE
+ * if the read can't be retried.
+ */
+static OFC_BOOL retry_read(struct smbcopy *copy_state,
+                           OFC_FILE_BUFFER *buffer, OFC_DWORD dwLastError)
+{
+  if (!copy_state->remote_source || !is_retryable(dwLastError) ||
+      copy_state->failovers >= FAILOVER_MAX || copy_state->cancelled)
+    return (OFC_FALSE);
+
+  if (!copy_state->failover)
+    {
+      smbtrace(OFC_LOG_WARN, "source lost at offset %lld: %s",
+               (long long) buffer->offset,
+               ofc_get_error_string(dwLastError));
+      copy_state->failover = OFC_TRUE;
+      copy_state->failed_at = ofc_time_get_now();
+    }
+  buffer->state = BUFFER_STATE_DEFER_READ;
+  ofc_enqueue(copy_state->deferred, buffer);
+  return (OFC_TRUE);
+}
+
+/*
+ * Read striping
+ *
+ * A striping copy reads each chunk from whichever of the source and its
+ * replicas should get it back first.  Each stripe keeps a moving average
+ * of the rate its reads complete at, and a chunk goes to the stripe that
+ * would get through the reads it has outstanding, and one more, soonest
+ * at that rate.  A stripe that hasn't finished a read yet is taken to
+ * read at the average of those that have, so that it is tried.  All of a
+ * chunk is read from one stripe and written once, from the buffer, as
+ * before.
+ *
+ * A replica that fails is read from no more and what it was reading is
+ * read from the source instead.  While the source fails over, chunks go
+ * to the replicas.  Only reads from the source are hedged.
+ */
+static OFC_HANDLE stripe_file(struct smbcopy *copy_state, OFC_INT stripe)
+{
+  return (stripe == 0 ? copy_state->read_file :
+          copy_state->stripes[stripe].file);
+}
+
+static OFC_VOID use_stripe(OFC_FILE_BUFFER *buffer, OFC_INT stripe)
+{
+  buffer->stripe = stripe;
+  buffer->readOverlapped = buffer->stripeOverlapped[stripe];
+}
+
+static OFC_INT pick_stripe(struct smbcopy *copy_state)
+{
+  struct stripe *stripes = copy_state->stripes;
+  OFC_UINT64 total;
+  OFC_UINT64 rate;
+  OFC_UINT64 best_rate;
+  OFC_INT sampled;
+  OFC_INT best;
+  OFC_INT s;
+
+  total = 0;
+  sampled = 0;
+  for (s = 0; s < copy_state->num_stripes; s++)
+    {
+      if (!stripes[s].lost && stripes[s].rate > 0)
+        {
+          total += stripes[s].rate;
+          sampled++;
+        }
+    }
+
+  best = 0;
+  best_rate = 0;
+  for (s = 0; s < copy_state->num_stripes; s++)
+    {
+      if (stripes[s].lost || (s == 0 && copy_state->failover))
+        continue;
+
+      rate = stripes[s].rate;
+      if (rate == 0)
+        rate = sampled > 0 ? total / sampled : 1;
+      /*
+       * (reading + 1) / rate, compared without dividing
+       */
+      if (best_rate == 0 ||
+          (OFC_UINT64) (stripes[s].reading + 1) * best_rate <
+          (OFC_UINT64) (stripes[best].reading + 1) * rate)
+        {
+          best = s;
+          best_rate = rate;
+        }
+    }
+  return (best);
+}
+
+/*
+ * Fold a read that has finished into its stripe's average
+ */
+static OFC_VOID sample_stripe(struct smbcopy *copy_state,
+                              OFC_FILE_BUFFER *buffer, OFC_DWORD dwLen)
+{
+  struct stripe *stripe = &copy_state->stripes[buffer->stripe];
+  OFC_UINT64 elapsed;
+  OFC_UINT64 sample;
+
+  stripe->bytes += dwLen;
+  elapsed = engine_now() - buffer->started;
+  if (elapsed == 0)
+    elapsed = 1;
+  sample = (OFC_UINT64) dwLen * 1000000 / elapsed;
+  if (stripe->rate == 0)
+    stripe->rate = sample;
+  else
+    stripe->rate = stripe->rate - (stripe->rate >> STRIPE_EWMA_SHIFT) +
+      (sample >> STRIPE_EWMA_SHIFT);
+}
+
+/*
+ * Stop reading from a replica whose read failed and move the buffer to
+ * the source
+ */
+static OFC_VOID lose_stripe(struct smbcopy *copy_state,
+                            OFC_FILE_BUFFER *buffer, OFC_DWORD dwLastError)
+{
+  struct stripe *stripe = &copy_state->stripes[buffer->stripe];
+
+  if (!stripe->lost)
+    {
+      smbtrace(OFC_LOG_WARN, "replica %d lost at offset %lld: %s",
+               buffer->stripe, (long long) buffer->offset,
+               ofc_get_error_string(dwLastError));
+      stripe->lost = OFC_TRUE;
+    }
+  use_stripe(buffer, 0);
+}
+
+/*
+ * Hedged reads
+ *
+ * With a replica of the source, a chunk read from the source that hasn't
+ * finished within the hedge time is read from the replica as well.
+ * Whichever read finishes first is written and the other is abandoned.
+ * There is no cancelling an overlapped read, so an abandoned read stays
+ * in the wait set until it finishes and its result is dropped.  The
+ * buffer doesn't read into memory an abandoned read may still fill, so a
+ * buffer whose source read lost waits for that read before it reads the
+ * next chunk, and a buffer isn't hedged again until its abandoned reads
+ * are back.  Only the first read of a chunk is hedged.  A hedge that
+ * fails or comes back short is ignored and the source read carries on.
+ */
+static OFC_VOID arm_hedge_timer(struct smbcopy *copy_state, OFC_MSTIME wait)
+{
+  if (!copy_state->hedge_armed)
+    {
+      ofc_timer_set(copy_state->hedge_timer, wait);
+      ofc_waitset_add(copy_state->wait_set,
+                      (OFC_HANDLE) &copy_state->timer_event,
+                      copy_state->hedge_timer);
+      copy_state->hedge_armed = OFC_TRUE;
+    }
+}
+
+static OFC_VOID issue_hedge(struct smbcopy *copy_state,
+                            OFC_FILE_BUFFER *buffer)
+{
+  OFC_DWORD dwLastError;
+
+  OfcSetOverlappedOffset(copy_state->replica_file, buffer->hedgeOverlapped,
+                         buffer->offset);
+  smbtrace(OFC_LOG_DEBUG, "hedge %p offset %lld length %u", buffer,
+           (long long) buffer->offset, buffer->length);
+  if (OfcReadFile(copy_state->replica_file, buffer->hedge_data,
+                  buffer->length, OFC_NULL, buffer->hedgeOverlapped) ||
+      (dwLastError = OfcGetLastError()) == OFC_ERROR_IO_PENDING)
+    {
+      ofc_waitset_add(copy_state->wait_set, (OFC_HANDLE) &buffer->event,
+                      buffer->hedgeOverlapped);
+      buffer->racing = OFC_TRUE;
+      copy_state->extra++;
+      copy_state->stats.hedges++;
+    }
+  else
+    smbtrace(OFC_LOG_WARN, "hedge offset %lld failed: %s",
+             (long long) buffer->offset, ofc_get_error_string(dwLastError));
+}
+
+/*
+ * Hedge every source read that has taken too long and rearm the timer
+ * for the next one that could
+ */
+static OFC_VOID check_hedges(struct smbcopy *copy_state)
+{
+  OFC_FILE_BUFFER *buffer;
+  OFC_MSTIME now;
+  OFC_MSTIME due;
+  OFC_MSTIME next;
+
+  if (copy_state->hedge_armed)
+    {
+      ofc_waitset_remove(copy_state->wait_set, copy_state->hedge_timer);
+      copy_state->hedge_armed = OFC_FALSE;
+    }
+
+  if (copy_state->cancelled)
+    return;
+
+  now = ofc_time_get_now();
+  next = 0;
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      if (buffer->state != BUFFER_STATE_READ || buffer->stripe != 0 ||
+          buffer->racing || buffer->stale != 0 || buffer->filled != 0)
+        continue;
+
+      due = buffer->issued + copy_state->hedge_ms;
+      if (due <= now)
+        {
+          /*
+           * A hedge is an extra read.  If the rate limiter won't have
+           * it, try again next time round.
+           */
+          if (smbrate_take(buffer->length) == 0)
+            issue_hedge(copy_state, buffer);
+          else if (next == 0)
+            next = now + 1;
+        }
+      else if (next == 0 || due < next)
+        next = due;
+    }
+
+  if (next != 0)
+    arm_hedge_timer(copy_state, next - now);
+}
+
+/*
+ * See whether a racing hedge has finished.  If it finished first with
+ * the whole read, its data becomes the buffer's and the source read is
+ * abandoned.  Returns ASYNC_RESULT_PENDING unless the hedge won.
+ */
+static ASYNC_RESULT hedge_result(struct smbcopy *copy_state,
+                                 OFC_FILE_BUFFER *buffer, OFC_DWORD *dwLen)
+{
+  OFC_CHAR *data;
+  OFC_BOOL status;
+
+  status = OfcGetOverlappedResult(copy_state->replica_file,
+                                  buffer->hedgeOverlapped, dwLen, OFC_FALSE);
+  if (status == OFC_FALSE && OfcGetLastError() == OFC_ERROR_IO_PENDING)
+    return (ASYNC_RESULT_PENDING);
+
+  ofc_waitset_remove(copy_state->wait_set, buffer->hedgeOverlapped);
+  buffer->racing = OFC_FALSE;
+  copy_state->extra--;
+  if (status == OFC_FALSE || *dwLen != buffer->length)
+    {
+      smbtrace(OFC_LOG_INFO, "hedge offset %lld ignored",
+               (long long) buffer->offset);
+      return (ASYNC_RESULT_PENDING);
+    }
+
+  smbtrace(OFC_LOG_DEBUG, "hedge %p offset %lld won", buffer,
+           (long long) buffer->offset);
+  data = buffer->data;
+  buffer->data = buffer->hedge_data;
+  buffer->hedge_data = data;
+  buffer->stale |= STALE_READ;
+  buffer->state = BUFFER_STATE_IDLE;
+  copy_state->extra++;
+  copy_state->stats.hedges_won++;
+  return (ASYNC_RESULT_DONE);
+}
+
+/*
+ * Drop the results of abandoned reads that have finished.  Returns
+ * OFC_TRUE if any had.
+ */
+static OFC_BOOL reap_stale(struct smbcopy *copy_state,
+                           OFC_FILE_BUFFER *buffer)
+{
+  OFC_DWORD dwLen;
+  OFC_BOOL reaped;
+
+  reaped = OFC_FALSE;
+  if ((buffer->stale & STALE_READ) &&
+      (OfcGetOverlappedResult(copy_state->read_file,
+                              buffer->readOverlapped, &dwLen, OFC_FALSE) ||
+       OfcGetLastError() != OFC_ERROR_IO_PENDING))
+    {
+      ofc_waitset_remove(copy_state->wait_set, buffer->readOverlapped);
+      buffer->stale &= ~STALE_READ;
+      copy_state->stripes[0].reading--;
+      copy_state->extra--;
+      reaped = OFC_TRUE;
+    }
+
+  if ((buffer->stale & STALE_HEDGE) &&
+      (OfcGetOverlappedResult(copy_state->replica_file,
+                              buffer->hedgeOverlapped, &dwLen, OFC_FALSE) ||
+       OfcGetLastError() != OFC_ERROR_IO_PENDING))
+    {
+      ofc_waitset_remove(copy_state->wait_set, buffer->hedgeOverlapped);
+      buffer->stale &= ~STALE_HEDGE;
+      copy_state->extra--;
+      reaped = OFC_TRUE;
+    }
+  return (reaped);
+}
+
+/*
+ * Rate limiting
+ *
+ * Reads and writes are issued through issue_io.  When the rate limiter
+ * won't admit an I/O, the buffer is queued and the I/O is issued later
+ * from the wait set, when the rate timer fires.  A queued I/O counts as
+ * pending and queued I/Os go out in the order they were queued.  Bytes
+ * are charged when a chunk is read, so the byte rate is the rate the copy
+ * runs at.  Every read and write counts as an I/O.  The same queue holds
+ * I/O back while the source fails over.
+ */
+static OFC_VOID arm_rate_timer(struct smbcopy *copy_state, OFC_MSTIME wait)
+{
+  if (!copy_state->timer_armed)
+    {
+      ofc_timer_set(copy_state->rate_timer, wait);
+      ofc_waitset_add(copy_state->wait_set,
+                      (OFC_HANDLE) &copy_state->timer_event,
+                      copy_state->rate_timer);
+      copy_state->timer_armed = OFC_TRUE;
+    }
+}
+
+static ASYNC_RESULT issue_io(struct smbcopy *copy_state,
+                             OFC_FILE_BUFFER *buffer, BUFFER_STATE state,
+                             OFC_DWORD dwLen, OFC_DWORD *dwLastError);
+
+static ASYNC_RESULT start_io(struct smbcopy *copy_state,
+                             OFC_FILE_BUFFER *buffer, BUFFER_STATE state,
+                             OFC_DWORD dwLen, OFC_DWORD *dwLastError)
+{
+  ASYNC_RESULT result;
+
+  if (state == BUFFER_STATE_READ)
+    {
+      result = AsyncRead(copy_state->wait_set,
+                         stripe_file(copy_state, buffer->stripe),
+                         buffer, dwLen, dwLastError);
+      if (result == ASYNC_RESULT_ERROR && buffer->stripe != 0)
+        {
+          /*
+           * Read it from the source instead
+           */
+          lose_stripe(copy_state, buffer, *dwLastError);
+          return (issue_io(copy_state, buffer, state, dwLen, dwLastError));
+        }
+
+      if (result == ASYNC_RESULT_PENDING)
+        {
+          copy_state->stripes[buffer->stripe].reading++;
+          buffer->started = engine_now();
+          buffer->issued = ofc_time_get_now();
+          if (copy_state->hedge_timer != OFC_HANDLE_NULL &&
+              buffer->stripe == 0 && buffer->filled == 0)
+            arm_hedge_timer(copy_state, copy_state->hedge_ms);
+        }
+      else if (result == ASYNC_RESULT_ERROR &&
+               retry_read(copy_state, buffer, *dwLastError))
+        {
+          *dwLastError = OFC_ERROR_SUCCESS;
+          result = ASYNC_RESULT_PENDING;
+        }
+    }
+  else
+    result = AsyncWrite(copy_state->wait_set, copy_state->write_file,
+                        buffer, dwLen, dwLastError);
+  return (result);
+}
+
+static ASYNC_RESULT issue_io(struct smbcopy *copy_state,
+                             OFC_FILE_BUFFER *buffer, BUFFER_STATE state,
+                             OFC_DWORD dwLen, OFC_DWORD *dwLastError)
+{
+  OFC_MSTIME wait;
+
+  buffer->length = dwLen;
+  if (state == BUFFER_STATE_READ && copy_state->failover &&
+      buffer->stripe == 0)
+    {
+      /*
+       * Reads wait for the source to come back
+       */
+      buffer->state = BUFFER_STATE_DEFER_READ;
+      ofc_enqueue(copy_state->deferred, buffer);
+      *dwLastError = OFC_ERROR_SUCCESS;
+      return (ASYNC_RESULT_PENDING);
+    }
+
+  if (copy_state->rate_timer != OFC_HANDLE_NULL)
+    {
+      /*
+       * Don't let an I/O overtake those already waiting
+       */
+      wait = 0;
+      if (ofc_queue_empty(copy_state->deferred))
+        wait = smbrate_take(state == BUFFER_STATE_READ ? dwLen : 0);
+
+      if (wait > 0 || !ofc_queue_empty(copy_state->deferred))
+        {
+          buffer->state = state == BUFFER_STATE_READ ?
+            BUFFER_STATE_DEFER_READ : BUFFER_STATE_DEFER_WRITE;
+          ofc_enqueue(copy_state->deferred, buffer);
+          arm_rate_timer(copy_state, wait);
+          *dwLastError = OFC_ERROR_SUCCESS;
+          return (ASYNC_RESULT_PENDING);
+        }
+    }
+  return (start_io(copy_state, buffer, state, dwLen, dwLastError));
+}
+
+/*
+ * Issue as many of the queued I/Os as the limiter will now admit and
+ * rearm the rate timer for the rest.  Called when the rate timer fires
+ * and when failover completes.
+ */
+static OFC_VOID issue_deferred(struct smbcopy *copy_state,
+                               OFC_DWORD *dwFirstError)
+{
+  OFC_FILE_BUFFER *buffer;
+  BUFFER_STATE state;
+  ASYNC_RESULT result;
+  OFC_DWORD dwLastError;
+  OFC_MSTIME wait;
+
+  if (copy_state->timer_armed)
+    {
+      ofc_waitset_remove(copy_state->wait_set, copy_state->rate_timer);
+      copy_state->timer_armed = OFC_FALSE;
+    }
+
+  while (!copy_state->failover &&
+         (buffer = ofc_queue_first(copy_state->deferred)) != OFC_NULL)
+    {
+      state = buffer->state == BUFFER_STATE_DEFER_READ ?
+        BUFFER_STATE_READ : BUFFER_STATE_WRITE;
+      wait = smbrate_take(state == BUFFER_STATE_READ ? buffer->length : 0);
+      if (wait > 0)
+        {
+          arm_rate_timer(copy_state, wait);
+          break;
+        }
+
+      ofc_dequeue(copy_state->deferred);
+      result = start_io(copy_state, buffer, state, buffer->length,
+                        &dwLastError);
+      if (result == ASYNC_RESULT_ERROR)
+        *dwFirstError = dwLastError;
+      if (result != ASYNC_RESULT_PENDING)
+        {
+          copy_state->eof = OFC_TRUE;
+          copy_state->pending--;
+        }
+    }
+}
+
+/*
+ * Give up on everything that is queued
+ */
+static OFC_VOID drop_deferred(struct smbcopy *copy_state)
+{
+  OFC_FILE_BUFFER *buffer;
+
+  while ((buffer = ofc_dequeue(copy_state->deferred)) != OFC_NULL)
+    {
+      buffer->state = BUFFER_STATE_IDLE;
+      copy_state->pending--;
+    }
+  copy_state->eof = OFC_TRUE;
+}
+
+/*
+ * Reopen the source and reissue the reads that were held back.  Called
+ * once no reads are outstanding on the old handle and again each time
+ * the failover timer fires.  An attempt that fails arms the timer for
+ * the next one rather than waiting here, so the caller's thread is only
+ * held up by the open itself.
+ */
+static OFC_DWORD fail_over(struct smbcopy *copy_state,
+                           OFC_DWORD *dwFirstError)
+{
+  OFC_FILE_BUFFER *buffer;
+  OFC_HANDLE read_file;
+  OFC_DWORD dwLastError;
+  OFC_MSTIME recovery;
+
+  if (copy_state->read_file != OFC_HANDLE_NULL)
+    {
+      for (buffer = ofc_queue_first(copy_state->buffer_list);
+           buffer != OFC_NULL;
+           buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+        {
+          if (buffer->stripeOverlapped[0] != OFC_HANDLE_NULL)
+            {
+              OfcDestroyOverlapped(copy_state->read_file,
+                                   buffer->stripeOverlapped[0]);
+              buffer->stripeOverlapped[0] = OFC_HANDLE_NULL;
+              if (buffer->stripe == 0)
+                buffer->readOverlapped = OFC_HANDLE_NULL;
+            }
+        }
+      OfcCloseHandle(copy_state->read_file);
+      copy_state->read_file = OFC_HANDLE_NULL;
+    }
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  copy_state->reopens++;
+  read_file = OfcCreateFile(copy_state->rfilename,
+                            OFC_GENERIC_READ,
+                            OFC_FILE_SHARE_READ,
+                            OFC_NULL,
+                            OFC_OPEN_EXISTING,
+                            OFC_FILE_ATTRIBUTE_NORMAL |
+                            OFC_FILE_FLAG_OVERLAPPED,
+                            OFC_HANDLE_NULL);
+  if (read_file == OFC_INVALID_HANDLE_VALUE)
+    {
+      dwLastError = OfcGetLastError();
+      smbtrace(OFC_LOG_WARN, "source reopen %d failed: %s",
+               copy_state->reopens, ofc_get_error_string(dwLastError));
+      if (copy_state->reopens < FAILOVER_ATTEMPTS)
+        {
+          ofc_timer_set(copy_state->failover_timer,
+                        FAILOVER_BACKOFF * copy_state->reopens);
+          ofc_waitset_add(copy_state->wait_set,
+                          (OFC_HANDLE) &copy_state->timer_event,
+                          copy_state->failover_timer);
+          copy_state->failover_armed = OFC_TRUE;
+          return (OFC_ERROR_SUCCESS);
+        }
+    }
+  else
+    {
+      copy_state->read_file = read_file;
+      for (buffer = ofc_queue_first(copy_state->buffer_list);
+           buffer != OFC_NULL && dwLastError == OFC_ERROR_SUCCESS;
+           buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+        {
+          buffer->stripeOverlapped[0] = OfcCreateOverlapped(read_file);
+          if (buffer->stripeOverlapped[0] == OFC_HANDLE_NULL)
+            dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+          else if (buffer->stripe == 0)
+            buffer->readOverlapped = buffer->stripeOverlapped[0];
+        }
+    }
+
+  copy_state->reopens = 0;
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    {
+      copy_state->failover = OFC_FALSE;
+      copy_state->failovers++;
+      recovery = ofc_time_get_now() - copy_state->failed_at;
+      copy_state->stats.failovers++;
+      copy_state->stats.failover_ms += recovery;
+      smbtrace(OFC_LOG_INFO, "source failed over in %u ms",
+               (unsigned int) recovery);
+      issue_deferred(copy_state, dwFirstError);
+    }
+  else
+    {
+      /*
+       * The copy fails.  Don't try again.
+       */
+      drop_deferred(copy_state);
+      copy_state->failover = OFC_FALSE;
+      copy_state->failovers = FAILOVER_MAX;
+    }
+
+  return (dwLastError);
+}
+
+static OFC_VOID destroy_buffer(struct smbcopy *copy_state,
+			       OFC_FILE_BUFFER *buffer)
+{
+  if (buffer->writeOverlapped != OFC_HANDLE_NULL)
+    {
+      /*
+       * Destroy the overlapped I/O handle for each buffer
+       */
+      OfcDestroyOverlapped(copy_state->write_file, buffer->writeOverlapped);
+      buffer->writeOverlapped = OFC_HANDLE_NULL;
+    }
+
+  if (buffer->stripeOverlapped[0] != OFC_HANDLE_NULL)
+    {
+      OfcDestroyOverlapped(copy_state->read_file,
+                           buffer->stripeOverlapped[0]);
+      buffer->stripeOverlapped[0] = OFC_HANDLE_NULL;
+      buffer->readOverlapped = OFC_HANDLE_NULL;
+    }
+
+  if (buffer->data != OFC_NULL)
+    {
+      free(buffer->data);
+      buffer->data = OFC_NULL;
+    }
+
+  free(buffer);
+}
+
+static OFC_VOID destroy_buffer_list (struct smbcopy *copy_state,
+				     OFC_HANDLE buffer_list)
+{
+  OFC_FILE_BUFFER *buffer;
+
+  for (buffer = ofc_dequeue(buffer_list);
+       buffer != OFC_NULL;
+       buffer = ofc_dequeue(buffer_list))
+    {
+      destroy_buffer(copy_state, buffer);
+    }
+}
+
+static OFC_HANDLE alloc_buffer_list(struct smbcopy *copy_state,
+				    OFC_HANDLE read_file,
+                                    OFC_HANDLE write_file)
+{
+  OFC_HANDLE buffer_list;
+  OFC_BOOL status = OFC_TRUE;
+  OFC_FILE_BUFFER *buffer;
+  
+  buffer_list = ofc_queue_create();
+  if (buffer_list == OFC_HANDLE_NULL)
+    status = OFC_FALSE;
+  
+  for (int i = 0; i < NUM_FILE_BUFFERS && status; i++)
+    {
+      /*
+       * Get the buffer descriptor and the data buffer
+       */
+      buffer = malloc(sizeof(OFC_FILE_BUFFER));
+      if (buffer == OFC_NULL)
+        {
+          status = OFC_FALSE;
+        }
+      else
+        {
+          buffer->data = OFC_NULL;
+          buffer->readOverlapped = OFC_HANDLE_NULL;
+          for (int s = 0; s < NUM_STRIPES; s++)
+            buffer->stripeOverlapped[s] = OFC_HANDLE_NULL;
+          buffer->stripe = 0;
+          buffer->started = 0;
+          buffer->writeOverlapped = OFC_HANDLE_NULL;
+          buffer->state = BUFFER_STATE_IDLE;
+          buffer->event.copy_state = copy_state;
+          buffer->event.buffer = buffer;
+          buffer->hedgeOverlapped = OFC_HANDLE_NULL;
+          buffer->hedge_data = OFC_NULL;
+          buffer->issued = 0;
+          buffer->racing = OFC_FALSE;
+          buffer->stale = 0;
+          
+          /*
+           * Buffers beyond the copy's share of the budget start out
+           * spare
+           */
+          if (i >= copy_state->share.held)
+            buffer->state = BUFFER_STATE_SPARE;
+          else
+            buffer->data = malloc(copy_state->share.chunk);
+          if (buffer->state != BUFFER_STATE_SPARE && buffer->data == OFC_NULL)
+            {
+              status = OFC_FALSE;
+            }
+          else
+            {
+              /*
+               * And initialize the overlapped handles
+               */
+              buffer->stripeOverlapped[0] = OfcCreateOverlapped(read_file);
+              buffer->readOverlapped = buffer->stripeOverlapped[0];
+              buffer->writeOverlapped = OfcCreateOverlapped(write_file);
+              if (buffer->readOverlapped == OFC_HANDLE_NULL ||
+                  buffer->writeOverlapped == OFC_HANDLE_NULL)
+                {
+                  status = OFC_FALSE;
+                }
+            }
+
+          if (status == OFC_TRUE)
+            {
+              /*
+               * Add it to our buffer list
+               */
+              ofc_enqueue(buffer_list, buffer);
+            }
+          else
+            {
+              destroy_buffer(copy_state, buffer);
+              buffer = OFC_NULL;
+            }
+        }
+    }
+
+  if (status == OFC_FALSE && buffer_list != OFC_HANDLE_NULL)
+    {
+      destroy_buffer_list(copy_state, buffer_list);
+      buffer_list = OFC_HANDLE_NULL;
+    }
+
+  return (buffer_list);
+}
+
+/*
+ * Fetch the allocated ranges of a sparse source.  Servers and file
+ * systems that don't support the query leave us with no ranges and every
+ * chunk is read and checked for zeros instead.
+ */
+static OFC_VOID query_ranges(struct smbcopy *copy_state)
+{
+  struct alloc_range query;
+  struct alloc_range *ranges;
+  OFC_DWORD dwLen;
+  OFC_BOOL status;
+  OFC_BOOL more;
+
+  query.offset = 0;
+  query.length = copy_state->size;
+  more = OFC_TRUE;
+  while (more)
+    {
+      copy_state->ranges =
+        realloc(copy_state->ranges, sizeof(struct alloc_range) *
+                (copy_state->num_ranges + NUM_QUERY_RANGES));
+      ranges = &copy_state->ranges[copy_state->num_ranges];
+      dwLen = 0;
+      status = OfcDeviceIoControl(copy_state->read_file,
+                                  FSCTL_QUERY_ALLOCATED_RANGES,
+                                  &query, sizeof(query),
+                                  ranges,
+                                  sizeof(struct alloc_range) *
+                                  NUM_QUERY_RANGES,
+                                  &dwLen, OFC_HANDLE_NULL);
+      /*
+       * A full reply means there may be more ranges after the last one
+       */
+      more = (status == OFC_TRUE &&
+              dwLen == sizeof(struct alloc_range) * NUM_QUERY_RANGES);
+      if (status == OFC_FALSE && copy_state->num_ranges == 0)
+        {
+          smbtrace(OFC_LOG_INFO, "allocated ranges not available: %s",
+                   ofc_get_error_string(OfcGetLastError()));
+          free(copy_state->ranges);
+          copy_state->ranges = OFC_NULL;
+          more = OFC_FALSE;
+        }
+      else if (status == OFC_TRUE)
+        {
+          copy_state->num_ranges += dwLen / sizeof(struct alloc_range);
+          if (more)
+            {
+              query.offset = ranges[NUM_QUERY_RANGES - 1].offset +
+                ranges[NUM_QUERY_RANGES - 1].length;
+              query.length = copy_state->size - query.offset;
+              more = (query.length > 0);
+            }
+        }
+    }
+}
+
+/*
+ * Move the read offset past any chunks that lie wholly within a hole
+ */
+static OFC_VOID skip_holes(struct smbcopy *copy_state)
+{
+  struct alloc_range *range;
+  OFC_OFFT next;
+
+  if (copy_state->ranges == OFC_NULL)
+    return;
+
+  while (copy_state->range < copy_state->num_ranges &&
+         copy_state->ranges[copy_state->range].offset +
+         copy_state->ranges[copy_state->range].length <= copy_state->offset)
+    copy_state->range++;
+
+  if (copy_state->range == copy_state->num_ranges)
+    next = copy_state->size;
+  else
+    {
+      range = &copy_state->ranges[copy_state->range];
+      /*
+       * Keep reads on chunk boundaries
+       */
+      next = range->offset - range->offset % copy_state->share.chunk;
+    }
+
+  if (next > copy_state->offset)
+    {
+      copy_state->skipped += next - copy_state->offset;
+      copy_state->offset = next;
+    }
+}
+
+/*
+ * Start a read of the next chunk into a buffer.  Once the source size is
+ * known, the last read is cut to the end of the file and no reads are
+ * issued past it.
+ */
+static ASYNC_RESULT next_read(struct smbcopy *copy_state,
+                              OFC_FILE_BUFFER *buffer,
+                              OFC_DWORD *dwLastError)
+{
+  OFC_DWORD dwLen;
+
+  if (copy_state->sparse)
+    skip_holes(copy_state);
+
+  /*
+   * Once the copy has ended, by reaching the end or by an error, or the
+   * source is gone, there is nothing more to read
+   */
+  if (copy_state->eof || copy_state->read_file == OFC_HANDLE_NULL ||
+      (copy_state->size >= 0 && copy_state->offset >= copy_state->size))
+    {
+      *dwLastError = OFC_ERROR_SUCCESS;
+      buffer->state = BUFFER_STATE_IDLE;
+      return (ASYNC_RESULT_EOF);
+    }
+
+  dwLen = copy_state->share.chunk;
+  if (copy_state->size >= 0 &&
+      copy_state->size - copy_state->offset < dwLen)
+    dwLen = (OFC_DWORD) (copy_state->size - copy_state->offset);
+
+  buffer->offset = copy_state->offset;
+  buffer->chunk = dwLen;
+  buffer->filled = 0;
+  buffer->flushed = 0;
+  copy_state->offset += dwLen;
+  if (copy_state->num_stripes > 1)
+    {
+      use_stripe(buffer, pick_stripe(copy_state));
+      if (buffer->stripe != 0)
+        copy_state->stats.striped++;
+    }
+  return (issue_io(copy_state, buffer, BUFFER_STATE_READ, dwLen,
+                   dwLastError));
+}
+
+/*
+ * Memory budget
+ *
+ * A copy starts with as many buffers as its share of the process's
+ * memory budget allows and the rest are spare, with no memory.  Each
+ * time a buffer finishes a chunk, the copy gives that buffer back if the
+ * budget says it holds too much, and otherwise puts spare buffers to
+ * work for as long as the budget has room for them.  A buffer with an
+ * abandoned read still outstanding isn't given back.
+ */
+static OFC_VOID free_buffer_data(OFC_FILE_BUFFER *buffer)
+{
+  free(buffer->data);
+  buffer->data = OFC_NULL;
+  free(buffer->hedge_data);
+  buffer->hedge_data = OFC_NULL;
+}
+
+static OFC_BOOL shrink_buffer(struct smbcopy *copy_state,
+                              OFC_FILE_BUFFER *buffer)
+{
+  if (buffer->stale != 0 || !smbmem_over(&copy_state->share))
+    return (OFC_FALSE);
+
+  free_buffer_data(buffer);
+  buffer->state = BUFFER_STATE_SPARE;
+  smbmem_release(&copy_state->share);
+  copy_state->stats.shrinks++;
+  return (OFC_TRUE);
+}
+
+static OFC_VOID grow_buffers(struct smbcopy *copy_state)
+{
+  OFC_FILE_BUFFER *buffer;
+  ASYNC_RESULT result;
+  OFC_DWORD dwLastError;
+
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL && !copy_state->eof && !copy_state->cancelled;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      if (buffer->state != BUFFER_STATE_SPARE)
+        continue;
+      if (!smbmem_grow(&copy_state->share))
+        break;
+
+      buffer->data = malloc(copy_state->share.chunk);
+      if (copy_state->replica_file != OFC_HANDLE_NULL)
+        buffer->hedge_data = malloc(copy_state->share.chunk);
+      if (buffer->data == OFC_NULL ||
+          (copy_state->replica_file != OFC_HANDLE_NULL &&
+           buffer->hedge_data == OFC_NULL))
+        {
+          free_buffer_data(buffer);
+          smbmem_release(&copy_state->share);
+          break;
+        }
+
+      buffer->state = BUFFER_STATE_IDLE;
+      copy_state->pending++;
+      result = next_read(copy_state, buffer, &dwLastError);
+      if (result == ASYNC_RESULT_ERROR)
+        copy_state->error = dwLastError;
+      if (result != ASYNC_RESULT_PENDING)
+        {
+          copy_state->pending--;
+          copy_state->eof = OFC_TRUE;
+        }
+    }
+}
+
+/*
+ * Move a buffer on to the next chunk, once any source read it abandoned
+ * to a hedge is back, or give it back to the memory budget
+ */
+static ASYNC_RESULT next_chunk(struct smbcopy *copy_state,
+                               OFC_FILE_BUFFER *buffer,
+                               OFC_DWORD *dwLastError)
+{
+  if (buffer->stale & STALE_READ)
+    {
+      buffer->state = BUFFER_STATE_DRAIN;
+      *dwLastError = OFC_ERROR_SUCCESS;
+      return (ASYNC_RESULT_PENDING);
+    }
+
+  if (shrink_buffer(copy_state, buffer))
+    {
+      /*
+       * The buffer is no longer pending, though the copy goes on
+       */
+      copy_state->pending--;
+      *dwLastError = OFC_ERROR_SUCCESS;
+      return (ASYNC_RESULT_PENDING);
+    }
+
+  grow_buffers(copy_state);
+  return (next_read(copy_state, buffer, dwLastError));
+}
+
+/*
+ * Find out how big the source is.  Best effort: if we can't, reads run
+ * until they hit EOF as before.
+ */
+static OFC_VOID init_size(struct smbcopy *copy_state)
+{
+  OFC_FILE_STANDARD_INFO info;
+
+  if (OfcGetFileInformationByHandleEx(copy_state->read_file,
+                                      OfcFileStandardInfo,
+                                      &info, sizeof(info)))
+    copy_state->size = info.EndOfFile;
+  else
+    smbtrace(OFC_LOG_INFO, "source size not available: %s",
+             ofc_get_error_string(OfcGetLastError()));
+}
+
+/*
+ * Reserve the destination's space up front so that writes completing out
+ * of order don't extend the file piecemeal.  The end of file is left
+ * alone until the copy completes so that an interrupted copy is visibly
+ * short.  Best effort.
+ */
+static OFC_VOID preallocate(OFC_HANDLE write_file, OFC_OFFT size)
+{
+  OFC_FILE_ALLOCATION_INFO alloc_info;
+
+  if (size <= 0)
+    return;
+
+  alloc_info.AllocationSize = size;
+  if (!OfcSetFileInformationByHandle(write_file,
+                                     OfcFileAllocationInfo,
+                                     &alloc_info, sizeof(alloc_info)))
+    smbtrace(OFC_LOG_INFO, "destination not preallocated: %s",
+             ofc_get_error_string(OfcGetLastError()));
+}
+
+/*
+ * Set up a sparse copy.  The destination is marked sparse so that the
+ * ranges we don't write don't take space, and its size is set when the
+ * copy completes.  Both steps are best effort.
+ */
+static OFC_VOID init_sparse(struct smbcopy *copy_state)
+{
+  OFC_DWORD dwLen;
+
+  if (copy_state->size >= 0)
+    query_ranges(copy_state);
+
+  if (!OfcDeviceIoControl(copy_state->write_file, FSCTL_SET_SPARSE,
+                          OFC_NULL, 0, OFC_NULL, 0, &dwLen,
+                          OFC_HANDLE_NULL))
+    smbtrace(OFC_LOG_INFO, "destination not marked sparse: %s",
+             ofc_get_error_string(OfcGetLastError()));
+}
+
+/*
+ * Set the exact size of the destination.  Chunks at the end that weren't
+ * written leave a sparse destination short, and preallocation may leave
+ * any destination long.
+ */
+static OFC_DWORD finish_copy(struct smbcopy *copy_state)
+{
+  OFC_FILE_END_OF_FILE_INFO eof_info;
+  OFC_DWORD dwLastError;
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  eof_info.EndOfFile = copy_state->size >= 0 ?
+    copy_state->size : copy_state->extent;
+  if (!OfcSetFileInformationByHandle(copy_state->write_file,
+                                     OfcFileEndOfFileInfo,
+                                     &eof_info, sizeof(eof_info)))
+    dwLastError = OfcGetLastError();
+  if (copy_state->sparse)
+    smbtrace(OFC_LOG_INFO, "sparse copy skipped %llu of %lld bytes",
+             (unsigned long long) copy_state->skipped,
+             (long long) eof_info.EndOfFile);
+  return (dwLastError);
+}
+
+static OFC_DWORD prime_buffers (struct smbcopy *copy_state)
+{
+  OFC_FILE_BUFFER *buffer;
+  ASYNC_RESULT result;
+  OFC_DWORD dwLastError;
+
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL && !copy_state->eof;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      if (buffer->state == BUFFER_STATE_SPARE)
+        continue;
+      /*
+       * Issue the read (pre increment the pending to
+       * avoid races
+       */
+      copy_state->pending++;
+      result = next_read(copy_state, buffer, &dwLastError);
+      /*
+       * Running out of file before we run out of buffers is not
+       * an error
+       */
+      if (result == ASYNC_RESULT_EOF)
+        dwLastError = OFC_ERROR_SUCCESS;
+
+      if (result != ASYNC_RESULT_PENDING)
+        {
+          /*
+           * discount pending and set eof
+           */
+          copy_state->pending--;
+          /*
+           * Set eof either because it really is eof, or we
+           * want to clean up.
+           */
+          copy_state->eof = OFC_TRUE;
+        }
+    }
+  return (dwLastError);
+}
+
+/*
+ * Give up the replica and everything used to hedge on it.  No hedge may
+ * be outstanding.
+ */
+static OFC_VOID drop_replica(struct smbcopy *copy_state)
+{
+  OFC_FILE_BUFFER *buffer;
+
+  if (copy_state->hedge_timer != OFC_HANDLE_NULL)
+    {
+      if (copy_state->hedge_armed)
+        ofc_waitset_remove(copy_state->wait_set, copy_state->hedge_timer);
+      copy_state->hedge_armed = OFC_FALSE;
+      ofc_timer_destroy(copy_state->hedge_timer);
+      copy_state->hedge_timer = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->buffer_list != OFC_HANDLE_NULL)
+    {
+      for (buffer = ofc_queue_first(copy_state->buffer_list);
+           buffer != OFC_NULL;
+           buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+        {
+          if (buffer->hedgeOverlapped != OFC_HANDLE_NULL)
+            {
+              OfcDestroyOverlapped(copy_state->replica_file,
+                                   buffer->hedgeOverlapped);
+              buffer->hedgeOverlapped = OFC_HANDLE_NULL;
+            }
+          if (buffer->hedge_data != OFC_NULL)
+            {
+              free(buffer->hedge_data);
+              buffer->hedge_data = OFC_NULL;
+            }
+        }
+    }
+
+  if (copy_state->replica_file != OFC_HANDLE_NULL)
+    {
+      OfcCloseHandle(copy_state->replica_file);
+      copy_state->replica_file = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->share.unit != copy_state->share.chunk)
+    smbmem_set_unit(&copy_state->share, copy_state->share.chunk);
+}
+
+/*
+ * Close a replica that chunks are read from along with the buffers'
+ * handles on it.  No read from it may be outstanding.
+ */
+static OFC_VOID close_stripe(struct smbcopy *copy_state, OFC_INT stripe)
+{
+  OFC_FILE_BUFFER *buffer;
+
+  if (copy_state->buffer_list != OFC_HANDLE_NULL)
+    {
+      for (buffer = ofc_queue_first(copy_state->buffer_list);
+           buffer != OFC_NULL;
+           buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+        {
+          if (buffer->stripeOverlapped[stripe] != OFC_HANDLE_NULL)
+            {
+              OfcDestroyOverlapped(copy_state->stripes[stripe].file,
+                                   buffer->stripeOverlapped[stripe]);
+              buffer->stripeOverlapped[stripe] = OFC_HANDLE_NULL;
+            }
+        }
+    }
+
+  if (copy_state->stripes[stripe].file != OFC_HANDLE_NULL)
+    {
+      OfcCloseHandle(copy_state->stripes[stripe].file);
+      copy_state->stripes[stripe].file = OFC_HANDLE_NULL;
+    }
+}
+
+/*
+ * Say how much each stripe read, and how fast
+ */
+static OFC_VOID trace_stripes(struct smbcopy *copy_state)
+{
+  struct stripe *stripe;
+  OFC_INT s;
+
+  for (s = 0; s < copy_state->num_stripes && copy_state->num_stripes > 1;
+       s++)
+    {
+      stripe = &copy_state->stripes[s];
+      smbtrace(OFC_LOG_INFO, "stripe %d: %llu bytes at %llu KB/s%s", s,
+               (unsigned long long) stripe->bytes,
+               (unsigned long long) stripe->rate / 1000,
+               stripe->lost ? " (lost)" : "");
+    }
+}
+
+static OFC_VOID destroy_copy_state(struct smbcopy *copy_state)
+{
+  OFC_INT s;
+
+  drop_replica(copy_state);
+  for (s = 1; s < copy_state->num_stripes; s++)
+    close_stripe(copy_state, s);
+
+  if (copy_state->buffer_list != OFC_HANDLE_NULL)
+    {
+      destroy_buffer_list (copy_state, copy_state->buffer_list);
+      copy_state->buffer_list = OFC_HANDLE_NULL;
+    }
+  smbmem_leave(&copy_state->share);
+  
+  if (copy_state->rate_timer != OFC_HANDLE_NULL)
+    {
+      if (copy_state->timer_armed)
+        ofc_waitset_remove(copy_state->wait_set, copy_state->rate_timer);
+      ofc_timer_destroy(copy_state->rate_timer);
+      copy_state->rate_timer = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->failover_timer != OFC_HANDLE_NULL)
+    {
+      if (copy_state->failover_armed)
+        ofc_waitset_remove(copy_state->wait_set, copy_state->failover_timer);
+      ofc_timer_destroy(copy_state->failover_timer);
+      copy_state->failover_timer = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->deferred != OFC_HANDLE_NULL)
+    {
+      while (ofc_dequeue(copy_state->deferred) != OFC_NULL);
+      ofc_queue_destroy(copy_state->deferred);
+      copy_state->deferred = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->write_file != OFC_HANDLE_NULL)
+    {
+      OfcCloseHandle(copy_state->write_file);
+      copy_state->write_file = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->read_file != OFC_HANDLE_NULL)
+    {
+      OfcCloseHandle(copy_state->read_file);
+      copy_state->read_file = OFC_HANDLE_NULL;
+    }
+
+  if (copy_state->ranges != OFC_NULL)
+    free(copy_state->ranges);
+
+  if (copy_state->rfilename != OFC_NULL)
+    free(copy_state->rfilename);
+
+  free(copy_state);
+}
+
+static struct smbcopy *init_copy_state(OFC_HANDLE wait_set,
+                                       OFC_CTCHAR *rfilename,
+                                       OFC_CTCHAR *wfilename,
+                                       OFC_BOOL sparse,
+                                       OFC_DWORD *dwLastError)
+{
+  struct smbcopy *copy_state;
+  OFC_INT want;
+
+  *dwLastError = OFC_ERROR_SUCCESS;
+  
+  copy_state = malloc(sizeof(struct smbcopy));
+  if (copy_state == OFC_NULL)
+    *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
+    {
+      copy_state->read_file = OFC_HANDLE_NULL;
+      copy_state->write_file = OFC_HANDLE_NULL;
+      copy_state->wait_set = wait_set;
+      copy_state->buffer_list = OFC_HANDLE_NULL;
+      copy_state->offset = 0;
+      copy_state->pending = 0;
+      copy_state->eof = OFC_FALSE;
+      copy_state->sparse = sparse;
+      copy_state->size = -1;
+      copy_state->extent = 0;
+      copy_state->ranges = OFC_NULL;
+      copy_state->num_ranges = 0;
+      copy_state->range = 0;
+      copy_state->skipped = 0;
+      copy_state->deferred = OFC_HANDLE_NULL;
+      copy_state->rate_timer = OFC_HANDLE_NULL;
+      copy_state->timer_armed = OFC_FALSE;
+      copy_state->rfilename = wcsdup(rfilename);
+      copy_state->remote_source = is_remote(rfilename);
+      copy_state->striping = OFC_FALSE;
+      for (int s = 0; s < NUM_STRIPES; s++)
+        {
+          copy_state->stripes[s].file = OFC_HANDLE_NULL;
+          copy_state->stripes[s].reading = 0;
+          copy_state->stripes[s].rate = 0;
+          copy_state->stripes[s].bytes = 0;
+          copy_state->stripes[s].lost = OFC_FALSE;
+        }
+      copy_state->num_stripes = 1;
+      copy_state->failover = OFC_FALSE;
+      copy_state->failed_at = 0;
+      copy_state->failovers = 0;
+      copy_state->reopens = 0;
+      copy_state->failover_timer = OFC_HANDLE_NULL;
+      copy_state->failover_armed = OFC_FALSE;
+      copy_state->replica_file = OFC_HANDLE_NULL;
+      copy_state->hedge_ms = 0;
+      copy_state->hedge_timer = OFC_HANDLE_NULL;
+      copy_state->hedge_armed = OFC_FALSE;
+      copy_state->extra = 0;
+      copy_state->timer_event.copy_state = copy_state;
+      copy_state->timer_event.buffer = OFC_NULL;
+      copy_state->status = SMBCOPY_RUNNING;
+      copy_state->error = OFC_ERROR_SUCCESS;
+      copy_state->cancelled = OFC_FALSE;
+      copy_state->written = 0;
+      copy_state->progress = OFC_NULL;
+      copy_state->context = OFC_NULL;
+      memset(&copy_state->stats, 0, sizeof(copy_state->stats));
+      memset(&copy_state->share, 0, sizeof(copy_state->share));
+      copy_state->boosted = OFC_FALSE;
+      /*
+       * Open up our read file.  This file should
+       * exist
+       */
+      copy_state->read_file = OfcCreateFile(rfilename,
+                                            OFC_GENERIC_READ,
+                                            OFC_FILE_SHARE_READ,
+                                            OFC_NULL,
+                                            OFC_OPEN_EXISTING,
+                                            OFC_FILE_ATTRIBUTE_NORMAL |
+                                            OFC_FILE_FLAG_OVERLAPPED,
+                                            OFC_HANDLE_NULL);
+
+      if (copy_state->rfilename == OFC_NULL)
+        {
+          *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+        }
+      else if (copy_state->read_file == OFC_INVALID_HANDLE_VALUE)
+        {
+          *dwLastError = OfcGetLastError();
+        }
+      else
+        {
+          /*
+           * Open up our write file.  If it exists, it will be deleted
+           */
+          copy_state->write_file = OfcCreateFile(wfilename,
+                                                 OFC_GENERIC_WRITE,
+                                                 0,
+                                                 OFC_NULL,
+                                                 OFC_CREATE_ALWAYS,
+                                                 OFC_FILE_ATTRIBUTE_NORMAL |
+                                                 OFC_FILE_FLAG_OVERLAPPED,
+                                                 OFC_HANDLE_NULL);
+
+          if (copy_state->write_file == OFC_INVALID_HANDLE_VALUE)
+            {
+              *dwLastError = OfcGetLastError();
+            }
+          else
+            {
+              init_size(copy_state);
+              if (sparse)
+                init_sparse(copy_state);
+              else
+                preallocate(copy_state->write_file, copy_state->size);
+            }
+        }
+
+      if (*dwLastError == OFC_ERROR_SUCCESS)
+        {
+          /*
+           * And create our own buffer list that we will manage, with as
+           * many buffers as the memory budget allows.  A small file
+           * doesn't ask for more buffers than it has chunks.
+           */
+          want = NUM_FILE_BUFFERS;
+          if (copy_state->size >= 0 &&
+              copy_state->size < (OFC_OFFT) want * BUFFER_SIZE)
+            want = (OFC_INT) ((copy_state->size + BUFFER_SIZE - 1) /
+                              BUFFER_SIZE);
+          if (want < 1)
+            want = 1;
+          smbmem_join(&copy_state->share, want, BUFFER_SIZE);
+          if (copy_state->share.low)
+            copy_state->stats.low_memory = 1;
+          smbtrace(OFC_LOG_INFO, "memory: %d of %d buffers of %u bytes",
+                   copy_state->share.held, NUM_FILE_BUFFERS,
+                   (unsigned int) copy_state->share.chunk);
+          copy_state->buffer_list = alloc_buffer_list(copy_state,
+						      copy_state->read_file,
+                                                      copy_state->write_file);
+
+          if (copy_state->buffer_list == OFC_HANDLE_NULL)
+            *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+      if (*dwLastError == OFC_ERROR_SUCCESS)
+        {
+          /*
+           * The queue for I/O that is held back and, if I/O is rate
+           * limited, the timer that releases it
+           */
+          copy_state->deferred = ofc_queue_create();
+          if (copy_state->deferred == OFC_HANDLE_NULL)
+            *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+          else if (smbrate_enabled())
+            {
+              copy_state->rate_timer = ofc_timer_create("smbcp rate");
+              if (copy_state->rate_timer == OFC_HANDLE_NULL)
+                *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+            }
+        }
+
+      if (*dwLastError == OFC_ERROR_SUCCESS && copy_state->remote_source)
+        {
+          /*
+           * The timer that spaces out attempts to reopen a lost source
+           */
+          copy_state->failover_timer = ofc_timer_create("smbcp failover");
+          if (copy_state->failover_timer == OFC_HANDLE_NULL)
+            *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+      if (*dwLastError != OFC_ERROR_SUCCESS)
+        {
+          destroy_copy_state (copy_state);
+          copy_state = OFC_NULL;
+        }
+    }
+  return (copy_state);
+}
+
+/*
+ * Handle the completion of a buffer's read or write and issue its next
+ * I/O.  Returns OFC_FALSE if the I/O was still in progress.
+ */
+static OFC_BOOL complete_buffer(struct smbcopy *copy_state,
+                                OFC_FILE_BUFFER *buffer,
+                                OFC_DWORD *dwFirstError)
+{
+  OFC_DWORD dwLen;
+  OFC_DWORD dwLastError;
+  ASYNC_RESULT result;
+  OFC_BOOL reaped;
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  reaped = OFC_FALSE;
+  if (buffer->stale != 0)
+    reaped = reap_stale(copy_state, buffer);
+
+  if (buffer->state == BUFFER_STATE_DRAIN)
+    {
+      /*
+       * The buffer can go on to the next chunk once the source read it
+       * abandoned is back
+       */
+      if (buffer->stale & STALE_READ)
+        return (reaped);
+
+      result = next_read(copy_state, buffer, &dwLastError);
+      if (result == ASYNC_RESULT_ERROR)
+        *dwFirstError = dwLastError;
+      if (result != ASYNC_RESULT_PENDING)
+        {
+          copy_state->eof = OFC_TRUE;
+          copy_state->pending--;
+        }
+    }
+  /*
+   * Now we have both read and write overlapped descriptors
+   * See what state we're in
+   */
+  else if (buffer->state == BUFFER_STATE_READ)
+    {
+      /*
+       * Read, so let's see the result of the read, or of the hedge
+       * racing it
+       */
+      result = ASYNC_RESULT_PENDING;
+      if (buffer->racing)
+        result = hedge_result(copy_state, buffer, &dwLen);
+      if (result == ASYNC_RESULT_PENDING)
+        {
+          result = AsyncReadResult(copy_state->wait_set,
+                                   stripe_file(copy_state, buffer->stripe),
+                                   buffer, &dwLen,
+                                   &dwLastError);
+          if (result == ASYNC_RESULT_PENDING)
+            return (reaped);
+
+          copy_state->stripes[buffer->stripe].reading--;
+          if (result == ASYNC_RESULT_DONE)
+            sample_stripe(copy_state, buffer, dwLen);
+          if (buffer->racing)
+            {
+              /*
+               * The source won.  Abandon the hedge.
+               */
+              buffer->racing = OFC_FALSE;
+              buffer->stale |= STALE_HEDGE;
+            }
+        }
+
+      if (result == ASYNC_RESULT_ERROR && buffer->stripe != 0 &&
+          !copy_state->cancelled)
+        {
+          /*
+           * The replica failed.  Read the rest of the chunk from the
+           * source.
+           */
+          lose_stripe(copy_state, buffer, dwLastError);
+          result = issue_io(copy_state, buffer, BUFFER_STATE_READ,
+                            buffer->chunk - buffer->filled, &dwLastError);
+          if (result == ASYNC_RESULT_PENDING)
+            return (OFC_TRUE);
+          if (result == ASYNC_RESULT_DONE)
+            result = AsyncReadResult(copy_state->wait_set,
+                                     copy_state->read_file,
+                                     buffer, &dwLen, &dwLastError);
+        }
+      /*
+       * A read can come back short.  Read the rest of the chunk into the
+       * same buffer so that the chunk is written whole, at the offset it
+       * was read from.
+       */
+      while (result == ASYNC_RESULT_DONE)
+        {
+          buffer->filled += dwLen;
+          if (buffer->filled == buffer->chunk || copy_state->cancelled)
+            break;
+
+          copy_state->stats.refills++;
+          result = issue_io(copy_state, buffer, BUFFER_STATE_READ,
+                            buffer->chunk - buffer->filled, &dwLastError);
+          if (result == ASYNC_RESULT_PENDING)
+            return (OFC_TRUE);
+          if (result == ASYNC_RESULT_DONE)
+            result = AsyncReadResult(copy_state->wait_set,
+                                     stripe_file(copy_state, buffer->stripe),
+                                     buffer, &dwLen, &dwLastError);
+        }
+
+      if (result == ASYNC_RESULT_EOF && buffer->filled > 0)
+        {
+          /*
+           * The source ended within the chunk.  Write what there is.
+           */
+          dwLastError = OFC_ERROR_SUCCESS;
+          result = ASYNC_RESULT_DONE;
+        }
+
+      if (result == ASYNC_RESULT_ERROR &&
+          retry_read(copy_state, buffer, dwLastError))
+        {
+          /*
+           * Held back until the source fails over
+           */
+          dwLastError = OFC_ERROR_SUCCESS;
+          result = ASYNC_RESULT_PENDING;
+        }
+      else if (result == ASYNC_RESULT_ERROR)
+        *dwFirstError = dwLastError;
+      else if (result == ASYNC_RESULT_DONE && copy_state->cancelled)
+        {
+          /*
+           * Don't write what was read after the copy was cancelled
+           */
+          result = ASYNC_RESULT_EOF;
+        }
+      else if (result == ASYNC_RESULT_DONE)
+        {
+          if (buffer->offset + buffer->filled > copy_state->extent)
+            copy_state->extent = buffer->offset + buffer->filled;
+          if (copy_state->sparse &&
+              buffer_is_zero(buffer->data, buffer->filled))
+            {
+              /*
+               * Nothing to write.  Go straight on to the next
+               * chunk.
+               */
+              copy_state->skipped += buffer->filled;
+              result = next_chunk(copy_state, buffer, &dwLastError);
+              if (result == ASYNC_RESULT_ERROR)
+                *dwFirstError = dwLastError;
+              else if (result != ASYNC_RESULT_PENDING)
+                result = ASYNC_RESULT_EOF;
+            }
+          else
+            {
+              /*
+               * When the read is done, let's start up the write
+               */
+              result = issue_io(copy_state, buffer,
+                                BUFFER_STATE_WRITE, buffer->filled,
+                                &dwLastError);
+              if (result == ASYNC_RESULT_ERROR)
+                *dwFirstError = dwLastError;
+            }
+        }
+      /*
+       * If the write failed, or we had a read result error
+       */
+      if (result == ASYNC_RESULT_ERROR ||
+          result == ASYNC_RESULT_EOF ||
+          (result == ASYNC_RESULT_DONE &&
+           dwLastError != OFC_ERROR_SUCCESS))
+        {
+          /*
+           * The I/O is no longer pending.
+           */
+          copy_state->pending--;
+          copy_state->eof = OFC_TRUE;
+        }
+    }
+  else if (buffer->state == BUFFER_STATE_WRITE)
+    {
+      /*
+       * The buffer state was write.  Let's look at our
+       * status
+       */
+      result = AsyncWriteResult(copy_state->wait_set,
+                                copy_state->write_file,
+                                buffer, &dwLen,
+                                &dwLastError);
+      if (result == ASYNC_RESULT_PENDING)
+        return (reaped);
+
+      if (result == ASYNC_RESULT_ERROR)
+        *dwFirstError = dwLastError;
+      else if (result == ASYNC_RESULT_DONE)
+        {
+          copy_state->written += dwLen;
+          buffer->flushed += dwLen;
+          if (buffer->flushed < buffer->filled)
+            {
+              /*
+               * A short write.  Write the rest of the chunk.  A write
+               * that completes at once is picked up by the sweep that
+               * follows.
+               */
+              copy_state->stats.refills++;
+              result = issue_io(copy_state, buffer, BUFFER_STATE_WRITE,
+                                buffer->filled - buffer->flushed,
+                                &dwLastError);
+              if (result == ASYNC_RESULT_DONE)
+                result = ASYNC_RESULT_PENDING;
+            }
+          else
+            {
+              /*
+               * The write is finished.
+               * Let's step the buffer and start a read on the
+               * next chunk
+               */
+              result = next_chunk(copy_state, buffer, &dwLastError);
+            }
+          if (result == ASYNC_RESULT_ERROR)
+            *dwFirstError = dwLastError;
+        }
+
+      if (result != ASYNC_RESULT_PENDING)
+        {
+          copy_state->eof = OFC_TRUE;
+          copy_state->pending--;
+        }
+    }
+  else
+    return (reaped);
+  return (OFC_TRUE);
+}
+
+/*
+ * Move the copy on after its I/O has been issued or completed.  Fails the
+ * source over once every read on the lost source has come back and
+ * finishes the copy once all of its I/O has.
+ */
+static OFC_VOID engine_step(struct smbcopy *copy_state)
+{
+  OFC_DWORD dwLastError;
+
+  while (copy_state->status == SMBCOPY_RUNNING)
+    {
+      if (copy_state->failover && !copy_state->failover_armed &&
+          copy_state->stripes[0].reading == 0)
+        {
+          dwLastError = fail_over(copy_state, &copy_state->error);
+          if (dwLastError != OFC_ERROR_SUCCESS)
+            copy_state->error = dwLastError;
+        }
+      else if (copy_state->pending > 0 || copy_state->extra > 0 ||
+               copy_state->failover_armed)
+        break;
+      else
+        {
+          if (copy_state->cancelled)
+            copy_state->status = SMBCOPY_CANCELLED;
+          else if (copy_state->error == OFC_ERROR_SUCCESS &&
+                   (copy_state->error = finish_copy(copy_state)) ==
+                   OFC_ERROR_SUCCESS)
+            copy_state->status = SMBCOPY_DONE;
+          else
+            copy_state->status = SMBCOPY_FAILED;
+
+          smbtrace(OFC_LOG_INFO, "engine: %llu completions, %llu wakeups, "
+                   "%llu harvested, %llu refills, %llu/%llu hedges won, "
+                   "%llu buffers given back, %llu us dispatching",
+                   (unsigned long long) copy_state->stats.completions,
+                   (unsigned long long) copy_state->stats.wakeups,
+                   (unsigned long long) copy_state->stats.harvested,
+                   (unsigned long long) copy_state->stats.refills,
+                   (unsigned long long) copy_state->stats.hedges_won,
+                   (unsigned long long) copy_state->stats.hedges,
+                   (unsigned long long) copy_state->stats.shrinks,
+                   (unsigned long long) copy_state->stats.dispatch_us);
+          trace_stripes(copy_state);
+        }
+    }
+}
+
+struct smbcopy *smbcopy_start(OFC_HANDLE wait_set, OFC_CTCHAR *rfilename,
+                              OFC_CTCHAR *wfilename, OFC_UINT32 flags,
+                              SMBCOPY_PROGRESS *progress, OFC_VOID *context,
+                              OFC_DWORD *dwLastError)
+{
+  struct smbcopy *copy_state;
+
+  copy_state = init_copy_state(wait_set, rfilename, wfilename,
+                               (flags & SMBCOPY_SPARSE) != 0, dwLastError);
+  if (copy_state != OFC_NULL)
+    {
+      copy_state->progress = progress;
+      copy_state->context = context;
+      copy_state->striping = (flags & SMBCOPY_STRIPE) != 0;
+      copy_state->boosted = ((flags & SMBCOPY_BOOST) != 0 &&
+                             copy_state->size >= 0 &&
+                             copy_state->size <= BOOST_SIZE);
+      if (copy_state->boosted)
+        copy_state->stats.boosted = 1;
+      smbcopy_set_priority(copy_state, SMBMEM_PRIORITY_NORMAL, 1);
+      /*
+       * Prime the engine.  Priming involves obtaining a buffer
+       * for each overlapped I/O and initilizing them.  If that fails,
+       * whatever did go out is left to come back before the copy fails.
+       */
+      copy_state->error = prime_buffers(copy_state);
+      engine_step(copy_state);
+    }
+  return (copy_state);
+}
+
+/*
+ * Open a replica of the source.  A replica that isn't the size of the
+ * source can't be a copy of it.
+ */
+static OFC_HANDLE open_replica(struct smbcopy *copy_state,
+                               OFC_CTCHAR *replica, OFC_DWORD *dwLastError)
+{
+  OFC_FILE_STANDARD_INFO info;
+  OFC_HANDLE replica_file;
+
+  *dwLastError = OFC_ERROR_SUCCESS;
+  replica_file = OfcCreateFile(replica,
+                               OFC_GENERIC_READ,
+                               OFC_FILE_SHARE_READ,
+                               OFC_NULL,
+                               OFC_OPEN_EXISTING,
+                               OFC_FILE_ATTRIBUTE_NORMAL |
+                               OFC_FILE_FLAG_OVERLAPPED,
+                               OFC_HANDLE_NULL);
+  if (replica_file == OFC_INVALID_HANDLE_VALUE)
+    {
+      *dwLastError = OfcGetLastError();
+      replica_file = OFC_HANDLE_NULL;
+    }
+  else if (copy_state->size >= 0 &&
+           OfcGetFileInformationByHandleEx(replica_file,
+                                           OfcFileStandardInfo,
+                                           &info, sizeof(info)) &&
+           info.EndOfFile != copy_state->size)
+    {
+      smbtrace(OFC_LOG_WARN, "replica is %lld bytes, source %lld",
+               (long long) info.EndOfFile, (long long) copy_state->size);
+      OfcCloseHandle(replica_file);
+      *dwLastError = OFC_ERROR_INVALID_PARAMETER;
+      replica_file = OFC_HANDLE_NULL;
+    }
+  return (replica_file);
+}
+
+/*
+ * Read chunks from a replica as well
+ */
+static OFC_DWORD add_stripe(struct smbcopy *copy_state, OFC_CTCHAR *replica)
+{
+  OFC_FILE_BUFFER *buffer;
+  OFC_DWORD dwLastError;
+  OFC_INT stripe;
+
+  if (copy_state->num_stripes == NUM_STRIPES)
+    {
+      smbtrace(OFC_LOG_INFO, "replica not striped, %d already",
+               NUM_STRIPES - 1);
+      return (OFC_ERROR_SUCCESS);
+    }
+
+  stripe = copy_state->num_stripes;
+  copy_state->stripes[stripe].file = open_replica(copy_state, replica,
+                                                  &dwLastError);
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL && dwLastError == OFC_ERROR_SUCCESS;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      buffer->stripeOverlapped[stripe] =
+        OfcCreateOverlapped(copy_state->stripes[stripe].file);
+      if (buffer->stripeOverlapped[stripe] == OFC_HANDLE_NULL)
+        dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+  /*
+   * Chunks read from here on are spread across it
+   */
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    copy_state->num_stripes++;
+  else
+    close_stripe(copy_state, stripe);
+  return (dwLastError);
+}
+
+/*
+ * Hedge slow reads from the source on a replica
+ */
+static OFC_DWORD add_hedge(struct smbcopy *copy_state, OFC_CTCHAR *replica,
+                           OFC_MSTIME hedge_ms)
+{
+  OFC_FILE_BUFFER *buffer;
+  OFC_DWORD dwLastError;
+
+  copy_state->replica_file = open_replica(copy_state, replica,
+                                          &dwLastError);
+  /*
+   * Hedge reads need a second buffer's worth of memory, which is
+   * charged to the copy's share.  Spare buffers get theirs when they
+   * are put to work.
+   */
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    smbmem_set_unit(&copy_state->share, copy_state->share.chunk * 2);
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL && dwLastError == OFC_ERROR_SUCCESS;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      buffer->hedgeOverlapped =
+        OfcCreateOverlapped(copy_state->replica_file);
+      if (buffer->state != BUFFER_STATE_SPARE)
+        buffer->hedge_data = malloc(copy_state->share.chunk);
+      if (buffer->hedgeOverlapped == OFC_HANDLE_NULL ||
+          (buffer->state != BUFFER_STATE_SPARE &&
+           buffer->hedge_data == OFC_NULL))
+        dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    {
+      copy_state->hedge_timer = ofc_timer_create("smbcp hedge");
+      if (copy_state->hedge_timer == OFC_HANDLE_NULL)
+        dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+  if (dwLastError != OFC_ERROR_SUCCESS)
+    drop_replica(copy_state);
+  else
+    {
+      /*
+       * Reads already in flight may be hedged too
+       */
+      copy_state->hedge_ms = hedge_ms;
+      check_hedges(copy_state);
+    }
+  return (dwLastError);
+}
+
+OFC_DWORD smbcopy_add_replica(struct smbcopy *copy_state,
+                              OFC_CTCHAR *replica, OFC_MSTIME hedge_ms)
+{
+  OFC_DWORD dwLastError;
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  if (copy_state->striping)
+    dwLastError = add_stripe(copy_state, replica);
+  /*
+   * Hedges go to one replica
+   */
+  if (dwLastError == OFC_ERROR_SUCCESS && hedge_ms > 0 &&
+      copy_state->replica_file == OFC_HANDLE_NULL)
+    dwLastError = add_hedge(copy_state, replica, hedge_ms);
+  else if (!copy_state->striping)
+    smbtrace(OFC_LOG_INFO, "replica not used");
+  return (dwLastError);
+}
+
+SMBCOPY_STATUS smbcopy_poll(OFC_HANDLE hEvent, struct smbcopy **copy)
+{
+  struct engine_event *event;
+  struct smbcopy *copy_state;
+  OFC_FILE_BUFFER *buffer;
+  OFC_UINT64 start;
+  OFC_UINT64 copied;
+
+  /*
+   * The app of the event says which copy and which buffer it is for
+   */
+  event = (struct engine_event *) ofc_handle_get_app(hEvent);
+  copy_state = event->copy_state;
+  if (copy != OFC_NULL)
+    *copy = copy_state;
+  if (copy_state->status != SMBCOPY_RUNNING)
+    return (copy_state->status);
+
+  start = engine_now();
+  copied = copy_state->written + copy_state->skipped;
+  copy_state->stats.wakeups++;
+  if (event->buffer == OFC_NULL && hEvent == copy_state->hedge_timer)
+    check_hedges(copy_state);
+  else if (event->buffer == OFC_NULL && hEvent == copy_state->failover_timer)
+    {
+      /*
+       * The source may be reopened again.  engine_step does it.
+       */
+      ofc_waitset_remove(copy_state->wait_set, copy_state->failover_timer);
+      copy_state->failover_armed = OFC_FALSE;
+    }
+  else if (event->buffer == OFC_NULL)
+    {
+      /*
+       * The rate timer.  Deferred I/O may be able to go now.
+       */
+      issue_deferred(copy_state, &copy_state->error);
+    }
+  else if (complete_buffer(copy_state, event->buffer, &copy_state->error))
+    copy_state->stats.completions++;
+  /*
+   * With deep queues other I/Os will often have finished by the time
+   * we're woken.  Harvest all of them now rather than taking a wakeup for
+   * each.  Their follow up I/Os go out together before the caller waits
+   * again.
+   */
+  for (buffer = ofc_queue_first(copy_state->buffer_list);
+       buffer != OFC_NULL;
+       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
+    {
+      if ((buffer->state == BUFFER_STATE_READ ||
+           buffer->state == BUFFER_STATE_WRITE || buffer->stale != 0) &&
+          complete_buffer(copy_state, buffer, &copy_state->error))
+        {
+          copy_state->stats.completions++;
+          copy_state->stats.harvested++;
+        }
+    }
+  engine_step(copy_state);
+  copy_state->stats.dispatch_us += engine_now() - start;
+
+  if (copy_state->progress != OFC_NULL &&
+      (copy_state->written + copy_state->skipped != copied ||
+       copy_state->status != SMBCOPY_RUNNING))
+    (*copy_state->progress)(copy_state,
+                            copy_state->written + copy_state->skipped,
+                            copy_state->size, copy_state->context);
+
+  return (copy_state->status);
+}
+
+SMBCOPY_STATUS smbcopy_status(struct smbcopy *copy_state,
+                              OFC_DWORD *dwLastError)
+{
+  if (dwLastError != OFC_NULL)
+    *dwLastError = copy_state->error;
+  return (copy_state->status);
+}
+
+OFC_VOID *smbcopy_context(struct smbcopy *copy_state)
+{
+  return (copy_state->context);
+}
+
+OFC_VOID smbcopy_cancel(struct smbcopy *copy_state)
+{
+  if (copy_state->status != SMBCOPY_RUNNING || copy_state->cancelled)
+    return;
+
+  smbtrace(OFC_LOG_INFO, "copy cancelled at offset %lld",
+           (long long) copy_state->offset);
+  copy_state->cancelled = OFC_TRUE;
+  /*
+   * Nothing more goes out.  I/O held back is dropped along with any
+   * failover that was waiting on it.
+   */
+  if (copy_state->timer_armed)
+    {
+      ofc_waitset_remove(copy_state->wait_set, copy_state->rate_timer);
+      copy_state->timer_armed = OFC_FALSE;
+    }
+  if (copy_state->hedge_armed)
+    {
+      ofc_waitset_remove(copy_state->wait_set, copy_state->hedge_timer);
+      copy_state->hedge_armed = OFC_FALSE;
+    }
+  if (copy_state->failover_armed)
+    {
+      ofc_waitset_remove(copy_state->wait_set, copy_state->failover_timer);
+      copy_state->failover_armed = OFC_FALSE;
+    }
+  drop_deferred(copy_state);
+  copy_state->failover = OFC_FALSE;
+  copy_state->reopens = 0;
+  engine_step(copy_state);
+}
+
+OFC_VOID smbcopy_set_priority(struct smbcopy *copy_state, OFC_INT priority,
+                              OFC_UINT32 weight)
+{
+  if (copy_state->boosted && priority < SMBMEM_PRIORITY_HIGH)
+    priority++;
+  smbmem_set_priority(&copy_state->share, priority, weight);
+}
+
+OFC_VOID smbcopy_get_stats(struct smbcopy *copy_state,
+                           struct smbcopy_stats *stats)
+{
+  *stats = copy_state->stats;
+}
+
+/*
+ * Only a copy that has finished may be destroyed.  A running copy has
+ * I/O in flight that refers to it.
+ */
+OFC_VOID smbcopy_destroy(struct smbcopy *copy_state)
+{
+  if (copy_state->status == SMBCOPY_RUNNING)
+    smbtrace(OFC_LOG_FATAL, "running copy destroyed");
+  else
+    destroy_copy_state(copy_state);
+}
+
+OFC_DWORD smbcopy_run(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename,
+                      OFC_UINT32 flags, OFC_CTCHAR **replicas,
+                      OFC_MSTIME hedge_ms, struct smbcopy_stats *stats)
+{
+  struct smbcopy *copy_state;
+  OFC_HANDLE wait_set;
+  OFC_HANDLE hEvent;
+  OFC_DWORD dwLastError;
+
+  if (stats != OFC_NULL)
+    memset(stats, 0, sizeof(*stats));
+  wait_set = ofc_waitset_create();
+  if (wait_set == OFC_HANDLE_NULL)
+    return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+
+  copy_state = smbcopy_start(wait_set, rfilename, wfilename, flags,
+                             OFC_NULL, OFC_NULL, &dwLastError);
+  if (copy_state != OFC_NULL)
+    {
+      /*
+       * A replica that can't be opened only means there is nothing
+       * to hedge on
+       */
+      for (; replicas != OFC_NULL && *replicas != OFC_NULL; replicas++)
+        {
+          dwLastError = smbcopy_add_replica(copy_state, *replicas, hedge_ms);
+          if (dwLastError != OFC_ERROR_SUCCESS)
+            smbtrace(OFC_LOG_WARN, "replica not opened: %s",
+                     ofc_get_error_string(dwLastError));
+        }
+      /*
+       * Every event in the wait set is ours.  Keep pumping
+       * until all of the I/O has come back.
+       */
+      while (smbcopy_status(copy_state, OFC_NULL) == SMBCOPY_RUNNING)
+        {
+          hEvent = ofc_waitset_wait(wait_set);
+          if (hEvent != OFC_HANDLE_NULL)
+            smbcopy_poll(hEvent, OFC_NULL);
+        }
+
+      smbcopy_status(copy_state, &dwLastError);
+      if (stats != OFC_NULL)
+        smbcopy_get_stats(copy_state, stats);
+      smbcopy_destroy(copy_state);
+    }
+  ofc_waitset_destroy(wait_set);
+
+  return (dwLastError);
+}
+
+OFC_DWORD smbcopy_sync(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename)
+{
+  OFC_DWORD dwLastError;
+  OFC_HANDLE read_file;
+  OFC_HANDLE write_file;
+  OFC_FILE_STANDARD_INFO info;
+  OFC_MSTIME wait;
+  struct smbmem_share share;
+  OFC_CHAR *buffer;
+  OFC_DWORD dwLen;
+  OFC_BOOL ret;
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  /*
+   * The one buffer comes out of the memory budget too
+   */
+  smbmem_join(&share, 1, BUFFER_SIZE);
+  buffer = malloc(share.chunk);
+  if (buffer == OFC_NULL)
+    {
+      smbmem_leave(&share);
+      return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+    }
+
+  read_file = OFC_HANDLE_NULL;
+  write_file = OFC_HANDLE_NULL;
+  /*
+   * Open up our read file.  This file should
+   * exist
+   */
+  read_file = OfcCreateFile(rfilename,
+			    OFC_GENERIC_READ,
+			    OFC_FILE_SHARE_READ,
+			    OFC_NULL,
+			    OFC_OPEN_EXISTING,
+			    OFC_FILE_ATTRIBUTE_NORMAL,
+			    OFC_HANDLE_NULL);
+
+  if (read_file == OFC_INVALID_HANDLE_VALUE)
+    {
+      dwLastError = OfcGetLastError();
+    }
+  else
+    {
+      /*
+       * Open up our write file.  If it exists, it will be deleted
+       */
+      write_file = OfcCreateFile(wfilename,
+				 OFC_GENERIC_WRITE,
+				 0,
+				 OFC_NULL,
+				 OFC_CREATE_ALWAYS,
+				 OFC_FILE_ATTRIBUTE_NORMAL,
+				 OFC_HANDLE_NULL);
+
+      if (write_file == OFC_INVALID_HANDLE_VALUE)
+	{
+	  dwLastError = OfcGetLastError();
+	}
+      else
+	{
+	  if (OfcGetFileInformationByHandleEx(read_file,
+					      OfcFileStandardInfo,
+					      &info, sizeof(info)))
+	    preallocate(write_file, info.EndOfFile);
+
+	  /*
+	   * With one I/O outstanding, waiting out the rate limiter is
+	   * as smooth as it gets
+	   */
+	  while ((wait = smbrate_take(share.chunk)) > 0)
+	    ofc_sleep(wait);
+	  while ((ret = OfcReadFile(read_file, buffer, share.chunk,
+				    &dwLen, OFC_HANDLE_NULL)) == OFC_TRUE)
+	    {
+	      while ((wait = smbrate_take(0)) > 0)
+		ofc_sleep(wait);
+	      ret = OfcWriteFile(write_file, buffer, dwLen,
+				 &dwLen, OFC_HANDLE_NULL);
+	      while (ret == OFC_TRUE &&
+		     (wait = smbrate_take(share.chunk)) > 0)
+		ofc_sleep(wait);
+	    }
+	  if (ret == OFC_FALSE)
+	    {
+	      if (OfcGetLastError() != OFC_ERROR_HANDLE_EOF)
+		dwLastError = OfcGetLastError();
+	    }
+	    
+	  OfcCloseHandle(write_file);
+	}
+      OfcCloseHandle(read_file);
+    }
+
+  free(buffer);
+  smbmem_leave(&share);
+  return (dwLastError);
+}
+
+/**
+ * \}
+ */
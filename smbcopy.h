@@ -0,0 +1,119 @@
+#if !defined(__smbcopy_h__)
+#define __smbcopy_h__
+
+#include <ofc/types.h>
+#include <ofc/handle.h>
+
+#include "smbmem.h"
+
+/*
+ * The copy engine.
+ *
+ * A copy keeps several overlapped reads and writes in flight and is
+ * driven by the events of a wait set that belongs to the caller, so any
+ * number of copies, and whatever else the caller waits on, can share one
+ * event loop.  smbcopy_start opens both files and issues the first
+ * reads.  Whenever ofc_waitset_wait returns an event the caller didn't
+ * add to the wait set itself, the event belongs to a copy and is handed
+ * to smbcopy_poll, which completes whatever I/O is ready, issues the next
+ * and says which copy the event was for and how it stands.  A copy is
+ * finished once its status is no longer SMBCOPY_RUNNING and must then be
+ * destroyed by the caller.
+ *
+ * smbcopy_cancel stops a copy from issuing new I/O.  The copy stays
+ * running until the I/O already in flight comes back through
+ * smbcopy_poll and is then SMBCOPY_CANCELLED.
+ *
+ * The progress routine, if given, is called from smbcopy_poll whenever
+ * the copy has advanced and once more when it finishes.  Bytes copied
+ * includes ranges of a sparse copy that were skipped.  Size is -1 if the
+ * size of the source isn't known.
+ *
+ * Copies run on the caller's thread and have no locking of their own.
+ * Every call for a given wait set must be made from one thread at a time.
+ * The stack must be up (see smbcp_init) before a copy is started.  While
+ * a copy fails its source over, smbcopy_poll blocks for as long as the
+ * source takes to reopen.
+ *
+ * smbcopy_add_replica gives a copy another copy of its source, on
+ * another DFS target say.  A read from the source that hasn't finished
+ * within hedge_ms is issued to the replica as well and whichever
+ * finishes first is used.  A hedge_ms of 0 doesn't hedge.  A copy
+ * started with SMBCOPY_STRIPE also reads chunks from every replica it is
+ * given, up to four, as well as from the source, and sends each chunk to
+ * whichever has been reading fastest for the reads it has outstanding.
+ * Writes all go to the one destination.  Chunks already being read when
+ * a replica is added stay where they are.
+ *
+ * Buffers come out of the process wide memory budget (see smbmem.h).  A
+ * copy runs with as many buffers as its share of the budget allows,
+ * fewer than it would like when memory is short, and with small chunks
+ * in low memory mode.  smbcopy_set_priority sets the copy's priority,
+ * one of SMBMEM_PRIORITY_*, and its weight among copies of that priority,
+ * which decide who gets buffers when they are short.  Copies start at
+ * normal priority with a weight of 1.  With SMBCOPY_BOOST, a source of
+ * 4MB or less runs a priority higher than it is set to, so that small
+ * copies aren't held up behind bulk ones.
+ *
+ * smbcopy_run is a blocking copy through the engine, with a wait set of
+ * its own, and smbcopy_sync is a blocking copy with one I/O at a time.
+ */
+struct smbcopy;
+
+typedef enum {
+  SMBCOPY_RUNNING,
+  SMBCOPY_DONE,
+  SMBCOPY_FAILED,
+  SMBCOPY_CANCELLED
+} SMBCOPY_STATUS;
+
+/*
+ * Copy flags
+ */
+#define SMBCOPY_SPARSE 0x0001   /* Skip holes and zero chunks */
+#define SMBCOPY_STRIPE 0x0002   /* Read from the replicas as well */
+#define SMBCOPY_BOOST 0x0004    /* Run small files a priority higher */
+
+/*
+ * Engine overhead
+ */
+struct smbcopy_stats {
+  OFC_UINT64 wakeups;           /* Events polled */
+  OFC_UINT64 completions;       /* Reads and writes completed */
+  OFC_UINT64 harvested;         /* Completions found without an event */
+  OFC_UINT64 refills;           /* Short reads and writes completed */
+  OFC_UINT64 hedges;            /* Reads hedged on a replica */
+  OFC_UINT64 hedges_won;        /* Hedges that finished first */
+  OFC_UINT64 striped;           /* Chunks read from replicas */
+  OFC_UINT64 shrinks;           /* Buffers given back to the memory budget */
+  OFC_UINT64 low_memory;        /* Copies run in low memory mode */
+  OFC_UINT64 boosted;           /* Copies boosted as small files */
+  OFC_UINT64 failovers;         /* Times the source failed over */
+  OFC_UINT64 failover_ms;       /* Time taken to fail over, in ms */
+  OFC_UINT64 dispatch_us;       /* Time spent completing and issuing */
+};
+
+typedef OFC_VOID (SMBCOPY_PROGRESS)(struct smbcopy *copy, OFC_UINT64 copied,
+                                    OFC_OFFT size, OFC_VOID *context);
+
+struct smbcopy *smbcopy_start(OFC_HANDLE wait_set, OFC_CTCHAR *rfilename,
+                              OFC_CTCHAR *wfilename, OFC_UINT32 flags,
+                              SMBCOPY_PROGRESS *progress, OFC_VOID *context,
+                              OFC_DWORD *dwLastError);
+SMBCOPY_STATUS smbcopy_poll(OFC_HANDLE hEvent, struct smbcopy **copy);
+SMBCOPY_STATUS smbcopy_status(struct smbcopy *copy, OFC_DWORD *dwLastError);
+OFC_DWORD smbcopy_add_replica(struct smbcopy *copy, OFC_CTCHAR *replica,
+                              OFC_MSTIME hedge_ms);
+OFC_VOID *smbcopy_context(struct smbcopy *copy);
+OFC_VOID smbcopy_cancel(struct smbcopy *copy);
+OFC_VOID smbcopy_set_priority(struct smbcopy *copy, OFC_INT priority,
+                              OFC_UINT32 weight);
+OFC_VOID smbcopy_get_stats(struct smbcopy *copy,
+                           struct smbcopy_stats *stats);
+OFC_VOID smbcopy_destroy(struct smbcopy *copy);
+
+OFC_DWORD smbcopy_run(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename,
+                      OFC_UINT32 flags, OFC_CTCHAR **replicas,
+                      OFC_MSTIME hedge_ms, struct smbcopy_stats *stats);
+OFC_DWORD smbcopy_sync(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename);
+#endif
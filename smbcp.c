@@ -7,877 +7,584 @@
 #include <string.h>
 #include <wchar.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include <ofc/config.h>
 #include <ofc/framework.h>
 #include <ofc/handle.h>
 #include <ofc/types.h>
 #include <ofc/file.h>
-#include <ofc/waitset.h>
-#include <ofc/queue.h>
+#include <ofc/lock.h>
 #include <of_smb/framework.h>
 
+#include "smbcopy.h"
+#include "smbworkers.h"
 #include "smbinit.h"
+#include "smbtrace.h"
+#include "smbrate.h"
+#include "smbmem.h"
+#include "smbdc.h"
 
 /**
  * \{
  */
-
 /*
- * Buffering definitions.  We test using overlapped asynchronous I/O.  
+ * Copies each worker runs at once
  */
-#define BUFFER_SIZE OFC_MAX_IO
-#define NUM_FILE_BUFFERS 10
+#define WORKER_DEPTH 4
 /*
- * Buffer states.
- */
-typedef enum {
-  BUFFER_STATE_IDLE,        /* There is no I/O active */
-  BUFFER_STATE_READ,        /* Data is being read into the buffer */
-  BUFFER_STATE_WRITE        /* Data is being written from the buffer */
-} BUFFER_STATE;
-/*
- * The buffer context
- */
-typedef struct {
-  OFC_HANDLE readOverlapped;  /* The handle to the buffer when reading */
-  OFC_HANDLE writeOverlapped; /* The handle to the buffer when writing */
-  OFC_CHAR *data;             /* Pointer to the buffer */
-  BUFFER_STATE state;         /* Buffer state */
-  OFC_OFFT offset;            /* Offset in file for I/O */
-} OFC_FILE_BUFFER;
-/**
- * Async I/O Result
+ * Most replicas of a source and the default time in milliseconds after
+ * which a read is hedged on one
  */
-typedef enum {
-  ASYNC_RESULT_DONE,            /* I/O is successful */
-  ASYNC_RESULT_ERROR,           /* I/O was in error */
-  ASYNC_RESULT_EOF,             /* I/O hit EOF */
-  ASYNC_RESULT_PENDING          /* I/O is still pending */
-} ASYNC_RESULT;
+#define REPLICA_MAX 4
+#define HEDGE_DEFAULT 500
 
-/**
- * Copy State
- *
- * Main state for the copy
+/*
+ * A file to copy
  */
-struct copy_state {
-  OFC_HANDLE read_file;         /* Handle of Read File */
-  OFC_HANDLE write_file;        /* Handle of Write File */
-  OFC_HANDLE wait_set;          /* Wait Set of all pending bufers */
-  OFC_HANDLE buffer_list;       /* List of Buffers */
-  OFC_OFFT offset;              /* Running Offset for next read */
-  OFC_INT pending;              /* Number of pending I/Os */
-  OFC_BOOL eof;                 /* EOF state of copy */
+struct smbcp_file {
+  OFC_TCHAR *rfilename;
+  OFC_TCHAR *wfilename;
+  OFC_TCHAR *replicas[REPLICA_MAX + 1]; /* Other copies of the source */
+  OFC_MSTIME hedge_ms;          /* Read time after which reads are hedged */
+  int stripe;                   /* Read from the replicas too */
 };
 
 /*
- * Perform an I/O Read
- *
- * This routine initiates a read on an async buffer and adds it to the
- * waitset if the I/O is pending
- *
- * \param wait_set
- * The wait set that this I/O and it's overlapped handles will be part of
- *
- * \param read_file
- * Handle of read file
- *
- * \param buffer
- * Pointer to buffer to read into
- *
- * \param dwLen
- * Length of buffer to read
- *
- * \param dwLastError
- * Error code if result is error
- *
- * \returns
- * ASYNC_RESULT of I/O
+ * Outcome of a copy run by the workers
  */
-static ASYNC_RESULT AsyncRead(OFC_HANDLE wait_set,
-                              OFC_HANDLE read_file,
-                              OFC_FILE_BUFFER *buffer,
-                              OFC_DWORD dwLen,
-                              OFC_DWORD *dwLastError)
-{
-  ASYNC_RESULT result;
-  OFC_BOOL status;
+struct smbcp_result {
+  OFC_LOCK lock;
+  OFC_DWORD dwLastError;
+};
 
-  /*
-   * initialize the read buffer using the read file, the read overlapped
-   * handle and the current read offset
-   */
-  OfcSetOverlappedOffset(read_file, buffer->readOverlapped, buffer->offset);
-  buffer->state = BUFFER_STATE_READ;
-  /*
-   * Issue the non blocking read
-   */
-  status = OfcReadFile(read_file, buffer->data, dwLen,
-                       OFC_NULL, buffer->readOverlapped);
+static OFC_VOID copy_done(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename,
+                          OFC_DWORD dwLastError, OFC_VOID *context)
+{
+  struct smbcp_result *result = context;
 
-  if (status == OFC_TRUE)
+  if (dwLastError != OFC_ERROR_SUCCESS)
     {
-      result = ASYNC_RESULT_DONE;
+      fprintf(stderr, "%ls: %s\n", rfilename,
+              ofc_get_error_string(dwLastError));
+      ofc_lock(result->lock);
+      result->dwLastError = dwLastError;
+      ofc_unlock(result->lock);
     }
-  else
-    {
-      /*
-       * Check if it's pending (expected)
-       */
-      *dwLastError = OfcGetLastError();
-      if (*dwLastError == OFC_ERROR_IO_PENDING)
-        {
-          /*
-           * Add it to the waitset
-           */
-          ofc_waitset_add(wait_set, (OFC_HANDLE) buffer,
-                          buffer->readOverlapped);
-          result = ASYNC_RESULT_PENDING;
-	  *dwLastError = OFC_ERROR_SUCCESS;
-        }
-      else
-        {
-          if (*dwLastError == OFC_ERROR_HANDLE_EOF) 
-            {
-              result = ASYNC_RESULT_EOF;
-            }
-          else
-            {
-              result = ASYNC_RESULT_ERROR;
-            }
-          /*
-           * Either eof or error, buffer is complete
-           */
-          buffer->state = BUFFER_STATE_IDLE;
-          ofc_waitset_remove(wait_set, buffer->readOverlapped);
-        }
-    }
-  return (result);
 }
 
 /*
- * Return the state of an async read
- *
- * \param wait_set
- * Wait set that the I/O should be part of
- *
- * \param read_file
- * Handle to the read file
- *
- * \param buffer
- * Pointer to the buffer
- *
- * \param dwLen
- * Number of bytes to read / number of bytes read
- *
- * \param dwLastError
- * Error code if status is ASYNC_RESULT_ERROR
- *
- * \returns
- * status of the read
+ * Copy the files.  A single file is copied on this thread unless
+ * workers were asked for.  Anything else goes to the workers, which
+ * always use the async engine.
  */
-static ASYNC_RESULT AsyncReadResult(OFC_HANDLE wait_set,
-                                    OFC_HANDLE read_file,
-                                    OFC_FILE_BUFFER *buffer,
-                                    OFC_DWORD *dwLen,
-                                    OFC_DWORD *dwLastError)
+static OFC_DWORD copy_files(struct smbcp_file *files, int num_files,
+                            int threads, int async, int sparse, int boost,
+                            struct smbcopy_stats *stats)
 {
-  ASYNC_RESULT result;
-  OFC_BOOL status;
-  /*
-   * Get the overlapped result
-   */
-  status = OfcGetOverlappedResult(read_file, buffer->readOverlapped,
-                                  dwLen, OFC_FALSE);
-  /*
-   * If the I/O is complete, status will be true and length will be non zero
-   */
-  if (status == OFC_TRUE)
+  struct smbworkers *workers;
+  struct smbcp_result result;
+  OFC_DWORD dwLastError;
+  OFC_UINT32 flags;
+  OFC_INT steals;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  flags = sparse ? SMBCOPY_SPARSE : 0;
+  if (boost)
+    flags |= SMBCOPY_BOOST;
+  if (threads == 0 && num_files == 1)
     {
-      if (*dwLen == 0)
-        {
-          result = ASYNC_RESULT_EOF;
-        }
+      if (files[0].stripe)
+        flags |= SMBCOPY_STRIPE;
+      if (async)
+        result.dwLastError = smbcopy_run(files[0].rfilename,
+                                         files[0].wfilename, flags,
+                                         (OFC_CTCHAR **) files[0].replicas,
+                                         files[0].hedge_ms, stats);
       else
-        {
-          result = ASYNC_RESULT_DONE;
-        }
+        result.dwLastError = smbcopy_sync(files[0].rfilename,
+                                          files[0].wfilename);
     }
   else
     {
-      /*
-       * I/O may still be pending
-       */
-      *dwLastError = OfcGetLastError();
-      if (*dwLastError == OFC_ERROR_IO_PENDING)
-        result = ASYNC_RESULT_PENDING;
+      result.lock = ofc_lock_init();
+      result.dwLastError = OFC_ERROR_SUCCESS;
+      workers = smbworkers_create(threads > 0 ? threads : 1, WORKER_DEPTH,
+                                  flags, &copy_done, &result);
+      if (workers == OFC_NULL)
+        result.dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
       else
         {
           /*
-           * I/O may also be EOF
+           * Priorities only rank copies against each other, so the copies
+           * of one invocation all run alike
            */
-          if (*dwLastError != OFC_ERROR_HANDLE_EOF)
+          for (i = 0; i < num_files; i++)
             {
-              result = ASYNC_RESULT_ERROR;
+              dwLastError = smbworkers_submit(workers, files[i].rfilename,
+                                              files[i].wfilename,
+                                              SMBMEM_PRIORITY_NORMAL, 1);
+              if (dwLastError != OFC_ERROR_SUCCESS)
+                copy_done(files[i].rfilename, files[i].wfilename,
+                          dwLastError, &result);
             }
-          else
-            result = ASYNC_RESULT_EOF;
+          smbworkers_wait(workers);
+          smbworkers_get_stats(workers, stats, &steals);
+          smbtrace(OFC_LOG_INFO, "%d files copied by %d workers, "
+                   "%d stolen", num_files, threads > 0 ? threads : 1,
+                   (int) steals);
+          smbworkers_destroy(workers);
         }
+      ofc_lock_destroy(result.lock);
     }
-
-  if (result != ASYNC_RESULT_PENDING)
-    {
-      /*
-       * Finish up the buffer if the I/O is no longer pending
-       */
-      buffer->state = BUFFER_STATE_IDLE;
-      ofc_waitset_remove(wait_set, buffer->readOverlapped);
-    }
-
-  return (result);
+  return (result.dwLastError);
 }
 
 /*
- * Perform an I/O Write
+ * Benchmark
  *
- * This routine initiates a write on an async buffer and adds it to the
- * waitset if the I/O is pending
- *
- * \param wait_set
- * The wait set that this I/O and it's overlapped handles will be part of
- *
- * \param write_file
- * Handle of write file
- *
- * \param buffer
- * Pointer to buffer to read into
- *
- * \param dwLen
- * Length of buffer to read
- *
- * \param dwLastError
- * Error code if result is error
- *
- * \returns
- * Async Result
+ * Copy the source to the destination under every combination of the
+ * listed ciphers, signing settings and dialects.  The stack is brought up
+ * afresh for each combination so that each one negotiates new sessions.
+ * CPU is the process's user and system time, which includes the stack's
+ * threads, so CPU per GB is the cost of moving and protecting the data.
  */
-static ASYNC_RESULT AsyncWrite(OFC_HANDLE wait_set, OFC_HANDLE write_file,
-                               OFC_FILE_BUFFER *buffer, OFC_DWORD dwLen,
-                               OFC_DWORD *dwLastError)
-{
-  OFC_BOOL status;
-  ASYNC_RESULT result;
-
-  OfcSetOverlappedOffset(write_file, buffer->writeOverlapped,
-                         buffer->offset);
-
-  buffer->state = BUFFER_STATE_WRITE;
-
-  status = OfcWriteFile(write_file, buffer->data, dwLen, OFC_NULL,
-                        buffer->writeOverlapped);
-
-  result = ASYNC_RESULT_DONE;
-  if (status != OFC_TRUE)
-    {
-      *dwLastError = OfcGetLastError();
-      if (*dwLastError == OFC_ERROR_IO_PENDING)
-        {
-	  *dwLastError = OFC_ERROR_SUCCESS;
-          result = ASYNC_RESULT_PENDING;
-          ofc_waitset_add(wait_set,
-                          (OFC_HANDLE) buffer, buffer->writeOverlapped);
-        }
-      else
-        {
-          result = ASYNC_RESULT_ERROR;
-          buffer->state = BUFFER_STATE_IDLE;
-        }
-    }
-  return (result);
-}
+#define BENCH_MAX 8
+
+struct bench_options {
+  SMBCP_CIPHER ciphers[BENCH_MAX];
+  OFC_INT num_ciphers;
+  SMBCP_SIGNING signings[BENCH_MAX];
+  OFC_INT num_signings;
+  OFC_UINT16 dialects[BENCH_MAX];
+  OFC_INT num_dialects;
+  OFC_INT runs;
+};
 
-static ASYNC_RESULT AsyncWriteResult(OFC_HANDLE wait_set,
-                                     OFC_HANDLE write_file,
-                                     OFC_FILE_BUFFER *buffer,
-                                     OFC_DWORD *dwLen,
-                                     OFC_DWORD *dwLastError)
+static double bench_cpu(OFC_VOID)
 {
-  ASYNC_RESULT result;
-  OFC_BOOL status;
+  struct rusage usage;
 
-  status = OfcGetOverlappedResult(write_file, buffer->writeOverlapped,
-                                  dwLen, OFC_FALSE);
-  if (status == OFC_TRUE)
-    result = ASYNC_RESULT_DONE;
-  else
-    {
-      *dwLastError = OfcGetLastError();
-      if (*dwLastError == OFC_ERROR_IO_PENDING)
-        result = ASYNC_RESULT_PENDING;
-      else
-        {
-          result = ASYNC_RESULT_ERROR;
-        }
-    }
-
-  if (result != ASYNC_RESULT_PENDING)
-    {
-      buffer->state = BUFFER_STATE_IDLE;
-      ofc_waitset_remove(wait_set, buffer->writeOverlapped);
-    }
-
-  return (result);
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
 }
 
-static OFC_VOID destroy_buffer(struct copy_state *copy_state,
-			       OFC_FILE_BUFFER *buffer)
+static double bench_now(OFC_VOID)
 {
-  if (buffer->writeOverlapped != OFC_HANDLE_NULL)
-    {
-      /*
-       * Destroy the overlapped I/O handle for each buffer
-       */
-      OfcDestroyOverlapped(copy_state->write_file, buffer->writeOverlapped);
-      buffer->writeOverlapped = OFC_HANDLE_NULL;
-    }
-
-  if (buffer->readOverlapped != OFC_HANDLE_NULL)
-    {
-      OfcDestroyOverlapped(copy_state->read_file, buffer->readOverlapped);
-      buffer->readOverlapped = OFC_HANDLE_NULL;
-    }
-
-  if (buffer->data != OFC_NULL)
-    {
-      free(buffer->data);
-      buffer->data = OFC_NULL;
-    }
+  struct timespec ts;
 
-  free(buffer);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
 }
 
-static OFC_VOID destroy_buffer_list (struct copy_state *copy_state,
-				     OFC_HANDLE buffer_list)
+static int bench(struct smbcp_file *files, int num_files, int threads,
+                 int async, int sparse, int boost, char *dc,
+                 struct bench_options *options)
 {
-  OFC_FILE_BUFFER *buffer;
-
-  for (buffer = ofc_dequeue(buffer_list);
-       buffer != OFC_NULL;
-       buffer = ofc_dequeue(buffer_list))
-    {
-      destroy_buffer(copy_state, buffer);
-    }
-}
+  OFC_WIN32_FILE_ATTRIBUTE_DATA file_info;
+  OFC_UINT64 size;
+  OFC_DWORD ret;
+  OFC_INT c;
+  OFC_INT s;
+  OFC_INT d;
+  OFC_INT run;
+  int i;
+  struct smbcopy_stats stats;
+  struct smbcopy_stats totals;
+  double start;
+  double cpu;
+  double seconds;
+  double cpu_seconds;
+  double gb;
+  int status;
 
-static OFC_HANDLE alloc_buffer_list(struct copy_state *copy_state,
-				    OFC_HANDLE read_file,
-                                    OFC_HANDLE write_file)
-{
-  OFC_HANDLE buffer_list;
-  OFC_BOOL status = OFC_TRUE;
-  OFC_FILE_BUFFER *buffer;
-  
-  buffer_list = ofc_queue_create();
-  if (buffer_list == OFC_HANDLE_NULL)
-    status = OFC_FALSE;
-  
-  for (int i = 0; i < NUM_FILE_BUFFERS && status; i++)
-    {
-      /*
-       * Get the buffer descriptor and the data buffer
-       */
-      buffer = malloc(sizeof(OFC_FILE_BUFFER));
-      if (buffer == OFC_NULL)
+  status = 0;
+  printf("%-12s %-8s %-8s %10s %12s %10s %10s\n", "cipher", "signing",
+         "dialect", "MB/s", "CPU s/GB", "I/Os/wake", "us/I/O");
+  for (c = 0; c < options->num_ciphers; c++)
+    for (s = 0; s < options->num_signings; s++)
+      for (d = 0; d < options->num_dialects; d++)
         {
-          status = OFC_FALSE;
-        }
-      else
-        {
-          buffer->data = OFC_NULL;
-          buffer->readOverlapped = OFC_HANDLE_NULL;
-          buffer->writeOverlapped = OFC_HANDLE_NULL;
-          
-          buffer->data = malloc(BUFFER_SIZE);
-          if (buffer->data == OFC_NULL)
+          smbcp_set_security(options->ciphers[c], options->signings[s],
+                             options->dialects[d]);
+          smbcp_init();
+          if (dc != NULL)
+            of_smb_set_bootstrap_dcs(1, &dc);
+
+          printf("%-12s %-8s %-8s ", smbcp_cipher_name(options->ciphers[c]),
+                 smbcp_signing_name(options->signings[s]),
+                 smbcp_dialect_name(options->dialects[d]));
+          fflush(stdout);
+
+          size = 0;
+          ret = OFC_ERROR_SUCCESS;
+          for (i = 0; i < num_files && ret == OFC_ERROR_SUCCESS; i++)
             {
-              status = OFC_FALSE;
+              if (!OfcGetFileAttributesEx(files[i].rfilename,
+                                          OfcGetFileExInfoStandard,
+                                          &file_info))
+                ret = OfcGetLastError();
+              else
+                size += ((OFC_UINT64) file_info.nFileSizeHigh << 32) |
+                  file_info.nFileSizeLow;
             }
-          else
+
+          seconds = 0;
+          cpu_seconds = 0;
+          memset(&totals, 0, sizeof(totals));
+          for (run = 0; run < options->runs && ret == OFC_ERROR_SUCCESS;
+               run++)
             {
-              /*
-               * And initialize the overlapped handles
-               */
-              buffer->readOverlapped = OfcCreateOverlapped(read_file);
-              buffer->writeOverlapped = OfcCreateOverlapped(write_file);
-              if (buffer->readOverlapped == OFC_HANDLE_NULL ||
-                  buffer->writeOverlapped == OFC_HANDLE_NULL)
-                {
-                  status = OFC_FALSE;
-                }
+              start = bench_now();
+              cpu = bench_cpu();
+              ret = copy_files(files, num_files, threads, async, sparse,
+                               boost, &stats);
+              totals.wakeups += stats.wakeups;
+              totals.completions += stats.completions;
+              totals.dispatch_us += stats.dispatch_us;
+              seconds += bench_now() - start;
+              cpu_seconds += bench_cpu() - cpu;
             }
 
-          if (status == OFC_TRUE)
+          if (ret != OFC_ERROR_SUCCESS)
             {
-              /*
-               * Add it to our buffer list
-               */
-              ofc_enqueue(buffer_list, buffer);
+              printf("[failed] %s\n", ofc_get_error_string(ret));
+              status = 1;
             }
           else
             {
-              destroy_buffer(copy_state, buffer);
-              buffer = OFC_NULL;
+              gb = (double) size * options->runs / (1024 * 1024 * 1024);
+              printf("%10.1f %12.2f",
+                     seconds > 0 ?
+                     size * options->runs / seconds / (1024 * 1024) : 0.0,
+                     gb > 0 ? cpu_seconds / gb : 0.0);
+              /*
+               * Engine overhead.  The synchronous copy has no engine.
+               */
+              if (totals.wakeups > 0 && totals.completions > 0)
+                printf(" %10.2f %10.2f\n",
+                       (double) totals.completions / totals.wakeups,
+                       (double) totals.dispatch_us / totals.completions);
+              else
+                printf(" %10s %10s\n", "-", "-");
             }
+          smbcp_deactivate();
         }
-    }
-
-  if (status == OFC_FALSE && buffer_list != OFC_HANDLE_NULL)
-    {
-      destroy_buffer_list(copy_state, buffer_list);
-      buffer_list = OFC_HANDLE_NULL;
-    }
-
-  return (buffer_list);
-}
-
-static OFC_DWORD prime_buffers (struct copy_state *copy_state)
-{
-  OFC_FILE_BUFFER *buffer;
-  OFC_DWORD dwLen;
-  ASYNC_RESULT result;
-  OFC_DWORD dwLastError;
-
-  for (buffer = ofc_queue_first(copy_state->buffer_list);
-       buffer != OFC_NULL && !copy_state->eof;
-       buffer = ofc_queue_next(copy_state->buffer_list, buffer))
-    {
-      dwLen = BUFFER_SIZE;
-      /*
-       * Issue the read (pre increment the pending to
-       * avoid races
-       */
-      copy_state->pending++;
-      buffer->offset = copy_state->offset;
-      result = AsyncRead(copy_state->wait_set, copy_state->read_file,
-                         buffer, dwLen, &dwLastError);
-
-      if (result != ASYNC_RESULT_PENDING)
-        {
-          /*
-           * discount pending and set eof
-           */
-          copy_state->pending--;
-          /*
-           * Set eof either because it really is eof, or we
-           * want to clean up.
-           */
-          copy_state->eof = OFC_TRUE;
-        }
-      /*
-       * Prepare for the next buffer
-       */
-      copy_state->offset += BUFFER_SIZE;
-    }
-  return (dwLastError);
+  return (status);
 }
 
-static OFC_VOID destroy_copy_state(struct copy_state *copy_state)
-{
-  if (copy_state->buffer_list != OFC_HANDLE_NULL)
-    {
-      destroy_buffer_list (copy_state, copy_state->buffer_list);
-      copy_state->buffer_list = OFC_HANDLE_NULL;
-    }
-  
-  if (copy_state->wait_set != OFC_HANDLE_NULL)
-    {
-      ofc_waitset_destroy(copy_state->wait_set);
-      copy_state->wait_set = OFC_HANDLE_NULL;
-    }
-
-  if (copy_state->write_file != OFC_HANDLE_NULL)
-    {
-      OfcCloseHandle(copy_state->write_file);
-      copy_state->write_file = OFC_HANDLE_NULL;
-    }
-
-  if (copy_state->read_file != OFC_HANDLE_NULL)
-    {
-      OfcCloseHandle(copy_state->read_file);
-      copy_state->read_file = OFC_HANDLE_NULL;
-    }
-
-  free(copy_state);
-}
+/*
+ * Parse a comma separated list of cipher, signing or dialect names
+ */
+typedef enum {
+  BENCH_LIST_CIPHER,
+  BENCH_LIST_SIGNING,
+  BENCH_LIST_DIALECT
+} BENCH_LIST;
 
-static struct copy_state *init_copy_state(OFC_CTCHAR *rfilename,
-                                          OFC_CTCHAR *wfilename,
-                                          OFC_DWORD *dwLastError)
+static int parse_list(char *arg, BENCH_LIST list,
+                      struct bench_options *options)
 {
-  struct copy_state *copy_state;
-
-  *dwLastError = OFC_ERROR_SUCCESS;
-  
-  copy_state = malloc(sizeof(struct copy_state));
-  if (copy_state == OFC_NULL)
-    *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
-  else
+  OFC_INT *num_values;
+  char *name;
+  char *save;
+  int ret;
+
+  num_values = list == BENCH_LIST_CIPHER ? &options->num_ciphers :
+    list == BENCH_LIST_SIGNING ? &options->num_signings :
+    &options->num_dialects;
+  *num_values = 0;
+  ret = 0;
+  for (name = strtok_r(arg, ",", &save); name != NULL && ret == 0;
+       name = strtok_r(NULL, ",", &save))
     {
-      copy_state->read_file = OFC_HANDLE_NULL;
-      copy_state->write_file = OFC_HANDLE_NULL;
-      copy_state->wait_set = OFC_HANDLE_NULL;
-      copy_state->buffer_list = OFC_HANDLE_NULL;
-      copy_state->offset = 0;
-      copy_state->pending = 0;
-      copy_state->eof = OFC_FALSE;
-      /*
-       * Open up our read file.  This file should
-       * exist
-       */
-      copy_state->read_file = OfcCreateFile(rfilename,
-                                            OFC_GENERIC_READ,
-                                            OFC_FILE_SHARE_READ,
-                                            OFC_NULL,
-                                            OFC_OPEN_EXISTING,
-                                            OFC_FILE_ATTRIBUTE_NORMAL |
-                                            OFC_FILE_FLAG_OVERLAPPED,
-                                            OFC_HANDLE_NULL);
-
-      if (copy_state->read_file == OFC_INVALID_HANDLE_VALUE)
-        {
-          *dwLastError = OfcGetLastError();
-        }
+      if (*num_values == BENCH_MAX)
+        ret = -1;
+      else if (list == BENCH_LIST_CIPHER)
+        ret = smbcp_parse_cipher(name, &options->ciphers[*num_values]);
+      else if (list == BENCH_LIST_SIGNING)
+        ret = smbcp_parse_signing(name, &options->signings[*num_values]);
       else
-        {
-          /*
-           * Open up our write file.  If it exists, it will be deleted
-           */
-          copy_state->write_file = OfcCreateFile(wfilename,
-                                                 OFC_GENERIC_WRITE,
-                                                 0,
-                                                 OFC_NULL,
-                                                 OFC_CREATE_ALWAYS,
-                                                 OFC_FILE_ATTRIBUTE_NORMAL |
-                                                 OFC_FILE_FLAG_OVERLAPPED,
-                                                 OFC_HANDLE_NULL);
-
-          if (copy_state->write_file == OFC_INVALID_HANDLE_VALUE)
-            {
-              *dwLastError = OfcGetLastError();
-            }
-        }
-
-      if (*dwLastError == OFC_ERROR_SUCCESS)
-        {
-          /*
-           * Now, create a wait set that we will wait for
-           */
-          copy_state->wait_set = ofc_waitset_create();
-          if (copy_state->wait_set == OFC_HANDLE_NULL)
-            {
-              *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
-            }
-        }
-
-      if (*dwLastError == OFC_ERROR_SUCCESS)
-        {
-          /*
-           * And create our own buffer list that we will manage
-           */
-          copy_state->buffer_list = alloc_buffer_list(copy_state,
-						      copy_state->read_file,
-                                                      copy_state->write_file);
-
-          if (copy_state->buffer_list == OFC_HANDLE_NULL)
-            *dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
-        }
-
-      if (*dwLastError != OFC_ERROR_SUCCESS)
-        {
-          destroy_copy_state (copy_state);
-          copy_state = OFC_NULL;
-        }
+        ret = smbcp_parse_dialect(name, &options->dialects[*num_values]);
+      if (ret == 0)
+        (*num_values)++;
     }
-  return (copy_state);
+  return (*num_values == 0 ? -1 : ret);
 }
 
-static OFC_DWORD feed_buffers(struct copy_state *copy_state)
+static OFC_TCHAR *make_tchar(const char *str)
 {
-  OFC_HANDLE hEvent;
-  OFC_FILE_BUFFER *buffer;
-  OFC_DWORD dwLen;
-  OFC_DWORD dwLastError;
-  OFC_DWORD dwFirstError;
-  ASYNC_RESULT result;
-  /*
-   * Now all our buffers should be busy doing reads.  Keep pumping
-   * more data to read and service writes
-   */
-  dwLastError = OFC_ERROR_SUCCESS;
-  dwFirstError = OFC_ERROR_SUCCESS;
+  OFC_TCHAR *tstr;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
 
-  while (copy_state->pending > 0)
-    {
-      /*
-       * Wait for some buffer to finish (may be a read if we've
-       * just finished priming, but it may be a write also if
-       * we've been in this loop a bit
-       */
-      hEvent = ofc_waitset_wait(copy_state->wait_set);
-      if (hEvent != OFC_HANDLE_NULL)
-        {
-          /*
-           * We use the app of the event as a pointer to the
-           * buffer descriptor.  Yeah, this isn't really nice but
-           * the alternative is to add a context to each handle.
-           * That may be cleaner, but basically unnecessary.  If
-           * we did this kind of thing a lot, I'm all for a
-           * new property of a handle
-           */
-          buffer = (OFC_FILE_BUFFER *) ofc_handle_get_app(hEvent);
-          /*
-           * Now we have both read and write overlapped descriptors
-           * See what state we're in
-           */
-          if (buffer->state == BUFFER_STATE_READ)
-            {
-              /*
-               * Read, so let's see the result of the read
-               */
-              result = AsyncReadResult(copy_state->wait_set,
-                                       copy_state->read_file,
-                                       buffer, &dwLen,
-                                       &dwLastError);
-              if (result == ASYNC_RESULT_ERROR)
-                dwFirstError = dwLastError;
-              else if (result == ASYNC_RESULT_DONE)
-                {
-                  /*
-                   * When the read is done, let's start up the write
-                   */
-                  result = AsyncWrite(copy_state->wait_set,
-                                      copy_state->write_file,
-                                      buffer, dwLen,
-                                      &dwLastError);
-                  if (result == ASYNC_RESULT_ERROR)
-                    dwFirstError = dwLastError;
-                }
-              /*
-               * If the write failed, or we had a read result error
-               */
-              if (result == ASYNC_RESULT_ERROR ||
-                  result == ASYNC_RESULT_EOF ||
-                  (result == ASYNC_RESULT_DONE &&
-                   dwLastError != OFC_ERROR_SUCCESS))
-                {
-                  /*
-                   * The I/O is no longer pending.
-                   */
-                  copy_state->pending--;
-                  copy_state->eof = OFC_TRUE;
-                }
-            }
-          else
-            {
-              /*
-               * The buffer state was write.  Let's look at our
-               * status
-               */
-              result = AsyncWriteResult(copy_state->wait_set,
-                                        copy_state->write_file,
-                                        buffer, &dwLen,
-                                        &dwLastError);
-              if (result == ASYNC_RESULT_ERROR)
-                dwFirstError = dwLastError;
-              else if (result == ASYNC_RESULT_DONE)
-                {
-                  /*
-                   * The write is finished.
-                   * Let's step the buffer
-                   */
-                  buffer->offset = copy_state->offset;
-                  copy_state->offset += BUFFER_SIZE;
-                  /*
-                   * And start a read on the next chunk
-                   */
-                  result = AsyncRead(copy_state->wait_set,
-                                     copy_state->read_file,
-                                     buffer, BUFFER_SIZE,
-                                     &dwLastError);
-                  if (result == ASYNC_RESULT_ERROR)
-                    dwFirstError = dwLastError;
-                }
-
-              if (result != ASYNC_RESULT_PENDING)
-                {
-                  copy_state->eof = OFC_TRUE;
-                  copy_state->pending--;
-                }
-            }
-        }
-    }
-  return (dwFirstError);
+  memset(&ps, 0, sizeof(ps));
+  len = strlen(str) + 1;
+  tstr = malloc(sizeof(wchar_t) * len);
+  cursor = str;
+  mbsrtowcs(tstr, &cursor, len, &ps);
+  return (tstr);
 }
 
-
-static OFC_DWORD copy_async(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename)
+/*
+ * The destination of a source copied into a directory
+ */
+static OFC_TCHAR *make_destination(const char *dir, const char *source)
 {
-  struct copy_state *copy_state;
-  OFC_DWORD dwLastError;
-
-  dwLastError = OFC_ERROR_SUCCESS;
-
-  copy_state = init_copy_state(rfilename, wfilename, &dwLastError);
-  if (copy_state != OFC_NULL)
-    {
-      /*
-       * Prime the engine.  Priming involves obtaining a buffer
-       * for each overlapped I/O and initilizing them
-       */
-      dwLastError = prime_buffers(copy_state);
-      if (dwLastError == OFC_ERROR_SUCCESS)
-        {
-          dwLastError = feed_buffers(copy_state);
-        }
-
-      destroy_copy_state(copy_state);
-      copy_state = OFC_NULL;
-    }
+  OFC_TCHAR *tstr;
+  const char *base;
+  const char *cursor;
+  char *path;
+  size_t len;
 
-  return (dwLastError);
+  base = source;
+  for (cursor = source; *cursor != '\0'; cursor++)
+    if (*cursor == '/' || *cursor == '\\')
+      base = cursor + 1;
+
+  len = strlen(dir);
+  path = malloc(len + strlen(base) + 2);
+  strcpy(path, dir);
+  if (len > 0 && dir[len - 1] != '/' && dir[len - 1] != '\\')
+    strcat(path, "/");
+  strcat(path, base);
+
+  tstr = make_tchar(path);
+  free(path);
+  return (tstr);
 }
 
-static OFC_DWORD copy_sync(OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename)
+int main (int argc, char **argp)
 {
-  struct copy_state *copy_state;
-  OFC_DWORD dwLastError;
-  OFC_HANDLE read_file;
-  OFC_HANDLE write_file;
-  OFC_CHAR buffer[BUFFER_SIZE];
-  OFC_DWORD dwLen;
-  OFC_BOOL ret;
-
-  dwLastError = OFC_ERROR_SUCCESS;
+  struct smbcp_file *files;
+  int num_files;
+  struct smbcopy_stats stats;
+  OFC_DWORD ret;
+  int async = 0;
+  int threads = 0;
+  int i;
+  int j;
+  char *replicas[REPLICA_MAX];
+  int num_replicas = 0;
+  int hedge_ms = HEDGE_DEFAULT;
+  int stripe = 0;
+  int sparse = 0;
+  int boost = 0;
+  int argidx;
+  int usage;
+  int bench_mode = 0;
+  char *dc = NULL;
+  OFC_UINT64 rate = 0;
+  OFC_UINT64 iops = 0;
+  OFC_UINT64 mem = 0;
+  struct smbmem_stats mem_stats;
+  const char *trace_path = NULL;
+  OFC_LOG_LEVEL trace_level = OFC_LOG_INFO;
+  struct bench_options options;
+
+  options.ciphers[0] = SMBCP_CIPHER_DEFAULT;
+  options.num_ciphers = 1;
+  options.signings[0] = SMBCP_SIGNING_DEFAULT;
+  options.num_signings = 1;
+  options.dialects[0] = SMBCP_DIALECT_DEFAULT;
+  options.num_dialects = 1;
+  options.runs = 1;
 
-  read_file = OFC_HANDLE_NULL;
-  write_file = OFC_HANDLE_NULL;
   /*
-   * Open up our read file.  This file should
-   * exist
+   * Everything that shapes the stack has to be known before the stack is
+   * started, so options are parsed first and the bootstrap dc, which
+   * needs the stack, is applied after it is up.
    */
-  read_file = OfcCreateFile(rfilename,
-			    OFC_GENERIC_READ,
-			    OFC_FILE_SHARE_READ,
-			    OFC_NULL,
-			    OFC_OPEN_EXISTING,
-			    OFC_FILE_ATTRIBUTE_NORMAL,
-			    OFC_HANDLE_NULL);
-
-  if (read_file == OFC_INVALID_HANDLE_VALUE)
-    {
-      dwLastError = OfcGetLastError();
-    }
-  else
+  usage = 0;
+  argidx = 1;
+  while (argidx < argc && argp[argidx][0] == '-' && !usage)
     {
-      /*
-       * Open up our write file.  If it exists, it will be deleted
-       */
-      write_file = OfcCreateFile(wfilename,
-				 OFC_GENERIC_WRITE,
-				 0,
-				 OFC_NULL,
-				 OFC_CREATE_ALWAYS,
-				 OFC_FILE_ATTRIBUTE_NORMAL,
-				 OFC_HANDLE_NULL);
-
-      if (write_file == OFC_INVALID_HANDLE_VALUE)
+      if (strcmp(argp[argidx], "-a") == 0)
+	async = 1;
+      else if (strcmp(argp[argidx], "-sparse") == 0)
 	{
-	  dwLastError = OfcGetLastError();
+	  /*
+	   * Skipping ranges needs positioned writes so sparse copies
+	   * always use the async engine
+	   */
+	  sparse = 1;
+	  async = 1;
 	}
-      else
+      else if (strcmp(argp[argidx], "-boost") == 0)
+	boost = 1;
+      else if (strcmp(argp[argidx], "-j") == 0 && argidx + 1 < argc)
 	{
-	  while ((ret = OfcReadFile(read_file, buffer, BUFFER_SIZE,
-				    &dwLen, OFC_HANDLE_NULL)) == OFC_TRUE)
-	    {
-	      ret = OfcWriteFile(write_file, buffer, dwLen,
-				 &dwLen, OFC_HANDLE_NULL);
-	    }
-	  if (ret == OFC_FALSE)
-	    {
-	      if (OfcGetLastError() != OFC_ERROR_HANDLE_EOF)
-		dwLastError = OfcGetLastError();
-	    }
-	    
-	  OfcCloseHandle(write_file);
+	  threads = atoi(argp[++argidx]);
+	  usage = (threads < 1);
 	}
-      OfcCloseHandle(read_file);
+      else if (strcmp(argp[argidx], "-fast") == 0)
+	smbcp_set_profile(SMBCP_PROFILE_FAST);
+      else if (strcmp(argp[argidx], "-trace") == 0 && argidx + 1 < argc)
+	trace_path = argp[++argidx];
+      else if (strcmp(argp[argidx], "-trace-level") == 0 &&
+	       argidx + 1 < argc)
+	usage = smbtrace_parse_level(argp[++argidx], &trace_level);
+      else if (strcmp(argp[argidx], "-dc") == 0 && argidx + 1 < argc)
+	dc = argp[++argidx];
+      else if (strcmp(argp[argidx], "-replica") == 0 && argidx + 1 < argc)
+	{
+	  argidx++;
+	  if (num_replicas < REPLICA_MAX)
+	    replicas[num_replicas++] = argp[argidx];
+	  else
+	    usage = 1;
+	  async = 1;
+	}
+      else if (strcmp(argp[argidx], "-stripe") == 0)
+	stripe = 1;
+      else if (strcmp(argp[argidx], "-hedge") == 0 && argidx + 1 < argc)
+	{
+	  hedge_ms = atoi(argp[++argidx]);
+	  usage = (hedge_ms < 1);
+	}
+      else if (strcmp(argp[argidx], "-dc-cache") == 0 && argidx + 1 < argc)
+	usage = smbdc_set_cache(argp[++argidx]);
+      else if (strcmp(argp[argidx], "-rate") == 0 && argidx + 1 < argc)
+	usage = smbrate_parse(argp[++argidx], &rate);
+      else if (strcmp(argp[argidx], "-iops") == 0 && argidx + 1 < argc)
+	usage = smbrate_parse(argp[++argidx], &iops);
+      else if (strcmp(argp[argidx], "-mem") == 0 && argidx + 1 < argc)
+	usage = smbrate_parse(argp[++argidx], &mem);
+      else if (strcmp(argp[argidx], "-cipher") == 0 && argidx + 1 < argc)
+	usage = parse_list(argp[++argidx], BENCH_LIST_CIPHER, &options);
+      else if (strcmp(argp[argidx], "-signing") == 0 && argidx + 1 < argc)
+	usage = parse_list(argp[++argidx], BENCH_LIST_SIGNING, &options);
+      else if (strcmp(argp[argidx], "-dialect") == 0 && argidx + 1 < argc)
+	usage = parse_list(argp[++argidx], BENCH_LIST_DIALECT, &options);
+      else if (strcmp(argp[argidx], "-bench") == 0 && argidx + 1 < argc)
+	{
+	  bench_mode = 1;
+	  options.runs = atoi(argp[++argidx]);
+	  usage = (options.runs < 1);
+	}
+      else
+	usage = 1;
+      argidx++;
     }
 
-  return (dwLastError);
-}
+  /*
+   * Only the benchmark takes more than one of each
+   */
+  if (!bench_mode && (options.num_ciphers > 1 || options.num_signings > 1 ||
+                      options.num_dialects > 1))
+    usage = 1;
+  /*
+   * Replicas are of a single source copied on the calling thread
+   */
+  if (num_replicas > 0 && (argc - argidx != 2 || threads > 0))
+    usage = 1;
+  if (stripe && num_replicas == 0)
+    usage = 1;
 
-int main (int argc, char **argp)
-{
-  OFC_TCHAR *rfilename;
-  OFC_TCHAR *wfilename;
-  size_t len;
-  mbstate_t ps;
-  OFC_DWORD ret;
-  const char *cursor;
-  int async = 0;
-  int argidx;
+  if (usage || argc - argidx < 2)
+    {
+      printf ("Usage: smbcp [-fast] [-a | -sparse | -dc <bootstrap-dc>] "
+	      "[-cipher <cipher>] [-signing on | off]\n"
+	      "             [-dialect <dialect>] "
+	      "[-trace <file> [-trace-level <level>]]\n"
+	      "             [-rate <bytes/s>] [-iops <ios/s>] "
+	      "[-dc-cache <file>] [-j <threads>]\n"
+	      "             [-mem <bytes> [-boost]] <source> <destination> | "
+	      "<source>... <directory>\n");
+      printf ("       smbcp [options] -replica <path>... [-hedge <ms>] "
+	      "[-stripe] <source> <destination>\n");
+      printf ("       smbcp -bench <runs> [-a | -sparse] [-dc <bootstrap-dc>] "
+	      "[-cipher <cipher>,...]\n"
+	      "             [-signing on,off] [-dialect <dialect>,...] "
+	      "[-j <threads>]\n"
+	      "             <source> <destination> | "
+	      "<source>... <directory>\n");
+      printf ("       Ciphers: none, aes-128-ccm, aes-128-gcm, "
+	      "aes-256-ccm, aes-256-gcm\n");
+      printf ("       Dialects: 2.0.2, 2.1, 3.0, 3.0.2, 3.1.1\n");
+      printf ("       Trace levels: debug, info, warn, fatal\n");
+      printf ("       Rates and sizes take a K, M or G suffix "
+	      "(powers of 1000)\n");
+      exit (1);
+    }
 
-  smbcp_init();
+  smbrate_set(rate, iops);
+  smbmem_set(mem);
 
-  if (argc < 3)
+  if (trace_path != NULL && smbtrace_init(trace_path, trace_level) != 0)
     {
-      printf ("Usage: smbcp [-a | -dc <bootstrap-dc>] <source> <destination>\n");
+      printf ("Cannot set up tracing to %s\n", trace_path);
       exit (1);
     }
 
-  argidx = 1;
-  while (1)
+  /*
+   * Look up the domain controllers for the paths, if they aren't cached
+   * already, so that the stack starts with them
+   */
+  for (i = argidx; i < argc; i++)
+    smbdc_resolve(argp[i]);
+  for (j = 0; j < num_replicas; j++)
+    smbdc_resolve(replicas[j]);
+
+  /*
+   * More than one source is copied into the destination directory
+   */
+  num_files = argc - argidx - 1;
+  files = malloc(sizeof(struct smbcp_file) * num_files);
+  for (i = 0; i < num_files; i++)
     {
-      if (strcmp(argp[argidx], "-a") == 0)
-	{
-	  async = 1;
-	  argidx++;
-	}
-      else if (strcmp(argp[argidx], "-dc") == 0)
-	{
-	  argidx++;
-	  memset(&ps, 0, sizeof(ps));
-	  len = strlen(argp[argidx]) + 1;
-	  argidx++;
-	  of_smb_set_bootstrap_dcs(1, &argp[argidx]);
-	}
+      files[i].rfilename = make_tchar(argp[argidx + i]);
+      if (num_files == 1)
+	files[i].wfilename = make_tchar(argp[argc - 1]);
       else
-	break;
+	files[i].wfilename = make_destination(argp[argc - 1],
+					      argp[argidx + i]);
+      for (j = 0; j < num_replicas; j++)
+	files[i].replicas[j] = make_tchar(replicas[j]);
+      files[i].replicas[j] = OFC_NULL;
+      files[i].hedge_ms = hedge_ms;
+      files[i].stripe = stripe;
     }
+  if (num_files > 1 || threads > 0)
+    async = 1;
 
-  memset(&ps, 0, sizeof(ps));
-  len = strlen(argp[argidx]) + 1;
-  rfilename = malloc(sizeof(wchar_t) * len);
-  cursor = argp[argidx];
-  mbsrtowcs(rfilename, &cursor, len, &ps);
+  if (bench_mode)
+    {
+      ret = bench(files, num_files, threads, async, sparse, boost, dc,
+                  &options);
+      exit(ret);
+    }
 
-  memset(&ps, 0, sizeof(ps));
-  len = strlen(argp[argidx+1]) + 1;
-  wfilename = malloc(sizeof(wchar_t) * len);
-  cursor = argp[argidx+1];
-  mbsrtowcs(wfilename, &cursor, len, &ps);
+  smbcp_set_security(options.ciphers[0], options.signings[0],
+                     options.dialects[0]);
+  smbcp_init();
+  if (dc != NULL)
+    of_smb_set_bootstrap_dcs(1, &dc);
 
-  printf("Copying %s to %s: ", argp[argidx], argp[argidx+1]);
+  if (num_files == 1)
+    printf("Copying %s to %s: ", argp[argidx], argp[argidx+1]);
+  else
+    printf("Copying %d files to %s: ", num_files, argp[argc - 1]);
   fflush(stdout);
+  /*
+   * Paths may carry credentials so they are kept out of the trace
+   */
+  smbtrace(OFC_LOG_INFO, "%s copy started", async ? "async" : "sync");
 
-  if (async)
-    ret = copy_async(rfilename, wfilename);
-  else
-    ret = copy_sync(rfilename, wfilename);
-  
-  free(rfilename);
-  free(wfilename);
+  ret = copy_files(files, num_files, threads, async, sparse, boost, &stats);
+
+  for (i = 0; i < num_files; i++)
+    {
+      free(files[i].rfilename);
+      free(files[i].wfilename);
+      for (j = 0; files[i].replicas[j] != OFC_NULL; j++)
+	free(files[i].replicas[j]);
+    }
+  free(files);
 
   int status;
   if (ret == OFC_ERROR_SUCCESS)
@@ -890,13 +597,31 @@ int main (int argc, char **argp)
       printf("[failed]\n");
       printf("%s\n", ofc_get_error_string(ret));
       status = 1;
+      smbtrace(OFC_LOG_FATAL, "copy failed: %s", ofc_get_error_string(ret));
+      smbtrace_dump("error");
+    }
+
+  if (stats.failovers > 0)
+    fprintf(stderr, "Source failed over %llu time(s), recovered in %llu ms\n",
+            (unsigned long long) stats.failovers,
+            (unsigned long long) stats.failover_ms);
+
+  if (smbmem_enabled())
+    {
+      smbmem_get_stats(&mem_stats);
+      printf("Memory: peak %llu of %llu bytes, %llu copies in low memory "
+             "mode, %llu buffers given back\n",
+             (unsigned long long) mem_stats.peak,
+             (unsigned long long) mem_stats.budget,
+             (unsigned long long) mem_stats.low_memory,
+             (unsigned long long) stats.shrinks);
     }
 
   /*
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   exit(status);
 }
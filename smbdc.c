@@ -0,0 +1,354 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include <ofc/types.h>
+#include <ofc/framework.h>
+#include <of_smb/framework.h>
+
+#include "smbdc.h"
+#include "smbtrace.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Most domains kept, controllers kept per domain and controllers handed
+ * to the stack
+ */
+#define DC_ENTRIES 64
+#define DC_PER_DOMAIN 8
+#define DC_BOOTSTRAP_MAX 16
+#define DC_NAME 256
+
+/*
+ * A cache entry.  An entry with no controllers records that the name
+ * isn't a domain.
+ */
+struct dc_entry {
+  char domain[DC_NAME];
+  time_t expiry;                /* Wall clock time the entry expires */
+  OFC_INT num_dcs;
+  char dcs[DC_PER_DOMAIN][DC_NAME];
+};
+
+static struct dc_entry *dc_entries = NULL;
+static OFC_INT dc_num_entries = 0;
+static char dc_path[PATH_MAX];
+static OFC_BOOL dc_active = OFC_FALSE;
+
+/*
+ * Read the cache file, dropping expired entries.  The file has a line
+ * per domain:
+ *
+ *   <domain> <expiry> <dc>[,<dc>...]
+ *
+ * with - in place of the controllers for a name that isn't a domain.
+ */
+static OFC_VOID dc_load(OFC_VOID)
+{
+  FILE *fp;
+  char line[DC_NAME * (DC_PER_DOMAIN + 1) + 64];
+  char domain[DC_NAME];
+  char dcs[DC_NAME * DC_PER_DOMAIN];
+  long long expiry;
+  struct dc_entry *entry;
+  char *dc;
+  char *save;
+  time_t now;
+
+  dc_num_entries = 0;
+  fp = fopen(dc_path, "r");
+  if (fp == NULL)
+    return;
+
+  now = time(NULL);
+  while (dc_num_entries < DC_ENTRIES && fgets(line, sizeof(line), fp) != NULL)
+    {
+      if (sscanf(line, "%255s %lld %2047s", domain, &expiry, dcs) != 3 ||
+          expiry <= now)
+        continue;
+
+      entry = &dc_entries[dc_num_entries++];
+      strcpy(entry->domain, domain);
+      entry->expiry = (time_t) expiry;
+      entry->num_dcs = 0;
+      if (strcmp(dcs, "-") != 0)
+        {
+          for (dc = strtok_r(dcs, ",", &save);
+               dc != NULL && entry->num_dcs < DC_PER_DOMAIN;
+               dc = strtok_r(NULL, ",", &save))
+            {
+              if (strlen(dc) < DC_NAME)
+                strcpy(entry->dcs[entry->num_dcs++], dc);
+            }
+        }
+    }
+  fclose(fp);
+}
+
+/*
+ * Write the cache back.  The file is replaced in one step so that other
+ * processes never read a partial file.
+ */
+static OFC_VOID dc_save(OFC_VOID)
+{
+  FILE *fp;
+  char tmp_path[PATH_MAX + 32];
+  struct dc_entry *entry;
+  OFC_INT i;
+  OFC_INT j;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", dc_path, (int) getpid());
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL)
+    {
+      smbtrace(OFC_LOG_WARN, "cannot write dc cache");
+      return;
+    }
+
+  for (i = 0; i < dc_num_entries; i++)
+    {
+      entry = &dc_entries[i];
+      fprintf(fp, "%s %lld ", entry->domain, (long long) entry->expiry);
+      if (entry->num_dcs == 0)
+        fprintf(fp, "-");
+      for (j = 0; j < entry->num_dcs; j++)
+        fprintf(fp, "%s%s", j > 0 ? "," : "", entry->dcs[j]);
+      fprintf(fp, "\n");
+    }
+
+  if (fclose(fp) != 0 || rename(tmp_path, dc_path) != 0)
+    {
+      smbtrace(OFC_LOG_WARN, "cannot write dc cache");
+      unlink(tmp_path);
+    }
+}
+
+static struct dc_entry *dc_find(const char *domain)
+{
+  OFC_INT i;
+
+  for (i = 0; i < dc_num_entries &&
+         strcasecmp(dc_entries[i].domain, domain) != 0; i++);
+  return (i == dc_num_entries ? NULL : &dc_entries[i]);
+}
+
+/*
+ * Hand every cached controller to the stack
+ */
+static OFC_VOID dc_apply(OFC_VOID)
+{
+  OFC_CHAR *dcs[DC_BOOTSTRAP_MAX];
+  OFC_INT num_dcs;
+  OFC_INT i;
+  OFC_INT j;
+  OFC_INT k;
+
+  num_dcs = 0;
+  for (i = 0; i < dc_num_entries; i++)
+    {
+      for (j = 0; j < dc_entries[i].num_dcs && num_dcs < DC_BOOTSTRAP_MAX;
+           j++)
+        {
+          for (k = 0; k < num_dcs &&
+                 strcasecmp(dcs[k], dc_entries[i].dcs[j]) != 0; k++);
+          if (k == num_dcs)
+            dcs[num_dcs++] = dc_entries[i].dcs[j];
+        }
+    }
+
+  if (num_dcs > 0)
+    {
+      smbtrace(OFC_LOG_INFO, "%d bootstrap dcs from cache", num_dcs);
+      of_smb_set_bootstrap_dcs(num_dcs, dcs);
+    }
+}
+
+/*
+ * Look up a domain's controllers from its SRV records, lowest priority
+ * first.  Fills in the entry and returns the shortest TTL of the records
+ * or -1 if there are none.
+ */
+static long dc_lookup(const char *domain, struct dc_entry *entry)
+{
+  unsigned char answer[NS_PACKETSZ * 4];
+  char query[DC_NAME + 32];
+  char target[NS_MAXDNAME];
+  OFC_UINT16 priority[DC_PER_DOMAIN];
+  OFC_UINT16 rr_priority;
+  ns_msg msg;
+  ns_rr rr;
+  long ttl;
+  int len;
+  int count;
+  int i;
+  int j;
+
+  entry->num_dcs = 0;
+  ttl = -1;
+  snprintf(query, sizeof(query), "_ldap._tcp.dc._msdcs.%s", domain);
+  len = res_search(query, ns_c_in, ns_t_srv, answer, sizeof(answer));
+  if (len < 0 || ns_initparse(answer, len, &msg) < 0)
+    return (-1);
+
+  count = ns_msg_count(msg, ns_s_an);
+  for (i = 0; i < count; i++)
+    {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 ||
+          ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7)
+        continue;
+      if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr) + 6,
+                    target, sizeof(target)) < 0 ||
+          strlen(target) >= DC_NAME)
+        continue;
+
+      if (ttl < 0 || (long) ns_rr_ttl(rr) < ttl)
+        ttl = ns_rr_ttl(rr);
+      /*
+       * Keep the list in priority order
+       */
+      rr_priority = ns_get16(ns_rr_rdata(rr));
+      for (j = entry->num_dcs; j > 0 && priority[j - 1] > rr_priority; j--);
+      if (j == DC_PER_DOMAIN)
+        continue;
+      if (entry->num_dcs == DC_PER_DOMAIN)
+        entry->num_dcs--;
+      memmove(&priority[j + 1], &priority[j],
+              (entry->num_dcs - j) * sizeof(priority[0]));
+      memmove(entry->dcs[j + 1], entry->dcs[j],
+              (entry->num_dcs - j) * DC_NAME);
+      priority[j] = rr_priority;
+      strcpy(entry->dcs[j], target);
+      entry->num_dcs++;
+    }
+  return (entry->num_dcs > 0 ? ttl : -1);
+}
+
+int smbdc_set_cache(const char *path)
+{
+  if (strlen(path) >= sizeof(dc_path))
+    return (-1);
+  if (dc_entries == NULL)
+    {
+      dc_entries = calloc(DC_ENTRIES, sizeof(struct dc_entry));
+      if (dc_entries == NULL)
+        return (-1);
+    }
+  strcpy(dc_path, path);
+  dc_active = OFC_TRUE;
+  return (0);
+}
+
+OFC_BOOL smbdc_enabled(OFC_VOID)
+{
+  return (dc_active);
+}
+
+static OFC_VOID dc_env(OFC_VOID)
+{
+  const char *env;
+
+  env = getenv("SMBCP_DC_CACHE");
+  if (!dc_active && env != NULL && smbdc_set_cache(env) != 0)
+    fprintf(stderr, "smbcp: bad SMBCP_DC_CACHE, not caching dcs\n");
+}
+
+OFC_VOID smbdc_preload(OFC_VOID)
+{
+  dc_env();
+  if (dc_active)
+    {
+      dc_load();
+      dc_apply();
+    }
+}
+
+OFC_VOID smbdc_resolve(const char *path)
+{
+  struct dc_entry lookup;
+  struct dc_entry *entry;
+  const char *start;
+  const char *end;
+  const char *at;
+  size_t len;
+  long ttl;
+  OFC_INT i;
+
+  dc_env();
+  if (!dc_active ||
+      !((path[0] == '/' || path[0] == '\\') &&
+        (path[1] == '/' || path[1] == '\\')))
+    return;
+
+  /*
+   * The server part of the path, less any credentials
+   */
+  start = path + 2;
+  for (end = start; *end != '\0' && *end != '/' && *end != '\\'; end++);
+  for (at = start; at < end; at++)
+    if (*at == '@')
+      start = at + 1;
+  for (at = start; at < end && *at != ':'; at++);
+  end = at;
+
+  len = end - start;
+  if (len == 0 || len >= DC_NAME)
+    return;
+  memcpy(lookup.domain, start, len);
+  lookup.domain[len] = '\0';
+
+  dc_load();
+  if (dc_find(lookup.domain) != NULL)
+    return;
+
+  ttl = dc_lookup(lookup.domain, &lookup);
+  if (ttl < 0)
+    ttl = SMBDC_NEGATIVE_TTL;
+  else if (ttl < SMBDC_MIN_TTL)
+    ttl = SMBDC_MIN_TTL;
+  else if (ttl > SMBDC_MAX_TTL)
+    ttl = SMBDC_MAX_TTL;
+  lookup.expiry = time(NULL) + ttl;
+  smbtrace(OFC_LOG_INFO, "%d dcs found in dns, cached for %ld s",
+           lookup.num_dcs, ttl);
+
+  /*
+   * Pick up whatever other processes have cached since we loaded
+   */
+  dc_load();
+  entry = dc_find(lookup.domain);
+  if (entry == NULL)
+    {
+      if (dc_num_entries == DC_ENTRIES)
+        {
+          /*
+           * Full.  Make room by dropping the entry closest to expiring.
+           */
+          entry = &dc_entries[0];
+          for (i = 1; i < dc_num_entries; i++)
+            if (dc_entries[i].expiry < entry->expiry)
+              entry = &dc_entries[i];
+        }
+      else
+        entry = &dc_entries[dc_num_entries++];
+    }
+  *entry = lookup;
+  dc_save();
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,34 @@
+#if !defined(__smbdc_h__)
+#define __smbdc_h__
+
+#include <ofc/types.h>
+
+/*
+ * Domain controller cache.
+ *
+ * On a cold start, resolving a DFS path means finding the domain's
+ * controllers in DNS before the first referral can be asked for.  With
+ * the cache enabled, the controllers found for each domain are kept in a
+ * file along with when they expire, and every unexpired controller in the
+ * file is handed to the stack as a bootstrap DC by smbcp_init.
+ *
+ * smbdc_resolve is called, before smbcp_init, with each path a tool is
+ * about to use.  If the server part of the path has no unexpired entry,
+ * its controllers are looked up from the domain's _ldap._tcp.dc._msdcs
+ * SRV records and saved with the records' TTL, so that smbcp_init
+ * preloads them.  A name with no such records is a server rather than a
+ * domain and is remembered as one for SMBDC_NEGATIVE_TTL seconds.
+ *
+ * smbdc_set_cache must be called before smbcp_init.  If it isn't,
+ * SMBCP_DC_CACHE=<file> in the environment enables the cache.  The
+ * stack keeps its own cache of the referrals themselves.
+ */
+#define SMBDC_MIN_TTL 60
+#define SMBDC_MAX_TTL 86400
+#define SMBDC_NEGATIVE_TTL 600
+
+int smbdc_set_cache(const char *path);
+OFC_BOOL smbdc_enabled(OFC_VOID);
+OFC_VOID smbdc_preload(OFC_VOID);
+OFC_VOID smbdc_resolve(const char *path);
+#endif
@@ -6,14 +6,441 @@
 #include <string.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <time.h>
 
 #include <ofc/file.h>
+#include <ofc/lock.h>
+#include <ofc/thread.h>
+#include <ofc/time.h>
 
 #include "smbinit.h"
+#include "smbpool.h"
 
 /**
  * \{
  */
+
+/*
+ * Default interval between polls in monitor mode (seconds)
+ */
+#define MONITOR_INTERVAL 60
+/*
+ * Maximum number of servers queried concurrently
+ */
+#define MONITOR_THREADS 16
+
+typedef enum {
+  MONITOR_FORMAT_PROMETHEUS,    /* Prometheus text exposition format */
+  MONITOR_FORMAT_NDJSON         /* One JSON object per share per poll */
+} MONITOR_FORMAT;
+
+/*
+ * A monitored share.
+ *
+ * The stack tears down connections once they go idle.  We keep a handle
+ * open on the share for the life of the monitor so that the session and
+ * tree connect are set up once and reused by every poll.
+ */
+struct monitor_share {
+  char *name;                   /* Share as given on the command line */
+  char *label;                  /* Share with any credentials removed */
+  OFC_TCHAR *wname;             /* Wide share name */
+  OFC_HANDLE pin;               /* Handle keeping the session alive */
+  OFC_BOOL up;                  /* Last query succeeded */
+  OFC_DWORD last_error;         /* Error of last query */
+  OFC_UINT64 total;             /* Capacity in bytes */
+  OFC_UINT64 avail;             /* Free bytes */
+  OFC_MSTIME latency;           /* Query time in ms */
+};
+
+/*
+ * Shares are grouped by server.  Servers are polled concurrently and the
+ * shares on one server, which share a session, are polled in turn.
+ */
+struct monitor_server {
+  char *server;                 /* Server name */
+  OFC_INT num_shares;           /* Number of shares on the server */
+  struct monitor_share **shares;
+};
+
+/*
+ * Remote names may be written //server/share or \\server\share
+ */
+static OFC_BOOL monitor_separator(char c)
+{
+  return (c == '/' || c == '\\');
+}
+
+static const char *monitor_remote(const char *name)
+{
+  if (monitor_separator(name[0]) && monitor_separator(name[1]))
+    return (name + 2);
+  return (OFC_NULL);
+}
+
+static const char *monitor_next_separator(const char *name)
+{
+  for (; *name != '\0' && !monitor_separator(*name); name++);
+  return (name);
+}
+
+/*
+ * Strip the credentials from a remote name.  //user:pass@server/share
+ * becomes //server/share and likewise for \\user:pass@server\share.
+ * The result must be freed.
+ */
+static char *monitor_label(const char *name)
+{
+  const char *remote;
+  const char *cursor;
+  const char *at;
+  const char *slash;
+  char *label;
+
+  remote = monitor_remote(name);
+  if (remote != OFC_NULL)
+    {
+      /*
+       * The user may be user@domain so the server follows the last @
+       */
+      slash = monitor_next_separator(remote);
+      at = NULL;
+      for (cursor = remote; cursor < slash; cursor++)
+        if (*cursor == '@')
+          at = cursor;
+      if (at != NULL)
+        {
+          label = malloc(strlen(at + 1) + 3);
+          memcpy(label, name, 2);
+          strcpy(label + 2, at + 1);
+          return (label);
+        }
+    }
+  return (strdup(name));
+}
+
+static char *monitor_server_name(const char *label)
+{
+  const char *start;
+  const char *end;
+  char *server;
+
+  start = monitor_remote(label);
+  if (start == OFC_NULL)
+    start = label;
+  end = monitor_next_separator(start);
+  server = malloc(end - start + 1);
+  memcpy(server, start, end - start);
+  server[end - start] = '\0';
+  return (server);
+}
+
+/*
+ * Print a string as the body of a JSON string
+ */
+static OFC_VOID monitor_json_string(FILE *out, const char *str)
+{
+  for (; *str != '\0'; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        fprintf(out, "\\%c", *str);
+      else if ((unsigned char) *str < 0x20)
+        fprintf(out, "\\u%04x", (unsigned char) *str);
+      else
+        fputc(*str, out);
+    }
+}
+
+/*
+ * Print a string as a Prometheus label value
+ */
+static OFC_VOID monitor_prom_label(FILE *out, const char *str)
+{
+  for (; *str != '\0'; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        fprintf(out, "\\%c", *str);
+      else if (*str == '\n')
+        fputs("\\n", out);
+      else
+        fputc(*str, out);
+    }
+}
+
+static OFC_VOID monitor_query(struct monitor_share *share)
+{
+  OFC_DWORD SectorsPerCluster;
+  OFC_DWORD BytesPerSector;
+  OFC_DWORD NumberOfFreeClusters;
+  OFC_DWORD TotalNumberOfClusters;
+  OFC_MSTIME start;
+
+  if (share->pin == OFC_HANDLE_NULL)
+    {
+      share->pin = OfcCreateFile(share->wname,
+                                 OFC_FILE_READ_ATTRIBUTES,
+                                 OFC_FILE_SHARE_READ | OFC_FILE_SHARE_WRITE |
+                                 OFC_FILE_SHARE_DELETE,
+                                 OFC_NULL,
+                                 OFC_OPEN_EXISTING,
+                                 OFC_FILE_ATTRIBUTE_DIRECTORY,
+                                 OFC_HANDLE_NULL);
+      if (share->pin == OFC_INVALID_HANDLE_VALUE)
+        share->pin = OFC_HANDLE_NULL;
+    }
+
+  start = ofc_time_get_now();
+  share->up = OfcGetDiskFreeSpace(share->wname,
+                                  &SectorsPerCluster,
+                                  &BytesPerSector,
+                                  &NumberOfFreeClusters,
+                                  &TotalNumberOfClusters);
+  share->latency = ofc_time_get_now() - start;
+
+  if (share->up)
+    {
+      share->last_error = OFC_ERROR_SUCCESS;
+      share->total = (OFC_UINT64) TotalNumberOfClusters *
+        SectorsPerCluster * BytesPerSector;
+      share->avail = (OFC_UINT64) NumberOfFreeClusters *
+        SectorsPerCluster * BytesPerSector;
+    }
+  else
+    {
+      share->last_error = OfcGetLastError();
+      /*
+       * The session may have gone.  Reconnect on the next poll.
+       */
+      if (share->pin != OFC_HANDLE_NULL)
+        {
+          OfcCloseHandle(share->pin);
+          share->pin = OFC_HANDLE_NULL;
+        }
+    }
+}
+
+static OFC_VOID monitor_work(struct smbpool *pool, OFC_VOID *item,
+                             OFC_VOID *context)
+{
+  struct monitor_server *server = item;
+  OFC_INT i;
+
+  for (i = 0; i < server->num_shares; i++)
+    monitor_query(server->shares[i]);
+}
+
+static OFC_VOID monitor_print(FILE *out, MONITOR_FORMAT format,
+                              struct monitor_share *shares,
+                              OFC_INT num_shares, time_t now)
+{
+  static const struct {
+    const char *name;
+    const char *help;
+  } metrics[] = {
+    { "smbfree_up", "Whether the last free space query succeeded" },
+    { "smbfree_capacity_bytes", "Capacity of the share in bytes" },
+    { "smbfree_free_bytes", "Free space on the share in bytes" },
+    { "smbfree_used_bytes", "Used space on the share in bytes" },
+    { "smbfree_query_seconds", "Time taken by the free space query" },
+  };
+  struct monitor_share *share;
+  OFC_INT i;
+  OFC_INT m;
+
+  if (format == MONITOR_FORMAT_NDJSON)
+    {
+      for (i = 0; i < num_shares; i++)
+        {
+          share = &shares[i];
+          fprintf(out, "{\"time\":%ld,\"share\":\"", (long) now);
+          monitor_json_string(out, share->label);
+          fprintf(out, "\",\"up\":%s", share->up ? "true" : "false");
+          if (share->up)
+            fprintf(out, ",\"capacity_bytes\":%llu,\"free_bytes\":%llu,"
+                    "\"used_bytes\":%llu",
+                    (unsigned long long) share->total,
+                    (unsigned long long) share->avail,
+                    (unsigned long long) (share->total - share->avail));
+          else
+            {
+              fprintf(out, ",\"error\":\"");
+              monitor_json_string(out,
+                                  ofc_get_error_string(share->last_error));
+              fprintf(out, "\"");
+            }
+          fprintf(out, ",\"query_ms\":%ld}\n", (long) share->latency);
+        }
+    }
+  else
+    {
+      for (m = 0; m < (OFC_INT) (sizeof(metrics) / sizeof(metrics[0])); m++)
+        {
+          fprintf(out, "# HELP %s %s\n", metrics[m].name, metrics[m].help);
+          fprintf(out, "# TYPE %s gauge\n", metrics[m].name);
+          for (i = 0; i < num_shares; i++)
+            {
+              share = &shares[i];
+              if (m != 0 && m != 4 && !share->up)
+                continue;
+              fprintf(out, "%s{share=\"", metrics[m].name);
+              monitor_prom_label(out, share->label);
+              fprintf(out, "\"} ");
+              if (m == 0)
+                fprintf(out, "%d\n", share->up ? 1 : 0);
+              else if (m == 4)
+                fprintf(out, "%.3f\n", share->latency / 1000.0);
+              else
+                fprintf(out, "%llu\n",
+                        (unsigned long long)
+                        (m == 1 ? share->total :
+                         m == 2 ? share->avail :
+                         share->total - share->avail));
+            }
+        }
+    }
+  fflush(out);
+}
+
+/*
+ * Write the poll to a file.  The output is written to a temporary file
+ * and renamed into place so that a collector (for example the node
+ * exporter textfile collector) never sees a partial poll.
+ */
+static OFC_VOID monitor_write(const char *path, MONITOR_FORMAT format,
+                              struct monitor_share *shares,
+                              OFC_INT num_shares, time_t now)
+{
+  FILE *out;
+  char *tmppath;
+
+  tmppath = malloc(strlen(path) + 5);
+  strcpy(tmppath, path);
+  strcat(tmppath, ".tmp");
+  out = fopen(tmppath, "w");
+  if (out == NULL)
+    fprintf(stderr, "Cannot write %s\n", tmppath);
+  else
+    {
+      monitor_print(out, format, shares, num_shares, now);
+      fclose(out);
+      if (rename(tmppath, path) != 0)
+        fprintf(stderr, "Cannot rename %s to %s\n", tmppath, path);
+    }
+  free(tmppath);
+}
+
+static int monitor(char **names, OFC_INT num_shares, MONITOR_FORMAT format,
+                   OFC_INT interval, OFC_INT count, const char *path)
+{
+  struct monitor_share *shares;
+  struct monitor_server *servers;
+  struct monitor_server *server;
+  struct smbpool *pool;
+  OFC_INT num_servers;
+  OFC_INT i;
+  OFC_INT j;
+  OFC_INT poll;
+  OFC_MSTIME next;
+  OFC_MSTIME now;
+  char *server_name;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
+  int ret;
+
+  shares = malloc(sizeof(struct monitor_share) * num_shares);
+  servers = malloc(sizeof(struct monitor_server) * num_shares);
+  num_servers = 0;
+
+  for (i = 0; i < num_shares; i++)
+    {
+      memset(&shares[i], 0, sizeof(struct monitor_share));
+      shares[i].name = names[i];
+      shares[i].label = monitor_label(names[i]);
+      shares[i].pin = OFC_HANDLE_NULL;
+
+      memset(&ps, 0, sizeof(ps));
+      len = strlen(names[i]) + 1;
+      shares[i].wname = malloc(sizeof(wchar_t) * len);
+      cursor = names[i];
+      mbsrtowcs(shares[i].wname, &cursor, len, &ps);
+
+      server_name = monitor_server_name(shares[i].label);
+      for (j = 0; j < num_servers &&
+             strcmp(servers[j].server, server_name) != 0; j++);
+      if (j == num_servers)
+        {
+          servers[j].server = server_name;
+          servers[j].num_shares = 0;
+          servers[j].shares = malloc(sizeof(struct monitor_share *) *
+                                     num_shares);
+          num_servers++;
+        }
+      else
+        free(server_name);
+      server = &servers[j];
+      server->shares[server->num_shares++] = &shares[i];
+    }
+
+  pool = smbpool_create(num_servers < MONITOR_THREADS ?
+                        num_servers : MONITOR_THREADS,
+                        &monitor_work, OFC_NULL);
+  if (pool == OFC_NULL)
+    {
+      printf("Cannot start the monitor: %s\n",
+             ofc_get_error_string(OFC_ERROR_NOT_ENOUGH_MEMORY));
+      ret = 1;
+    }
+  else
+    {
+      next = ofc_time_get_now();
+      for (poll = 0; count == 0 || poll < count; poll++)
+        {
+          for (j = 0; j < num_servers; j++)
+            smbpool_submit(pool, &servers[j]);
+          smbpool_wait(pool);
+
+          if (path != NULL)
+            monitor_write(path, format, shares, num_shares, time(NULL));
+          else
+            monitor_print(stdout, format, shares, num_shares, time(NULL));
+
+          /*
+           * Polls are scheduled on a fixed period so a slow poll doesn't
+           * push the following ones back
+           */
+          next += interval * 1000;
+          now = ofc_time_get_now();
+          if (count == 0 || poll + 1 < count)
+            {
+              if (next > now)
+                ofc_sleep(next - now);
+              else
+                next = now;
+            }
+        }
+
+      smbpool_destroy(pool);
+      ret = 0;
+    }
+
+  for (i = 0; i < num_shares; i++)
+    {
+      if (shares[i].pin != OFC_HANDLE_NULL)
+        OfcCloseHandle(shares[i].pin);
+      free(shares[i].wname);
+      free(shares[i].label);
+    }
+  for (j = 0; j < num_servers; j++)
+    {
+      free(servers[j].shares);
+      free(servers[j].server);
+    }
+  free(servers);
+  free(shares);
+  return (ret);
+}
+
 int main (int argc, char **argv)
 {
   OFC_TCHAR *sharename;
@@ -32,21 +459,65 @@ int main (int argc, char **argv)
   long int avail;
   long int total;
 
+  int monitor_mode = 0;
+  MONITOR_FORMAT format = MONITOR_FORMAT_PROMETHEUS;
+  int interval = MONITOR_INTERVAL;
+  int count = 0;
+  const char *path = NULL;
+  int argidx;
+
   smbcp_init();
-  
-  if (argc < 2)
+
+  argidx = 1;
+  while (argidx < argc && argv[argidx][0] == '-')
+    {
+      if (strcmp(argv[argidx], "-m") == 0)
+        monitor_mode = 1;
+      else if (strcmp(argv[argidx], "-i") == 0 && argidx + 1 < argc)
+        interval = atoi(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-n") == 0 && argidx + 1 < argc)
+        count = atoi(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-o") == 0 && argidx + 1 < argc)
+        path = argv[++argidx];
+      else if (strcmp(argv[argidx], "-f") == 0 && argidx + 1 < argc)
+        {
+          argidx++;
+          if (strcmp(argv[argidx], "ndjson") == 0)
+            format = MONITOR_FORMAT_NDJSON;
+          else if (strcmp(argv[argidx], "prom") == 0)
+            format = MONITOR_FORMAT_PROMETHEUS;
+          else
+            break;
+        }
+      else
+        break;
+      argidx++;
+    }
+
+  if (argidx >= argc || interval < 1 || count < 0 ||
+      (!monitor_mode && argidx + 1 != argc))
     {
       printf ("Usage: smbfree <destination>\n");
+      printf ("       smbfree -m [-i <seconds>] [-n <polls>] "
+              "[-f prom | ndjson] [-o <file>] <share>...\n");
       exit (1);
     }
 
+  if (monitor_mode)
+    {
+      ret = monitor(&argv[argidx], argc - argidx, format, interval,
+                    count, path);
+      smbcp_deactivate_at_exit();
+      return (ret);
+    }
+
   memset(&ps, 0, sizeof(ps));
-  len = strlen(argv[1]) + 1;
+  len = strlen(argv[argidx]) + 1;
   sharename = malloc(sizeof(wchar_t) * len);
-  cursor = argv[1];
+  cursor = argv[argidx];
   mbsrtowcs(sharename, &cursor, len, &ps);
 
-  printf("Finding Free Space on %s: ", argv[1]);
+  printf("Finding Free Space on %s: ", argv[argidx]);
   fflush(stdout);
 
   result = OfcGetDiskFreeSpace(sharename,
@@ -93,7 +564,7 @@ int main (int argc, char **argv)
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   return (ret);
 }
@@ -0,0 +1,983 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <unistd.h>
+
+#include <ofc/config.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/file.h>
+#include <of_smb/framework.h>
+
+#include "smbinit.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Persistent Metadata Index
+ *
+ * smbindex keeps the metadata of a remote tree (names, sizes, times and
+ * attributes) in a compact local file.  A refresh re-enumerates only those
+ * directories whose last write time has changed since the previous refresh.
+ * Directories whose last write time is unchanged are revalidated with a
+ * single attribute query and their children are carried over from the
+ * index.
+ *
+ * NOTE: A directory's last write time changes when entries are added,
+ * removed or renamed within it.  Servers do not, in general, update it when
+ * the contents of an existing file change.  Use -f to force a full walk
+ * when in place modifications must be detected.
+ *
+ * Each entry records the generation (refresh number) in which it last
+ * changed and what the change was.  Entries removed from the remote are
+ * kept as tombstones until the following refresh so that the changes query
+ * can report them.
+ *
+ * The index file is laid out as a header followed by the tree in preorder:
+ *
+ *   Header:  magic[8], version(u32), generation(u32),
+ *            root length(u16), root (UTF-8)
+ *   Entry:   attributes(u32), size(u64), create(u32,u32), access(u32,u32),
+ *            write(u32,u32), generation(u32), change(u8),
+ *            child count(u32), name length(u16), name (UTF-8)
+ *
+ * Integers are stored in host byte order.  The index is a local cache and
+ * is not meant to be moved between machines.
+ */
+#define INDEX_MAGIC "SMBIDX\0\0"
+#define INDEX_VERSION 1
+
+typedef enum {
+  INDEX_CHANGE_NONE,        /* Entry is unchanged */
+  INDEX_CHANGE_ADDED,       /* Entry was added */
+  INDEX_CHANGE_MODIFIED,    /* Entry metadata changed */
+  INDEX_CHANGE_REMOVED      /* Entry was removed (tombstone) */
+} INDEX_CHANGE;
+
+struct index_entry {
+  OFC_TCHAR *name;                   /* Name of entry (root has full path) */
+  OFC_DWORD attributes;              /* File attributes */
+  OFC_UINT64 size;                   /* End of file */
+  OFC_FILETIME create_time;          /* Create time */
+  OFC_FILETIME access_time;          /* Last access time */
+  OFC_FILETIME write_time;           /* Last write time */
+  OFC_UINT32 generation;             /* Generation of last change */
+  INDEX_CHANGE change;               /* Last change */
+  OFC_UINT32 num_children;           /* Number of children */
+  OFC_UINT32 max_children;           /* Allocated size of children */
+  struct index_entry **children;     /* Children sorted by name */
+};
+
+struct index {
+  OFC_UINT32 generation;             /* Current generation */
+  OFC_BOOL full;                     /* Force full enumeration */
+  OFC_UINT32 enumerated;             /* Directories enumerated */
+  OFC_UINT32 revalidated;            /* Directories revalidated */
+  OFC_UINT32 errors;                 /* Directories that failed */
+  struct index_entry *root;          /* Root of tree */
+};
+
+static wchar_t *MakeFilename(const wchar_t *dirname, const wchar_t *name)
+{
+  size_t dirlen;
+  size_t namelen;
+  wchar_t *filename;
+
+  dirlen = wcslen (dirname);
+  namelen = wcslen (name);
+  filename =
+    malloc((dirlen + namelen + 2) * sizeof(wchar_t));
+  wcscpy (filename, dirname);
+  filename[dirlen] = L'/';
+  wcscpy (&filename[dirlen+1], name);
+  filename[dirlen + 1 + namelen] = L'\0';
+  return (filename);
+}
+
+static OFC_BOOL filetime_equal(const OFC_FILETIME *a, const OFC_FILETIME *b)
+{
+  return (a->dwLowDateTime == b->dwLowDateTime &&
+          a->dwHighDateTime == b->dwHighDateTime);
+}
+
+static OFC_BOOL is_directory(const struct index_entry *entry)
+{
+  return ((entry->attributes & OFC_FILE_ATTRIBUTE_DIRECTORY) != 0);
+}
+
+static struct index_entry *alloc_entry(OFC_CTCHAR *name)
+{
+  struct index_entry *entry;
+
+  entry = malloc(sizeof(struct index_entry));
+  if (entry != OFC_NULL)
+    {
+      memset(entry, 0, sizeof(struct index_entry));
+      entry->name = malloc((wcslen(name) + 1) * sizeof(OFC_TCHAR));
+      if (entry->name == OFC_NULL)
+        {
+          free(entry);
+          entry = OFC_NULL;
+        }
+      else
+        wcscpy(entry->name, name);
+    }
+  return (entry);
+}
+
+static OFC_VOID free_entry(struct index_entry *entry)
+{
+  OFC_UINT32 i;
+
+  if (entry != OFC_NULL)
+    {
+      for (i = 0; i < entry->num_children; i++)
+        free_entry(entry->children[i]);
+      free(entry->children);
+      free(entry->name);
+      free(entry);
+    }
+}
+
+static OFC_BOOL add_child(struct index_entry *parent,
+                          struct index_entry *child)
+{
+  struct index_entry **children;
+  OFC_UINT32 max_children;
+  OFC_BOOL ret;
+
+  ret = OFC_TRUE;
+  if (parent->num_children == parent->max_children)
+    {
+      max_children = parent->max_children == 0 ? 16 :
+        parent->max_children * 2;
+      children = realloc(parent->children,
+                         max_children * sizeof(struct index_entry *));
+      if (children == OFC_NULL)
+        ret = OFC_FALSE;
+      else
+        {
+          parent->children = children;
+          parent->max_children = max_children;
+        }
+    }
+
+  if (ret == OFC_TRUE)
+    parent->children[parent->num_children++] = child;
+
+  return (ret);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  const struct index_entry *entry_a = *(const struct index_entry **) a;
+  const struct index_entry *entry_b = *(const struct index_entry **) b;
+
+  return (wcscmp(entry_a->name, entry_b->name));
+}
+
+static struct index_entry *find_child(struct index_entry *parent,
+                                      OFC_CTCHAR *name)
+{
+  OFC_INT low;
+  OFC_INT high;
+  OFC_INT mid;
+  OFC_INT cmp;
+  struct index_entry *found;
+
+  found = OFC_NULL;
+  if (parent != OFC_NULL)
+    {
+      low = 0;
+      high = (OFC_INT) parent->num_children - 1;
+      while (low <= high && found == OFC_NULL)
+        {
+          mid = (low + high) / 2;
+          cmp = wcscmp(name, parent->children[mid]->name);
+          if (cmp == 0)
+            found = parent->children[mid];
+          else if (cmp < 0)
+            high = mid - 1;
+          else
+            low = mid + 1;
+        }
+    }
+  return (found);
+}
+
+/*
+ * UTF-8 conversion of entry names.  We don't depend on the locale so that
+ * the index can always represent any name the server returns.
+ */
+static size_t utf8_encode(OFC_CTCHAR *name, OFC_CHAR *out, size_t outlen)
+{
+  size_t len;
+  OFC_UINT32 c;
+
+  len = 0;
+  for (; *name != L'\0'; name++)
+    {
+      c = (OFC_UINT32) *name;
+      if (c < 0x80 && len + 1 <= outlen)
+        out[len++] = (OFC_CHAR) c;
+      else if (c < 0x800 && len + 2 <= outlen)
+        {
+          out[len++] = (OFC_CHAR) (0xc0 | (c >> 6));
+          out[len++] = (OFC_CHAR) (0x80 | (c & 0x3f));
+        }
+      else if (c < 0x10000 && len + 3 <= outlen)
+        {
+          out[len++] = (OFC_CHAR) (0xe0 | (c >> 12));
+          out[len++] = (OFC_CHAR) (0x80 | ((c >> 6) & 0x3f));
+          out[len++] = (OFC_CHAR) (0x80 | (c & 0x3f));
+        }
+      else if (c >= 0x10000 && len + 4 <= outlen)
+        {
+          out[len++] = (OFC_CHAR) (0xf0 | (c >> 18));
+          out[len++] = (OFC_CHAR) (0x80 | ((c >> 12) & 0x3f));
+          out[len++] = (OFC_CHAR) (0x80 | ((c >> 6) & 0x3f));
+          out[len++] = (OFC_CHAR) (0x80 | (c & 0x3f));
+        }
+    }
+  return (len);
+}
+
+static OFC_TCHAR *utf8_decode(const OFC_UCHAR *in, size_t inlen)
+{
+  OFC_TCHAR *name;
+  size_t i;
+  size_t len;
+  OFC_UINT32 c;
+
+  name = malloc((inlen + 1) * sizeof(OFC_TCHAR));
+  if (name != OFC_NULL)
+    {
+      len = 0;
+      for (i = 0; i < inlen; )
+        {
+          c = in[i++];
+          if (c >= 0xf0 && i + 3 <= inlen)
+            {
+              c = ((c & 0x07) << 18) | ((in[i] & 0x3f) << 12) |
+                ((in[i+1] & 0x3f) << 6) | (in[i+2] & 0x3f);
+              i += 3;
+            }
+          else if (c >= 0xe0 && i + 2 <= inlen)
+            {
+              c = ((c & 0x0f) << 12) | ((in[i] & 0x3f) << 6) |
+                (in[i+1] & 0x3f);
+              i += 2;
+            }
+          else if (c >= 0xc0 && i + 1 <= inlen)
+            {
+              c = ((c & 0x1f) << 6) | (in[i] & 0x3f);
+              i += 1;
+            }
+          name[len++] = (OFC_TCHAR) c;
+        }
+      name[len] = L'\0';
+    }
+  return (name);
+}
+
+/*
+ * Index file I/O
+ */
+static OFC_BOOL write_name(FILE *fp, OFC_CTCHAR *name)
+{
+  OFC_CHAR *utf8;
+  size_t utf8len;
+  OFC_UINT16 len;
+  OFC_BOOL ret;
+
+  ret = OFC_FALSE;
+  utf8len = wcslen(name) * 4;
+  utf8 = malloc(utf8len + 1);
+  if (utf8 != OFC_NULL)
+    {
+      utf8len = utf8_encode(name, utf8, utf8len);
+      len = (OFC_UINT16) utf8len;
+      if (fwrite(&len, sizeof(len), 1, fp) == 1 &&
+          fwrite(utf8, 1, len, fp) == len)
+        ret = OFC_TRUE;
+      free(utf8);
+    }
+  return (ret);
+}
+
+static OFC_TCHAR *read_name(FILE *fp)
+{
+  OFC_UCHAR *utf8;
+  OFC_UINT16 len;
+  OFC_TCHAR *name;
+
+  name = OFC_NULL;
+  if (fread(&len, sizeof(len), 1, fp) == 1)
+    {
+      utf8 = malloc(len + 1);
+      if (utf8 != OFC_NULL)
+        {
+          if (fread(utf8, 1, len, fp) == len)
+            name = utf8_decode(utf8, len);
+          free(utf8);
+        }
+    }
+  return (name);
+}
+
+static OFC_BOOL write_entry(FILE *fp, struct index_entry *entry)
+{
+  OFC_UINT32 times[6];
+  OFC_UINT8 change;
+  OFC_UINT32 i;
+  OFC_BOOL ret;
+
+  times[0] = entry->create_time.dwLowDateTime;
+  times[1] = entry->create_time.dwHighDateTime;
+  times[2] = entry->access_time.dwLowDateTime;
+  times[3] = entry->access_time.dwHighDateTime;
+  times[4] = entry->write_time.dwLowDateTime;
+  times[5] = entry->write_time.dwHighDateTime;
+  change = (OFC_UINT8) entry->change;
+
+  ret = (fwrite(&entry->attributes, sizeof(OFC_UINT32), 1, fp) == 1 &&
+         fwrite(&entry->size, sizeof(OFC_UINT64), 1, fp) == 1 &&
+         fwrite(times, sizeof(times), 1, fp) == 1 &&
+         fwrite(&entry->generation, sizeof(OFC_UINT32), 1, fp) == 1 &&
+         fwrite(&change, sizeof(change), 1, fp) == 1 &&
+         fwrite(&entry->num_children, sizeof(OFC_UINT32), 1, fp) == 1 &&
+         write_name(fp, entry->name));
+
+  for (i = 0; i < entry->num_children && ret == OFC_TRUE; i++)
+    ret = write_entry(fp, entry->children[i]);
+
+  return (ret);
+}
+
+static struct index_entry *read_entry(FILE *fp)
+{
+  struct index_entry *entry;
+  struct index_entry *child;
+  OFC_UINT32 times[6];
+  OFC_UINT8 change;
+  OFC_UINT32 num_children;
+  OFC_UINT32 i;
+  OFC_BOOL ret;
+
+  entry = malloc(sizeof(struct index_entry));
+  if (entry != OFC_NULL)
+    {
+      memset(entry, 0, sizeof(struct index_entry));
+      ret = (fread(&entry->attributes, sizeof(OFC_UINT32), 1, fp) == 1 &&
+             fread(&entry->size, sizeof(OFC_UINT64), 1, fp) == 1 &&
+             fread(times, sizeof(times), 1, fp) == 1 &&
+             fread(&entry->generation, sizeof(OFC_UINT32), 1, fp) == 1 &&
+             fread(&change, sizeof(change), 1, fp) == 1 &&
+             fread(&num_children, sizeof(OFC_UINT32), 1, fp) == 1);
+      if (ret == OFC_TRUE)
+        {
+          entry->create_time.dwLowDateTime = times[0];
+          entry->create_time.dwHighDateTime = times[1];
+          entry->access_time.dwLowDateTime = times[2];
+          entry->access_time.dwHighDateTime = times[3];
+          entry->write_time.dwLowDateTime = times[4];
+          entry->write_time.dwHighDateTime = times[5];
+          entry->change = (INDEX_CHANGE) change;
+          entry->name = read_name(fp);
+          if (entry->name == OFC_NULL)
+            ret = OFC_FALSE;
+        }
+
+      for (i = 0; i < num_children && ret == OFC_TRUE; i++)
+        {
+          child = read_entry(fp);
+          if (child == OFC_NULL)
+            ret = OFC_FALSE;
+          else if (add_child(entry, child) == OFC_FALSE)
+            {
+              free_entry(child);
+              ret = OFC_FALSE;
+            }
+        }
+
+      if (ret == OFC_FALSE)
+        {
+          free_entry(entry);
+          entry = OFC_NULL;
+        }
+    }
+  return (entry);
+}
+
+static struct index *load_index(const char *path)
+{
+  FILE *fp;
+  struct index *index;
+  OFC_CHAR magic[8];
+  OFC_UINT32 version;
+
+  index = OFC_NULL;
+  fp = fopen(path, "rb");
+  if (fp != OFC_NULL)
+    {
+      index = malloc(sizeof(struct index));
+      if (index != OFC_NULL)
+        {
+          memset(index, 0, sizeof(struct index));
+          if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+              memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+              fread(&version, sizeof(version), 1, fp) != 1 ||
+              version != INDEX_VERSION ||
+              fread(&index->generation, sizeof(OFC_UINT32), 1, fp) != 1 ||
+              (index->root = read_entry(fp)) == OFC_NULL)
+            {
+              printf("Index %s is not valid\n", path);
+              free(index);
+              index = OFC_NULL;
+            }
+        }
+      fclose(fp);
+    }
+  return (index);
+}
+
+static OFC_BOOL save_index(const char *path, struct index *index)
+{
+  FILE *fp;
+  char *tmppath;
+  OFC_UINT32 version;
+  OFC_BOOL ret;
+
+  ret = OFC_FALSE;
+  /*
+   * Write to a temporary file and rename it into place so that an
+   * interrupted refresh never leaves a truncated index behind
+   */
+  tmppath = malloc(strlen(path) + 5);
+  if (tmppath != OFC_NULL)
+    {
+      strcpy(tmppath, path);
+      strcat(tmppath, ".tmp");
+      fp = fopen(tmppath, "wb");
+      if (fp != OFC_NULL)
+        {
+          version = INDEX_VERSION;
+          ret = (fwrite(INDEX_MAGIC, 8, 1, fp) == 1 &&
+                 fwrite(&version, sizeof(version), 1, fp) == 1 &&
+                 fwrite(&index->generation, sizeof(OFC_UINT32), 1, fp) == 1 &&
+                 write_entry(fp, index->root));
+          if (fclose(fp) != 0)
+            ret = OFC_FALSE;
+          if (ret == OFC_TRUE && rename(tmppath, path) != 0)
+            ret = OFC_FALSE;
+          if (ret == OFC_FALSE)
+            unlink(tmppath);
+        }
+      free(tmppath);
+    }
+  return (ret);
+}
+
+static OFC_VOID free_index(struct index *index)
+{
+  if (index != OFC_NULL)
+    {
+      free_entry(index->root);
+      free(index);
+    }
+}
+
+/*
+ * Refresh
+ */
+
+/*
+ * Carry the change state of an entry forward from the previous index
+ *
+ * \param index
+ * The index being refreshed
+ *
+ * \param entry
+ * The entry with fresh metadata
+ *
+ * \param old
+ * The matching entry from the previous index or OFC_NULL
+ */
+static OFC_VOID update_change(struct index *index,
+                              struct index_entry *entry,
+                              struct index_entry *old)
+{
+  if (old == OFC_NULL || old->change == INDEX_CHANGE_REMOVED)
+    {
+      entry->change = INDEX_CHANGE_ADDED;
+      entry->generation = index->generation;
+    }
+  else if (old->attributes != entry->attributes ||
+           (!is_directory(entry) && old->size != entry->size) ||
+           !filetime_equal(&old->write_time, &entry->write_time))
+    {
+      entry->change = INDEX_CHANGE_MODIFIED;
+      entry->generation = index->generation;
+    }
+  else
+    {
+      entry->change = old->change;
+      entry->generation = old->generation;
+    }
+}
+
+static struct index_entry *entry_from_find_data(OFC_WIN32_FIND_DATA *find_data)
+{
+  struct index_entry *entry;
+
+  entry = alloc_entry(find_data->cFileName);
+  if (entry != OFC_NULL)
+    {
+      entry->attributes = find_data->dwFileAttributes;
+      OFC_LARGE_INTEGER_SET(entry->size, find_data->nFileSizeLow,
+                            find_data->nFileSizeHigh);
+      entry->create_time = find_data->ftCreateTime;
+      entry->access_time = find_data->ftLastAccessTime;
+      entry->write_time = find_data->ftLastWriteTime;
+    }
+  return (entry);
+}
+
+static OFC_DWORD stat_entry(OFC_CTCHAR *path, struct index_entry *entry)
+{
+  OFC_WIN32_FILE_ATTRIBUTE_DATA info;
+  OFC_DWORD last_error;
+
+  last_error = OFC_ERROR_SUCCESS;
+  if (OfcGetFileAttributesEx(path, OfcGetFileExInfoStandard, &info) !=
+      OFC_TRUE)
+    last_error = OfcGetLastError();
+  else
+    {
+      entry->attributes = info.dwFileAttributes;
+      OFC_LARGE_INTEGER_SET(entry->size, info.nFileSizeLow,
+                            info.nFileSizeHigh);
+      entry->create_time = info.ftCreationTime;
+      entry->access_time = info.ftLastAccessTime;
+      entry->write_time = info.ftLastWriteTime;
+    }
+  return (last_error);
+}
+
+static OFC_VOID refresh_dir(struct index *index, OFC_CTCHAR *dirname,
+                            struct index_entry *dir, struct index_entry *old);
+
+static OFC_DWORD enumerate_dir(struct index *index, OFC_CTCHAR *dirname,
+                               struct index_entry *dir,
+                               struct index_entry *old)
+{
+  OFC_HANDLE list_handle;
+  OFC_WIN32_FIND_DATA find_data;
+  OFC_BOOL more = OFC_FALSE;
+  OFC_BOOL status;
+  OFC_TCHAR *filename;
+  OFC_DWORD last_error;
+  struct index_entry *entry;
+  struct index_entry *tombstone;
+  OFC_UINT32 i;
+
+  last_error = OFC_ERROR_SUCCESS;
+  filename = MakeFilename(dirname, TSTR("*"));
+  list_handle = OfcFindFirstFile(filename, &find_data, &more);
+  free(filename);
+
+  if (list_handle == OFC_INVALID_HANDLE_VALUE)
+    last_error = OfcGetLastError();
+  else
+    {
+      index->enumerated++;
+      status = OFC_TRUE;
+      while (status == OFC_TRUE)
+        {
+          if (wcscmp(find_data.cFileName, L".") != 0 &&
+              wcscmp(find_data.cFileName, L"..") != 0)
+            {
+              entry = entry_from_find_data(&find_data);
+              if (entry == OFC_NULL)
+                last_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+              else if (add_child(dir, entry) == OFC_FALSE)
+                {
+                  free_entry(entry);
+                  last_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+                }
+            }
+
+          if (!more || last_error != OFC_ERROR_SUCCESS)
+            status = OFC_FALSE;
+          else
+            {
+              status = OfcFindNextFile(list_handle, &find_data, &more);
+              if (status == OFC_FALSE &&
+                  OfcGetLastError() != OFC_ERROR_NO_MORE_FILES)
+                last_error = OfcGetLastError();
+            }
+        }
+      OfcFindClose(list_handle);
+    }
+
+  if (last_error == OFC_ERROR_SUCCESS)
+    {
+      qsort(dir->children, dir->num_children, sizeof(struct index_entry *),
+            compare_entries);
+      /*
+       * Compare against the previous listing and descend
+       */
+      for (i = 0; i < dir->num_children; i++)
+        {
+          entry = dir->children[i];
+          update_change(index, entry, find_child(old, entry->name));
+          if (is_directory(entry))
+            {
+              filename = MakeFilename(dirname, entry->name);
+              refresh_dir(index, filename, entry,
+                          find_child(old, entry->name));
+              free(filename);
+            }
+        }
+      /*
+       * Anything in the previous listing we didn't see has been removed.
+       * Leave a tombstone (without descendants) for the changes query.
+       */
+      for (i = 0; old != OFC_NULL && i < old->num_children; i++)
+        {
+          if (old->children[i]->change != INDEX_CHANGE_REMOVED &&
+              find_child(dir, old->children[i]->name) == OFC_NULL)
+            {
+              tombstone = alloc_entry(old->children[i]->name);
+              if (tombstone != OFC_NULL)
+                {
+                  tombstone->attributes = old->children[i]->attributes;
+                  tombstone->size = old->children[i]->size;
+                  tombstone->create_time = old->children[i]->create_time;
+                  tombstone->access_time = old->children[i]->access_time;
+                  tombstone->write_time = old->children[i]->write_time;
+                  tombstone->change = INDEX_CHANGE_REMOVED;
+                  tombstone->generation = index->generation;
+                  if (add_child(dir, tombstone) == OFC_FALSE)
+                    free_entry(tombstone);
+                }
+            }
+        }
+      qsort(dir->children, dir->num_children, sizeof(struct index_entry *),
+            compare_entries);
+    }
+  return (last_error);
+}
+
+static OFC_VOID revalidate_dir(struct index *index, OFC_CTCHAR *dirname,
+                               struct index_entry *dir,
+                               struct index_entry *old)
+{
+  struct index_entry *entry;
+  struct index_entry *child;
+  OFC_TCHAR *filename;
+  OFC_UINT32 i;
+
+  index->revalidated++;
+  for (i = 0; i < old->num_children; i++)
+    {
+      child = old->children[i];
+      /*
+       * Tombstones from the previous generation are dropped
+       */
+      if (child->change != INDEX_CHANGE_REMOVED)
+        {
+          entry = alloc_entry(child->name);
+          if (entry != OFC_NULL)
+            {
+              entry->attributes = child->attributes;
+              entry->size = child->size;
+              entry->create_time = child->create_time;
+              entry->access_time = child->access_time;
+              entry->write_time = child->write_time;
+              entry->change = child->change;
+              entry->generation = child->generation;
+              if (add_child(dir, entry) == OFC_FALSE)
+                free_entry(entry);
+              else if (is_directory(entry))
+                {
+                  filename = MakeFilename(dirname, entry->name);
+                  /*
+                   * A subdirectory's last write time is only reported by
+                   * its parent's listing so query it directly.
+                   */
+                  if (stat_entry(filename, entry) != OFC_ERROR_SUCCESS)
+                    index->errors++;
+                  else
+                    update_change(index, entry, child);
+                  refresh_dir(index, filename, entry, child);
+                  free(filename);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Refresh a directory
+ *
+ * \param index
+ * The index being refreshed
+ *
+ * \param dirname
+ * Path to the directory
+ *
+ * \param dir
+ * Entry for the directory with fresh metadata and no children
+ *
+ * \param old
+ * Matching entry from the previous index or OFC_NULL
+ */
+static OFC_VOID refresh_dir(struct index *index, OFC_CTCHAR *dirname,
+                            struct index_entry *dir, struct index_entry *old)
+{
+  OFC_DWORD last_error;
+
+  if (!index->full && old != OFC_NULL &&
+      old->change != INDEX_CHANGE_REMOVED &&
+      filetime_equal(&old->write_time, &dir->write_time))
+    revalidate_dir(index, dirname, dir, old);
+  else
+    {
+      last_error = enumerate_dir(index, dirname, dir, old);
+      if (last_error != OFC_ERROR_SUCCESS)
+        {
+          printf("Cannot enumerate %ls: %s\n", dirname,
+                 ofc_get_error_string(last_error));
+          index->errors++;
+          /*
+           * Discard a partial listing and keep what we knew about the
+           * directory.  Clearing the write time forces it to be
+           * enumerated on the next refresh.
+           */
+          while (dir->num_children > 0)
+            free_entry(dir->children[--dir->num_children]);
+          if (old != OFC_NULL)
+            revalidate_dir(index, dirname, dir, old);
+          dir->write_time.dwLowDateTime = 0;
+          dir->write_time.dwHighDateTime = 0;
+        }
+    }
+}
+
+static OFC_DWORD refresh(const char *indexpath, OFC_CTCHAR *dirname,
+                         OFC_BOOL full)
+{
+  struct index *old;
+  struct index index;
+  OFC_DWORD last_error;
+
+  memset(&index, 0, sizeof(index));
+  index.full = full;
+
+  old = load_index(indexpath);
+  if (old != OFC_NULL && wcscmp(old->root->name, dirname) != 0)
+    {
+      printf("Index %s is for %ls, rebuilding\n", indexpath,
+             old->root->name);
+      free_index(old);
+      old = OFC_NULL;
+    }
+  index.generation = old == OFC_NULL ? 1 : old->generation + 1;
+
+  index.root = alloc_entry(dirname);
+  if (index.root == OFC_NULL)
+    last_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
+    {
+      last_error = stat_entry(dirname, index.root);
+      if (last_error == OFC_ERROR_SUCCESS)
+        {
+          update_change(&index, index.root,
+                        old == OFC_NULL ? OFC_NULL : old->root);
+          refresh_dir(&index, dirname, index.root,
+                      old == OFC_NULL ? OFC_NULL : old->root);
+
+          if (save_index(indexpath, &index) == OFC_FALSE)
+            {
+              printf("Cannot write index %s\n", indexpath);
+              last_error = OFC_ERROR_ACCESS_DENIED;
+            }
+          else
+            printf("Generation %u: %u enumerated, %u revalidated, "
+                   "%u failed\n", index.generation, index.enumerated,
+                   index.revalidated, index.errors);
+        }
+      free_entry(index.root);
+    }
+  free_index(old);
+
+  return (last_error);
+}
+
+/*
+ * Queries
+ */
+static OFC_VOID print_changes(struct index_entry *entry, OFC_CTCHAR *path,
+                              OFC_UINT32 generation)
+{
+  static const char change2char[] = { ' ', 'A', 'M', 'D' };
+  OFC_TCHAR *filename;
+  OFC_UINT32 i;
+
+  if (entry->generation == generation && entry->change != INDEX_CHANGE_NONE)
+    printf("%c %ls%s\n", change2char[entry->change], path,
+           is_directory(entry) ? "/" : "");
+
+  for (i = 0; i < entry->num_children; i++)
+    {
+      filename = MakeFilename(path, entry->children[i]->name);
+      print_changes(entry->children[i], filename, generation);
+      free(filename);
+    }
+}
+
+static OFC_VOID sum_sizes(struct index_entry *entry, OFC_UINT64 *files,
+                          OFC_UINT64 *dirs, OFC_UINT64 *bytes)
+{
+  OFC_UINT32 i;
+
+  if (entry->change != INDEX_CHANGE_REMOVED)
+    {
+      if (is_directory(entry))
+        (*dirs)++;
+      else
+        {
+          (*files)++;
+          *bytes += entry->size;
+        }
+      for (i = 0; i < entry->num_children; i++)
+        sum_sizes(entry->children[i], files, dirs, bytes);
+    }
+}
+
+static OFC_DWORD query(const char *indexpath, const char *command)
+{
+  struct index *index;
+  OFC_DWORD last_error;
+  OFC_UINT64 files;
+  OFC_UINT64 dirs;
+  OFC_UINT64 bytes;
+
+  last_error = OFC_ERROR_SUCCESS;
+  index = load_index(indexpath);
+  if (index == OFC_NULL)
+    last_error = OFC_ERROR_FILE_NOT_FOUND;
+  else
+    {
+      if (strcmp(command, "changes") == 0)
+        {
+          printf("Changes to %ls in generation %u\n", index->root->name,
+                 index->generation);
+          print_changes(index->root, index->root->name, index->generation);
+        }
+      else
+        {
+          files = 0;
+          dirs = 0;
+          bytes = 0;
+          sum_sizes(index->root, &files, &dirs, &bytes);
+          printf("Size of %ls in generation %u\n", index->root->name,
+                 index->generation);
+          printf("  Files: %llu\n", (unsigned long long) files);
+          printf("  Directories: %llu\n", (unsigned long long) dirs);
+          printf("  Total Size: %llu bytes\n", (unsigned long long) bytes);
+        }
+      free_index(index);
+    }
+  return (last_error);
+}
+
+int main (int argc, char **argp)
+{
+  OFC_TCHAR *wfilename;
+  OFC_DWORD ret;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
+  OFC_BOOL full;
+  int argidx;
+
+  full = OFC_FALSE;
+  argidx = 1;
+  if (argidx < argc && strcmp(argp[argidx], "-f") == 0)
+    {
+      full = OFC_TRUE;
+      argidx++;
+    }
+
+  if (argc - argidx < 2 ||
+      (strcmp(argp[argidx], "refresh") == 0 && argc - argidx < 3) ||
+      (strcmp(argp[argidx], "refresh") != 0 &&
+       strcmp(argp[argidx], "changes") != 0 &&
+       strcmp(argp[argidx], "size") != 0))
+    {
+      printf ("Usage: smbindex [-f] refresh <index> <dir>\n");
+      printf ("       smbindex changes <index>\n");
+      printf ("       smbindex size <index>\n");
+      exit (1);
+    }
+
+  if (strcmp(argp[argidx], "refresh") == 0)
+    {
+      /*
+       * Queries are answered from the index alone so only a refresh
+       * needs the stack
+       */
+      smbcp_init();
+
+      memset(&ps, 0, sizeof(ps));
+      len = strlen(argp[argidx+2]) + 1;
+      wfilename = malloc(sizeof(wchar_t) * len);
+      cursor = argp[argidx+2];
+      mbsrtowcs(wfilename, &cursor, len, &ps);
+
+      printf("Indexing %s into %s\n", argp[argidx+2], argp[argidx+1]);
+      fflush(stdout);
+
+      ret = refresh(argp[argidx+1], wfilename, full);
+      free(wfilename);
+    }
+  else
+    ret = query(argp[argidx+1], argp[argidx]);
+
+  int status;
+  if (ret == OFC_ERROR_SUCCESS)
+    {
+      printf("[ok]\n");
+      status = 0;
+    }
+  else
+    {
+      printf("[failed]\n");
+      printf("%s\n", ofc_get_error_string(ret));
+      status = 1;
+    }
+
+  if (strcmp(argp[argidx], "refresh") == 0)
+    {
+      /*
+       * Deactivate the openfiles stack
+       */
+      printf("Deactivating Stack\n");
+      smbcp_deactivate_at_exit();
+    }
+
+  exit(status);
+}
+
+/**
+ * \}
+ */
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <wchar.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <ofc/config.h>
 #include <ofc/framework.h>
@@ -17,6 +18,10 @@
 #include <ofc/queue.h>
 #include <of_smb/framework.h>
 
+#include "smbinit.h"
+#include "smbtrace.h"
+#include "smbdc.h"
+
 #if !defined(INIT_ON_LOAD)
 /*
  * Forward Declaration of explicit configuration routine
@@ -24,6 +29,151 @@
 void smbcp_configure(void);
 #endif
 
+/*
+ * Startup profile.  Set by smbcp_set_profile or from the SMBCP_PROFILE
+ * environment variable if smbcp_set_profile hasn't been called.
+ */
+static SMBCP_PROFILE smbcp_profile = SMBCP_PROFILE_DEFAULT;
+static OFC_BOOL smbcp_profile_set = OFC_FALSE;
+/*
+ * Whether to log the time taken by each startup and teardown step
+ */
+static OFC_BOOL smbcp_timing = OFC_FALSE;
+
+void smbcp_set_profile(SMBCP_PROFILE profile)
+{
+  smbcp_profile = profile;
+  smbcp_profile_set = OFC_TRUE;
+}
+
+/*
+ * Security settings applied when the stack is configured.  The defaults
+ * leave the stack's own configuration alone.
+ */
+static SMBCP_CIPHER smbcp_cipher = SMBCP_CIPHER_DEFAULT;
+static SMBCP_SIGNING smbcp_signing = SMBCP_SIGNING_DEFAULT;
+static OFC_UINT16 smbcp_dialect = SMBCP_DIALECT_DEFAULT;
+
+static const struct {
+  const char *name;
+  SMBCP_CIPHER cipher;
+  OFC_UINT16 id;                /* SMB2 encryption cipher id */
+} smbcp_ciphers[] = {
+  { "default", SMBCP_CIPHER_DEFAULT, 0 },
+  { "none", SMBCP_CIPHER_NONE, 0 },
+  { "aes-128-ccm", SMBCP_CIPHER_AES_128_CCM, 0x0001 },
+  { "aes-128-gcm", SMBCP_CIPHER_AES_128_GCM, 0x0002 },
+  { "aes-256-ccm", SMBCP_CIPHER_AES_256_CCM, 0x0003 },
+  { "aes-256-gcm", SMBCP_CIPHER_AES_256_GCM, 0x0004 },
+};
+#define NUM_CIPHERS (sizeof(smbcp_ciphers) / sizeof(smbcp_ciphers[0]))
+
+static const struct {
+  const char *name;
+  OFC_UINT16 dialect;
+} smbcp_dialects[] = {
+  { "default", SMBCP_DIALECT_DEFAULT },
+  { "2.0.2", 0x0202 },
+  { "2.1", 0x0210 },
+  { "3.0", 0x0300 },
+  { "3.0.2", 0x0302 },
+  { "3.1.1", 0x0311 },
+};
+#define NUM_DIALECTS (sizeof(smbcp_dialects) / sizeof(smbcp_dialects[0]))
+
+void smbcp_set_security(SMBCP_CIPHER cipher, SMBCP_SIGNING signing,
+                        OFC_UINT16 max_dialect)
+{
+  smbcp_cipher = cipher;
+  smbcp_signing = signing;
+  smbcp_dialect = max_dialect;
+}
+
+int smbcp_parse_cipher(const char *name, SMBCP_CIPHER *cipher)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_CIPHERS && strcmp(smbcp_ciphers[i].name, name) != 0;
+       i++);
+  if (i == NUM_CIPHERS)
+    return (-1);
+  *cipher = smbcp_ciphers[i].cipher;
+  return (0);
+}
+
+const char *smbcp_cipher_name(SMBCP_CIPHER cipher)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_CIPHERS && smbcp_ciphers[i].cipher != cipher; i++);
+  return (i == NUM_CIPHERS ? "unknown" : smbcp_ciphers[i].name);
+}
+
+int smbcp_parse_signing(const char *name, SMBCP_SIGNING *signing)
+{
+  int ret;
+
+  ret = 0;
+  if (strcmp(name, "default") == 0)
+    *signing = SMBCP_SIGNING_DEFAULT;
+  else if (strcmp(name, "off") == 0)
+    *signing = SMBCP_SIGNING_OFF;
+  else if (strcmp(name, "on") == 0)
+    *signing = SMBCP_SIGNING_ON;
+  else
+    ret = -1;
+  return (ret);
+}
+
+const char *smbcp_signing_name(SMBCP_SIGNING signing)
+{
+  return (signing == SMBCP_SIGNING_OFF ? "off" :
+          signing == SMBCP_SIGNING_ON ? "on" : "default");
+}
+
+int smbcp_parse_dialect(const char *name, OFC_UINT16 *dialect)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_DIALECTS && strcmp(smbcp_dialects[i].name, name) != 0;
+       i++);
+  if (i == NUM_DIALECTS)
+    return (-1);
+  *dialect = smbcp_dialects[i].dialect;
+  return (0);
+}
+
+const char *smbcp_dialect_name(OFC_UINT16 dialect)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_DIALECTS && smbcp_dialects[i].dialect != dialect; i++);
+  return (i == NUM_DIALECTS ? "unknown" : smbcp_dialects[i].name);
+}
+
+static double smbcp_step_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+/*
+ * Log the time taken by a step and start timing the next one
+ */
+static void smbcp_step(const char *step, double *start)
+{
+  double now;
+
+  if (smbcp_timing)
+    {
+      now = smbcp_step_now();
+      fprintf(stderr, "smbcp: %s %.3f ms\n", step, now - *start);
+      *start = now;
+    }
+}
+
 /**
  * Routine to initialize the openfiles (ConnectSMB) stack
  *
@@ -77,31 +227,97 @@ void smbcp_configure(void);
  */
 void smbcp_init(void)
 {
+  const char *env;
+  double start;
+  OFC_LOG_LEVEL level;
+
+  if (!smbcp_profile_set)
+    {
+      env = getenv("SMBCP_PROFILE");
+      if (env != NULL && strcmp(env, "fast") == 0)
+        smbcp_profile = SMBCP_PROFILE_FAST;
+    }
+  smbcp_timing = (getenv("SMBCP_INIT_TIMING") != NULL);
+
+  env = getenv("SMBCP_TRACE");
+  if (env != NULL && !smbtrace_enabled())
+    {
+      level = OFC_LOG_INFO;
+      if (getenv("SMBCP_TRACE_LEVEL") != NULL &&
+          smbtrace_parse_level(getenv("SMBCP_TRACE_LEVEL"), &level) != 0)
+        fprintf(stderr, "smbcp: bad SMBCP_TRACE_LEVEL, using info\n");
+      smbtrace_init(env, level);
+    }
+  start = smbcp_step_now();
+
 #if defined(INIT_ON_LOAD)
   /*
-   * Force an SMB library load, which will force initialization
+   * Force an SMB library load, which will force initialization.  The
+   * stack was configured from the default configuration when the library
+   * loaded so the profile has no effect.
    */
   volatile OFC_VOID *init = of_smb_init;
+  smbcp_step("load", &start);
 #else
   /*
    * Explicit Open Files Initialization
    */
   ofc_framework_init();
+  smbcp_step("framework init", &start);
   of_smb_init();
+  smbcp_step("smb init", &start);
   /*
    * Configure the stack either through persistent configuration or
    * explicitly through APIs
    */
   smbcp_configure();
+  smbcp_step("configure", &start);
   /*
    * Startup SMB.  The argument is a handle to a scheduler (i.e. a
    * run loop thread.  If Null, one will be created for it 
    */
   of_smb_startup(OFC_HANDLE_NULL);
+  smbcp_step("smb startup", &start);
 #endif
+  /*
+   * Hand the stack the domain controllers found by earlier runs so that
+   * it needn't look them up again
+   */
+  smbdc_preload();
+  smbcp_step("dc preload", &start);
 }
 
 #if !defined(INIT_ON_LOAD)
+/*
+ * Apply the security settings pinned by smbcp_set_security.  These are
+ * applied after the configuration file, if any, so they override it.
+ */
+static void smbcp_configure_security(void)
+{
+  OFC_UINT16 cipher_id;
+  size_t i;
+
+  if (smbcp_cipher == SMBCP_CIPHER_NONE)
+    of_smb_set_encryption(OFC_FALSE);
+  else if (smbcp_cipher != SMBCP_CIPHER_DEFAULT)
+    {
+      for (i = 0; i < NUM_CIPHERS && smbcp_ciphers[i].cipher != smbcp_cipher;
+           i++);
+      if (i < NUM_CIPHERS)
+        {
+          cipher_id = smbcp_ciphers[i].id;
+          of_smb_set_encryption(OFC_TRUE);
+          of_smb_set_ciphers(1, &cipher_id);
+        }
+    }
+
+  if (smbcp_signing != SMBCP_SIGNING_DEFAULT)
+    of_smb_set_signing(smbcp_signing == SMBCP_SIGNING_ON);
+
+  if (smbcp_dialect != SMBCP_DIALECT_DEFAULT)
+    of_smb_set_max_dialect(smbcp_dialect);
+}
+
 void smbcp_configure(void)
 {
 #if defined(OFC_PERSIST)
@@ -114,6 +330,16 @@ void smbcp_configure(void)
    * explicitly specify the location.
    */
   ofc_framework_load(TSTR("/etc/openfiles.xml"));
+  if (smbcp_profile == SMBCP_PROFILE_FAST)
+    {
+      /*
+       * A short lived client resolves names through DNS and has no use
+       * for NetBIOS or for tracking interfaces coming and going, whatever
+       * the configuration file says.
+       */
+      ofc_framework_set_interface_discovery(OFC_FALSE);
+      ofc_framework_set_netbios(OFC_FALSE);
+    }
 #else
   /*
    * We will explicity configure the stack.
@@ -129,56 +355,63 @@ void smbcp_configure(void)
    * Network Monitoring will monitor for interface interruption.
    */
 #if defined(SMBCP_NETWORK_AUTOCONFIG)
-  ofc_framework_set_interface_discovery(OFC_TRUE);
+  ofc_framework_set_interface_discovery(smbcp_profile != SMBCP_PROFILE_FAST);
 #else
   /*
    * Turn off interface discovery
    */
   ofc_framework_set_interface_discovery(OFC_FALSE);
   /*
-   * Add an interface.  This is done by filling in an
-   * framework interface structure add calling
-   * ofc_framework_add_interface
+   * The interface is used for NetBIOS name service which is off when
+   * starting fast
    */
-  OFC_FRAMEWORK_INTERFACE iface ;
-  /*
-   * Configure WINS (PMODE) mode.
-   * Other mode are Broadcast (BMODE), Mixed (MMODE), and
-   * Hybrid (HMODE).  Mixed is broadcast first, if that
-   * fails, then WINS.  Hybrid is WINS first, then broadcast.
-   */
-  iface.netBiosMode = OFC_CONFIG_PMODE;
-  /*
-   * Configure the IP address.  The IP address is an
-   * OFC_IPADDR which can initialized by a call to
-   * ofc_pton.  NOTE: Be sure to retrieve and specify
-   * the actual IP you wish to use.
-   */
-  ofc_pton("192.168.1.60", &iface.ip);
-  ofc_pton("192.168.1.255", &iface.bcast);
-  ofc_pton("255.255.255.0", &iface.mask);
-  /*
-   * Local Master Browser is not supported in SMBv2.  Deprecated
-   * but specify as NULL.
-   */
-  iface.lmb = OFC_NULL;
-  /*
-   * Build a WINS list
-   * A wins list consists of a count of wins servers followed
-   * by a pointer to an array of WINS ip addresses
-   * The wins list can be statically or dynamically allocated.
-   * If you are dynamically allocating it, make sure you
-   * free it after the ofc_framework_add_interface call.
-   */
-  OFC_IPADDR winsaddr[2];
-  ofc_pton("192.168.1.61", &winsaddr[0]);
-  ofc_pton("192.168.1.62", &winsaddr[1]);
-  iface.wins.num_wins = 2;
-  iface.wins.winsaddr = winsaddr;
-  /*
-   * Now add the interface
-   */
-  ofc_framework_add_interface(&iface) ;
+  if (smbcp_profile != SMBCP_PROFILE_FAST)
+    {
+      /*
+       * Add an interface.  This is done by filling in an
+       * framework interface structure add calling
+       * ofc_framework_add_interface
+       */
+      OFC_FRAMEWORK_INTERFACE iface ;
+      /*
+       * Configure WINS (PMODE) mode.
+       * Other mode are Broadcast (BMODE), Mixed (MMODE), and
+       * Hybrid (HMODE).  Mixed is broadcast first, if that
+       * fails, then WINS.  Hybrid is WINS first, then broadcast.
+       */
+      iface.netBiosMode = OFC_CONFIG_PMODE;
+      /*
+       * Configure the IP address.  The IP address is an
+       * OFC_IPADDR which can initialized by a call to
+       * ofc_pton.  NOTE: Be sure to retrieve and specify
+       * the actual IP you wish to use.
+       */
+      ofc_pton("192.168.1.60", &iface.ip);
+      ofc_pton("192.168.1.255", &iface.bcast);
+      ofc_pton("255.255.255.0", &iface.mask);
+      /*
+       * Local Master Browser is not supported in SMBv2.  Deprecated
+       * but specify as NULL.
+       */
+      iface.lmb = OFC_NULL;
+      /*
+       * Build a WINS list
+       * A wins list consists of a count of wins servers followed
+       * by a pointer to an array of WINS ip addresses
+       * The wins list can be statically or dynamically allocated.
+       * If you are dynamically allocating it, make sure you
+       * free it after the ofc_framework_add_interface call.
+       */
+      OFC_IPADDR winsaddr[2];
+      ofc_pton("192.168.1.61", &winsaddr[0]);
+      ofc_pton("192.168.1.62", &winsaddr[1]);
+      iface.wins.num_wins = 2;
+      iface.wins.winsaddr = winsaddr;
+      /*
+       * Now add the interface
+       */
+      ofc_framework_add_interface(&iface) ;
+    }
 #endif
   /*
    * Set up logging.  We want to log INFO messages and
@@ -203,9 +436,9 @@ void smbcp_configure(void)
    */
 
   /*
-   * Enable Netbios
+   * Enable Netbios unless we're starting fast
    */
-  ofc_framework_set_netbios(OFC_TRUE);
+  ofc_framework_set_netbios(smbcp_profile != SMBCP_PROFILE_FAST);
   /*
    * Set the UUID.  This is required in an SMB negotiate request
    * but it doesn't appear to be checked by servers.  Ideally
@@ -227,15 +460,24 @@ void smbcp_configure(void)
   /*
    * There is configuration for supported ciphers, but by
    * default we specify both AES-128-GCM and AES-128-CCM.
-   * There should never be a reason to change this
+   * Unless one has been pinned with smbcp_set_security we
+   * leave it be.
    */
 
   /*
    * There is also a configuration for max smb version but
-   * by default we specify SMB 3.11.  There should never be
-   * a reason to change this.
+   * by default we specify SMB 3.11.  Again, we leave it unless
+   * one has been pinned.
    */
 #endif
+  smbcp_configure_security();
+  /*
+   * With the trace ring on, keep the stack's routine messages out of
+   * syslog.  Only its warnings and above are still logged.
+   */
+  if (smbtrace_enabled())
+    ofc_framework_set_logging(smbtrace_level() > OFC_LOG_WARN ?
+                              smbtrace_level() : OFC_LOG_WARN, OFC_FALSE);
 }
 
 #endif
@@ -245,22 +487,51 @@ void smbcp_configure(void)
  *
  * This can be called implicitly on exit by setting the build
  * configuration variable INIT_ON_LOAD.  When performing manual
- * initialization, this should be called when shutting down the stack
+ * initialization, this should be called when shutting down the stack.
+ * The stack is torn down completely so smbcp_init may be called again.
  */
 void smbcp_deactivate(void)
 {
 #if !defined(INIT_ON_LOAD)
+  double start;
+
+  start = smbcp_step_now();
   /*
-   * Shutdown and deactivate SMB
+   * Shutdown SMB.  This closes our sessions with the servers.
    */
   of_smb_shutdown();
+  smbcp_step("smb shutdown", &start);
   of_smb_destroy();
+  smbcp_step("smb destroy", &start);
   /*
    * Shutdown and deactivate the core framework
    */
   ofc_framework_shutdown();
+  smbcp_step("framework shutdown", &start);
   ofc_framework_destroy();
+  smbcp_step("framework destroy", &start);
 #endif
 }
 
+/**
+ * Routine to deactivate the stack of a program that is about to exit.
+ *
+ * With the fast profile, only our sessions are closed.  The process
+ * takes the stack's memory and threads with it when it exits.  Otherwise
+ * this is smbcp_deactivate.
+ */
+void smbcp_deactivate_at_exit(void)
+{
+#if !defined(INIT_ON_LOAD)
+  double start;
 
+  if (smbcp_profile == SMBCP_PROFILE_FAST)
+    {
+      start = smbcp_step_now();
+      of_smb_shutdown();
+      smbcp_step("smb shutdown", &start);
+      return;
+    }
+#endif
+  smbcp_deactivate();
+}
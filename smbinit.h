@@ -1,6 +1,63 @@
 #if !defined(__smbinit_h__)
 #define __smbinit_h__
 
+#include <ofc/types.h>
+
+/*
+ * Stack startup profiles.
+ *
+ * The fast profile is for short lived command line jobs.  It turns off
+ * NetBIOS and interface discovery and monitoring.  A program about to
+ * exit deactivates the stack with smbcp_deactivate_at_exit, which with
+ * the fast profile closes sessions without tearing down the rest of the
+ * stack.  smbcp_deactivate always tears the stack down completely so it
+ * can be started again.  The profile must be set before smbcp_init.  If
+ * it isn't, SMBCP_PROFILE=fast in the environment selects it.
+ *
+ * With SMBCP_INIT_TIMING set in the environment the time taken by each
+ * startup and teardown step is logged to stderr.
+ */
+typedef enum {
+  SMBCP_PROFILE_DEFAULT,
+  SMBCP_PROFILE_FAST
+} SMBCP_PROFILE;
+
+/*
+ * Security settings.
+ *
+ * smbcp_set_security pins the encryption cipher, whether signing is used
+ * and the highest dialect negotiated.  The settings take effect at the
+ * next smbcp_init and override the configuration file.  The DEFAULT
+ * values leave the stack's configuration as is.  A cipher the library
+ * doesn't implement fails at session setup.
+ */
+typedef enum {
+  SMBCP_CIPHER_DEFAULT,
+  SMBCP_CIPHER_NONE,            /* Encryption off */
+  SMBCP_CIPHER_AES_128_CCM,
+  SMBCP_CIPHER_AES_128_GCM,
+  SMBCP_CIPHER_AES_256_CCM,
+  SMBCP_CIPHER_AES_256_GCM
+} SMBCP_CIPHER;
+
+typedef enum {
+  SMBCP_SIGNING_DEFAULT,
+  SMBCP_SIGNING_OFF,
+  SMBCP_SIGNING_ON
+} SMBCP_SIGNING;
+
+#define SMBCP_DIALECT_DEFAULT 0
+
+void smbcp_set_profile(SMBCP_PROFILE profile);
+void smbcp_set_security(SMBCP_CIPHER cipher, SMBCP_SIGNING signing,
+                        OFC_UINT16 max_dialect);
+int smbcp_parse_cipher(const char *name, SMBCP_CIPHER *cipher);
+const char *smbcp_cipher_name(SMBCP_CIPHER cipher);
+int smbcp_parse_signing(const char *name, SMBCP_SIGNING *signing);
+const char *smbcp_signing_name(SMBCP_SIGNING signing);
+int smbcp_parse_dialect(const char *name, OFC_UINT16 *dialect);
+const char *smbcp_dialect_name(OFC_UINT16 dialect);
 void smbcp_init(void);
 void smbcp_deactivate(void);
+void smbcp_deactivate_at_exit(void);
 #endif
@@ -0,0 +1,648 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include <ofc/config.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/file.h>
+
+#include "smbinit.h"
+#include "smbpool.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Load generator
+ *
+ * Operations arrive on an open loop: arrival times are drawn from a
+ * Poisson process at the requested rate and do not wait on earlier
+ * operations completing.  Latency is measured from the time an operation
+ * was due to start, so time spent queued behind a slow server counts
+ * against the server rather than being hidden by a stalled client.
+ *
+ * Each target directory gets its own set of files.  The stack shares one
+ * session between everything opened on a server with the same
+ * credentials, so to drive several sessions against one server give the
+ * same share several times with different users.
+ */
+#define LOAD_THREADS 64
+#define LOAD_FILES 16
+#define LOAD_FILE_SIZE (4 * 1024 * 1024)
+#define LOAD_IO_SIZE (64 * 1024)
+#define LOAD_RATE 1000
+#define LOAD_DURATION 10
+/*
+ * Arrivals due while this many operations are outstanding are dropped
+ * and counted rather than queued without bound
+ */
+#define LOAD_MAX_BACKLOG 100000
+
+typedef enum {
+  LOAD_OP_READ,
+  LOAD_OP_WRITE,
+  LOAD_OP_LIST,
+  LOAD_OP_STAT,
+  LOAD_OP_MAX
+} LOAD_OP;
+
+static const char *load_op_names[LOAD_OP_MAX] =
+  {
+    "read", "write", "list", "stat"
+  };
+
+/*
+ * Latency histogram.  Latencies in microseconds are bucketed with 16
+ * buckets per power of two so percentiles are within about 6%.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct load_stats {
+  OFC_UINT64 count;             /* Operations completed */
+  OFC_UINT64 errors;            /* Operations failed */
+  OFC_UINT64 bytes;             /* Bytes read or written */
+  OFC_UINT64 max_us;            /* Worst latency */
+  OFC_DWORD last_error;         /* Most recent error */
+  OFC_UINT64 hist[HIST_BUCKETS];
+};
+
+struct load_target {
+  char *name;                   /* Directory as given */
+  OFC_TCHAR *wdir;              /* Wide directory name */
+  OFC_TCHAR *wpattern;          /* Wide enumeration pattern */
+  OFC_TCHAR **wfiles;           /* Wide file names */
+  OFC_HANDLE *handles;          /* Open file handles */
+};
+
+struct load_state {
+  struct load_target *targets;
+  OFC_INT num_targets;
+  OFC_INT num_files;            /* Files per target */
+  OFC_UINT64 file_size;         /* Size of each file */
+  OFC_DWORD io_size;            /* Size of reads and writes */
+  OFC_INT outstanding;          /* Operations submitted and not done */
+  struct load_stats stats[LOAD_OP_MAX];
+};
+
+struct load_op {
+  LOAD_OP type;
+  struct load_target *target;
+  OFC_INT file;
+  OFC_OFFT offset;
+  OFC_UINT64 due_us;            /* When the operation was due to start */
+};
+
+static wchar_t *MakeFilename(const wchar_t *dirname, const wchar_t *name)
+{
+  size_t dirlen;
+  size_t namelen;
+  wchar_t *filename;
+
+  dirlen = wcslen (dirname);
+  namelen = wcslen (name);
+  filename =
+    malloc((dirlen + namelen + 2) * sizeof(wchar_t));
+  wcscpy (filename, dirname);
+  filename[dirlen] = L'/';
+  wcscpy (&filename[dirlen+1], name);
+  filename[dirlen + 1 + namelen] = L'\0';
+  return (filename);
+}
+
+static OFC_UINT64 now_us(OFC_VOID)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((OFC_UINT64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static OFC_INT hist_bucket(OFC_UINT64 us)
+{
+  OFC_INT shift;
+
+  if (us < HIST_SUB)
+    return ((OFC_INT) us);
+  shift = 63 - __builtin_clzll(us) - HIST_SUB_BITS;
+  return ((shift + 1) * HIST_SUB + (OFC_INT) ((us >> shift) - HIST_SUB));
+}
+
+static OFC_UINT64 hist_value(OFC_INT bucket)
+{
+  OFC_INT shift;
+
+  if (bucket < HIST_SUB)
+    return (bucket);
+  shift = bucket / HIST_SUB - 1;
+  /*
+   * Report the upper edge of the bucket
+   */
+  return ((((OFC_UINT64) (bucket % HIST_SUB + HIST_SUB) + 1) << shift) - 1);
+}
+
+static OFC_UINT64 hist_percentile(struct load_stats *stats, double pct)
+{
+  OFC_UINT64 want;
+  OFC_UINT64 seen;
+  OFC_INT i;
+
+  want = (OFC_UINT64) ceil(stats->count * pct / 100.0);
+  if (want == 0)
+    want = 1;
+  seen = 0;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    {
+      seen += stats->hist[i];
+      if (seen >= want)
+        return (hist_value(i) < stats->max_us ?
+                hist_value(i) : stats->max_us);
+    }
+  return (stats->max_us);
+}
+
+/*
+ * xorshift64*.  Only the arrival thread draws numbers.
+ */
+static OFC_UINT64 load_random(OFC_UINT64 *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (*state * 0x2545f4914f6cdd1dULL);
+}
+
+static double load_uniform(OFC_UINT64 *state)
+{
+  /*
+   * (0, 1]
+   */
+  return (((load_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0));
+}
+
+static OFC_BOOL load_io(OFC_HANDLE file, OFC_BOOL write, OFC_VOID *buf,
+                        OFC_DWORD len, OFC_OFFT offset, OFC_DWORD *done)
+{
+  OFC_HANDLE overlapped;
+  OFC_BOOL status;
+
+  overlapped = OfcCreateOverlapped(file);
+  if (overlapped == OFC_HANDLE_NULL)
+    return (OFC_FALSE);
+
+  OfcSetOverlappedOffset(file, overlapped, offset);
+  if (write)
+    status = OfcWriteFile(file, buf, len, done, overlapped);
+  else
+    status = OfcReadFile(file, buf, len, done, overlapped);
+  if (status == OFC_FALSE && OfcGetLastError() == OFC_ERROR_IO_PENDING)
+    status = OfcGetOverlappedResult(file, overlapped, done, OFC_TRUE);
+  OfcDestroyOverlapped(file, overlapped);
+  return (status);
+}
+
+static OFC_BOOL load_list(OFC_CTCHAR *pattern)
+{
+  OFC_HANDLE list_handle;
+  OFC_WIN32_FIND_DATA find_data;
+  OFC_BOOL more = OFC_FALSE;
+  OFC_BOOL status;
+
+  list_handle = OfcFindFirstFile(pattern, &find_data, &more);
+  if (list_handle == OFC_INVALID_HANDLE_VALUE)
+    return (OFC_FALSE);
+
+  status = OFC_TRUE;
+  while (more && status == OFC_TRUE)
+    status = OfcFindNextFile(list_handle, &find_data, &more);
+  if (status == OFC_FALSE && OfcGetLastError() == OFC_ERROR_NO_MORE_FILES)
+    status = OFC_TRUE;
+  OfcFindClose(list_handle);
+  return (status);
+}
+
+static OFC_VOID load_work(struct smbpool *pool, OFC_VOID *item,
+                          OFC_VOID *context)
+{
+  struct load_state *state = context;
+  struct load_op *op = item;
+  struct load_stats *stats;
+  OFC_WIN32_FILE_ATTRIBUTE_DATA file_info;
+  OFC_CHAR *buf;
+  OFC_DWORD done;
+  OFC_BOOL status;
+  OFC_UINT64 latency;
+  OFC_UINT64 max;
+
+  done = 0;
+  buf = OFC_NULL;
+  switch (op->type)
+    {
+    default:
+    case LOAD_OP_READ:
+    case LOAD_OP_WRITE:
+      buf = malloc(state->io_size);
+      if (op->type == LOAD_OP_WRITE)
+        memset(buf, (int) op->offset, state->io_size);
+      status = load_io(op->target->handles[op->file],
+                       op->type == LOAD_OP_WRITE, buf, state->io_size,
+                       op->offset, &done);
+      free(buf);
+      break;
+    case LOAD_OP_LIST:
+      status = load_list(op->target->wpattern);
+      break;
+    case LOAD_OP_STAT:
+      status = OfcGetFileAttributesEx(op->target->wfiles[op->file],
+                                      OfcGetFileExInfoStandard,
+                                      &file_info);
+      break;
+    }
+
+  latency = now_us() - op->due_us;
+
+  stats = &state->stats[op->type];
+  __atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->hist[hist_bucket(latency)], 1,
+                     __ATOMIC_RELAXED);
+  max = __atomic_load_n(&stats->max_us, __ATOMIC_RELAXED);
+  while (latency > max &&
+         !__atomic_compare_exchange_n(&stats->max_us, &max, latency, OFC_TRUE,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if (status == OFC_TRUE)
+    __atomic_add_fetch(&stats->bytes, done, __ATOMIC_RELAXED);
+  else
+    {
+      __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+      stats->last_error = OfcGetLastError();
+    }
+
+  __atomic_sub_fetch(&state->outstanding, 1, __ATOMIC_RELAXED);
+  free(op);
+}
+
+/*
+ * Create the files for a target and leave them open for the run
+ */
+static OFC_DWORD load_setup(struct load_state *state,
+                            struct load_target *target)
+{
+  OFC_CHAR *buf;
+  OFC_TCHAR name[32];
+  OFC_UINT64 offset;
+  OFC_DWORD done;
+  OFC_DWORD last_error;
+  OFC_INT i;
+
+  last_error = OFC_ERROR_SUCCESS;
+  target->wpattern = MakeFilename(target->wdir, TSTR("smbload-*"));
+  target->wfiles = malloc(sizeof(OFC_TCHAR *) * state->num_files);
+  target->handles = malloc(sizeof(OFC_HANDLE) * state->num_files);
+  for (i = 0; i < state->num_files; i++)
+    {
+      swprintf(name, sizeof(name) / sizeof(OFC_TCHAR), L"smbload-%d", i);
+      target->wfiles[i] = MakeFilename(target->wdir, name);
+      target->handles[i] = OFC_HANDLE_NULL;
+    }
+
+  buf = malloc(state->io_size);
+  memset(buf, 0x5a, state->io_size);
+  for (i = 0; i < state->num_files && last_error == OFC_ERROR_SUCCESS; i++)
+    {
+      target->handles[i] = OfcCreateFile(target->wfiles[i],
+                                         OFC_GENERIC_READ | OFC_GENERIC_WRITE,
+                                         OFC_FILE_SHARE_READ |
+                                         OFC_FILE_SHARE_WRITE,
+                                         OFC_NULL,
+                                         OFC_CREATE_ALWAYS,
+                                         OFC_FILE_ATTRIBUTE_NORMAL |
+                                         OFC_FILE_FLAG_OVERLAPPED,
+                                         OFC_HANDLE_NULL);
+      if (target->handles[i] == OFC_INVALID_HANDLE_VALUE)
+        {
+          target->handles[i] = OFC_HANDLE_NULL;
+          last_error = OfcGetLastError();
+        }
+      else
+        {
+          for (offset = 0; offset < state->file_size &&
+                 last_error == OFC_ERROR_SUCCESS; offset += state->io_size)
+            {
+              if (!load_io(target->handles[i], OFC_TRUE, buf,
+                           state->io_size, offset, &done))
+                last_error = OfcGetLastError();
+            }
+        }
+    }
+  free(buf);
+  return (last_error);
+}
+
+static OFC_VOID load_teardown(struct load_state *state,
+                              struct load_target *target, OFC_BOOL keep)
+{
+  OFC_INT i;
+
+  for (i = 0; i < state->num_files; i++)
+    {
+      if (target->handles[i] != OFC_HANDLE_NULL)
+        {
+          OfcCloseHandle(target->handles[i]);
+          if (!keep)
+            OfcDeleteFile(target->wfiles[i]);
+        }
+      free(target->wfiles[i]);
+    }
+  free(target->wfiles);
+  free(target->handles);
+  free(target->wpattern);
+}
+
+static OFC_VOID load_report(struct load_state *state, double duration,
+                            double seconds, OFC_UINT64 offered,
+                            OFC_UINT64 dropped)
+{
+  struct load_stats *stats;
+  OFC_UINT64 total;
+  OFC_INT i;
+
+  total = 0;
+  for (i = 0; i < LOAD_OP_MAX; i++)
+    total += state->stats[i].count;
+
+  printf("Offered %llu operations in %.1f seconds (%.0f/s)\n",
+         (unsigned long long) offered, duration, offered / duration);
+  printf("Completed %llu operations in %.1f seconds (%.0f/s), "
+         "dropped %llu\n",
+         (unsigned long long) total, seconds, total / seconds,
+         (unsigned long long) dropped);
+  printf("%-6s %10s %8s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+         "errors", "MB/s", "p50 us", "p90 us", "p99 us", "p99.9 us",
+         "max us");
+  for (i = 0; i < LOAD_OP_MAX; i++)
+    {
+      stats = &state->stats[i];
+      if (stats->count == 0)
+        continue;
+      printf("%-6s %10llu %8llu %10.1f %10llu %10llu %10llu %10llu %10llu\n",
+             load_op_names[i],
+             (unsigned long long) stats->count,
+             (unsigned long long) stats->errors,
+             stats->bytes / seconds / (1024 * 1024),
+             (unsigned long long) hist_percentile(stats, 50.0),
+             (unsigned long long) hist_percentile(stats, 90.0),
+             (unsigned long long) hist_percentile(stats, 99.0),
+             (unsigned long long) hist_percentile(stats, 99.9),
+             (unsigned long long) stats->max_us);
+    }
+  for (i = 0; i < LOAD_OP_MAX; i++)
+    {
+      stats = &state->stats[i];
+      if (stats->errors > 0)
+        printf("Last %s error: %s\n", load_op_names[i],
+               ofc_get_error_string(stats->last_error));
+    }
+}
+
+/*
+ * Parse an operation mix of the form read,write,list,stat weights
+ */
+static int parse_mix(const char *str, OFC_INT *weights)
+{
+  char *end;
+  OFC_INT total;
+  OFC_INT i;
+
+  total = 0;
+  for (i = 0; i < LOAD_OP_MAX; i++)
+    {
+      weights[i] = strtol(str, &end, 10);
+      if (end == str || weights[i] < 0)
+        return (-1);
+      total += weights[i];
+      str = end;
+      if (*str == ',' && i + 1 < LOAD_OP_MAX)
+        str++;
+    }
+  return (*str != '\0' || total == 0 ? -1 : 0);
+}
+
+static OFC_UINT64 parse_size(const char *str)
+{
+  char *end;
+  OFC_UINT64 size;
+
+  size = strtoull(str, &end, 10);
+  if (*end == 'k' || *end == 'K')
+    size *= 1024;
+  else if (*end == 'm' || *end == 'M')
+    size *= 1024 * 1024;
+  else if (*end == 'g' || *end == 'G')
+    size *= 1024 * 1024 * 1024;
+  return (size);
+}
+
+int main (int argc, char **argv)
+{
+  struct load_state state;
+  struct load_op *op;
+  struct smbpool *pool;
+  OFC_INT weights[LOAD_OP_MAX] = { 70, 20, 5, 5 };
+  OFC_INT total_weight;
+  OFC_INT num_threads = LOAD_THREADS;
+  double rate = LOAD_RATE;
+  double duration = LOAD_DURATION;
+  OFC_BOOL keep = OFC_FALSE;
+  OFC_UINT64 rng;
+  OFC_UINT64 start;
+  OFC_UINT64 end;
+  OFC_UINT64 due;
+  OFC_UINT64 now;
+  OFC_UINT64 offered;
+  OFC_UINT64 dropped;
+  OFC_UINT64 pick;
+  OFC_DWORD last_error;
+  OFC_INT argidx;
+  OFC_INT i;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
+  int usage;
+  int ret;
+
+  memset(&state, 0, sizeof(state));
+  state.num_files = LOAD_FILES;
+  state.file_size = LOAD_FILE_SIZE;
+  state.io_size = LOAD_IO_SIZE;
+
+  usage = 0;
+  argidx = 1;
+  while (argidx < argc && argv[argidx][0] == '-' && !usage)
+    {
+      if (strcmp(argv[argidx], "-r") == 0 && argidx + 1 < argc)
+        rate = atof(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-d") == 0 && argidx + 1 < argc)
+        duration = atof(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-j") == 0 && argidx + 1 < argc)
+        num_threads = atoi(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-n") == 0 && argidx + 1 < argc)
+        state.num_files = atoi(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-s") == 0 && argidx + 1 < argc)
+        state.file_size = parse_size(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-b") == 0 && argidx + 1 < argc)
+        state.io_size = (OFC_DWORD) parse_size(argv[++argidx]);
+      else if (strcmp(argv[argidx], "-m") == 0 && argidx + 1 < argc)
+        usage = (parse_mix(argv[++argidx], weights) != 0);
+      else if (strcmp(argv[argidx], "-k") == 0)
+        keep = OFC_TRUE;
+      else
+        usage = 1;
+      argidx++;
+    }
+
+  if (usage || argidx >= argc || rate <= 0 || duration <= 0 ||
+      num_threads < 1 || state.num_files < 1 || state.io_size == 0 ||
+      state.io_size > OFC_MAX_IO || state.file_size < state.io_size)
+    {
+      printf ("Usage: smbload [-r <ops/s>] [-d <seconds>] [-j <threads>] "
+              "[-n <files>]\n"
+              "               [-s <file size>] [-b <io size>] "
+              "[-m <read,write,list,stat>] [-k]\n"
+              "               <dir>...\n");
+      printf ("       Defaults: -r %d -d %d -j %d -n %d -s %dM -b %dK "
+              "-m 70,20,5,5\n", LOAD_RATE, LOAD_DURATION, LOAD_THREADS,
+              LOAD_FILES, LOAD_FILE_SIZE / (1024 * 1024),
+              LOAD_IO_SIZE / 1024);
+      printf ("       -k keeps the load files when done\n");
+      exit (1);
+    }
+
+  smbcp_init();
+
+  state.num_targets = argc - argidx;
+  state.targets = malloc(sizeof(struct load_target) * state.num_targets);
+  memset(state.targets, 0, sizeof(struct load_target) * state.num_targets);
+
+  ret = 0;
+  for (i = 0; i < state.num_targets && ret == 0; i++)
+    {
+      state.targets[i].name = argv[argidx + i];
+      memset(&ps, 0, sizeof(ps));
+      len = strlen(argv[argidx + i]) + 1;
+      state.targets[i].wdir = malloc(sizeof(wchar_t) * len);
+      cursor = argv[argidx + i];
+      mbsrtowcs(state.targets[i].wdir, &cursor, len, &ps);
+
+      printf("Creating %d files in %s: ", state.num_files,
+             state.targets[i].name);
+      fflush(stdout);
+      last_error = load_setup(&state, &state.targets[i]);
+      if (last_error == OFC_ERROR_SUCCESS)
+        printf("[ok]\n");
+      else
+        {
+          printf("[failed]\n");
+          printf("%s\n", ofc_get_error_string(last_error));
+          ret = 1;
+        }
+    }
+
+  if (ret == 0)
+    {
+      pool = smbpool_create(num_threads, &load_work, &state);
+      if (pool == OFC_NULL)
+        {
+          printf("Cannot start %d threads: %s\n", num_threads,
+                 ofc_get_error_string(OFC_ERROR_NOT_ENOUGH_MEMORY));
+          ret = 1;
+        }
+    }
+
+  if (ret == 0)
+    {
+      total_weight = 0;
+      for (i = 0; i < LOAD_OP_MAX; i++)
+        total_weight += weights[i];
+
+      printf("Offering %.0f operations/s for %.0f seconds on %d threads\n",
+             rate, duration, num_threads);
+      fflush(stdout);
+
+      rng = now_us() | 1;
+      offered = 0;
+      dropped = 0;
+      start = now_us();
+      end = start + (OFC_UINT64) (duration * 1000000);
+      due = start;
+      while (due < end)
+        {
+          now = now_us();
+          if (due > now)
+            usleep(due - now);
+
+          offered++;
+          if (__atomic_load_n(&state.outstanding, __ATOMIC_RELAXED) >=
+              LOAD_MAX_BACKLOG ||
+              (op = malloc(sizeof(struct load_op))) == OFC_NULL)
+            dropped++;
+          else
+            {
+              op->due_us = due;
+              pick = load_random(&rng) % total_weight;
+              for (i = 0; pick >= (OFC_UINT64) weights[i]; i++)
+                pick -= weights[i];
+              op->type = (LOAD_OP) i;
+              op->target =
+                &state.targets[load_random(&rng) % state.num_targets];
+              op->file = load_random(&rng) % state.num_files;
+              op->offset = (load_random(&rng) %
+                            (state.file_size / state.io_size)) *
+                state.io_size;
+              __atomic_add_fetch(&state.outstanding, 1, __ATOMIC_RELAXED);
+              smbpool_submit(pool, op);
+            }
+          /*
+           * Exponential interarrival time
+           */
+          due += (OFC_UINT64) (-log(load_uniform(&rng)) * 1000000 / rate);
+        }
+
+      smbpool_wait(pool);
+      smbpool_destroy(pool);
+
+      load_report(&state, duration, (now_us() - start) / 1000000.0,
+                  offered, dropped);
+    }
+
+  for (i = 0; i < state.num_targets; i++)
+    {
+      if (state.targets[i].wfiles != OFC_NULL)
+        load_teardown(&state, &state.targets[i], keep);
+      free(state.targets[i].wdir);
+    }
+  free(state.targets);
+
+  /*
+   * Deactivate the openfiles stack
+   */
+  printf("Deactivating Stack\n");
+  smbcp_deactivate_at_exit();
+
+  exit(ret);
+  return (ret);
+}
+
+/**
+ * \}
+ */
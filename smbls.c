@@ -237,7 +237,7 @@ int main (int argc, char **argp)
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   exit(status);
 }
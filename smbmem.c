@@ -0,0 +1,239 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <ofc/types.h>
+
+#include "smbmem.h"
+
+/**
+ * \{
+ */
+
+/*
+ * The budget lives outside the stack, like the rate limiter, so that it
+ * can be set before the stack is up
+ */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static OFC_INT64 mem_budget;    /* Budget, 0 if unlimited */
+static OFC_INT64 mem_in_use;    /* Memory held by copies */
+static OFC_INT64 mem_peak;      /* Most memory held at once */
+/*
+ * Memory copies would like and don't have, by priority
+ */
+static OFC_INT64 mem_short[SMBMEM_PRIORITIES];
+static OFC_INT mem_copies;      /* Copies holding a share */
+/*
+ * Total weight of the copies, by priority
+ */
+static OFC_INT64 mem_weight[SMBMEM_PRIORITIES];
+static OFC_UINT64 mem_low;      /* Copies joined in low memory mode */
+
+static OFC_VOID mem_charge(OFC_INT64 bytes)
+{
+  mem_in_use += bytes;
+  if (mem_in_use > mem_peak)
+    mem_peak = mem_in_use;
+}
+
+static OFC_INT64 mem_own_short(struct smbmem_share *share)
+{
+  return ((OFC_INT64) (share->want - share->held) * share->unit);
+}
+
+/*
+ * What copies of higher priority would like and don't have
+ */
+static OFC_INT64 mem_short_above(struct smbmem_share *share)
+{
+  OFC_INT64 total;
+  OFC_INT p;
+
+  total = 0;
+  for (p = share->priority + 1; p < SMBMEM_PRIORITIES; p++)
+    total += mem_short[p];
+  return (total);
+}
+
+/*
+ * What other copies of the same priority would like and don't have
+ */
+static OFC_INT64 mem_others_short(struct smbmem_share *share)
+{
+  return (mem_short[share->priority] - mem_own_short(share));
+}
+
+/*
+ * The budget in proportion to the copy's weight among the copies of its
+ * priority
+ */
+static OFC_INT64 mem_fair(struct smbmem_share *share)
+{
+  OFC_INT64 weight;
+
+  weight = mem_weight[share->priority];
+  return (mem_budget * share->weight / (weight > 0 ? weight : 1));
+}
+
+OFC_VOID smbmem_set(OFC_UINT64 budget)
+{
+  pthread_mutex_lock(&mem_lock);
+  mem_budget = (OFC_INT64) budget;
+  pthread_mutex_unlock(&mem_lock);
+}
+
+OFC_BOOL smbmem_enabled(OFC_VOID)
+{
+  return (mem_budget > 0);
+}
+
+OFC_VOID smbmem_join(struct smbmem_share *share, OFC_INT want,
+                     OFC_DWORD chunk)
+{
+  OFC_INT64 avail;
+
+  pthread_mutex_lock(&mem_lock);
+  share->want = want;
+  share->held = want;
+  share->chunk = chunk;
+  share->unit = chunk;
+  share->low = OFC_FALSE;
+  share->priority = SMBMEM_PRIORITY_NORMAL;
+  share->weight = 1;
+  if (mem_budget > 0)
+    {
+      avail = mem_budget > mem_in_use ? mem_budget - mem_in_use : 0;
+      if (avail < mem_budget * SMBMEM_LOW_PERCENT / 100 &&
+          chunk > SMBMEM_SMALL_CHUNK)
+        {
+          share->chunk = SMBMEM_SMALL_CHUNK;
+          share->unit = SMBMEM_SMALL_CHUNK;
+          share->low = OFC_TRUE;
+          mem_low++;
+        }
+      if (avail / share->unit < want)
+        share->held = (OFC_INT) (avail / share->unit);
+      if (share->held < 1)
+        share->held = 1;
+    }
+  mem_copies++;
+  mem_weight[share->priority] += share->weight;
+  mem_short[share->priority] += mem_own_short(share);
+  mem_charge((OFC_INT64) share->held * share->unit);
+  pthread_mutex_unlock(&mem_lock);
+}
+
+OFC_BOOL smbmem_grow(struct smbmem_share *share)
+{
+  OFC_BOOL grow;
+
+  if (share->held >= share->want)
+    return (OFC_FALSE);
+
+  pthread_mutex_lock(&mem_lock);
+  grow = (mem_budget == 0 ||
+          (mem_in_use + share->unit <= mem_budget &&
+           mem_short_above(share) == 0 &&
+           (mem_others_short(share) == 0 ||
+            (OFC_INT64) (share->held + 1) * share->unit <= mem_fair(share))));
+  if (grow)
+    {
+      share->held++;
+      mem_short[share->priority] -= share->unit;
+      mem_charge(share->unit);
+    }
+  pthread_mutex_unlock(&mem_lock);
+  return (grow);
+}
+
+OFC_BOOL smbmem_over(struct smbmem_share *share)
+{
+  OFC_BOOL over;
+
+  if (mem_budget == 0 || share->held <= 1)
+    return (OFC_FALSE);
+
+  pthread_mutex_lock(&mem_lock);
+  over = (mem_in_use > mem_budget || mem_short_above(share) > 0 ||
+          (mem_others_short(share) > 0 &&
+           (OFC_INT64) share->held * share->unit > mem_fair(share)));
+  pthread_mutex_unlock(&mem_lock);
+  return (over);
+}
+
+OFC_VOID smbmem_release(struct smbmem_share *share)
+{
+  pthread_mutex_lock(&mem_lock);
+  share->held--;
+  mem_short[share->priority] += share->unit;
+  mem_charge(-(OFC_INT64) share->unit);
+  pthread_mutex_unlock(&mem_lock);
+}
+
+OFC_VOID smbmem_set_unit(struct smbmem_share *share, OFC_DWORD unit)
+{
+  OFC_INT64 delta;
+
+  pthread_mutex_lock(&mem_lock);
+  delta = (OFC_INT64) unit - share->unit;
+  mem_short[share->priority] += (OFC_INT64) (share->want - share->held) *
+    delta;
+  mem_charge((OFC_INT64) share->held * delta);
+  share->unit = unit;
+  pthread_mutex_unlock(&mem_lock);
+}
+
+OFC_VOID smbmem_set_priority(struct smbmem_share *share, OFC_INT priority,
+                             OFC_UINT32 weight)
+{
+  if (priority < SMBMEM_PRIORITY_LOW)
+    priority = SMBMEM_PRIORITY_LOW;
+  if (priority > SMBMEM_PRIORITY_HIGH)
+    priority = SMBMEM_PRIORITY_HIGH;
+  if (weight == 0)
+    weight = 1;
+
+  pthread_mutex_lock(&mem_lock);
+  mem_short[share->priority] -= mem_own_short(share);
+  mem_weight[share->priority] -= share->weight;
+  share->priority = priority;
+  share->weight = weight;
+  mem_short[share->priority] += mem_own_short(share);
+  mem_weight[share->priority] += share->weight;
+  pthread_mutex_unlock(&mem_lock);
+}
+
+OFC_VOID smbmem_leave(struct smbmem_share *share)
+{
+  if (share->want == 0)
+    return;
+
+  pthread_mutex_lock(&mem_lock);
+  mem_short[share->priority] -= mem_own_short(share);
+  mem_charge(-(OFC_INT64) share->held * share->unit);
+  mem_copies--;
+  mem_weight[share->priority] -= share->weight;
+  pthread_mutex_unlock(&mem_lock);
+  share->want = 0;
+  share->held = 0;
+}
+
+OFC_VOID smbmem_get_stats(struct smbmem_stats *stats)
+{
+  pthread_mutex_lock(&mem_lock);
+  stats->budget = (OFC_UINT64) mem_budget;
+  stats->in_use = (OFC_UINT64) mem_in_use;
+  stats->peak = (OFC_UINT64) mem_peak;
+  stats->low_memory = mem_low;
+  stats->copies = mem_copies;
+  pthread_mutex_unlock(&mem_lock);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,86 @@
+#if !defined(__smbmem_h__)
+#define __smbmem_h__
+
+#include <ofc/types.h>
+
+/*
+ * Process wide memory budget for copy buffers.
+ *
+ * Every copy in the process draws its buffers from one budget.  A copy
+ * joins with the number of buffers it would like and is granted as many
+ * as the budget has room for, but always at least one so that every copy
+ * gets somewhere.  When less than SMBMEM_LOW_PERCENT of the budget is
+ * free as a copy joins, the copy runs in low memory mode with chunks of
+ * SMBMEM_SMALL_CHUNK bytes.
+ *
+ * Copies have a priority and a weight.  While a copy of higher priority
+ * is short of buffers, copies of lower priority are over and should give
+ * buffers back, down to their last one, and can't take more.  A copy's
+ * fair share is the budget in proportion to its weight among the copies
+ * of its priority.  While some copies of a priority have fewer buffers
+ * than they would like, a copy of that priority holding more than its
+ * fair share is over.  A copy short of buffers takes another whenever
+ * the budget has room and it is under its fair share, or nobody of its
+ * priority or higher is short.  Copies ask as their
+ * buffers finish chunks, so each copy's queue depth follows the pressure
+ * on the budget.  Copies join at normal priority with a weight of 1.
+ *
+ * A budget of zero, the default, is unlimited and copies get every
+ * buffer they ask for.  Memory is counted either way.  smbmem_set may be
+ * called at any time, including before smbcp_init.
+ */
+#define SMBMEM_LOW_PERCENT 25
+#define SMBMEM_SMALL_CHUNK (64 * 1024)
+/*
+ * Priorities
+ */
+#define SMBMEM_PRIORITY_LOW 0
+#define SMBMEM_PRIORITY_NORMAL 1
+#define SMBMEM_PRIORITY_HIGH 2
+#define SMBMEM_PRIORITIES 3
+
+/*
+ * A copy's share of the budget.  Belongs to the copy and is only
+ * changed through the calls below.
+ */
+struct smbmem_share {
+  OFC_INT want;                 /* Buffers the copy would like */
+  OFC_INT held;                 /* Buffers the copy holds */
+  OFC_DWORD chunk;              /* Size of the copy's chunks */
+  OFC_DWORD unit;               /* Memory held per buffer */
+  OFC_BOOL low;                 /* Joined in low memory mode */
+  OFC_INT priority;             /* Priority of the copy */
+  OFC_UINT32 weight;            /* Weight among copies of its priority */
+};
+
+struct smbmem_stats {
+  OFC_UINT64 budget;            /* Budget, 0 if unlimited */
+  OFC_UINT64 in_use;            /* Memory held by copies */
+  OFC_UINT64 peak;              /* Most memory held at once */
+  OFC_UINT64 low_memory;        /* Copies run in low memory mode */
+  OFC_INT copies;               /* Copies holding a share */
+};
+
+OFC_VOID smbmem_set(OFC_UINT64 budget);
+OFC_BOOL smbmem_enabled(OFC_VOID);
+OFC_VOID smbmem_join(struct smbmem_share *share, OFC_INT want,
+                     OFC_DWORD chunk);
+/*
+ * Take another buffer.  Returns OFC_TRUE if the copy may have it.
+ */
+OFC_BOOL smbmem_grow(struct smbmem_share *share);
+/*
+ * Returns OFC_TRUE if the copy should give a buffer back
+ */
+OFC_BOOL smbmem_over(struct smbmem_share *share);
+OFC_VOID smbmem_release(struct smbmem_share *share);
+/*
+ * Change the memory held per buffer, for buffers that carry more than
+ * their chunk.  The change is charged whatever the budget.
+ */
+OFC_VOID smbmem_set_unit(struct smbmem_share *share, OFC_DWORD unit);
+OFC_VOID smbmem_set_priority(struct smbmem_share *share, OFC_INT priority,
+                             OFC_UINT32 weight);
+OFC_VOID smbmem_leave(struct smbmem_share *share);
+OFC_VOID smbmem_get_stats(struct smbmem_stats *stats);
+#endif
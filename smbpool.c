@@ -0,0 +1,205 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ofc/config.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/queue.h>
+#include <ofc/lock.h>
+#include <ofc/event.h>
+#include <ofc/thread.h>
+
+#include "smbpool.h"
+
+/**
+ * \{
+ */
+
+/*
+ * The pool
+ *
+ * Items are kept on a single queue.  Idle workers wait on an auto reset
+ * event.  A worker that dequeues an item while more are queued passes the
+ * wakeup on so that a burst of submissions fans out across the pool.
+ */
+struct smbpool {
+  SMBPOOL_WORK *work;           /* Work routine */
+  OFC_VOID *context;            /* Context for work routine */
+  OFC_HANDLE work_queue;        /* Queued items */
+  OFC_LOCK lock;                /* Protects the queue and outstanding */
+  OFC_HANDLE work_event;        /* Signalled when work is queued */
+  OFC_HANDLE done_event;        /* Signalled when the pool goes idle */
+  OFC_INT outstanding;          /* Items queued or being worked */
+  OFC_INT num_threads;          /* Number of workers */
+  OFC_HANDLE *threads;          /* Worker threads */
+  OFC_HANDLE *notify;           /* Worker exit notifications */
+};
+
+static OFC_DWORD smbpool_thread(OFC_HANDLE hThread, OFC_VOID *context)
+{
+  struct smbpool *pool = context;
+  OFC_VOID *item;
+  OFC_BOOL more;
+
+  while (!ofc_thread_is_deleting(hThread))
+    {
+      ofc_lock(pool->lock);
+      item = ofc_dequeue(pool->work_queue);
+      more = !ofc_queue_empty(pool->work_queue);
+      ofc_unlock(pool->lock);
+
+      if (more)
+        ofc_event_set(pool->work_event);
+
+      if (item == OFC_NULL)
+        ofc_event_wait(pool->work_event);
+      else
+        {
+          (*pool->work)(pool, item, pool->context);
+
+          ofc_lock(pool->lock);
+          pool->outstanding--;
+          if (pool->outstanding == 0)
+            ofc_event_set(pool->done_event);
+          ofc_unlock(pool->lock);
+        }
+    }
+  /*
+   * Pass the wakeup on to the next worker that is exiting
+   */
+  ofc_event_set(pool->work_event);
+  return (0);
+}
+
+/*
+ * Stop the first num_started workers and wait for them to exit
+ */
+static OFC_VOID stop_threads(struct smbpool *pool, OFC_INT num_started)
+{
+  OFC_INT i;
+
+  for (i = 0; i < num_started; i++)
+    ofc_thread_delete(pool->threads[i]);
+  ofc_event_set(pool->work_event);
+
+  for (i = 0; i < num_started; i++)
+    ofc_event_wait(pool->notify[i]);
+}
+
+/*
+ * Release the pool once its workers have exited.  Anything not created
+ * is null, so this also cleans up a pool that was only partly set up.
+ */
+static OFC_VOID free_pool(struct smbpool *pool)
+{
+  OFC_INT i;
+
+  if (pool->notify != OFC_NULL)
+    {
+      for (i = 0; i < pool->num_threads; i++)
+        if (pool->notify[i] != OFC_HANDLE_NULL)
+          ofc_event_destroy(pool->notify[i]);
+      free(pool->notify);
+    }
+  free(pool->threads);
+  if (pool->done_event != OFC_HANDLE_NULL)
+    ofc_event_destroy(pool->done_event);
+  if (pool->work_event != OFC_HANDLE_NULL)
+    ofc_event_destroy(pool->work_event);
+  if (pool->lock != OFC_NULL)
+    ofc_lock_destroy(pool->lock);
+  if (pool->work_queue != OFC_HANDLE_NULL)
+    ofc_queue_destroy(pool->work_queue);
+  free(pool);
+}
+
+struct smbpool *smbpool_create(OFC_INT num_threads, SMBPOOL_WORK *work,
+                               OFC_VOID *context)
+{
+  struct smbpool *pool;
+  OFC_INT i;
+
+  pool = calloc(1, sizeof(struct smbpool));
+  if (pool == OFC_NULL)
+    return (OFC_NULL);
+
+  pool->work = work;
+  pool->context = context;
+  pool->outstanding = 0;
+  pool->num_threads = num_threads;
+  pool->work_queue = ofc_queue_create();
+  pool->lock = ofc_lock_init();
+  pool->work_event = ofc_event_create(OFC_EVENT_AUTO);
+  pool->done_event = ofc_event_create(OFC_EVENT_AUTO);
+  /*
+   * Zeroed so that a worker that isn't started has nothing to destroy
+   */
+  pool->threads = calloc(num_threads, sizeof(OFC_HANDLE));
+  pool->notify = calloc(num_threads, sizeof(OFC_HANDLE));
+  if (pool->work_queue == OFC_HANDLE_NULL || pool->lock == OFC_NULL ||
+      pool->work_event == OFC_HANDLE_NULL ||
+      pool->done_event == OFC_HANDLE_NULL ||
+      pool->threads == OFC_NULL || pool->notify == OFC_NULL)
+    {
+      free_pool(pool);
+      return (OFC_NULL);
+    }
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pool->notify[i] = ofc_event_create(OFC_EVENT_AUTO);
+      if (pool->notify[i] != OFC_HANDLE_NULL)
+        pool->threads[i] = ofc_thread_create(&smbpool_thread,
+                                             "SMBPOOL", i, pool,
+                                             OFC_THREAD_DETACH,
+                                             pool->notify[i]);
+      if (pool->threads[i] == OFC_HANDLE_NULL)
+        {
+          stop_threads(pool, i);
+          free_pool(pool);
+          return (OFC_NULL);
+        }
+    }
+  return (pool);
+}
+
+OFC_VOID smbpool_submit(struct smbpool *pool, OFC_VOID *item)
+{
+  ofc_lock(pool->lock);
+  pool->outstanding++;
+  ofc_enqueue(pool->work_queue, item);
+  ofc_unlock(pool->lock);
+
+  ofc_event_set(pool->work_event);
+}
+
+OFC_VOID smbpool_wait(struct smbpool *pool)
+{
+  OFC_BOOL idle;
+
+  idle = OFC_FALSE;
+  while (!idle)
+    {
+      ofc_lock(pool->lock);
+      idle = (pool->outstanding == 0);
+      ofc_unlock(pool->lock);
+
+      if (!idle)
+        ofc_event_wait(pool->done_event);
+    }
+}
+
+OFC_VOID smbpool_destroy(struct smbpool *pool)
+{
+  stop_threads(pool, pool->num_threads);
+  free_pool(pool);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,24 @@
+#if !defined(__smbpool_h__)
+#define __smbpool_h__
+
+#include <ofc/types.h>
+
+/*
+ * A fixed size pool of worker threads servicing a shared work queue.
+ *
+ * The work routine is called on a pool thread for every submitted item.
+ * It may submit further items to the same pool.  Work routines run
+ * concurrently so any state they share must be protected by the caller.
+ * smbpool_create returns OFC_NULL if the pool can't be set up.
+ */
+struct smbpool;
+
+typedef OFC_VOID (SMBPOOL_WORK)(struct smbpool *pool, OFC_VOID *item,
+                                OFC_VOID *context);
+
+struct smbpool *smbpool_create(OFC_INT num_threads, SMBPOOL_WORK *work,
+                               OFC_VOID *context);
+OFC_VOID smbpool_submit(struct smbpool *pool, OFC_VOID *item);
+OFC_VOID smbpool_wait(struct smbpool *pool);
+OFC_VOID smbpool_destroy(struct smbpool *pool);
+#endif
@@ -0,0 +1,165 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ofc/types.h>
+
+#include "smbrate.h"
+
+/**
+ * \{
+ */
+
+/*
+ * A bucket.  Tokens go negative when an I/O larger than what's in the
+ * bucket is admitted.
+ */
+struct rate_bucket {
+  double rate;                  /* Tokens per second, 0 if unlimited */
+  double burst;                 /* Most tokens the bucket holds */
+  double tokens;                /* Tokens in the bucket */
+};
+
+/*
+ * The limiter lives outside the stack so that it can be configured
+ * before the stack is up and survives the stack being restarted
+ */
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rate_bucket rate_bytes;
+static struct rate_bucket rate_ios;
+static OFC_UINT64 rate_last;    /* Time of last refill in microseconds */
+static volatile OFC_BOOL rate_active = OFC_FALSE;
+
+static OFC_UINT64 rate_now(OFC_VOID)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((OFC_UINT64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static OFC_VOID rate_init_bucket(struct rate_bucket *bucket, OFC_UINT64 rate)
+{
+  bucket->rate = (double) rate;
+  bucket->burst = bucket->rate * SMBRATE_BURST_MS / 1000;
+  /*
+   * Always let at least one I/O through per refill
+   */
+  if (bucket->burst < 1)
+    bucket->burst = 1;
+  bucket->tokens = bucket->burst;
+}
+
+static OFC_VOID rate_refill(struct rate_bucket *bucket, OFC_UINT64 elapsed)
+{
+  if (bucket->rate > 0)
+    {
+      bucket->tokens += bucket->rate * elapsed / 1000000;
+      if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    }
+}
+
+/*
+ * Milliseconds until the bucket is out of debt
+ */
+static OFC_MSTIME rate_wait(struct rate_bucket *bucket)
+{
+  OFC_MSTIME wait;
+
+  wait = 0;
+  if (bucket->rate > 0 && bucket->tokens < 0)
+    {
+      wait = (OFC_MSTIME) (-bucket->tokens * 1000 / bucket->rate) + 1;
+    }
+  return (wait);
+}
+
+OFC_VOID smbrate_set(OFC_UINT64 bytes_per_sec, OFC_UINT64 ios_per_sec)
+{
+  pthread_mutex_lock(&rate_lock);
+  rate_init_bucket(&rate_bytes, bytes_per_sec);
+  rate_init_bucket(&rate_ios, ios_per_sec);
+  rate_last = rate_now();
+  rate_active = (bytes_per_sec > 0 || ios_per_sec > 0);
+  pthread_mutex_unlock(&rate_lock);
+}
+
+OFC_BOOL smbrate_enabled(OFC_VOID)
+{
+  return (rate_active);
+}
+
+OFC_MSTIME smbrate_take(OFC_DWORD bytes)
+{
+  OFC_UINT64 now;
+  OFC_MSTIME wait;
+  OFC_MSTIME ios_wait;
+
+  if (!rate_active)
+    return (0);
+
+  pthread_mutex_lock(&rate_lock);
+  now = rate_now();
+  rate_refill(&rate_bytes, now - rate_last);
+  rate_refill(&rate_ios, now - rate_last);
+  rate_last = now;
+
+  wait = rate_wait(&rate_bytes);
+  ios_wait = rate_wait(&rate_ios);
+  if (ios_wait > wait)
+    wait = ios_wait;
+
+  if (wait == 0)
+    {
+      if (rate_bytes.rate > 0)
+        rate_bytes.tokens -= bytes;
+      if (rate_ios.rate > 0)
+        rate_ios.tokens -= 1;
+    }
+  pthread_mutex_unlock(&rate_lock);
+
+  return (wait);
+}
+
+int smbrate_parse(const char *str, OFC_UINT64 *rate)
+{
+  char *end;
+  int ret;
+
+  ret = 0;
+  *rate = strtoull(str, &end, 10);
+  if (end == str)
+    ret = -1;
+  else
+    {
+      switch (*end)
+        {
+        case 'G': case 'g':
+          *rate *= 1000;
+          /* fall through */
+        case 'M': case 'm':
+          *rate *= 1000;
+          /* fall through */
+        case 'K': case 'k':
+          *rate *= 1000;
+          end++;
+          break;
+        default:
+          break;
+        }
+      if (*end != '\0')
+        ret = -1;
+    }
+  return (ret);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,33 @@
+#if !defined(__smbrate_h__)
+#define __smbrate_h__
+
+#include <ofc/types.h>
+
+/*
+ * Process wide I/O rate limiter.
+ *
+ * A token bucket for bytes and another for I/Os, shared by every copy in
+ * the process.  Each bucket refills continuously at its rate and holds at
+ * most SMBRATE_BURST_MS worth of tokens, so a throttled process issues
+ * I/Os at a steady pace rather than sleeping and then bursting.  An I/O
+ * is admitted whenever neither bucket is in debt and is then charged in
+ * full, which lets I/Os larger than the burst through without stalling.
+ *
+ * A rate of zero leaves that bucket unlimited.  smbrate_set may be called
+ * at any time, including before smbcp_init.
+ */
+#define SMBRATE_BURST_MS 50
+
+OFC_VOID smbrate_set(OFC_UINT64 bytes_per_sec, OFC_UINT64 ios_per_sec);
+OFC_BOOL smbrate_enabled(OFC_VOID);
+/*
+ * Charge an I/O of the given number of bytes.  Returns 0 if the I/O may
+ * be issued, or the number of milliseconds to wait before asking again.
+ * Nothing is charged unless the I/O is admitted.
+ */
+OFC_MSTIME smbrate_take(OFC_DWORD bytes);
+/*
+ * Parse a rate with an optional K, M or G suffix
+ */
+int smbrate_parse(const char *str, OFC_UINT64 *rate);
+#endif
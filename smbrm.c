@@ -12,12 +12,22 @@
 #include <ofc/handle.h>
 #include <ofc/types.h>
 #include <ofc/file.h>
+#include <ofc/lock.h>
 
 #include "smbinit.h"
+#include "smbpool.h"
+#include "smbwalk.h"
 /**
  * \{
  */
 
+/*
+ * Number of delete on close opens in flight and number of directories
+ * enumerated concurrently in recursive and batch modes
+ */
+#define RM_THREADS 16
+#define WALK_THREADS 8
+
 static OFC_DWORD rm(OFC_CTCHAR *wfilename)
 {
   OFC_DWORD dwLastError;
@@ -50,6 +60,235 @@ static OFC_DWORD rm(OFC_CTCHAR *wfilename)
   return (dwLastError);
 }
 
+/*
+ * Recursive and batch removal
+ *
+ * Files are deleted on a pool of workers so that a bounded number of
+ * delete on close opens are in flight.  Trees are walked in parallel and
+ * each file found is handed to the delete pool with a hold on its
+ * directory.  A directory is removed once it has been enumerated and every
+ * file and subdirectory within it has been dealt with, so directories are
+ * removed bottom up as they empty.
+ */
+struct rm_state {
+  struct smbpool *delete_pool;  /* Pool of delete workers */
+  OFC_LOCK lock;                /* Serializes output and protects counts */
+  OFC_DWORD first_error;        /* First error */
+  OFC_UINT64 files;             /* Files removed */
+  OFC_UINT64 dirs;              /* Directories removed */
+  OFC_UINT64 failed;            /* Files and directories not removed */
+};
+
+struct rm_item {
+  OFC_TCHAR *filename;          /* File to remove */
+  struct smbwalk_dir *dir;      /* Held directory or OFC_NULL */
+};
+
+static wchar_t *MakeFilename(const wchar_t *dirname, const wchar_t *name)
+{
+  size_t dirlen;
+  size_t namelen;
+  wchar_t *filename;
+
+  dirlen = wcslen (dirname);
+  namelen = wcslen (name);
+  filename =
+    malloc((dirlen + namelen + 2) * sizeof(wchar_t));
+  if (filename == NULL)
+    return (NULL);
+  wcscpy (filename, dirname);
+  filename[dirlen] = L'/';
+  wcscpy (&filename[dirlen+1], name);
+  filename[dirlen + 1 + namelen] = L'\0';
+  return (filename);
+}
+
+static OFC_VOID rm_result(struct rm_state *state, OFC_CTCHAR *filename,
+                          OFC_BOOL dir, OFC_DWORD dwLastError)
+{
+  ofc_lock(state->lock);
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    {
+      if (dir)
+        state->dirs++;
+      else
+        state->files++;
+    }
+  else
+    {
+      state->failed++;
+      printf("Cannot remove %ls: %s\n", filename,
+             ofc_get_error_string(dwLastError));
+      if (state->first_error == OFC_ERROR_SUCCESS)
+        state->first_error = dwLastError;
+    }
+  ofc_unlock(state->lock);
+}
+
+static OFC_VOID rm_work(struct smbpool *pool, OFC_VOID *item,
+                        OFC_VOID *context)
+{
+  struct rm_state *state = context;
+  struct rm_item *rm_item = item;
+
+  rm_result(state, rm_item->filename, OFC_FALSE, rm(rm_item->filename));
+  /*
+   * The file is dealt with.  Let the directory complete.
+   */
+  if (rm_item->dir != OFC_NULL)
+    smbwalk_release(rm_item->dir);
+
+  free(rm_item->filename);
+  free(rm_item);
+}
+
+static OFC_VOID rm_submit(struct rm_state *state, OFC_TCHAR *filename,
+                          struct smbwalk_dir *dir)
+{
+  struct rm_item *rm_item;
+
+  rm_item = malloc(sizeof(struct rm_item));
+  if (rm_item == OFC_NULL)
+    {
+      rm_result(state, filename, OFC_FALSE, OFC_ERROR_NOT_ENOUGH_MEMORY);
+      free(filename);
+      return;
+    }
+  rm_item->filename = filename;
+  rm_item->dir = dir;
+  if (dir != OFC_NULL)
+    smbwalk_hold(dir);
+  smbpool_submit(state->delete_pool, rm_item);
+}
+
+static OFC_VOID rm_entry(struct smbwalk_dir *dir,
+                         OFC_WIN32_FIND_DATA *find_data,
+                         OFC_VOID *context)
+{
+  struct rm_state *state = context;
+  OFC_TCHAR *filename;
+
+  if (!(find_data->dwFileAttributes & OFC_FILE_ATTRIBUTE_DIRECTORY))
+    {
+      filename = MakeFilename(smbwalk_dirname(dir), find_data->cFileName);
+      if (filename == OFC_NULL)
+        rm_result(state, find_data->cFileName, OFC_FALSE,
+                  OFC_ERROR_NOT_ENOUGH_MEMORY);
+      else
+        rm_submit(state, filename, dir);
+    }
+}
+
+static OFC_VOID rm_dir_done(OFC_CTCHAR *dirname, OFC_VOID *context)
+{
+  struct rm_state *state = context;
+  OFC_DWORD dwLastError;
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  if (OfcRemoveDirectory(dirname) != OFC_TRUE)
+    dwLastError = OfcGetLastError();
+  rm_result(state, dirname, OFC_TRUE, dwLastError);
+}
+
+static OFC_VOID rm_path(struct rm_state *state, const char *path,
+                        OFC_BOOL recursive)
+{
+  OFC_TCHAR *wfilename;
+  OFC_WIN32_FILE_ATTRIBUTE_DATA info;
+  OFC_DWORD dwLastError;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
+
+  memset(&ps, 0, sizeof(ps));
+  len = strlen(path) + 1;
+  wfilename = malloc(sizeof(wchar_t) * len);
+  if (wfilename == OFC_NULL)
+    {
+      ofc_lock(state->lock);
+      state->failed++;
+      printf("Cannot remove %s: %s\n", path,
+             ofc_get_error_string(OFC_ERROR_NOT_ENOUGH_MEMORY));
+      if (state->first_error == OFC_ERROR_SUCCESS)
+        state->first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+      ofc_unlock(state->lock);
+      return;
+    }
+  cursor = path;
+  mbsrtowcs(wfilename, &cursor, len, &ps);
+
+  if (recursive &&
+      OfcGetFileAttributesEx(wfilename, OfcGetFileExInfoStandard,
+                             &info) == OFC_TRUE &&
+      (info.dwFileAttributes & OFC_FILE_ATTRIBUTE_DIRECTORY))
+    {
+      dwLastError = smbwalk(wfilename, WALK_THREADS, &rm_entry,
+                            &rm_dir_done, state);
+      if (dwLastError != OFC_ERROR_SUCCESS)
+        {
+          ofc_lock(state->lock);
+          if (state->first_error == OFC_ERROR_SUCCESS)
+            state->first_error = dwLastError;
+          ofc_unlock(state->lock);
+        }
+      free(wfilename);
+    }
+  else
+    rm_submit(state, wfilename, OFC_NULL);
+}
+
+static OFC_DWORD rm_batch(char **paths, int num_paths, OFC_BOOL recursive,
+                          int num_threads)
+{
+  struct rm_state state;
+  char *line;
+  size_t linesize;
+  ssize_t linelen;
+  int i;
+
+  memset(&state, 0, sizeof(state));
+  state.lock = ofc_lock_init();
+  if (state.lock == OFC_NULL)
+    return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+  state.delete_pool = smbpool_create(num_threads, &rm_work, &state);
+  if (state.delete_pool == OFC_NULL)
+    state.first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
+    {
+      if (num_paths == 1 && strcmp(paths[0], "-") == 0)
+        {
+          /*
+           * One path per line on stdin
+           */
+          line = OFC_NULL;
+          linesize = 0;
+          while ((linelen = getline(&line, &linesize, stdin)) != -1)
+            {
+              while (linelen > 0 && (line[linelen-1] == '\n' ||
+                                     line[linelen-1] == '\r'))
+                line[--linelen] = '\0';
+              if (linelen > 0)
+                rm_path(&state, line, recursive);
+            }
+          free(line);
+        }
+      else
+        {
+          for (i = 0; i < num_paths; i++)
+            rm_path(&state, paths[i], recursive);
+        }
+
+      smbpool_wait(state.delete_pool);
+      smbpool_destroy(state.delete_pool);
+    }
+
+  printf("Removed %llu files and %llu directories, %llu failed\n",
+         (unsigned long long) state.files, (unsigned long long) state.dirs,
+         (unsigned long long) state.failed);
+  ofc_lock_destroy(state.lock);
+  return (state.first_error);
+}
+
 int main (int argc, char **argp)
 {
   OFC_TCHAR *wfilename;
@@ -57,27 +296,50 @@ int main (int argc, char **argp)
   size_t len;
   mbstate_t ps;
   const char *cursor;
+  int recursive = 0;
+  int num_threads = RM_THREADS;
+  int argidx;
 
   smbcp_init();
-  
-  if (argc < 2)
+
+  argidx = 1;
+  while (argidx < argc && argp[argidx][0] == '-')
+    {
+      if (strcmp(argp[argidx], "-r") == 0)
+        recursive = 1;
+      else if (strcmp(argp[argidx], "-j") == 0 && argidx + 1 < argc)
+        num_threads = atoi(argp[++argidx]);
+      else
+        break;
+      argidx++;
+    }
+
+  if (argidx >= argc || num_threads < 1)
     {
       printf ("Usage: smbrm <destination>\n");
+      printf ("       smbrm [-r] [-j <deletes>] <path> <path>... | -\n");
       exit (1);
     }
 
-  memset(&ps, 0, sizeof(ps));
-  len = strlen(argp[1]) + 1;
-  wfilename = malloc(sizeof(wchar_t) * len);
-  cursor = argp[1];
-  mbsrtowcs(wfilename, &cursor, len, &ps);
+  if (recursive || argc - argidx > 1 || strcmp(argp[argidx], "-") == 0)
+    {
+      ret = rm_batch(&argp[argidx], argc - argidx, recursive, num_threads);
+    }
+  else
+    {
+      memset(&ps, 0, sizeof(ps));
+      len = strlen(argp[argidx]) + 1;
+      wfilename = malloc(sizeof(wchar_t) * len);
+      cursor = argp[argidx];
+      mbsrtowcs(wfilename, &cursor, len, &ps);
 
-  printf("Removing %s: ", argp[1]);
-  fflush(stdout);
+      printf("Removing %s: ", argp[argidx]);
+      fflush(stdout);
 
-  ret = rm(wfilename);
-  
-  free(wfilename);
+      ret = rm(wfilename);
+
+      free(wfilename);
+    }
 
   int status;
   if (ret == OFC_ERROR_SUCCESS)
@@ -96,7 +358,7 @@ int main (int argc, char **argp)
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   exit(status);
 }
@@ -6,8 +6,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
+#include <limits.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 
 #include <ofc/config.h>
 #include <ofc/handle.h>
@@ -16,25 +27,394 @@
 #include <of_smb/framework.h>
 
 #include "smbinit.h"
+#include "smbsynth.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Port the server accepts sessions on
+ */
+#define SMB_PORT 445
+
+/*
+ * Set from signal handlers and serviced by the main loop
+ */
+static volatile sig_atomic_t shutdown_requested = 0;
+static volatile sig_atomic_t dump_requested = 0;
+
+static void signal_handler(int sig)
+{
+  if (sig == SIGUSR1)
+    dump_requested = 1;
+  else
+    shutdown_requested = 1;
+}
+
+/*
+ * Runtime statistics
+ *
+ * The stack doesn't export its internal counters so statistics are taken
+ * from what the kernel knows about the process:
+ *
+ *   sessions     - established TCP connections to the SMB port on sockets
+ *                  owned by this process
+ *   open files   - file descriptors open on regular files
+ *   bytes        - storage bytes read and written by the process and all
+ *                  bytes (network included) moved through read/write
+ *                  system calls
+ *
+ * Rates are computed over the interval since the previous dump.  The SMB
+ * dispatch is inside the stack and doesn't count requests, so there are
+ * no request rates or per command latencies here.
+ */
+struct server_stats {
+  struct timespec when;         /* Time of sample */
+  OFC_UINT64 sessions;          /* Established SMB connections */
+  OFC_UINT64 open_files;        /* Open regular files */
+  OFC_UINT64 read_bytes;        /* Storage bytes read */
+  OFC_UINT64 write_bytes;       /* Storage bytes written */
+  OFC_UINT64 rchar;             /* Bytes read (all descriptors) */
+  OFC_UINT64 wchar;             /* Bytes written (all descriptors) */
+  double cpu;                   /* CPU seconds (user + system) */
+  long maxrss;                  /* Max resident set (KB) */
+};
+
+static struct timespec start_time;
+static struct server_stats last_stats;
+
+static OFC_BOOL socket_owned(unsigned long inode, unsigned long *inodes,
+                             OFC_INT num_inodes)
+{
+  OFC_INT i;
+
+  for (i = 0; i < num_inodes && inodes[i] != inode; i++);
+  return (i < num_inodes);
+}
+
+static OFC_UINT64 count_sessions(const char *table, unsigned long *inodes,
+                                 OFC_INT num_inodes)
+{
+  FILE *fp;
+  char line[512];
+  char local[64];
+  char remote[64];
+  unsigned int state;
+  unsigned long inode;
+  char *colon;
+  OFC_UINT64 sessions;
+
+  sessions = 0;
+  fp = fopen(table, "r");
+  if (fp != NULL)
+    {
+      /*
+       * Skip the heading
+       */
+      if (fgets(line, sizeof(line), fp) != NULL)
+        {
+          while (fgets(line, sizeof(line), fp) != NULL)
+            {
+              if (sscanf(line, "%*d: %63s %63s %x %*s %*s %*s %*d %*d %lu",
+                         local, remote, &state, &inode) == 4)
+                {
+                  colon = strrchr(local, ':');
+                  /*
+                   * State 01 is ESTABLISHED
+                   */
+                  if (colon != NULL && state == 0x01 &&
+                      strtoul(colon + 1, NULL, 16) == SMB_PORT &&
+                      socket_owned(inode, inodes, num_inodes))
+                    sessions++;
+                }
+            }
+        }
+      fclose(fp);
+    }
+  return (sessions);
+}
+
+static OFC_VOID sample_stats(struct server_stats *stats)
+{
+  DIR *dir;
+  struct dirent *dirent;
+  char path[sizeof("/proc/self/fd/") + NAME_MAX];
+  char link[128];
+  ssize_t len;
+  struct stat st;
+  unsigned long *inodes;
+  unsigned long *grown;
+  OFC_INT num_inodes;
+  OFC_INT max_inodes;
+  FILE *fp;
+  char name[32];
+  unsigned long long value;
+  struct rusage usage;
+
+  memset(stats, 0, sizeof(struct server_stats));
+  clock_gettime(CLOCK_MONOTONIC, &stats->when);
+
+  /*
+   * Walk our descriptors collecting socket inodes and counting files
+   */
+  num_inodes = 0;
+  max_inodes = 64;
+  inodes = malloc(sizeof(unsigned long) * max_inodes);
+  if (inodes == NULL)
+    max_inodes = 0;
+  dir = opendir("/proc/self/fd");
+  if (dir != NULL)
+    {
+      while ((dirent = readdir(dir)) != NULL)
+        {
+          if (dirent->d_name[0] == '.')
+            continue;
+          snprintf(path, sizeof(path), "/proc/self/fd/%s", dirent->d_name);
+          len = readlink(path, link, sizeof(link) - 1);
+          if (len <= 0)
+            continue;
+          link[len] = '\0';
+          if (strncmp(link, "socket:[", 8) == 0)
+            {
+              /*
+               * Sockets we have no room for aren't counted as sessions
+               */
+              if (num_inodes == max_inodes && max_inodes > 0)
+                {
+                  grown = realloc(inodes, sizeof(unsigned long) *
+                                  max_inodes * 2);
+                  if (grown != NULL)
+                    {
+                      inodes = grown;
+                      max_inodes *= 2;
+                    }
+                }
+              if (num_inodes < max_inodes)
+                inodes[num_inodes++] = strtoul(link + 8, NULL, 10);
+            }
+          else if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            stats->open_files++;
+        }
+      closedir(dir);
+    }
+
+  stats->sessions = count_sessions("/proc/self/net/tcp", inodes, num_inodes) +
+    count_sessions("/proc/self/net/tcp6", inodes, num_inodes);
+  free(inodes);
+
+  fp = fopen("/proc/self/io", "r");
+  if (fp != NULL)
+    {
+      while (fscanf(fp, "%31[^:]: %llu\n", name, &value) == 2)
+        {
+          if (strcmp(name, "read_bytes") == 0)
+            stats->read_bytes = value;
+          else if (strcmp(name, "write_bytes") == 0)
+            stats->write_bytes = value;
+          else if (strcmp(name, "rchar") == 0)
+            stats->rchar = value;
+          else if (strcmp(name, "wchar") == 0)
+            stats->wchar = value;
+        }
+      fclose(fp);
+    }
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+      stats->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+      stats->maxrss = usage.ru_maxrss;
+    }
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+  return ((to->tv_sec - from->tv_sec) +
+          (to->tv_nsec - from->tv_nsec) / 1e9);
+}
+
+static OFC_VOID dump_stats(FILE *out)
+{
+  struct server_stats stats;
+  double interval;
+
+  sample_stats(&stats);
+  interval = elapsed(&last_stats.when, &stats.when);
+  if (interval <= 0)
+    interval = 1;
+
+  fprintf(out, "Server Statistics\n");
+  fprintf(out, "  Uptime: %.0f seconds\n", elapsed(&start_time, &stats.when));
+  fprintf(out, "  Sessions: %llu\n", (unsigned long long) stats.sessions);
+  fprintf(out, "  Open Files: %llu\n", (unsigned long long) stats.open_files);
+  fprintf(out, "  Storage Bytes Read: %llu (%.0f/s)\n",
+          (unsigned long long) stats.read_bytes,
+          (stats.read_bytes - last_stats.read_bytes) / interval);
+  fprintf(out, "  Storage Bytes Written: %llu (%.0f/s)\n",
+          (unsigned long long) stats.write_bytes,
+          (stats.write_bytes - last_stats.write_bytes) / interval);
+  fprintf(out, "  Total Bytes Read: %llu (%.0f/s)\n",
+          (unsigned long long) stats.rchar,
+          (stats.rchar - last_stats.rchar) / interval);
+  fprintf(out, "  Total Bytes Written: %llu (%.0f/s)\n",
+          (unsigned long long) stats.wchar,
+          (stats.wchar - last_stats.wchar) / interval);
+  fprintf(out, "  CPU: %.2f seconds (%.0f%%)\n", stats.cpu,
+          100.0 * (stats.cpu - last_stats.cpu) / interval);
+  fprintf(out, "  Max Resident: %ld KB\n", stats.maxrss);
+  smbsynth_dump(out);
+  fflush(out);
+
+  last_stats = stats;
+}
+
+/*
+ * The stats socket.  A client connecting to the unix domain socket
+ * receives a dump and the connection is closed.  For example:
+ *
+ *   socat - UNIX-CONNECT:/run/smbserver.sock
+ */
+static int open_stats_socket(const char *path)
+{
+  int fd;
+  struct sockaddr_un addr;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0)
+    {
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+      unlink(path);
+      if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+          listen(fd, 4) != 0)
+        {
+          perror(path);
+          close(fd);
+          fd = -1;
+        }
+    }
+  return (fd);
+}
+
+static OFC_VOID serve_stats(int fd)
+{
+  int client;
+  FILE *out;
+
+  client = accept(fd, NULL, NULL);
+  if (client >= 0)
+    {
+      out = fdopen(client, "w");
+      if (out == NULL)
+        close(client);
+      else
+        {
+          dump_stats(out);
+          fclose(out);
+        }
+    }
+}
 
 int main (int argc, char **argp)
 {
-  OFC_DWORD ret;
+  const char *stats_path = NULL;
+  int stats_fd = -1;
+  struct sigaction sa;
+  struct pollfd pfd;
+  int argidx;
+  int usage;
+  const char *synth_config = NULL;
+  int synth_checksum = 0;
+
+  usage = 0;
+  for (argidx = 1; argidx < argc && !usage; argidx++)
+    {
+      if (strcmp(argp[argidx], "-s") == 0 && argidx + 1 < argc)
+        stats_path = argp[++argidx];
+      else if (strcmp(argp[argidx], "-synth") == 0 && argidx + 1 < argc)
+        synth_config = argp[++argidx];
+      else if (strcmp(argp[argidx], "-synth-checksum") == 0)
+        synth_checksum = 1;
+      else
+        usage = 1;
+    }
+
+  if (usage)
+    {
+      printf ("Usage: smbserver [-s <stats-socket>] "
+              "[-synth <config> [-synth-checksum]]\n");
+      printf ("       -synth serves generated data from the files in "
+              "<config>\n");
+      printf ("       on shares whose path is %s:/\n", SMBSYNTH_DEVICE);
+      exit (1);
+    }
 
   smbcp_init();
 
+  /*
+   * The synthetic file system is registered before the server is started
+   * so shares configured on it can be served from the first connection
+   */
+  if (synth_config != NULL &&
+      smbsynth_setup(synth_config, synth_checksum) != 0)
+    {
+      smbcp_deactivate();
+      exit (1);
+    }
+
 #if defined(OF_SMB_SERVER)
   printf("Starting Server\n");
 
-  OFC_HANDLE hApp = of_smb_startup_server(OFC_HANDLE_NULL);
+  /*
+   * The server is started on an implicitly created scheduler and we are
+   * handed back that scheduler for the shutdown
+   */
+  OFC_HANDLE hScheduler = of_smb_startup_server(OFC_HANDLE_NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  sample_stats(&last_stats);
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = signal_handler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (stats_path != NULL)
+    stats_fd = open_stats_socket(stats_path);
+
+  while (!shutdown_requested)
+    {
+      /*
+       * Signals interrupt the poll so requests are serviced promptly.
+       * The timeout covers a signal landing just before we block.
+       */
+      pfd.fd = stats_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, stats_fd >= 0 ? 1 : 0, 1000) > 0 &&
+          (pfd.revents & POLLIN))
+        serve_stats(stats_fd);
+
+      if (dump_requested)
+        {
+          dump_requested = 0;
+          dump_stats(stdout);
+        }
+    }
 
-  while (1)
+  printf("Stopping Server\n");
+  if (stats_fd >= 0)
     {
-      sleep(10000);
+      close(stats_fd);
+      unlink(stats_path);
     }
-#if 0
+  dump_stats(stdout);
   of_smb_server_shutdown(hScheduler);
-#endif
 #else
   printf("Server Not Supported\n");
 #endif
@@ -43,9 +423,12 @@ int main (int argc, char **argp)
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   exit(0);
   return (0);
 }
 
+/**
+ * \}
+ */
@@ -12,12 +12,24 @@
 #include <ofc/handle.h>
 #include <ofc/types.h>
 #include <ofc/file.h>
+#include <ofc/lock.h>
 
 #include "smbinit.h"
+#include "smbpool.h"
+#include "smbwalk.h"
 /**
  * \{
  */
 
+/*
+ * Number of directories enumerated concurrently in recursive mode
+ */
+#define DU_THREADS 8
+/*
+ * Number of path queries in flight in batch mode
+ */
+#define STAT_THREADS 16
+
 static OFC_DWORD getsizebyhandle(OFC_CTCHAR *wfilename)
 {
   OFC_DWORD dwLastError;
@@ -91,38 +103,408 @@ static OFC_DWORD getsize(OFC_CTCHAR *wfilename)
   return (dwLastError);
 }
 
-int main (int argc, char **argp)
+/*
+ * Recursive (du style) totals
+ *
+ * End of file comes straight from the directory enumeration.  Directory
+ * listings don't carry the allocation size so by default it is estimated
+ * by rounding each file up to the cluster size of the share.  With -a,
+ * the exact allocation size of each file is queried by handle, which
+ * costs an open, query and close per file.
+ */
+struct du_state {
+  OFC_LOCK lock;                /* Protects the totals */
+  OFC_BOOL exact;               /* Query allocation size per file */
+  OFC_UINT64 cluster_size;      /* Cluster size or 0 if unknown */
+  OFC_UINT64 files;             /* Number of files */
+  OFC_UINT64 dirs;              /* Number of directories */
+  OFC_UINT64 end_of_file;       /* Total end of file */
+  OFC_UINT64 allocation;        /* Total allocation size */
+  OFC_UINT64 errors;            /* Files whose allocation query failed */
+};
+
+static OFC_BOOL getallocation(OFC_CTCHAR *dirname, OFC_CTCHAR *name,
+                              OFC_UINT64 *allocation)
 {
+  OFC_TCHAR *filename;
+  OFC_HANDLE file;
+  OFC_FILE_STANDARD_INFO info;
+  size_t dirlen;
+  OFC_BOOL ret;
+
+  ret = OFC_FALSE;
+  dirlen = wcslen(dirname);
+  filename = malloc((dirlen + wcslen(name) + 2) * sizeof(OFC_TCHAR));
+  if (filename != OFC_NULL)
+    {
+      wcscpy(filename, dirname);
+      filename[dirlen] = L'/';
+      wcscpy(&filename[dirlen+1], name);
+
+      file = OfcCreateFile(filename,
+                           OFC_FILE_READ_ATTRIBUTES,
+                           OFC_FILE_SHARE_READ | OFC_FILE_SHARE_WRITE |
+                           OFC_FILE_SHARE_DELETE,
+                           OFC_NULL,
+                           OFC_OPEN_EXISTING,
+                           OFC_FILE_ATTRIBUTE_NORMAL,
+                           OFC_HANDLE_NULL);
+      if (file != OFC_INVALID_HANDLE_VALUE)
+        {
+          ret = OfcGetFileInformationByHandleEx(file,
+                                                OfcFileStandardInfo,
+                                                &info,
+                                                sizeof(OFC_FILE_STANDARD_INFO));
+          if (ret == OFC_TRUE)
+            *allocation = info.AllocationSize;
+          OfcCloseHandle(file);
+        }
+      free(filename);
+    }
+  return (ret);
+}
+
+static OFC_VOID du_entry(struct smbwalk_dir *dir,
+                         OFC_WIN32_FIND_DATA *find_data,
+                         OFC_VOID *context)
+{
+  struct du_state *du = context;
+  OFC_UINT64 file_size;
+  OFC_UINT64 allocation;
+  OFC_BOOL ret;
+
+  if (find_data->dwFileAttributes & OFC_FILE_ATTRIBUTE_DIRECTORY)
+    {
+      ofc_lock(du->lock);
+      du->dirs++;
+      ofc_unlock(du->lock);
+    }
+  else
+    {
+      OFC_LARGE_INTEGER_SET(file_size, find_data->nFileSizeLow,
+                            find_data->nFileSizeHigh);
+      ret = OFC_TRUE;
+      if (du->exact)
+        ret = getallocation(smbwalk_dirname(dir), find_data->cFileName,
+                            &allocation);
+      else if (du->cluster_size != 0)
+        allocation = ((file_size + du->cluster_size - 1) /
+                      du->cluster_size) * du->cluster_size;
+      else
+        allocation = 0;
+
+      ofc_lock(du->lock);
+      du->files++;
+      du->end_of_file += file_size;
+      if (ret == OFC_TRUE)
+        du->allocation += allocation;
+      else
+        du->errors++;
+      ofc_unlock(du->lock);
+    }
+}
+
+static OFC_DWORD getsizerecursive(OFC_CTCHAR *wfilename,
+                                  OFC_INT num_threads, OFC_BOOL exact)
+{
+  struct du_state du;
+  OFC_DWORD dwLastError;
+  OFC_DWORD SectorsPerCluster;
+  OFC_DWORD BytesPerSector;
+  OFC_DWORD NumberOfFreeClusters;
+  OFC_DWORD TotalNumberOfClusters;
+
+  memset(&du, 0, sizeof(du));
+  du.exact = exact;
+  du.lock = ofc_lock_init();
+
+  if (!exact &&
+      OfcGetDiskFreeSpace(wfilename, &SectorsPerCluster, &BytesPerSector,
+                          &NumberOfFreeClusters,
+                          &TotalNumberOfClusters) == OFC_TRUE)
+    du.cluster_size = (OFC_UINT64) SectorsPerCluster * BytesPerSector;
+
+  dwLastError = smbwalk(wfilename, num_threads, &du_entry, OFC_NULL, &du);
+
+  printf("Size Info of %S by Tree:\n", wfilename);
+  printf("  Files: %llu\n", (unsigned long long) du.files);
+  printf("  Directories: %llu\n", (unsigned long long) du.dirs);
+  printf("  End of File: %llu bytes\n", (unsigned long long) du.end_of_file);
+  if (exact)
+    printf("  Allocation Size: %llu bytes\n",
+           (unsigned long long) du.allocation);
+  else if (du.cluster_size != 0)
+    printf("  Allocation Size: %llu bytes (estimated, %llu byte clusters)\n",
+           (unsigned long long) du.allocation,
+           (unsigned long long) du.cluster_size);
+  else
+    printf("  Allocation Size: unknown\n");
+  if (du.errors != 0)
+    printf("  Allocation Query Failures: %llu\n",
+           (unsigned long long) du.errors);
+
+  ofc_lock_destroy(du.lock);
+  return (dwLastError);
+}
+
+/*
+ * Batched stat
+ *
+ * Each path costs a single path based query rather than an open, query
+ * and close.  Several queries are kept in flight on a pool of workers and
+ * a line is printed for each path as its query completes so the output is
+ * not necessarily in input order.
+ */
+struct stat_state {
+  OFC_LOCK lock;                /* Serializes output and first_error */
+  OFC_DWORD first_error;        /* First failed query */
+  OFC_UINT64 count;             /* Number of paths queried */
+};
+
+static OFC_VOID stat_path(struct smbpool *pool, OFC_VOID *item,
+                          OFC_VOID *context)
+{
+  struct stat_state *stat = context;
+  char *path = item;
   OFC_TCHAR *wfilename;
-  OFC_DWORD ret;
+  OFC_WIN32_FILE_ATTRIBUTE_DATA info;
+  OFC_UINT64 file_size;
+  OFC_DWORD dwLastError;
   size_t len;
   mbstate_t ps;
   const char *cursor;
 
-  smbcp_init();
-  
-  if (argc < 2)
+  memset(&ps, 0, sizeof(ps));
+  len = strlen(path) + 1;
+  wfilename = malloc(sizeof(wchar_t) * len);
+
+  dwLastError = OFC_ERROR_SUCCESS;
+  if (wfilename == OFC_NULL)
+    dwLastError = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
     {
-      printf ("Usage: smbsize <destination>\n");
-      exit (1);
+      cursor = path;
+      mbsrtowcs(wfilename, &cursor, len, &ps);
+      if (OfcGetFileAttributesEx(wfilename, OfcGetFileExInfoStandard,
+                                 &info) != OFC_TRUE)
+        dwLastError = OfcGetLastError();
+    }
+
+  ofc_lock(stat->lock);
+  stat->count++;
+  if (dwLastError == OFC_ERROR_SUCCESS)
+    {
+      OFC_LARGE_INTEGER_SET(file_size, info.nFileSizeLow, info.nFileSizeHigh);
+      printf("%llu %s\n", (unsigned long long) file_size, path);
+    }
+  else
+    {
+      printf("failed %s: %s\n", path, ofc_get_error_string(dwLastError));
+      if (stat->first_error == OFC_ERROR_SUCCESS)
+        stat->first_error = dwLastError;
     }
+  ofc_unlock(stat->lock);
+
+  free(wfilename);
+  free(path);
+}
+
+/*
+ * Queue a copy of a path, or count it as failed if there is no memory
+ * for one
+ */
+static OFC_VOID stat_submit(struct smbpool *pool, struct stat_state *stat,
+                            const char *path)
+{
+  char *item;
+
+  item = strdup(path);
+  if (item != OFC_NULL)
+    smbpool_submit(pool, item);
+  else
+    {
+      ofc_lock(stat->lock);
+      stat->count++;
+      printf("failed %s: %s\n", path,
+             ofc_get_error_string(OFC_ERROR_NOT_ENOUGH_MEMORY));
+      if (stat->first_error == OFC_ERROR_SUCCESS)
+        stat->first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+      ofc_unlock(stat->lock);
+    }
+}
+
+static OFC_DWORD getsizebatch(char **paths, int num_paths, int num_threads)
+{
+  struct stat_state stat;
+  struct smbpool *pool;
+  char *line;
+  size_t linesize;
+  ssize_t linelen;
+  int i;
+
+  stat.first_error = OFC_ERROR_SUCCESS;
+  stat.count = 0;
+  stat.lock = ofc_lock_init();
+  if (stat.lock == OFC_NULL)
+    return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+
+  pool = smbpool_create(num_threads, &stat_path, &stat);
+  if (pool == OFC_NULL)
+    stat.first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
+    {
+      if (num_paths == 1 && strcmp(paths[0], "-") == 0)
+        {
+          /*
+           * One path per line on stdin.  Queries start while we are
+           * still reading.
+           */
+          line = OFC_NULL;
+          linesize = 0;
+          while ((linelen = getline(&line, &linesize, stdin)) != -1)
+            {
+              while (linelen > 0 && (line[linelen-1] == '\n' ||
+                                     line[linelen-1] == '\r'))
+                line[--linelen] = '\0';
+              if (linelen > 0)
+                stat_submit(pool, &stat, line);
+            }
+          free(line);
+        }
+      else
+        {
+          for (i = 0; i < num_paths; i++)
+            stat_submit(pool, &stat, paths[i]);
+        }
+
+      smbpool_wait(pool);
+      smbpool_destroy(pool);
+    }
+
+  printf("Queried %llu paths\n", (unsigned long long) stat.count);
+  ofc_lock_destroy(stat.lock);
+  return (stat.first_error);
+}
+
+static OFC_TCHAR *widen(const char *path)
+{
+  OFC_TCHAR *wfilename;
+  size_t len;
+  mbstate_t ps;
+  const char *cursor;
 
   memset(&ps, 0, sizeof(ps));
-  len = strlen(argp[1]) + 1;
+  len = strlen(path) + 1;
   wfilename = malloc(sizeof(wchar_t) * len);
-  cursor = argp[1];
-  mbsrtowcs(wfilename, &cursor, len, &ps);
+  if (wfilename != OFC_NULL)
+    {
+      cursor = path;
+      mbsrtowcs(wfilename, &cursor, len, &ps);
+    }
+  return (wfilename);
+}
 
-  printf("Size of %s: ", argp[1]);
-  fflush(stdout);
+int main (int argc, char **argp)
+{
+  OFC_TCHAR *wfilename;
+  OFC_DWORD ret;
+  OFC_DWORD path_ret;
+  int recursive = 0;
+  int exact = 0;
+  int byhandle = 0;
+  int num_threads = 0;
+  int num_paths;
+  int usage = 0;
+  int argidx;
+  int i;
 
-  ret = getsizebyhandle(wfilename);
-  if (ret == OFC_ERROR_SUCCESS)
+  argidx = 1;
+  while (argidx < argc && argp[argidx][0] == '-' && argp[argidx][1] != '\0')
     {
-      ret = getsize(wfilename);
+      if (strcmp(argp[argidx], "-r") == 0)
+        recursive = 1;
+      else if (strcmp(argp[argidx], "-a") == 0)
+        exact = 1;
+      else if (strcmp(argp[argidx], "-handle") == 0)
+        byhandle = 1;
+      else if (strcmp(argp[argidx], "-j") == 0 && argidx + 1 < argc)
+        num_threads = atoi(argp[++argidx]);
+      else
+        usage = 1;
+      argidx++;
+    }
+
+  num_paths = argc - argidx;
+  /*
+   * The handle query is for a single path.  The tree walk takes any
+   * number of paths but not a list on stdin.
+   */
+  if (usage || num_paths < 1 || num_threads < 0 ||
+      (byhandle && (recursive || num_paths > 1)) ||
+      (exact && !recursive))
+    usage = 1;
+  for (i = argidx; recursive && i < argc; i++)
+    if (strcmp(argp[i], "-") == 0)
+      usage = 1;
+
+  if (usage)
+    {
+      printf ("Usage: smbsize [-handle] <destination>\n");
+      printf ("       smbsize [-j <threads>] <path> <path>... | -\n");
+      printf ("       smbsize -r [-j <threads>] [-a] <destination>...\n");
+      printf ("       -handle also queries the allocation size by handle\n");
+      exit (1);
+    }
+
+  smbcp_init();
+
+  if (!recursive &&
+      (num_paths > 1 || strcmp(argp[argidx], "-") == 0))
+    {
+      ret = getsizebatch(&argp[argidx], num_paths,
+                         num_threads == 0 ? STAT_THREADS : num_threads);
+    }
+  else
+    {
+      ret = OFC_ERROR_SUCCESS;
+      for (i = argidx; i < argc; i++)
+        {
+          wfilename = widen(argp[i]);
+
+          printf("Size of %s: ", argp[i]);
+          fflush(stdout);
+
+          if (wfilename == OFC_NULL)
+            {
+              path_ret = OFC_ERROR_NOT_ENOUGH_MEMORY;
+              printf("%s\n", ofc_get_error_string(path_ret));
+            }
+          else if (recursive)
+            path_ret = getsizerecursive(wfilename,
+                                        num_threads == 0 ?
+                                        DU_THREADS : num_threads,
+                                        exact);
+          else
+            {
+              /*
+               * The path based query is a single round trip.  The handle
+               * based query (open, query, close) is only needed for the
+               * allocation size
+               */
+              path_ret = OFC_ERROR_SUCCESS;
+              if (byhandle)
+                path_ret = getsizebyhandle(wfilename);
+              if (path_ret == OFC_ERROR_SUCCESS)
+                {
+                  path_ret = getsize(wfilename);
+                }
+            }
+          if (ret == OFC_ERROR_SUCCESS)
+            ret = path_ret;
+
+          free(wfilename);
+        }
     }
-  
-  free(wfilename);
 
   int status;
   if (ret == OFC_ERROR_SUCCESS)
@@ -141,8 +523,7 @@ int main (int argc, char **argp)
    * Deactivate the openfiles stack
    */
   printf("Deactivating Stack\n");
-  smbcp_deactivate();
+  smbcp_deactivate_at_exit();
 
   exit(status);
 }
-
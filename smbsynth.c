@@ -0,0 +1,1325 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ofc/types.h>
+#include <ofc/handle.h>
+#include <ofc/event.h>
+#include <ofc/thread.h>
+#include <ofc/file.h>
+#include <ofc/fs.h>
+#include <ofc/path.h>
+
+#include "smbsynth.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Synthetic data share
+ *
+ * The share is a file system of its own, registered with the stack as
+ * OFC_FST_OTHER and reached through the SMBSYNTH_DEVICE path mapping, so
+ * the server's file calls on the share come straight to the functions
+ * below and nothing else in the process is affected.  The share is flat.
+ * It holds the files listed in the config, with the sizes given there,
+ * and any files clients create.  No data is stored:
+ *
+ *   - reads return a deterministic pattern that is a function of the
+ *     file offset only, so any byte of any file can be verified
+ *     independently
+ *   - writes are discarded and, with checksumming on, summed.  They move
+ *     end of file like any other write, so a file written to the share
+ *     has the size written but reads back as the pattern.
+ *
+ * The write checksum is a pair of 64 bit sums over the bytes written,
+ * sum(d) and sum(d * (offset + 1)).  It depends on where each byte lands
+ * but not on how the writes were split up or the order they arrived in,
+ * so it can be compared with the same sums computed over the source.
+ * The sums of each file are listed in the statistics.
+ *
+ * The config file has a line per file:
+ *
+ *   # name          size
+ *   1g.bin          1G
+ *   small.bin       4K
+ *
+ * Sizes take an optional K, M, G or T (binary) suffix.
+ */
+#define SYNTH_SEED 0x736d627379736e74ULL
+#define SYNTH_WIDE(str) TSTR(str)
+#define SYNTH_DEVICE SYNTH_WIDE(SMBSYNTH_DEVICE)
+/*
+ * Geometry reported for the share
+ */
+#define SYNTH_SECTOR_SIZE 512
+#define SYNTH_SECTORS_PER_CLUSTER 8
+#define SYNTH_CLUSTERS 0x7fffffff
+
+struct synth_file {
+  struct synth_file *next;      /* Next file in the share */
+  OFC_TCHAR *name;              /* Name within the share */
+  OFC_UINT64 size;              /* End of file */
+  OFC_INT refs;                 /* Open handles, plus one while linked */
+  OFC_UINT64 written;           /* Bytes written */
+  OFC_UINT64 sum;               /* Sum of bytes written */
+  OFC_UINT64 weighted;          /* Sum of bytes written times offset + 1 */
+};
+
+/*
+ * An open file.  A handle with no file is open on the share root.
+ */
+struct synth_handle {
+  struct synth_file *file;      /* File or NULL for the root */
+  OFC_UINT64 position;          /* File pointer for synchronous I/O */
+  OFC_BOOL delete_on_close;     /* Unlink the file on close */
+};
+
+/*
+ * I/O completes as it is issued.  The overlapped handle is an event that
+ * is set at once so that callers waiting on it in a wait set see the
+ * completion like any other.
+ */
+struct synth_overlapped {
+  struct synth_overlapped *next;
+  OFC_HANDLE event;             /* The overlapped handle */
+  OFC_OFFT offset;              /* Offset of the next I/O */
+  OFC_DWORD transferred;        /* Bytes moved by the last I/O */
+  OFC_DWORD error;              /* Error of the last I/O */
+};
+
+/*
+ * An enumeration takes a copy of the matching entries when it starts
+ */
+struct synth_entry {
+  OFC_TCHAR *name;
+  OFC_UINT64 size;
+};
+
+struct synth_find {
+  OFC_INT count;                /* Number of entries */
+  OFC_INT next;                 /* Next entry to return */
+  struct synth_entry *entries;
+};
+
+static pthread_mutex_t synth_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct synth_file *synth_files = NULL;
+static struct synth_overlapped *synth_overlapped = NULL;
+static OFC_FILETIME synth_time;
+static int synth_enabled = 0;
+static int synth_checksum = 0;
+static OFC_UINT64 synth_bytes_read = 0;
+static OFC_UINT64 synth_bytes_written = 0;
+static OFC_UINT64 synth_opens = 0;
+
+static OFC_UINT64 synth_word(OFC_UINT64 index)
+{
+  OFC_UINT64 z;
+
+  /*
+   * splitmix64
+   */
+  z = SYNTH_SEED + (index + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return (z ^ (z >> 31));
+}
+
+/*
+ * Fill a buffer with the pattern for a file offset.  Each aligned 8 byte
+ * word of a file holds synth_word(offset / 8) stored little endian.
+ */
+static OFC_VOID synth_fill(unsigned char *buf, size_t len, OFC_UINT64 offset)
+{
+  OFC_UINT64 word;
+  size_t skip;
+  size_t i;
+
+  while (len > 0)
+    {
+      word = synth_word(offset / 8);
+      skip = offset % 8;
+      if (skip == 0 && len >= 8)
+        {
+          for (i = 0; i < 8; i++)
+            buf[i] = (unsigned char) (word >> (8 * i));
+          buf += 8;
+          offset += 8;
+          len -= 8;
+        }
+      else
+        {
+          for (; skip < 8 && len > 0; skip++, len--, offset++)
+            *buf++ = (unsigned char) (word >> (8 * skip));
+        }
+    }
+}
+
+static OFC_VOID synth_error(OFC_DWORD error)
+{
+  ofc_thread_set_variable(OfcLastError, (OFC_DWORD_PTR) error);
+}
+
+static OFC_BOOL synth_separator(OFC_TCHAR c)
+{
+  return (c == TSTR('/') || c == TSTR('\\'));
+}
+
+/*
+ * The name of a path within the share.  Returns an empty name for the
+ * root and NULL for a path below a directory, which the share doesn't
+ * have.
+ */
+static OFC_LPCTSTR synth_name(OFC_LPCTSTR path)
+{
+  size_t len;
+  OFC_LPCTSTR cursor;
+
+  len = wcslen(SYNTH_DEVICE);
+  if (wcsncasecmp(path, SYNTH_DEVICE, len) == 0 &&
+      path[len] == TSTR(':'))
+    path += len + 1;
+  for (; synth_separator(*path); path++);
+  for (cursor = path; *cursor != TSTR('\0') &&
+         !synth_separator(*cursor); cursor++);
+  for (; synth_separator(*cursor); cursor++);
+  return (*cursor == TSTR('\0') ? path : OFC_NULL);
+}
+
+/*
+ * Length of a name up to any trailing separator
+ */
+static size_t synth_name_len(OFC_LPCTSTR name)
+{
+  size_t len;
+
+  for (len = 0; name[len] != TSTR('\0') && !synth_separator(name[len]);
+       len++);
+  return (len);
+}
+
+/*
+ * Case insensitive match of a name against a pattern with * and ?
+ */
+static OFC_BOOL synth_match(OFC_LPCTSTR pattern, size_t pattern_len,
+                            OFC_LPCTSTR name)
+{
+  if (pattern_len == 0)
+    return (*name == TSTR('\0'));
+  if (*pattern == TSTR('*'))
+    {
+      for (;; name++)
+        {
+          if (synth_match(pattern + 1, pattern_len - 1, name))
+            return (OFC_TRUE);
+          if (*name == TSTR('\0'))
+            return (OFC_FALSE);
+        }
+    }
+  if (*name == TSTR('\0') ||
+      (*pattern != TSTR('?') && towlower(*pattern) != towlower(*name)))
+    return (OFC_FALSE);
+  return (synth_match(pattern + 1, pattern_len - 1, name + 1));
+}
+
+/*
+ * Called with the lock held
+ */
+static struct synth_file *synth_lookup(OFC_LPCTSTR name)
+{
+  struct synth_file *file;
+  size_t len;
+
+  len = synth_name_len(name);
+  for (file = synth_files;
+       file != NULL && (wcslen(file->name) != len ||
+                        wcsncasecmp(file->name, name, len) != 0);
+       file = file->next);
+  return (file);
+}
+
+static struct synth_file *synth_add(OFC_LPCTSTR name, OFC_UINT64 size)
+{
+  struct synth_file *file;
+  size_t len;
+
+  file = malloc(sizeof(struct synth_file));
+  if (file != NULL)
+    {
+      memset(file, 0, sizeof(struct synth_file));
+      len = synth_name_len(name);
+      file->name = malloc((len + 1) * sizeof(OFC_TCHAR));
+      wcsncpy(file->name, name, len);
+      file->name[len] = TSTR('\0');
+      file->size = size;
+      file->refs = 1;
+      file->next = synth_files;
+      synth_files = file;
+    }
+  return (file);
+}
+
+static OFC_VOID synth_release(struct synth_file *file)
+{
+  file->refs--;
+  if (file->refs == 0)
+    {
+      free(file->name);
+      free(file);
+    }
+}
+
+static OFC_VOID synth_unlink(struct synth_file *file)
+{
+  struct synth_file **prev;
+
+  for (prev = &synth_files; *prev != NULL && *prev != file;
+       prev = &(*prev)->next);
+  if (*prev == file)
+    {
+      *prev = file->next;
+      synth_release(file);
+    }
+}
+
+static OFC_VOID synth_truncate(struct synth_file *file)
+{
+  file->size = 0;
+  file->written = 0;
+  file->sum = 0;
+  file->weighted = 0;
+}
+
+static OFC_HANDLE synth_create_file(OFC_LPCTSTR lpFileName,
+                                    OFC_DWORD dwDesiredAccess,
+                                    OFC_DWORD dwShareMode,
+                                    OFC_LPSECURITY_ATTRIBUTES lpSecAttributes,
+                                    OFC_DWORD dwCreationDisposition,
+                                    OFC_DWORD dwFlagsAndAttributes,
+                                    OFC_HANDLE hTemplateFile)
+{
+  struct synth_handle *handle;
+  struct synth_file *file;
+  OFC_LPCTSTR name;
+  OFC_DWORD error;
+
+  error = OFC_ERROR_SUCCESS;
+  file = NULL;
+  name = synth_name(lpFileName);
+  if (name == OFC_NULL)
+    error = OFC_ERROR_PATH_NOT_FOUND;
+  else if (*name == TSTR('\0'))
+    {
+      if (dwCreationDisposition != OFC_OPEN_EXISTING &&
+          dwCreationDisposition != OFC_OPEN_ALWAYS)
+        error = OFC_ERROR_ACCESS_DENIED;
+    }
+  else
+    {
+      pthread_mutex_lock(&synth_lock);
+      file = synth_lookup(name);
+      switch (dwCreationDisposition)
+        {
+        case OFC_CREATE_NEW:
+          if (file != NULL)
+            error = OFC_ERROR_FILE_EXISTS;
+          else
+            file = synth_add(name, 0);
+          break;
+        case OFC_CREATE_ALWAYS:
+          if (file != NULL)
+            synth_truncate(file);
+          else
+            file = synth_add(name, 0);
+          break;
+        case OFC_OPEN_ALWAYS:
+          if (file == NULL)
+            file = synth_add(name, 0);
+          break;
+        case OFC_TRUNCATE_EXISTING:
+          if (file != NULL)
+            synth_truncate(file);
+          else
+            error = OFC_ERROR_FILE_NOT_FOUND;
+          break;
+        case OFC_OPEN_EXISTING:
+        default:
+          if (file == NULL)
+            error = OFC_ERROR_FILE_NOT_FOUND;
+          break;
+        }
+      if (error == OFC_ERROR_SUCCESS && file == NULL)
+        error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+      if (error == OFC_ERROR_SUCCESS)
+        file->refs++;
+      pthread_mutex_unlock(&synth_lock);
+    }
+
+  if (error != OFC_ERROR_SUCCESS)
+    {
+      synth_error(error);
+      return (OFC_INVALID_HANDLE_VALUE);
+    }
+
+  handle = malloc(sizeof(struct synth_handle));
+  handle->file = file;
+  handle->position = 0;
+  handle->delete_on_close =
+    (dwFlagsAndAttributes & OFC_FILE_FLAG_DELETE_ON_CLOSE) != 0;
+  __atomic_add_fetch(&synth_opens, 1, __ATOMIC_RELAXED);
+  return (ofc_handle_create(OFC_HANDLE_FSOTHER_FILE, handle));
+}
+
+static OFC_BOOL synth_close_handle(OFC_HANDLE hFile)
+{
+  struct synth_handle *handle;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  if (handle->file != NULL)
+    {
+      pthread_mutex_lock(&synth_lock);
+      if (handle->delete_on_close)
+        synth_unlink(handle->file);
+      synth_release(handle->file);
+      pthread_mutex_unlock(&synth_lock);
+    }
+  ofc_handle_unlock(hFile);
+  ofc_handle_destroy(hFile);
+  free(handle);
+  return (OFC_TRUE);
+}
+
+static OFC_BOOL synth_delete_file(OFC_LPCTSTR lpFileName)
+{
+  struct synth_file *file;
+  OFC_LPCTSTR name;
+
+  file = NULL;
+  name = synth_name(lpFileName);
+  pthread_mutex_lock(&synth_lock);
+  if (name != OFC_NULL && *name != TSTR('\0'))
+    {
+      file = synth_lookup(name);
+      if (file != NULL)
+        synth_unlink(file);
+    }
+  pthread_mutex_unlock(&synth_lock);
+
+  if (file == NULL)
+    synth_error(OFC_ERROR_FILE_NOT_FOUND);
+  return (file != NULL);
+}
+
+static OFC_BOOL synth_move_file(OFC_LPCTSTR lpExistingFileName,
+                                OFC_LPCTSTR lpNewFileName)
+{
+  struct synth_file *file;
+  OFC_LPCTSTR name;
+  OFC_LPCTSTR new_name;
+  OFC_TCHAR *copy;
+  size_t len;
+  OFC_DWORD error;
+
+  error = OFC_ERROR_SUCCESS;
+  name = synth_name(lpExistingFileName);
+  new_name = synth_name(lpNewFileName);
+  pthread_mutex_lock(&synth_lock);
+  if (name == OFC_NULL || *name == TSTR('\0') ||
+      (file = synth_lookup(name)) == NULL)
+    error = OFC_ERROR_FILE_NOT_FOUND;
+  else if (new_name == OFC_NULL || *new_name == TSTR('\0'))
+    error = OFC_ERROR_PATH_NOT_FOUND;
+  else if (synth_lookup(new_name) != NULL)
+    error = OFC_ERROR_FILE_EXISTS;
+  else
+    {
+      len = synth_name_len(new_name);
+      copy = malloc((len + 1) * sizeof(OFC_TCHAR));
+      wcsncpy(copy, new_name, len);
+      copy[len] = TSTR('\0');
+      free(file->name);
+      file->name = copy;
+    }
+  pthread_mutex_unlock(&synth_lock);
+
+  if (error != OFC_ERROR_SUCCESS)
+    synth_error(error);
+  return (error == OFC_ERROR_SUCCESS);
+}
+
+static OFC_VOID synth_fill_find(OFC_LPWIN32_FIND_DATAW lpFindFileData,
+                                struct synth_entry *entry)
+{
+  memset(lpFindFileData, 0, sizeof(*lpFindFileData));
+  lpFindFileData->dwFileAttributes = OFC_FILE_ATTRIBUTE_NORMAL;
+  lpFindFileData->ftCreateTime = synth_time;
+  lpFindFileData->ftLastAccessTime = synth_time;
+  lpFindFileData->ftLastWriteTime = synth_time;
+  lpFindFileData->nFileSizeHigh = OFC_LARGE_INTEGER_HIGH(entry->size);
+  lpFindFileData->nFileSizeLow = OFC_LARGE_INTEGER_LOW(entry->size);
+  wcsncpy(lpFindFileData->cFileName, entry->name,
+          sizeof(lpFindFileData->cFileName) / sizeof(OFC_TCHAR) - 1);
+}
+
+static OFC_VOID synth_free_find(struct synth_find *find)
+{
+  OFC_INT i;
+
+  for (i = 0; i < find->count; i++)
+    free(find->entries[i].name);
+  free(find->entries);
+  free(find);
+}
+
+static OFC_HANDLE synth_find_first_file(OFC_LPCTSTR lpFileName,
+                                        OFC_LPWIN32_FIND_DATAW lpFindFileData,
+                                        OFC_BOOL *more)
+{
+  struct synth_find *find;
+  struct synth_file *file;
+  OFC_LPCTSTR pattern;
+  size_t pattern_len;
+  OFC_INT max;
+
+  pattern = synth_name(lpFileName);
+  if (pattern == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_PATH_NOT_FOUND);
+      return (OFC_INVALID_HANDLE_VALUE);
+    }
+  pattern_len = synth_name_len(pattern);
+
+  find = malloc(sizeof(struct synth_find));
+  find->count = 0;
+  find->next = 0;
+  pthread_mutex_lock(&synth_lock);
+  for (max = 0, file = synth_files; file != NULL; file = file->next, max++);
+  find->entries = malloc(sizeof(struct synth_entry) * (max + 1));
+  for (file = synth_files; file != NULL; file = file->next)
+    {
+      if (pattern_len == 0 || synth_match(pattern, pattern_len, file->name))
+        {
+          find->entries[find->count].name = wcsdup(file->name);
+          find->entries[find->count].size = file->size;
+          find->count++;
+        }
+    }
+  pthread_mutex_unlock(&synth_lock);
+
+  if (find->count == 0)
+    {
+      synth_free_find(find);
+      synth_error(OFC_ERROR_FILE_NOT_FOUND);
+      return (OFC_INVALID_HANDLE_VALUE);
+    }
+
+  synth_fill_find(lpFindFileData, &find->entries[find->next++]);
+  *more = find->next < find->count;
+  return (ofc_handle_create(OFC_HANDLE_FSOTHER_FILE, find));
+}
+
+static OFC_BOOL synth_find_next_file(OFC_HANDLE hFindFile,
+                                     OFC_LPWIN32_FIND_DATAW lpFindFileData,
+                                     OFC_BOOL *more)
+{
+  struct synth_find *find;
+  OFC_BOOL ret;
+
+  find = ofc_handle_lock(hFindFile);
+  if (find == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  ret = find->next < find->count;
+  if (ret)
+    synth_fill_find(lpFindFileData, &find->entries[find->next++]);
+  else
+    synth_error(OFC_ERROR_NO_MORE_FILES);
+  *more = find->next < find->count;
+  ofc_handle_unlock(hFindFile);
+  return (ret);
+}
+
+static OFC_BOOL synth_find_close(OFC_HANDLE hFindFile)
+{
+  struct synth_find *find;
+
+  find = ofc_handle_lock(hFindFile);
+  if (find == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+  ofc_handle_unlock(hFindFile);
+  ofc_handle_destroy(hFindFile);
+  synth_free_find(find);
+  return (OFC_TRUE);
+}
+
+static OFC_BOOL synth_flush_file_buffers(OFC_HANDLE hFile)
+{
+  return (OFC_TRUE);
+}
+
+static OFC_BOOL synth_get_file_attributes_ex(OFC_LPCTSTR lpFileName,
+                                             OFC_GET_FILEEX_INFO_LEVELS
+                                             fInfoLevelId,
+                                             OFC_LPVOID lpFileInformation)
+{
+  OFC_WIN32_FILE_ATTRIBUTE_DATA *info = lpFileInformation;
+  struct synth_file *file;
+  OFC_LPCTSTR name;
+  OFC_BOOL ret;
+
+  ret = OFC_FALSE;
+  name = synth_name(lpFileName);
+  if (fInfoLevelId != OfcGetFileExInfoStandard)
+    synth_error(OFC_ERROR_NOT_SUPPORTED);
+  else if (name == OFC_NULL)
+    synth_error(OFC_ERROR_PATH_NOT_FOUND);
+  else
+    {
+      memset(info, 0, sizeof(OFC_WIN32_FILE_ATTRIBUTE_DATA));
+      info->ftCreationTime = synth_time;
+      info->ftLastAccessTime = synth_time;
+      info->ftLastWriteTime = synth_time;
+      if (*name == TSTR('\0'))
+        {
+          info->dwFileAttributes = OFC_FILE_ATTRIBUTE_DIRECTORY;
+          ret = OFC_TRUE;
+        }
+      else
+        {
+          pthread_mutex_lock(&synth_lock);
+          file = synth_lookup(name);
+          if (file != NULL)
+            {
+              info->dwFileAttributes = OFC_FILE_ATTRIBUTE_NORMAL;
+              info->nFileSizeHigh = OFC_LARGE_INTEGER_HIGH(file->size);
+              info->nFileSizeLow = OFC_LARGE_INTEGER_LOW(file->size);
+              ret = OFC_TRUE;
+            }
+          pthread_mutex_unlock(&synth_lock);
+          if (!ret)
+            synth_error(OFC_ERROR_FILE_NOT_FOUND);
+        }
+    }
+  return (ret);
+}
+
+static OFC_VOID synth_large_time(OFC_LARGE_INTEGER *large)
+{
+  OFC_LARGE_INTEGER_SET(*large, synth_time.dwLowDateTime,
+                        synth_time.dwHighDateTime);
+}
+
+static OFC_BOOL synth_get_file_information_by_handle_ex
+(OFC_HANDLE hFile, OFC_FILE_INFO_BY_HANDLE_CLASS FileInformationClass,
+ OFC_LPVOID lpFileInformation, OFC_DWORD dwBufferSize)
+{
+  struct synth_handle *handle;
+  OFC_FILE_BASIC_INFO *basic;
+  OFC_FILE_STANDARD_INFO *standard;
+  OFC_FILE_NAME_INFO *name_info;
+  OFC_DWORD error;
+  size_t len;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  error = OFC_ERROR_SUCCESS;
+  pthread_mutex_lock(&synth_lock);
+  switch (FileInformationClass)
+    {
+    case OfcFileBasicInfo:
+      if (dwBufferSize < sizeof(OFC_FILE_BASIC_INFO))
+        error = OFC_ERROR_INSUFFICIENT_BUFFER;
+      else
+        {
+          basic = lpFileInformation;
+          synth_large_time(&basic->CreationTime);
+          synth_large_time(&basic->LastAccessTime);
+          synth_large_time(&basic->LastWriteTime);
+          synth_large_time(&basic->ChangeTime);
+          basic->FileAttributes = handle->file == NULL ?
+            OFC_FILE_ATTRIBUTE_DIRECTORY : OFC_FILE_ATTRIBUTE_NORMAL;
+        }
+      break;
+    case OfcFileStandardInfo:
+      if (dwBufferSize < sizeof(OFC_FILE_STANDARD_INFO))
+        error = OFC_ERROR_INSUFFICIENT_BUFFER;
+      else
+        {
+          standard = lpFileInformation;
+          standard->EndOfFile = handle->file == NULL ? 0 : handle->file->size;
+          standard->AllocationSize = 0;
+          standard->NumberOfLinks = 1;
+          standard->DeletePending = handle->delete_on_close;
+          standard->Directory = handle->file == NULL;
+        }
+      break;
+    case OfcFileNameInfo:
+      len = handle->file == NULL ? 0 : wcslen(handle->file->name);
+      if (dwBufferSize < sizeof(OFC_FILE_NAME_INFO) + len * sizeof(OFC_WCHAR))
+        error = OFC_ERROR_INSUFFICIENT_BUFFER;
+      else
+        {
+          name_info = lpFileInformation;
+          name_info->FileNameLength = (OFC_DWORD) (len * sizeof(OFC_WCHAR));
+          if (len > 0)
+            memcpy(name_info->FileName, handle->file->name,
+                   len * sizeof(OFC_WCHAR));
+        }
+      break;
+    default:
+      error = OFC_ERROR_NOT_SUPPORTED;
+      break;
+    }
+  pthread_mutex_unlock(&synth_lock);
+  ofc_handle_unlock(hFile);
+
+  if (error != OFC_ERROR_SUCCESS)
+    synth_error(error);
+  return (error == OFC_ERROR_SUCCESS);
+}
+
+/*
+ * Called with the lock held
+ */
+static struct synth_overlapped *synth_find_overlapped(OFC_HANDLE hOverlapped)
+{
+  struct synth_overlapped *overlapped;
+
+  for (overlapped = synth_overlapped;
+       overlapped != NULL && overlapped->event != hOverlapped;
+       overlapped = overlapped->next);
+  return (overlapped);
+}
+
+static OFC_HANDLE synth_create_overlapped(OFC_VOID)
+{
+  struct synth_overlapped *overlapped;
+
+  overlapped = malloc(sizeof(struct synth_overlapped));
+  if (overlapped == NULL)
+    return (OFC_HANDLE_NULL);
+
+  memset(overlapped, 0, sizeof(struct synth_overlapped));
+  overlapped->event = ofc_event_create(OFC_EVENT_MANUAL);
+  pthread_mutex_lock(&synth_lock);
+  overlapped->next = synth_overlapped;
+  synth_overlapped = overlapped;
+  pthread_mutex_unlock(&synth_lock);
+  return (overlapped->event);
+}
+
+static OFC_VOID synth_destroy_overlapped(OFC_HANDLE hOverlapped)
+{
+  struct synth_overlapped **prev;
+  struct synth_overlapped *overlapped;
+
+  pthread_mutex_lock(&synth_lock);
+  for (prev = &synth_overlapped;
+       *prev != NULL && (*prev)->event != hOverlapped;
+       prev = &(*prev)->next);
+  overlapped = *prev;
+  if (overlapped != NULL)
+    *prev = overlapped->next;
+  pthread_mutex_unlock(&synth_lock);
+
+  if (overlapped != NULL)
+    {
+      ofc_event_destroy(overlapped->event);
+      free(overlapped);
+    }
+}
+
+static OFC_VOID synth_set_overlapped_offset(OFC_HANDLE hOverlapped,
+                                            OFC_OFFT offset)
+{
+  struct synth_overlapped *overlapped;
+
+  pthread_mutex_lock(&synth_lock);
+  overlapped = synth_find_overlapped(hOverlapped);
+  if (overlapped != NULL)
+    overlapped->offset = offset;
+  pthread_mutex_unlock(&synth_lock);
+  if (overlapped != NULL)
+    ofc_event_reset(hOverlapped);
+}
+
+static OFC_BOOL synth_get_overlapped_result(OFC_HANDLE hFile,
+                                            OFC_HANDLE hOverlapped,
+                                            OFC_LPDWORD
+                                            lpNumberOfBytesTransferred,
+                                            OFC_BOOL bWait)
+{
+  struct synth_overlapped *overlapped;
+  OFC_DWORD error;
+
+  error = OFC_ERROR_INVALID_HANDLE;
+  pthread_mutex_lock(&synth_lock);
+  overlapped = synth_find_overlapped(hOverlapped);
+  if (overlapped != NULL)
+    {
+      *lpNumberOfBytesTransferred = overlapped->transferred;
+      error = overlapped->error;
+    }
+  pthread_mutex_unlock(&synth_lock);
+
+  if (error != OFC_ERROR_SUCCESS)
+    synth_error(error);
+  return (error == OFC_ERROR_SUCCESS);
+}
+
+/*
+ * Complete an I/O.  Synchronous I/O moves the file pointer.  Overlapped
+ * I/O is reported pending and its event is set so the caller picks up
+ * the result as usual.
+ */
+static OFC_BOOL synth_complete(struct synth_handle *handle,
+                               OFC_HANDLE hOverlapped, OFC_DWORD transferred,
+                               OFC_DWORD error, OFC_LPDWORD lpTransferred)
+{
+  struct synth_overlapped *overlapped;
+
+  if (hOverlapped == OFC_HANDLE_NULL)
+    {
+      /*
+       * A synchronous read at end of file succeeds with no data
+       */
+      if (error == OFC_ERROR_HANDLE_EOF)
+        error = OFC_ERROR_SUCCESS;
+      handle->position += transferred;
+      if (lpTransferred != OFC_NULL)
+        *lpTransferred = transferred;
+      if (error != OFC_ERROR_SUCCESS)
+        synth_error(error);
+      return (error == OFC_ERROR_SUCCESS);
+    }
+
+  pthread_mutex_lock(&synth_lock);
+  overlapped = synth_find_overlapped(hOverlapped);
+  if (overlapped != NULL)
+    {
+      overlapped->transferred = transferred;
+      overlapped->error = error;
+    }
+  pthread_mutex_unlock(&synth_lock);
+
+  if (overlapped == NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+  ofc_event_set(hOverlapped);
+  synth_error(OFC_ERROR_IO_PENDING);
+  return (OFC_FALSE);
+}
+
+static OFC_UINT64 synth_offset(struct synth_handle *handle,
+                               OFC_HANDLE hOverlapped)
+{
+  struct synth_overlapped *overlapped;
+  OFC_UINT64 offset;
+
+  if (hOverlapped == OFC_HANDLE_NULL)
+    return (handle->position);
+
+  offset = 0;
+  pthread_mutex_lock(&synth_lock);
+  overlapped = synth_find_overlapped(hOverlapped);
+  if (overlapped != NULL)
+    offset = overlapped->offset;
+  pthread_mutex_unlock(&synth_lock);
+  return (offset);
+}
+
+static OFC_BOOL synth_read_file(OFC_HANDLE hFile, OFC_LPVOID lpBuffer,
+                                OFC_DWORD nNumberOfBytesToRead,
+                                OFC_LPDWORD lpNumberOfBytesRead,
+                                OFC_HANDLE hOverlapped)
+{
+  struct synth_handle *handle;
+  OFC_UINT64 offset;
+  OFC_UINT64 size;
+  OFC_DWORD len;
+  OFC_DWORD error;
+  OFC_BOOL ret;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  len = 0;
+  error = OFC_ERROR_SUCCESS;
+  if (handle->file == NULL)
+    error = OFC_ERROR_ACCESS_DENIED;
+  else
+    {
+      offset = synth_offset(handle, hOverlapped);
+      size = __atomic_load_n(&handle->file->size, __ATOMIC_RELAXED);
+      if (offset < size)
+        len = size - offset < nNumberOfBytesToRead ?
+          (OFC_DWORD) (size - offset) : nNumberOfBytesToRead;
+      if (len > 0)
+        {
+          synth_fill(lpBuffer, len, offset);
+          __atomic_add_fetch(&synth_bytes_read, len, __ATOMIC_RELAXED);
+        }
+      else if (nNumberOfBytesToRead > 0)
+        error = OFC_ERROR_HANDLE_EOF;
+    }
+  ret = synth_complete(handle, hOverlapped, len, error, lpNumberOfBytesRead);
+  ofc_handle_unlock(hFile);
+  return (ret);
+}
+
+static OFC_BOOL synth_write_file(OFC_HANDLE hFile, OFC_LPCVOID lpBuffer,
+                                 OFC_DWORD nNumberOfBytesToWrite,
+                                 OFC_LPDWORD lpNumberOfBytesWritten,
+                                 OFC_HANDLE hOverlapped)
+{
+  struct synth_handle *handle;
+  struct synth_file *file;
+  const unsigned char *data = lpBuffer;
+  OFC_UINT64 offset;
+  OFC_UINT64 sum;
+  OFC_UINT64 weighted;
+  OFC_DWORD i;
+  OFC_DWORD error;
+  OFC_BOOL ret;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  error = OFC_ERROR_SUCCESS;
+  file = handle->file;
+  if (file == NULL)
+    error = OFC_ERROR_ACCESS_DENIED;
+  else
+    {
+      offset = synth_offset(handle, hOverlapped);
+      sum = 0;
+      weighted = 0;
+      if (synth_checksum)
+        {
+          for (i = 0; i < nNumberOfBytesToWrite; i++)
+            {
+              sum += data[i];
+              weighted += data[i] * (offset + i + 1);
+            }
+        }
+      pthread_mutex_lock(&synth_lock);
+      if (offset + nNumberOfBytesToWrite > file->size)
+        __atomic_store_n(&file->size, offset + nNumberOfBytesToWrite,
+                         __ATOMIC_RELAXED);
+      file->written += nNumberOfBytesToWrite;
+      file->sum += sum;
+      file->weighted += weighted;
+      pthread_mutex_unlock(&synth_lock);
+      __atomic_add_fetch(&synth_bytes_written, nNumberOfBytesToWrite,
+                         __ATOMIC_RELAXED);
+    }
+  ret = synth_complete(handle, hOverlapped,
+                       error == OFC_ERROR_SUCCESS ? nNumberOfBytesToWrite : 0,
+                       error, lpNumberOfBytesWritten);
+  ofc_handle_unlock(hFile);
+  return (ret);
+}
+
+static OFC_VOID synth_set_size(struct synth_file *file, OFC_UINT64 size)
+{
+  pthread_mutex_lock(&synth_lock);
+  __atomic_store_n(&file->size, size, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&synth_lock);
+}
+
+static OFC_BOOL synth_set_end_of_file(OFC_HANDLE hFile)
+{
+  struct synth_handle *handle;
+  OFC_BOOL ret;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  ret = handle->file != NULL;
+  if (ret)
+    synth_set_size(handle->file, handle->position);
+  else
+    synth_error(OFC_ERROR_ACCESS_DENIED);
+  ofc_handle_unlock(hFile);
+  return (ret);
+}
+
+static OFC_BOOL synth_set_file_attributes(OFC_LPCTSTR lpFileName,
+                                          OFC_DWORD dwFileAttributes)
+{
+  OFC_WIN32_FILE_ATTRIBUTE_DATA info;
+
+  /*
+   * Attributes aren't kept.  Succeed if the file is there.
+   */
+  return (synth_get_file_attributes_ex(lpFileName, OfcGetFileExInfoStandard,
+                                       &info));
+}
+
+static OFC_BOOL synth_set_file_information_by_handle
+(OFC_HANDLE hFile, OFC_FILE_INFO_BY_HANDLE_CLASS FileInformationClass,
+ OFC_LPVOID lpFileInformation, OFC_DWORD dwBufferSize)
+{
+  struct synth_handle *handle;
+  OFC_FILE_END_OF_FILE_INFO *eof_info;
+  OFC_FILE_DISPOSITION_INFO *disposition;
+  OFC_DWORD error;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_FALSE);
+    }
+
+  error = OFC_ERROR_SUCCESS;
+  switch (FileInformationClass)
+    {
+    case OfcFileEndOfFileInfo:
+      eof_info = lpFileInformation;
+      if (handle->file == NULL)
+        error = OFC_ERROR_ACCESS_DENIED;
+      else
+        synth_set_size(handle->file, eof_info->EndOfFile);
+      break;
+    case OfcFileDispositionInfo:
+      disposition = lpFileInformation;
+      if (handle->file == NULL)
+        error = OFC_ERROR_ACCESS_DENIED;
+      else
+        handle->delete_on_close = disposition->DeleteFile;
+      break;
+    case OfcFileBasicInfo:
+    case OfcFileAllocationInfo:
+      /*
+       * Times and allocation aren't kept
+       */
+      break;
+    default:
+      error = OFC_ERROR_NOT_SUPPORTED;
+      break;
+    }
+  ofc_handle_unlock(hFile);
+
+  if (error != OFC_ERROR_SUCCESS)
+    synth_error(error);
+  return (error == OFC_ERROR_SUCCESS);
+}
+
+static OFC_DWORD synth_set_file_pointer(OFC_HANDLE hFile,
+                                        OFC_LONG lDistanceToMove,
+                                        OFC_PLONG lpDistanceToMoveHigh,
+                                        OFC_DWORD dwMoveMethod)
+{
+  struct synth_handle *handle;
+  OFC_INT64 distance;
+  OFC_INT64 base;
+  OFC_DWORD ret;
+
+  handle = ofc_handle_lock(hFile);
+  if (handle == OFC_NULL)
+    {
+      synth_error(OFC_ERROR_INVALID_HANDLE);
+      return (OFC_INVALID_SET_FILE_POINTER);
+    }
+
+  if (lpDistanceToMoveHigh != OFC_NULL)
+    distance = ((OFC_INT64) *lpDistanceToMoveHigh << 32) |
+      (OFC_DWORD) lDistanceToMove;
+  else
+    distance = lDistanceToMove;
+
+  if (dwMoveMethod == OFC_FILE_CURRENT)
+    base = handle->position;
+  else if (dwMoveMethod == OFC_FILE_END)
+    base = handle->file == NULL ? 0 :
+      __atomic_load_n(&handle->file->size, __ATOMIC_RELAXED);
+  else
+    base = 0;
+
+  if (base + distance < 0)
+    {
+      synth_error(OFC_ERROR_INVALID_PARAMETER);
+      ret = OFC_INVALID_SET_FILE_POINTER;
+    }
+  else
+    {
+      handle->position = base + distance;
+      if (lpDistanceToMoveHigh != OFC_NULL)
+        *lpDistanceToMoveHigh = (OFC_LONG) (handle->position >> 32);
+      ret = OFC_LARGE_INTEGER_LOW(handle->position);
+    }
+  ofc_handle_unlock(hFile);
+  return (ret);
+}
+
+static OFC_BOOL synth_get_disk_free_space(OFC_LPCTSTR lpRootPathName,
+                                          OFC_LPDWORD lpSectorsPerCluster,
+                                          OFC_LPDWORD lpBytesPerSector,
+                                          OFC_LPDWORD lpNumberOfFreeClusters,
+                                          OFC_LPDWORD
+                                          lpTotalNumberOfClusters)
+{
+  /*
+   * Writes take no space so the share is always empty
+   */
+  *lpSectorsPerCluster = SYNTH_SECTORS_PER_CLUSTER;
+  *lpBytesPerSector = SYNTH_SECTOR_SIZE;
+  *lpNumberOfFreeClusters = SYNTH_CLUSTERS;
+  *lpTotalNumberOfClusters = SYNTH_CLUSTERS;
+  return (OFC_TRUE);
+}
+
+static OFC_BOOL synth_create_directory(OFC_LPCTSTR lpPathName,
+                                       OFC_LPSECURITY_ATTRIBUTES
+                                       lpSecurityAttributes)
+{
+  synth_error(OFC_ERROR_NOT_SUPPORTED);
+  return (OFC_FALSE);
+}
+
+static OFC_BOOL synth_remove_directory(OFC_LPCTSTR lpPathName)
+{
+  synth_error(OFC_ERROR_NOT_SUPPORTED);
+  return (OFC_FALSE);
+}
+
+/*
+ * Calls left NULL aren't supported by the share
+ */
+static OFC_FILE_FSINFO synth_fsinfo = {
+  .CreateFile = &synth_create_file,
+  .CloseHandle = &synth_close_handle,
+  .DeleteFile = &synth_delete_file,
+  .FindFirstFile = &synth_find_first_file,
+  .FindNextFile = &synth_find_next_file,
+  .FindClose = &synth_find_close,
+  .FlushFileBuffers = &synth_flush_file_buffers,
+  .GetFileAttributesEx = &synth_get_file_attributes_ex,
+  .GetFileInformationByHandleEx = &synth_get_file_information_by_handle_ex,
+  .MoveFile = &synth_move_file,
+  .CreateOverlapped = &synth_create_overlapped,
+  .DestroyOverlapped = &synth_destroy_overlapped,
+  .SetOverlappedOffset = &synth_set_overlapped_offset,
+  .GetOverlappedResult = &synth_get_overlapped_result,
+  .ReadFile = &synth_read_file,
+  .SetEndOfFile = &synth_set_end_of_file,
+  .SetFileAttributes = &synth_set_file_attributes,
+  .SetFileInformationByHandle = &synth_set_file_information_by_handle,
+  .SetFilePointer = &synth_set_file_pointer,
+  .WriteFile = &synth_write_file,
+  .GetDiskFreeSpace = &synth_get_disk_free_space,
+  .CreateDirectory = &synth_create_directory,
+  .RemoveDirectory = &synth_remove_directory,
+};
+
+static int parse_size(const char *str, OFC_UINT64 *size)
+{
+  char *end;
+  int ret;
+
+  ret = 0;
+  *size = strtoull(str, &end, 10);
+  if (end == str)
+    ret = -1;
+  else
+    {
+      switch (*end)
+        {
+        case 'T': case 't':
+          *size <<= 10;
+          /* fall through */
+        case 'G': case 'g':
+          *size <<= 10;
+          /* fall through */
+        case 'M': case 'm':
+          *size <<= 10;
+          /* fall through */
+        case 'K': case 'k':
+          *size <<= 10;
+          end++;
+          break;
+        default:
+          break;
+        }
+      if (*end != '\0')
+        ret = -1;
+    }
+  return (ret);
+}
+
+int smbsynth_setup(const char *config, int checksum)
+{
+  FILE *fp;
+  char line[PATH_MAX + 64];
+  char name[PATH_MAX];
+  char size_str[64];
+  char format[32];
+  OFC_TCHAR wname[PATH_MAX];
+  OFC_UINT64 size;
+  OFC_UINT64 now;
+  OFC_PATH *root;
+  int ret;
+  int lineno;
+  int num_files;
+  int fields;
+
+  /*
+   * Widths that keep sscanf within name and size_str
+   */
+  snprintf(format, sizeof(format), "%%%ds %%%ds", PATH_MAX - 1,
+           (int) sizeof(size_str) - 1);
+
+  ret = 0;
+  fp = fopen(config, "r");
+  if (fp == NULL)
+    {
+      perror(config);
+      ret = -1;
+    }
+
+  lineno = 0;
+  num_files = 0;
+  while (ret == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+      lineno++;
+      if (line[0] == '#')
+        continue;
+      /*
+       * Blank lines are skipped.  Anything else needs a name and a size.
+       */
+      fields = sscanf(line, format, name, size_str);
+      if (fields == EOF)
+        continue;
+
+      if (fields != 2 ||
+          strchr(name, '/') != NULL || strchr(name, '\\') != NULL ||
+          parse_size(size_str, &size) != 0 ||
+          mbstowcs(wname, name, PATH_MAX) == (size_t) -1)
+        {
+          fprintf(stderr, "%s:%d: expected <name> <size>\n", config, lineno);
+          ret = -1;
+        }
+      else
+        {
+          pthread_mutex_lock(&synth_lock);
+          if (synth_lookup(wname) != NULL)
+            {
+              fprintf(stderr, "%s:%d: %s is listed twice\n", config, lineno,
+                      name);
+              ret = -1;
+            }
+          else if (synth_add(wname, size) == NULL)
+            ret = -1;
+          else
+            num_files++;
+          pthread_mutex_unlock(&synth_lock);
+        }
+    }
+  if (fp != NULL)
+    fclose(fp);
+
+  if (ret == 0)
+    {
+      /*
+       * Files are dated when the share is set up.  FILETIME counts 100ns
+       * intervals from 1601.
+       */
+      now = ((OFC_UINT64) time(NULL) + 11644473600ULL) * 10000000ULL;
+      synth_time.dwLowDateTime = OFC_LARGE_INTEGER_LOW(now);
+      synth_time.dwHighDateTime = OFC_LARGE_INTEGER_HIGH(now);
+      synth_checksum = checksum;
+
+      ofc_fs_register(OFC_FST_OTHER, &synth_fsinfo);
+      root = ofc_path_createW(TSTR("/"));
+      if (root == OFC_NULL ||
+          !ofc_path_add_mapping(SYNTH_DEVICE,
+                                TSTR("Synthetic Share"), root,
+                                OFC_FST_OTHER, OFC_FALSE))
+        {
+          fprintf(stderr, "Cannot map %s:\n", SMBSYNTH_DEVICE);
+          ret = -1;
+        }
+      else
+        {
+          synth_enabled = 1;
+          printf("Synthetic share at %s:/ with %d files\n", SMBSYNTH_DEVICE,
+                 num_files);
+        }
+    }
+  return (ret);
+}
+
+void smbsynth_dump(FILE *out)
+{
+  struct synth_file *file;
+
+  if (synth_enabled)
+    {
+      fprintf(out, "  Synthetic Opens: %llu\n",
+              (unsigned long long) synth_opens);
+      fprintf(out, "  Synthetic Bytes Read: %llu\n",
+              (unsigned long long) synth_bytes_read);
+      fprintf(out, "  Synthetic Bytes Discarded: %llu\n",
+              (unsigned long long) synth_bytes_written);
+      if (synth_checksum)
+        {
+          pthread_mutex_lock(&synth_lock);
+          for (file = synth_files; file != NULL; file = file->next)
+            {
+              if (file->written > 0)
+                fprintf(out, "  Synthetic Write %ls: %llu bytes, "
+                        "sum %016llx weighted %016llx\n", file->name,
+                        (unsigned long long) file->written,
+                        (unsigned long long) file->sum,
+                        (unsigned long long) file->weighted);
+            }
+          pthread_mutex_unlock(&synth_lock);
+        }
+    }
+}
+
+/**
+ * \}
+ */
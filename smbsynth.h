@@ -0,0 +1,20 @@
+#if !defined(__smbsynth_h__)
+#define __smbsynth_h__
+
+#include <stdio.h>
+
+/*
+ * Synthetic data share support for smbserver.
+ *
+ * smbsynth_setup registers a file system with the stack holding the files
+ * listed in a config file, and maps it to the SMBSYNTH_DEVICE device.  A
+ * share whose path in the stack's configuration is synth:/ is served from
+ * it.  Reads of its files return deterministic data and writes are
+ * discarded, optionally after being checksummed.  Call it after the stack
+ * is initialized and before the server is started.
+ */
+#define SMBSYNTH_DEVICE "synth"
+
+int smbsynth_setup(const char *config, int checksum);
+void smbsynth_dump(FILE *out);
+#endif
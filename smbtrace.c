@@ -0,0 +1,260 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include <ofc/types.h>
+#include <ofc/framework.h>
+
+#include "smbtrace.h"
+
+/**
+ * \{
+ */
+
+/*
+ * Number of events the ring holds.  Must be a power of two.
+ */
+#define TRACE_ENTRIES 4096
+/*
+ * Longest event text kept.  Longer events are truncated.
+ */
+#define TRACE_TEXT 112
+
+/*
+ * An event.  The sequence number is zero while the event is being
+ * written and the event's index plus one once it is complete, so a dump
+ * racing a writer can tell a torn or overwritten entry and skip it.
+ */
+struct trace_entry {
+  OFC_UINT64 seq;               /* Index + 1, or 0 while being written */
+  OFC_UINT64 when;              /* Monotonic time in microseconds */
+  OFC_UINT32 tid;               /* Thread that recorded the event */
+  OFC_UINT32 level;             /* OFC_LOG_LEVEL of the event */
+  char text[TRACE_TEXT];
+};
+
+static struct trace_entry *trace_ring = NULL;
+static OFC_UINT64 trace_head = 0;       /* Index of the next event */
+static OFC_UINT64 trace_dumped = 0;     /* Index of first event not dumped */
+static int trace_dumping = 0;           /* A dump is in progress */
+static volatile int trace_active = 0;
+static OFC_LOG_LEVEL trace_level = OFC_LOG_INFO;
+static char trace_path[PATH_MAX];
+static __thread OFC_UINT32 trace_tid = 0;  /* Cached on first event */
+
+static const char *trace_level_names[] =
+  {
+    "debug", "info", "warn", "fatal"
+  };
+#define NUM_LEVELS (sizeof(trace_level_names) / sizeof(trace_level_names[0]))
+
+static OFC_VOID trace_record(OFC_LOG_LEVEL level, const char *fmt,
+                             va_list ap)
+{
+  struct trace_entry *entry;
+  struct timespec ts;
+  OFC_UINT64 index;
+
+  index = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  entry = &trace_ring[index & (TRACE_ENTRIES - 1)];
+
+  __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  entry->when = (OFC_UINT64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (trace_tid == 0)
+    trace_tid = (OFC_UINT32) syscall(SYS_gettid);
+  entry->tid = trace_tid;
+  entry->level = level;
+  vsnprintf(entry->text, TRACE_TEXT, fmt, ap);
+
+  __atomic_store_n(&entry->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+OFC_VOID smbtrace(OFC_LOG_LEVEL level, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (trace_active && level >= trace_level)
+    {
+      va_start(ap, fmt);
+      trace_record(level, fmt, ap);
+      va_end(ap);
+    }
+}
+
+/*
+ * Dumps can be made from a signal handler so they are formatted by hand
+ * and written with write(2) rather than through stdio
+ */
+static char *put_str(char *p, char *end, const char *str)
+{
+  while (*str != '\0' && p < end)
+    *p++ = *str++;
+  return (p);
+}
+
+static char *put_num(char *p, char *end, OFC_UINT64 value, int width)
+{
+  char digits[24];
+  int n;
+
+  n = 0;
+  do
+    {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+    }
+  while (value > 0);
+  while (n < width)
+    digits[n++] = '0';
+  while (n > 0 && p < end)
+    *p++ = digits[--n];
+  return (p);
+}
+
+OFC_VOID smbtrace_dump(const char *reason)
+{
+  struct trace_entry entry;
+  OFC_UINT64 head;
+  OFC_UINT64 index;
+  OFC_UINT64 lost;
+  OFC_UINT64 seq;
+  char line[TRACE_TEXT + 64];
+  char *p;
+  char *end;
+  int fd;
+
+  if (!trace_active ||
+      __atomic_exchange_n(&trace_dumping, 1, __ATOMIC_ACQUIRE))
+    return;
+
+  fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd >= 0)
+    {
+      head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+      index = trace_dumped;
+      lost = 0;
+      if (head - index > TRACE_ENTRIES)
+        {
+          lost = head - index - TRACE_ENTRIES;
+          index = head - TRACE_ENTRIES;
+        }
+
+      end = line + sizeof(line) - 1;
+      p = put_str(line, end, "--- trace dump (");
+      p = put_str(p, end, reason);
+      p = put_str(p, end, "): ");
+      p = put_num(p, end, head - index, 0);
+      p = put_str(p, end, " events, ");
+      p = put_num(p, end, lost, 0);
+      p = put_str(p, end, " overwritten\n");
+      write(fd, line, p - line);
+
+      for (; index < head; index++)
+        {
+          seq = __atomic_load_n(&trace_ring[index & (TRACE_ENTRIES - 1)].seq,
+                                __ATOMIC_ACQUIRE);
+          memcpy(&entry, &trace_ring[index & (TRACE_ENTRIES - 1)],
+                 sizeof(entry));
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+          if (seq != index + 1 ||
+              __atomic_load_n(&trace_ring[index & (TRACE_ENTRIES - 1)].seq,
+                              __ATOMIC_RELAXED) != seq)
+            continue;
+
+          entry.text[TRACE_TEXT - 1] = '\0';
+          p = put_num(line, end, entry.when / 1000000, 0);
+          p = put_str(p, end, ".");
+          p = put_num(p, end, entry.when % 1000000, 6);
+          p = put_str(p, end, " ");
+          p = put_num(p, end, entry.tid, 0);
+          p = put_str(p, end, " ");
+          p = put_str(p, end, entry.level < NUM_LEVELS ?
+                      trace_level_names[entry.level] : "?");
+          p = put_str(p, end, " ");
+          p = put_str(p, end, entry.text);
+          if (p == line || p[-1] != '\n')
+            *p++ = '\n';
+          write(fd, line, p - line);
+        }
+      trace_dumped = head;
+      close(fd);
+    }
+  __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_signal(int sig)
+{
+  smbtrace_dump("signal");
+}
+
+static void trace_exit(void)
+{
+  smbtrace_dump("exit");
+}
+
+int smbtrace_parse_level(const char *name, OFC_LOG_LEVEL *level)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_LEVELS && strcmp(trace_level_names[i], name) != 0;
+       i++);
+  if (i == NUM_LEVELS)
+    return (-1);
+  *level = (OFC_LOG_LEVEL) i;
+  return (0);
+}
+
+int smbtrace_init(const char *path, OFC_LOG_LEVEL level)
+{
+  struct sigaction sa;
+
+  if (trace_active)
+    return (0);
+  if (strlen(path) >= sizeof(trace_path))
+    return (-1);
+
+  trace_ring = calloc(TRACE_ENTRIES, sizeof(struct trace_entry));
+  if (trace_ring == NULL)
+    return (-1);
+  strcpy(trace_path, path);
+  trace_level = level;
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, NULL);
+  atexit(trace_exit);
+
+  trace_active = 1;
+  return (0);
+}
+
+OFC_BOOL smbtrace_enabled(OFC_VOID)
+{
+  return (trace_active ? OFC_TRUE : OFC_FALSE);
+}
+
+OFC_LOG_LEVEL smbtrace_level(OFC_VOID)
+{
+  return (trace_level);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,31 @@
+#if !defined(__smbtrace_h__)
+#define __smbtrace_h__
+
+#include <ofc/types.h>
+#include <ofc/framework.h>
+
+/*
+ * In-process trace ring.
+ *
+ * Once enabled, events at or above the trace level are recorded in a
+ * fixed size in-memory ring instead of going to syslog.  Recording takes
+ * no locks and, after a thread's first event, makes no system calls.  The
+ * stack's own log messages still go to syslog, but only warnings and
+ * above while the ring is enabled.  The ring is appended to the trace
+ * file only when smbtrace_dump is called (on an error, say), when the
+ * process receives SIGUSR2 and at exit.  Each dump writes the events
+ * recorded since the previous one, or as many of them as the ring still
+ * holds.
+ *
+ * smbtrace_init must be called before smbcp_init.  If it isn't,
+ * SMBCP_TRACE=<file> and optionally SMBCP_TRACE_LEVEL=<level> in the
+ * environment enable the ring.
+ */
+int smbtrace_init(const char *path, OFC_LOG_LEVEL level);
+OFC_BOOL smbtrace_enabled(OFC_VOID);
+OFC_LOG_LEVEL smbtrace_level(OFC_VOID);
+int smbtrace_parse_level(const char *name, OFC_LOG_LEVEL *level);
+OFC_VOID smbtrace(OFC_LOG_LEVEL level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+OFC_VOID smbtrace_dump(const char *reason);
+#endif
@@ -0,0 +1,285 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <ofc/config.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/file.h>
+#include <ofc/lock.h>
+#include <ofc/event.h>
+
+#include "smbpool.h"
+#include "smbwalk.h"
+
+/**
+ * \{
+ */
+
+/*
+ * State of a walk.
+ */
+struct walk_state {
+  SMBWALK_ENTRY *entry;         /* Entry callback */
+  SMBWALK_DONE *done;           /* Directory done callback */
+  OFC_VOID *context;            /* Context for callbacks */
+  OFC_LOCK lock;                /* Protects first_error and hold counts */
+  OFC_DWORD first_error;        /* First enumeration error */
+  OFC_HANDLE root_done;         /* Signalled when the root completes */
+};
+
+/*
+ * A directory.  Each directory still to be enumerated is a work item
+ * on the pool.  A directory is held by its own enumeration, by each of its
+ * subdirectories and by any holds placed by the entry callback.  It
+ * completes when the last hold is released.
+ */
+struct smbwalk_dir {
+  struct walk_state *walk;      /* The walk this directory is part of */
+  struct smbwalk_dir *parent;   /* Parent or OFC_NULL for the root */
+  OFC_TCHAR *dirname;           /* Path of the directory */
+  OFC_INT holds;                /* Outstanding holds */
+};
+
+static wchar_t *MakeFilename(const wchar_t *dirname, const wchar_t *name)
+{
+  size_t dirlen;
+  size_t namelen;
+  wchar_t *filename;
+
+  dirlen = wcslen (dirname);
+  namelen = wcslen (name);
+  filename =
+    malloc((dirlen + namelen + 2) * sizeof(wchar_t));
+  if (filename == NULL)
+    return (NULL);
+  wcscpy (filename, dirname);
+  filename[dirlen] = L'/';
+  wcscpy (&filename[dirlen+1], name);
+  filename[dirlen + 1 + namelen] = L'\0';
+  return (filename);
+}
+
+/*
+ * The directory takes over dirname.  Returns OFC_NULL, having freed
+ * dirname, if either is out of memory.
+ */
+static struct smbwalk_dir *alloc_dir(struct walk_state *walk,
+                                     struct smbwalk_dir *parent,
+                                     OFC_TCHAR *dirname)
+{
+  struct smbwalk_dir *dir;
+
+  if (dirname == OFC_NULL)
+    return (OFC_NULL);
+  dir = malloc(sizeof(struct smbwalk_dir));
+  if (dir == OFC_NULL)
+    {
+      free(dirname);
+      return (OFC_NULL);
+    }
+  dir->walk = walk;
+  dir->parent = parent;
+  dir->dirname = dirname;
+  /*
+   * Held by its own enumeration
+   */
+  dir->holds = 1;
+  if (parent != OFC_NULL)
+    smbwalk_hold(parent);
+  return (dir);
+}
+
+OFC_CTCHAR *smbwalk_dirname(struct smbwalk_dir *dir)
+{
+  return (dir->dirname);
+}
+
+OFC_VOID smbwalk_hold(struct smbwalk_dir *dir)
+{
+  ofc_lock(dir->walk->lock);
+  dir->holds++;
+  ofc_unlock(dir->walk->lock);
+}
+
+OFC_VOID smbwalk_release(struct smbwalk_dir *dir)
+{
+  struct walk_state *walk;
+  struct smbwalk_dir *parent;
+  OFC_INT holds;
+
+  while (dir != OFC_NULL)
+    {
+      walk = dir->walk;
+      ofc_lock(walk->lock);
+      holds = --dir->holds;
+      ofc_unlock(walk->lock);
+
+      if (holds > 0)
+        dir = OFC_NULL;
+      else
+        {
+          if (walk->done != OFC_NULL)
+            (*walk->done)(dir->dirname, walk->context);
+
+          parent = dir->parent;
+          if (parent == OFC_NULL)
+            ofc_event_set(walk->root_done);
+
+          free(dir->dirname);
+          free(dir);
+          /*
+           * And release the hold the directory had on its parent
+           */
+          dir = parent;
+        }
+    }
+}
+
+/*
+ * Record the first error of the walk
+ */
+static OFC_VOID walk_error(struct walk_state *walk, OFC_DWORD last_error)
+{
+  ofc_lock(walk->lock);
+  if (walk->first_error == OFC_ERROR_SUCCESS)
+    walk->first_error = last_error;
+  ofc_unlock(walk->lock);
+}
+
+static OFC_VOID walk_entry(struct smbpool *pool, struct smbwalk_dir *dir,
+                           OFC_WIN32_FIND_DATA *find_data)
+{
+  struct walk_state *walk = dir->walk;
+  struct smbwalk_dir *subdir;
+
+  if (wcscmp(find_data->cFileName, L".") != 0 &&
+      wcscmp(find_data->cFileName, L"..") != 0)
+    {
+      (*walk->entry)(dir, find_data, walk->context);
+      if (find_data->dwFileAttributes & OFC_FILE_ATTRIBUTE_DIRECTORY)
+        {
+          subdir = alloc_dir(walk, dir,
+                             MakeFilename(dir->dirname,
+                                          find_data->cFileName));
+          if (subdir != OFC_NULL)
+            smbpool_submit(pool, subdir);
+          else
+            {
+              printf("Cannot enumerate %ls/%ls: %s\n", dir->dirname,
+                     find_data->cFileName,
+                     ofc_get_error_string(OFC_ERROR_NOT_ENOUGH_MEMORY));
+              walk_error(walk, OFC_ERROR_NOT_ENOUGH_MEMORY);
+            }
+        }
+    }
+}
+
+static OFC_VOID walk_dir(struct smbpool *pool, OFC_VOID *item,
+                         OFC_VOID *context)
+{
+  struct walk_state *walk = context;
+  struct smbwalk_dir *dir = item;
+  OFC_HANDLE list_handle;
+  OFC_WIN32_FIND_DATA find_data;
+  OFC_BOOL more = OFC_FALSE;
+  OFC_BOOL status;
+  OFC_TCHAR *filename;
+  OFC_DWORD last_error;
+
+  last_error = OFC_ERROR_SUCCESS;
+  filename = MakeFilename(dir->dirname, TSTR("*"));
+  if (filename == OFC_NULL)
+    {
+      last_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+      list_handle = OFC_INVALID_HANDLE_VALUE;
+    }
+  else
+    {
+      list_handle = OfcFindFirstFile(filename, &find_data, &more);
+      free(filename);
+      if (list_handle == OFC_INVALID_HANDLE_VALUE)
+        last_error = OfcGetLastError();
+    }
+
+  if (list_handle != OFC_INVALID_HANDLE_VALUE)
+    {
+      walk_entry(pool, dir, &find_data);
+
+      status = OFC_TRUE;
+      while (more && status == OFC_TRUE)
+        {
+          status = OfcFindNextFile(list_handle, &find_data, &more);
+          if (status == OFC_TRUE)
+            walk_entry(pool, dir, &find_data);
+          else if (OfcGetLastError() != OFC_ERROR_NO_MORE_FILES)
+            last_error = OfcGetLastError();
+        }
+      OfcFindClose(list_handle);
+    }
+
+  if (last_error != OFC_ERROR_SUCCESS)
+    {
+      printf("Cannot enumerate %ls: %s\n", dir->dirname,
+             ofc_get_error_string(last_error));
+      walk_error(walk, last_error);
+    }
+  /*
+   * Release the enumeration's hold
+   */
+  smbwalk_release(dir);
+}
+
+OFC_DWORD smbwalk(OFC_CTCHAR *root, OFC_INT num_threads,
+                  SMBWALK_ENTRY *entry, SMBWALK_DONE *done,
+                  OFC_VOID *context)
+{
+  struct walk_state walk;
+  struct smbpool *pool;
+  struct smbwalk_dir *dir;
+
+  walk.entry = entry;
+  walk.done = done;
+  walk.context = context;
+  walk.first_error = OFC_ERROR_SUCCESS;
+  walk.lock = ofc_lock_init();
+  walk.root_done = ofc_event_create(OFC_EVENT_MANUAL);
+
+  pool = OFC_NULL;
+  if (walk.lock != OFC_NULL && walk.root_done != OFC_HANDLE_NULL)
+    pool = smbpool_create(num_threads, &walk_dir, &walk);
+  if (pool == OFC_NULL)
+    walk.first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+  else
+    {
+      dir = alloc_dir(&walk, OFC_NULL, wcsdup(root));
+      if (dir == OFC_NULL)
+        walk.first_error = OFC_ERROR_NOT_ENOUGH_MEMORY;
+      else
+        {
+          smbpool_submit(pool, dir);
+          /*
+           * The root completes only once every directory below it has
+           * been enumerated and every hold placed on them released.
+           */
+          ofc_event_wait(walk.root_done);
+          smbpool_wait(pool);
+        }
+      smbpool_destroy(pool);
+    }
+
+  if (walk.root_done != OFC_HANDLE_NULL)
+    ofc_event_destroy(walk.root_done);
+  if (walk.lock != OFC_NULL)
+    ofc_lock_destroy(walk.lock);
+  return (walk.first_error);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,40 @@
+#if !defined(__smbwalk_h__)
+#define __smbwalk_h__
+
+#include <ofc/types.h>
+#include <ofc/file.h>
+
+/*
+ * Parallel directory tree walk.
+ *
+ * Directories are enumerated concurrently on a pool of num_threads
+ * workers.  The entry callback is called for every entry below the root
+ * (other than . and ..) with the directory that contains it.  Callbacks
+ * run concurrently on the pool threads.
+ *
+ * The optional done callback is called once for each directory, root
+ * included, after it and everything below it has been walked.  Children
+ * complete before their parents so the done callbacks run bottom up.  An
+ * entry callback that hands work off to another thread can keep the
+ * containing directory from completing with smbwalk_hold and
+ * smbwalk_release.
+ *
+ * smbwalk returns once the root has completed.  The return value is the
+ * first enumeration error encountered, if any.  The walk continues past
+ * directories that cannot be enumerated.  Running out of memory is
+ * reported as OFC_ERROR_NOT_ENOUGH_MEMORY.
+ */
+struct smbwalk_dir;
+
+typedef OFC_VOID (SMBWALK_ENTRY)(struct smbwalk_dir *dir,
+                                 OFC_WIN32_FIND_DATA *find_data,
+                                 OFC_VOID *context);
+typedef OFC_VOID (SMBWALK_DONE)(OFC_CTCHAR *dirname, OFC_VOID *context);
+
+OFC_DWORD smbwalk(OFC_CTCHAR *root, OFC_INT num_threads,
+                  SMBWALK_ENTRY *entry, SMBWALK_DONE *done,
+                  OFC_VOID *context);
+OFC_CTCHAR *smbwalk_dirname(struct smbwalk_dir *dir);
+OFC_VOID smbwalk_hold(struct smbwalk_dir *dir);
+OFC_VOID smbwalk_release(struct smbwalk_dir *dir);
+#endif
@@ -0,0 +1,551 @@
+/* Copyright (c) 2021 Connected Way, LLC. All rights reserved.
+ * Use of this source code is unrestricted
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <ofc/config.h>
+#include <ofc/handle.h>
+#include <ofc/types.h>
+#include <ofc/file.h>
+#include <ofc/queue.h>
+#include <ofc/lock.h>
+#include <ofc/event.h>
+#include <ofc/thread.h>
+#include <ofc/waitset.h>
+
+#include "smbworkers.h"
+#include "smbcopy.h"
+#include "smbtrace.h"
+
+/**
+ * \{
+ */
+
+/*
+ * A submitted copy
+ */
+struct copy_job {
+  OFC_TCHAR *rfilename;
+  OFC_TCHAR *wfilename;
+  OFC_INT priority;
+  OFC_UINT32 weight;
+};
+
+/*
+ * A worker.  The queues of copies not yet started, one for each
+ * priority, are shared with the other workers, who may steal from them.
+ * Everything else belongs to the worker's thread.
+ */
+struct worker {
+  struct smbworkers *workers;   /* Pool the worker is in */
+  OFC_HANDLE wait_set;          /* Events of the worker's copies */
+  OFC_HANDLE wake;              /* Signalled when there may be work */
+  OFC_LOCK lock;                /* Protects queued and num_queued */
+  OFC_HANDLE queued[SMBMEM_PRIORITIES]; /* Copies not yet started */
+  volatile OFC_INT num_queued;  /* Number of copies queued */
+  volatile OFC_BOOL idle;       /* Worker is waiting with nothing to do */
+  OFC_INT active;               /* Copies running */
+  OFC_INT running[SMBMEM_PRIORITIES]; /* Copies running at each priority */
+  OFC_INT steals;               /* Copies taken from other workers */
+  struct smbcopy_stats stats;   /* Totals of finished copies */
+  OFC_HANDLE thread;            /* Worker thread */
+  OFC_HANDLE notify;            /* Worker exit notification */
+};
+
+struct smbworkers {
+  OFC_INT num_workers;          /* Number of workers */
+  OFC_INT depth;                /* Copies run at once by each worker */
+  OFC_UINT32 flags;             /* Copy flags */
+  SMBWORKERS_DONE *done;        /* Done routine */
+  OFC_VOID *context;            /* Context for done routine */
+  OFC_LOCK lock;                /* Protects next and outstanding */
+  OFC_INT next;                 /* Worker the next copy is queued to */
+  OFC_INT outstanding;          /* Copies submitted and not done */
+  OFC_HANDLE done_event;        /* Signalled when all copies are done */
+  struct worker *worker;        /* The workers */
+};
+
+static OFC_VOID destroy_job(struct copy_job *job)
+{
+  free(job->rfilename);
+  free(job->wfilename);
+  free(job);
+}
+
+/*
+ * Wake a worker that has nothing to do so that it can steal
+ */
+static OFC_VOID wake_idle(struct smbworkers *workers, struct worker *self)
+{
+  OFC_INT i;
+
+  for (i = 0; i < workers->num_workers; i++)
+    {
+      if (&workers->worker[i] != self && workers->worker[i].idle)
+        {
+          ofc_event_set(workers->worker[i].wake);
+          break;
+        }
+    }
+}
+
+/*
+ * Take the first copy of the highest priority, at least min_priority,
+ * from a worker's queues.  Called with the worker locked.
+ */
+static struct copy_job *take_job(struct worker *worker, OFC_INT min_priority,
+                                 OFC_BOOL last)
+{
+  struct copy_job *job;
+  OFC_INT p;
+
+  job = OFC_NULL;
+  for (p = SMBMEM_PRIORITIES - 1; p >= min_priority && job == OFC_NULL; p--)
+    {
+      job = last ? ofc_queue_last(worker->queued[p]) :
+        ofc_queue_first(worker->queued[p]);
+      if (job != OFC_NULL)
+        {
+          ofc_queue_unlink(worker->queued[p], job);
+          worker->num_queued--;
+        }
+    }
+  return (job);
+}
+
+/*
+ * Take the highest priority copy, at least min_priority, from the front
+ * of our own queues or, failing that, from the back of the longest
+ * queues of another worker
+ */
+static struct copy_job *next_job(struct worker *worker, OFC_INT min_priority)
+{
+  struct smbworkers *workers = worker->workers;
+  struct worker *victim;
+  struct copy_job *job;
+  OFC_BOOL more;
+  OFC_INT i;
+
+  ofc_lock(worker->lock);
+  job = take_job(worker, min_priority, OFC_FALSE);
+  more = (worker->num_queued > 0);
+  ofc_unlock(worker->lock);
+
+  if (job != OFC_NULL)
+    {
+      if (more)
+        wake_idle(workers, worker);
+      return (job);
+    }
+
+  /*
+   * The queue lengths are read without the locks.  They only pick the
+   * victim.
+   */
+  victim = OFC_NULL;
+  for (i = 0; i < workers->num_workers; i++)
+    {
+      if (&workers->worker[i] != worker &&
+          workers->worker[i].num_queued > 0 &&
+          (victim == OFC_NULL ||
+           workers->worker[i].num_queued > victim->num_queued))
+        victim = &workers->worker[i];
+    }
+
+  if (victim != OFC_NULL)
+    {
+      ofc_lock(victim->lock);
+      job = take_job(victim, min_priority, OFC_TRUE);
+      ofc_unlock(victim->lock);
+
+      if (job != OFC_NULL)
+        worker->steals++;
+    }
+  return (job);
+}
+
+static OFC_VOID finish_job(struct worker *worker, struct copy_job *job,
+                           OFC_DWORD dwLastError)
+{
+  struct smbworkers *workers = worker->workers;
+
+  if (workers->done != OFC_NULL)
+    (*workers->done)(job->rfilename, job->wfilename, dwLastError,
+                     workers->context);
+  destroy_job(job);
+
+  ofc_lock(workers->lock);
+  workers->outstanding--;
+  if (workers->outstanding == 0)
+    ofc_event_set(workers->done_event);
+  ofc_unlock(workers->lock);
+}
+
+static OFC_VOID reap_copy(struct worker *worker, struct smbcopy *copy)
+{
+  struct copy_job *job;
+  struct smbcopy_stats stats;
+  OFC_DWORD dwLastError;
+
+  smbcopy_status(copy, &dwLastError);
+  smbcopy_get_stats(copy, &stats);
+  worker->stats.wakeups += stats.wakeups;
+  worker->stats.completions += stats.completions;
+  worker->stats.harvested += stats.harvested;
+  worker->stats.refills += stats.refills;
+  worker->stats.hedges += stats.hedges;
+  worker->stats.hedges_won += stats.hedges_won;
+  worker->stats.striped += stats.striped;
+  worker->stats.shrinks += stats.shrinks;
+  worker->stats.low_memory += stats.low_memory;
+  worker->stats.boosted += stats.boosted;
+  worker->stats.failovers += stats.failovers;
+  worker->stats.failover_ms += stats.failover_ms;
+  worker->stats.dispatch_us += stats.dispatch_us;
+
+  job = smbcopy_context(copy);
+  worker->running[job->priority]--;
+  worker->active--;
+  finish_job(worker, job, dwLastError);
+  smbcopy_destroy(copy);
+}
+
+/*
+ * The priority a copy needs to start now.  A full worker still starts a
+ * copy of higher priority than any it is running, up to twice its depth,
+ * so that urgent copies don't wait behind bulk ones.
+ */
+static OFC_INT start_priority(struct worker *worker)
+{
+  OFC_INT p;
+
+  if (worker->active < worker->workers->depth)
+    return (SMBMEM_PRIORITY_LOW);
+  if (worker->active >= worker->workers->depth * 2)
+    return (SMBMEM_PRIORITIES);
+
+  for (p = SMBMEM_PRIORITIES - 1; p >= 0 && worker->running[p] == 0; p--);
+  return (p + 1);
+}
+
+/*
+ * Start copies until the worker is full or there is nothing left to
+ * start
+ */
+static OFC_VOID start_jobs(struct worker *worker)
+{
+  struct smbworkers *workers = worker->workers;
+  struct copy_job *job;
+  struct smbcopy *copy;
+  OFC_DWORD dwLastError;
+  OFC_INT min_priority;
+
+  while ((min_priority = start_priority(worker)) < SMBMEM_PRIORITIES &&
+         (job = next_job(worker, min_priority)) != OFC_NULL)
+    {
+      copy = smbcopy_start(worker->wait_set, job->rfilename,
+                           job->wfilename, workers->flags, OFC_NULL, job,
+                           &dwLastError);
+      if (copy == OFC_NULL)
+        finish_job(worker, job, dwLastError);
+      else
+        {
+          smbcopy_set_priority(copy, job->priority, job->weight);
+          worker->running[job->priority]++;
+          worker->active++;
+          if (smbcopy_status(copy, OFC_NULL) != SMBCOPY_RUNNING)
+            reap_copy(worker, copy);
+        }
+    }
+}
+
+static OFC_DWORD smbworkers_thread(OFC_HANDLE hThread, OFC_VOID *context)
+{
+  struct worker *worker = context;
+  struct smbcopy *copy;
+  OFC_HANDLE hEvent;
+
+  while (!ofc_thread_is_deleting(hThread))
+    {
+      start_jobs(worker);
+      /*
+       * With nothing running, say so before looking once more, so that
+       * work queued after the look is sure to wake us
+       */
+      if (worker->active == 0)
+        {
+          worker->idle = OFC_TRUE;
+          start_jobs(worker);
+        }
+      if (worker->active > 0)
+        worker->idle = OFC_FALSE;
+
+      hEvent = ofc_waitset_wait(worker->wait_set);
+      worker->idle = OFC_FALSE;
+      if (hEvent != OFC_HANDLE_NULL && hEvent != worker->wake &&
+          smbcopy_poll(hEvent, &copy) != SMBCOPY_RUNNING)
+        reap_copy(worker, copy);
+    }
+  return (0);
+}
+
+/*
+ * Release what a worker holds.  Anything not created is null, so this
+ * also cleans up a worker that was only partly set up.
+ */
+static OFC_VOID destroy_worker(struct worker *worker)
+{
+  OFC_INT p;
+
+  if (worker->notify != OFC_HANDLE_NULL)
+    ofc_event_destroy(worker->notify);
+  if (worker->wait_set != OFC_HANDLE_NULL && worker->wake != OFC_HANDLE_NULL)
+    ofc_waitset_remove(worker->wait_set, worker->wake);
+  if (worker->wait_set != OFC_HANDLE_NULL)
+    ofc_waitset_destroy(worker->wait_set);
+  if (worker->wake != OFC_HANDLE_NULL)
+    ofc_event_destroy(worker->wake);
+  if (worker->lock != OFC_NULL)
+    ofc_lock_destroy(worker->lock);
+  for (p = 0; p < SMBMEM_PRIORITIES; p++)
+    if (worker->queued[p] != OFC_HANDLE_NULL)
+      ofc_queue_destroy(worker->queued[p]);
+}
+
+/*
+ * Stop the threads of the first num_started workers and wait for them to
+ * exit
+ */
+static OFC_VOID stop_workers(struct smbworkers *workers, OFC_INT num_started)
+{
+  struct worker *worker;
+  OFC_INT i;
+
+  for (i = 0; i < num_started; i++)
+    {
+      worker = &workers->worker[i];
+      ofc_thread_delete(worker->thread);
+      ofc_event_set(worker->wake);
+    }
+
+  for (i = 0; i < num_started; i++)
+    ofc_event_wait(workers->worker[i].notify);
+}
+
+/*
+ * Release the pool once the threads of the workers are stopped
+ */
+static OFC_VOID free_workers(struct smbworkers *workers)
+{
+  OFC_INT i;
+
+  if (workers->worker != OFC_NULL)
+    {
+      for (i = 0; i < workers->num_workers; i++)
+        destroy_worker(&workers->worker[i]);
+      free(workers->worker);
+    }
+  if (workers->done_event != OFC_HANDLE_NULL)
+    ofc_event_destroy(workers->done_event);
+  if (workers->lock != OFC_NULL)
+    ofc_lock_destroy(workers->lock);
+  free(workers);
+}
+
+/*
+ * Set up a worker.  Returns OFC_FALSE if anything it needs could not be
+ * created, leaving what was to destroy_worker.
+ */
+static OFC_BOOL init_worker(struct smbworkers *workers,
+                            struct worker *worker)
+{
+  OFC_INT p;
+
+  worker->workers = workers;
+  worker->wait_set = ofc_waitset_create();
+  worker->wake = ofc_event_create(OFC_EVENT_AUTO);
+  if (worker->wait_set == OFC_HANDLE_NULL || worker->wake == OFC_HANDLE_NULL)
+    return (OFC_FALSE);
+  ofc_waitset_add(worker->wait_set, (OFC_HANDLE) worker, worker->wake);
+
+  worker->lock = ofc_lock_init();
+  if (worker->lock == OFC_NULL)
+    return (OFC_FALSE);
+  for (p = 0; p < SMBMEM_PRIORITIES; p++)
+    {
+      worker->queued[p] = ofc_queue_create();
+      if (worker->queued[p] == OFC_HANDLE_NULL)
+        return (OFC_FALSE);
+      worker->running[p] = 0;
+    }
+  worker->num_queued = 0;
+  worker->idle = OFC_FALSE;
+  worker->active = 0;
+  worker->steals = 0;
+  memset(&worker->stats, 0, sizeof(worker->stats));
+  return (OFC_TRUE);
+}
+
+struct smbworkers *smbworkers_create(OFC_INT num_workers, OFC_INT depth,
+                                     OFC_UINT32 flags, SMBWORKERS_DONE *done,
+                                     OFC_VOID *context)
+{
+  struct smbworkers *workers;
+  struct worker *worker;
+  OFC_INT i;
+
+  workers = calloc(1, sizeof(struct smbworkers));
+  if (workers == OFC_NULL)
+    return (OFC_NULL);
+
+  workers->num_workers = num_workers;
+  workers->depth = depth;
+  workers->flags = flags;
+  workers->done = done;
+  workers->context = context;
+  workers->next = 0;
+  workers->outstanding = 0;
+  workers->lock = ofc_lock_init();
+  workers->done_event = ofc_event_create(OFC_EVENT_AUTO);
+  /*
+   * Zeroed so that a worker that isn't set up has nothing to destroy
+   */
+  workers->worker = calloc(num_workers, sizeof(struct worker));
+  if (workers->lock == OFC_NULL || workers->done_event == OFC_HANDLE_NULL ||
+      workers->worker == OFC_NULL)
+    {
+      free_workers(workers);
+      return (OFC_NULL);
+    }
+
+  for (i = 0; i < num_workers; i++)
+    {
+      if (!init_worker(workers, &workers->worker[i]))
+        {
+          free_workers(workers);
+          return (OFC_NULL);
+        }
+    }
+  /*
+   * Start the threads once every worker is there to steal from
+   */
+  for (i = 0; i < num_workers; i++)
+    {
+      worker = &workers->worker[i];
+      worker->notify = ofc_event_create(OFC_EVENT_AUTO);
+      if (worker->notify != OFC_HANDLE_NULL)
+        worker->thread = ofc_thread_create(&smbworkers_thread,
+                                           "SMBWORKER", i, worker,
+                                           OFC_THREAD_DETACH,
+                                           worker->notify);
+      if (worker->thread == OFC_HANDLE_NULL)
+        {
+          stop_workers(workers, i);
+          free_workers(workers);
+          return (OFC_NULL);
+        }
+    }
+  return (workers);
+}
+
+OFC_DWORD smbworkers_submit(struct smbworkers *workers,
+                            OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename,
+                            OFC_INT priority, OFC_UINT32 weight)
+{
+  struct copy_job *job;
+  struct worker *worker;
+
+  if (priority < SMBMEM_PRIORITY_LOW)
+    priority = SMBMEM_PRIORITY_LOW;
+  if (priority > SMBMEM_PRIORITY_HIGH)
+    priority = SMBMEM_PRIORITY_HIGH;
+
+  job = malloc(sizeof(struct copy_job));
+  if (job == OFC_NULL)
+    return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+  job->rfilename = wcsdup(rfilename);
+  job->wfilename = wcsdup(wfilename);
+  if (job->rfilename == OFC_NULL || job->wfilename == OFC_NULL)
+    {
+      destroy_job(job);
+      return (OFC_ERROR_NOT_ENOUGH_MEMORY);
+    }
+  job->priority = priority;
+  job->weight = weight;
+
+  ofc_lock(workers->lock);
+  workers->outstanding++;
+  worker = &workers->worker[workers->next];
+  workers->next = (workers->next + 1) % workers->num_workers;
+  ofc_unlock(workers->lock);
+
+  ofc_lock(worker->lock);
+  ofc_enqueue(worker->queued[priority], job);
+  worker->num_queued++;
+  ofc_unlock(worker->lock);
+
+  ofc_event_set(worker->wake);
+  return (OFC_ERROR_SUCCESS);
+}
+
+OFC_VOID smbworkers_wait(struct smbworkers *workers)
+{
+  OFC_BOOL idle;
+
+  idle = OFC_FALSE;
+  while (!idle)
+    {
+      ofc_lock(workers->lock);
+      idle = (workers->outstanding == 0);
+      ofc_unlock(workers->lock);
+
+      if (!idle)
+        ofc_event_wait(workers->done_event);
+    }
+}
+
+OFC_VOID smbworkers_get_stats(struct smbworkers *workers,
+                              struct smbcopy_stats *stats,
+                              OFC_INT *steals)
+{
+  struct worker *worker;
+  OFC_INT i;
+
+  memset(stats, 0, sizeof(*stats));
+  *steals = 0;
+  for (i = 0; i < workers->num_workers; i++)
+    {
+      worker = &workers->worker[i];
+      stats->wakeups += worker->stats.wakeups;
+      stats->completions += worker->stats.completions;
+      stats->harvested += worker->stats.harvested;
+      stats->refills += worker->stats.refills;
+      stats->hedges += worker->stats.hedges;
+      stats->hedges_won += worker->stats.hedges_won;
+      stats->striped += worker->stats.striped;
+      stats->shrinks += worker->stats.shrinks;
+      stats->low_memory += worker->stats.low_memory;
+      stats->boosted += worker->stats.boosted;
+      stats->failovers += worker->stats.failovers;
+      stats->failover_ms += worker->stats.failover_ms;
+      stats->dispatch_us += worker->stats.dispatch_us;
+      *steals += worker->steals;
+    }
+}
+
+/*
+ * The workers must be idle
+ */
+OFC_VOID smbworkers_destroy(struct smbworkers *workers)
+{
+  stop_workers(workers, workers->num_workers);
+  free_workers(workers);
+}
+
+/**
+ * \}
+ */
@@ -0,0 +1,58 @@
+#if !defined(__smbworkers_h__)
+#define __smbworkers_h__
+
+#include <ofc/types.h>
+
+#include "smbcopy.h"
+
+/*
+ * Copy workers.
+ *
+ * A fixed number of threads, each with a wait set of its own, that run
+ * submitted copies through the copy engine.  Each worker keeps up to
+ * depth copies running at a time and a queue of copies that haven't
+ * started.  Submitted copies are dealt out to the workers' queues in
+ * turn.  A worker that has room for another copy and nothing queued of
+ * its own takes one from the back of the longest queue of another
+ * worker, so a worker that drew large files doesn't hold up the rest.
+ *
+ * Each copy is submitted with a priority, one of SMBMEM_PRIORITY_*, and
+ * a weight, which the copy runs with (see smbcopy_set_priority).  Higher
+ * priority copies are started, and stolen, first.  A worker that is full
+ * still starts a copy of higher priority than any it is running, up to
+ * twice depth copies at once.
+ *
+ * Completions of the copies a worker runs are all handled on that
+ * worker's thread, so the work of completing I/O, and of whatever the
+ * stack does on completion, is spread across the workers.
+ *
+ * The done routine is called on a worker thread as each copy finishes
+ * and must be safe to call from several workers at once.
+ *
+ * smbworkers_create returns OFC_NULL if the pool can't be set up.
+ * smbworkers_submit returns OFC_ERROR_NOT_ENOUGH_MEMORY, without queueing
+ * the copy, if it can't be recorded.
+ */
+struct smbworkers;
+
+typedef OFC_VOID (SMBWORKERS_DONE)(OFC_CTCHAR *rfilename,
+                                   OFC_CTCHAR *wfilename,
+                                   OFC_DWORD dwLastError,
+                                   OFC_VOID *context);
+
+struct smbworkers *smbworkers_create(OFC_INT num_workers, OFC_INT depth,
+                                     OFC_UINT32 flags, SMBWORKERS_DONE *done,
+                                     OFC_VOID *context);
+OFC_DWORD smbworkers_submit(struct smbworkers *workers,
+                            OFC_CTCHAR *rfilename, OFC_CTCHAR *wfilename,
+                            OFC_INT priority, OFC_UINT32 weight);
+OFC_VOID smbworkers_wait(struct smbworkers *workers);
+/*
+ * Totals over the copies finished so far and the number of copies
+ * stolen.  Only meaningful once the workers are idle.
+ */
+OFC_VOID smbworkers_get_stats(struct smbworkers *workers,
+                              struct smbcopy_stats *stats,
+                              OFC_INT *steals);
+OFC_VOID smbworkers_destroy(struct smbworkers *workers);
+#endif
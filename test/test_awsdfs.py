@@ -53,6 +53,8 @@ import argparse
 import os
 import time
 import fcntl
+import filecmp
+import re
 
 import pytest
 
@@ -436,6 +438,229 @@ def test_transaction(descr, dir, config, logfile, setup_teardown):
         fd.write(f"  List {end_ls - start_ls:.2f} seconds\n")
 
 
+#
+# Failover tests.  A file on a replicated DFS link is copied down slowly
+# and a replica is firewalled off part way through.  If the replica was
+# the one serving the copy, smbcp fails over to the other and reports how
+# long recovery took.  Only one of the replicas serves the copy, so a run
+# may not fail over, but across the runs one of them must.
+#
+# Tuples of the form:
+# ("comment", "remote directory", "replica to lose")
+#
+failover_tests = [
+    ("DFS Domain Failover", "//DOUBLEDOUBLEU/Spirit/air", DENY_SPIRITDC),
+    ("DFS Domain Failover", "//DOUBLEDOUBLEU/Spirit/air", DENY_SPIRITDCB),
+]
+
+#
+# Where each replica of the link is, for checking replication
+#
+replicas = {
+    DENY_SPIRITDC: "//spiritdc/air",
+    DENY_SPIRITDCB: "//spiritdcb/air",
+}
+
+FAILOVER_INPUT_FILENAME = "test_failover_file.bin"
+FAILOVER_INPUT_FILE = f"/tmp/{FAILOVER_INPUT_FILENAME}"
+FAILOVER_OUTPUT_FILE = "/tmp/test_failover_output.bin"
+FAILOVER_PROBE_FILE = "/tmp/test_failover_probe.bin"
+#
+# Failover file size in MB and the rate it is copied at.  The copy has
+# to last long enough to lose the replica part way through.  Smaller
+# than on the Vapornet since we pay for it
+#
+FAILOVER_FILE_MB = 4
+FAILOVER_RATE = "500K"
+#
+# Seconds into the copy that the replica is lost, and how long to wait
+# for replication and for the copy
+#
+FAILOVER_DELAY = 3
+REPLICATION_TIMEOUT = 120
+FAILOVER_TIMEOUT = 300
+#
+# Recovery time in ms of each failover run, by the replica lost, or None
+# if the run didn't fail over
+#
+failover_recoveries = {}
+
+
+@pytest.fixture
+def firewall(logfile):
+    """
+    pytest setup/teardown logic for failover tests
+
+    Starts the firewall utility with all hosts allowed and resets it
+    when the test is done.
+
+    Args:
+        logfile (str): The name of the logfile
+
+    Returns:
+        subprocess.Popen: The firewall utility
+
+    Raises:
+        Nothing
+    """
+    firewall_path = os.path.dirname(os.path.abspath(__file__)) + "/awsdfs_ufw.py"
+    firewall = subprocess.Popen(
+        ["python3", firewall_path],
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE,
+        text=True,
+    )
+    fcntl.fcntl(firewall.stdout.fileno(), fcntl.F_SETFL, os.O_NONBLOCK)
+    firewall.stdin.write("reset\n")
+    firewall.stdin.flush()
+
+    yield firewall
+
+    with open(logfile, "a") as fd:
+        fd.write(f"\n\nTeardown Firewall after failover\n\n")
+        firewall.stdin.write(f"reset\n")
+        firewall.stdin.flush()
+        firewall.stdin.write(f"status\n")
+        firewall.stdin.flush()
+        firewall.stdin.write(f"quit\n")
+        firewall.stdin.flush()
+        firewall.wait()
+        for line in firewall.stdout:
+            fd.write(line)
+
+
+def wait_for_replication(fd):
+    """
+    Wait until the failover file can be read from every replica
+
+    Args:
+        fd (io.TextIOWrapper): The file descriptor of the log file
+
+    Returns:
+        bool: True if the file replicated in time
+
+    Raises:
+        Nothing
+    """
+    deadline = time.time() + REPLICATION_TIMEOUT
+    pending = list(replicas.values())
+    while pending and time.time() < deadline:
+        for replica in list(pending):
+            command = (f"smbcp {replica}/{FAILOVER_INPUT_FILENAME} "
+                       f"{FAILOVER_PROBE_FILE}")
+            if (run_command(command, fd) == 0 and
+                    filecmp.cmp(FAILOVER_INPUT_FILE, FAILOVER_PROBE_FILE,
+                                shallow=False)):
+                pending.remove(replica)
+        if pending:
+            time.sleep(5)
+    try:
+        os.remove(FAILOVER_PROBE_FILE)
+    except FileNotFoundError:
+        pass
+    return not pending
+
+
+@pytest.mark.parametrize("descr, dir, lose", failover_tests)
+def test_failover(descr, dir, lose, logfile, firewall):
+    """
+    Test failover of a copy from a replicated DFS link
+
+    The copy must complete and match the source whichever replica is
+    lost.  The recovery time reported by smbcp is written to the log.
+
+    Args:
+        descr (str) : The test description
+        dir (str) : The remote path to use
+        lose (str) : The replica to firewall off during the copy
+        logfile (str) : The output log file fixture
+        firewall (subprocess.Popen) : The firewall utility
+    """
+    with open(logfile, "a") as fd:
+        fd.write(f"Running {descr} losing {lose}\n\n")
+        fd.flush()
+
+        command = (f"dd if=/dev/urandom of={FAILOVER_INPUT_FILE} "
+                   f"bs=1M count={FAILOVER_FILE_MB}")
+        assert run_command(command, fd) == 0, "Could not create failover file"
+
+        command = f"smbcp {FAILOVER_INPUT_FILE} {dir}/{FAILOVER_INPUT_FILENAME}"
+        return_code = run_command(command, fd)
+        assert return_code == 0, f"Could not copy {FAILOVER_INPUT_FILE} to {dir}"
+
+        try:
+            assert wait_for_replication(fd), \
+                f"{FAILOVER_INPUT_FILENAME} did not replicate"
+            #
+            # Start the copy down, rate limited so that it is still
+            # running when the replica goes away
+            #
+            command = (f"smbcp -a -rate {FAILOVER_RATE} "
+                       f"{dir}/{FAILOVER_INPUT_FILENAME} {FAILOVER_OUTPUT_FILE}")
+            fd.write("command: \n")
+            fd.write(f"{command}\n\n")
+            start = time.time()
+            copy = subprocess.Popen(command, shell=True,
+                                    stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE, text=True)
+
+            time.sleep(FAILOVER_DELAY)
+            firewall.stdin.write(f"deny {lose}\n")
+            firewall.stdin.flush()
+
+            stdout, stderr = copy.communicate(timeout=FAILOVER_TIMEOUT)
+            end = time.time()
+            fd.write("stdout: \n")
+            fd.write(stdout)
+            fd.write("\n")
+            fd.write("stderr: \n")
+            fd.write(stderr)
+            fd.write("\n")
+            fd.write(f"result: {copy.returncode}\n\n")
+
+            assert copy.returncode == 0, f"Copy from {dir} failed losing {lose}"
+            assert filecmp.cmp(FAILOVER_INPUT_FILE, FAILOVER_OUTPUT_FILE,
+                               shallow=False), \
+                f"Copy from {dir} differs after losing {lose}"
+
+            recovery = re.search(r"recovered in (\d+) ms", stderr)
+            fd.write(f"Test {descr} losing {lose} Completed in "
+                     f"{end - start:.2f} seconds\n")
+            if recovery:
+                fd.write(f"  Recovery {int(recovery.group(1)) / 1000:.2f} "
+                         f"seconds\n")
+                failover_recoveries[lose] = int(recovery.group(1))
+            else:
+                fd.write(f"  No failover, {lose} was not serving the copy\n")
+                failover_recoveries[lose] = None
+        finally:
+            #
+            # Let the remove through whichever replica is left
+            #
+            command = f"smbrm {dir}/{FAILOVER_INPUT_FILENAME}"
+            run_command(command, fd)
+            for filename in [FAILOVER_INPUT_FILE, FAILOVER_OUTPUT_FILE]:
+                try:
+                    os.remove(filename)
+                except FileNotFoundError:
+                    pass
+
+
+def test_failover_recovered():
+    """
+    Check that the failover runs failed over
+
+    Whichever replica serves the copy, one of the runs loses it, so at
+    least one of them has to report a recovery.  Runs after every
+    failover run.
+    """
+    if len(failover_recoveries) < len(failover_tests):
+        pytest.skip("Not every failover run completed")
+    assert any(recovery is not None
+               for recovery in failover_recoveries.values()), \
+        "No failover run failed over"
+
+
 @pytest.fixture(scope="module", autouse=True)
 def setup_module():
     """